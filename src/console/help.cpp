@@ -73,6 +73,10 @@ void show_help(void)
         "  -o,  --optimize                     perform full optimization\n"
         "  -q,  --quick-optimization           perform quick optimization\n"
         "       --optimize-mft                 optimize master file tables only\n"
+        "       --zoned-optimization           place recently accessed files\n"
+        "                                      at the beginning of the disk\n"
+        "                                      and files not accessed for a\n"
+        "                                      long time at the end\n"
         "  -l,  --list-available-volumes       list all fixed disks available\n"
         "                                      for defragmentation\n"
         "  -la, --list-available-volumes=all   list all available disks,\n"
@@ -148,17 +152,62 @@ void show_help(void)
         "  UD_SORTING                          set sorting criteria for the disk\n"
         "                                      optimization; PATH is used by default,\n"
         "                                      it forces to sort files by their paths;\n"
-        "                                      four more options are available:\n"
-        "                                      SIZE (sort by size), C_TIME (sort by\n"
-        "                                      creation time), M_TIME (sort by last\n"
-        "                                      modification time) and A_TIME (sort by\n"
-        "                                      last access time)\n"
+        "                                      six more options are\n"
+        "                                      available: SIZE (sort by\n"
+        "                                      size), C_TIME (sort by\n"
+        "                                      creation time), M_TIME\n"
+        "                                      (sort by last modification\n"
+        "                                      time), A_TIME (sort by last\n"
+        "                                      access time), TREE (place\n"
+        "                                      files next to their\n"
+        "                                      directories, in depth first\n"
+        "                                      order of the directory tree;\n"
+        "                                      NTFS only) and TREE_BFS (the\n"
+        "                                      same in breadth first order)\n"
         "\n"
         "  UD_SORTING_ORDER                    set sorting order for the disk\n"
         "                                      optimization; ASC (ascending) is used\n"
         "                                      by default, DESC (descending) forces\n"
         "                                      to sort files in reverse order\n"
         "\n"
+        "  UD_LAYOUT_ORDER_FILE                path of a text file listing\n"
+        "                                      full paths of files, one per\n"
+        "                                      line; optimization places the\n"
+        "                                      listed files first, in order\n"
+        "                                      of the list, regardless of\n"
+        "                                      their size; the rest of files\n"
+        "                                      follow sorted as usual\n"
+        "\n"
+        "  UD_INCREMENTAL_OPTIMIZATION         set it to 1 (one) to save the\n"
+        "                                      layout of files after\n"
+        "                                      optimization and let quick\n"
+        "                                      optimization of NTFS volumes\n"
+        "                                      repair it, placing again only\n"
+        "                                      files added, resized or moved\n"
+        "                                      since then\n"
+        "\n"
+        "  UD_HOT_ZONE_AGE                     in zoned optimization, place\n"
+        "                                      files accessed within the\n"
+        "                                      specified number of days in\n"
+        "                                      the hot zone; the default\n"
+        "                                      value is 30\n"
+        "\n"
+        "  UD_COLD_ZONE_AGE                    in zoned optimization, place\n"
+        "                                      files not accessed for the\n"
+        "                                      specified number of days in\n"
+        "                                      the cold zone; the default\n"
+        "                                      value is 180\n"
+        "\n"
+        "  UD_HOT_ZONE_SIZE                    size of the hot zone at the\n"
+        "                                      beginning of the disk, in\n"
+        "                                      percents of the disk size; the\n"
+        "                                      default value is 25\n"
+        "\n"
+        "  UD_COLD_ZONE_SIZE                   size of the cold zone at the\n"
+        "                                      end of the disk, in percents\n"
+        "                                      of the disk size; the default\n"
+        "                                      value is 50\n"
+        "\n"
         "  UD_FRAGMENTATION_THRESHOLD          cancel all tasks except of the MFT\n"
         "                                      optimization when fragmentation level\n"
         "                                      is below than specified\n"
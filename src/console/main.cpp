@@ -62,6 +62,7 @@ bool g_analyze = false;
 bool g_optimize = false;
 bool g_quick_optimization = false;
 bool g_optimize_mft = false;
+bool g_zoned_optimization = false;
 bool g_all = false;
 bool g_all_fixed = false;
 bool g_list_volumes = false;
@@ -273,7 +274,8 @@ void update_progress(udefrag_progress_info *pi, void *p)
             */
             if(g_analyze) op_name = "analysis";
             if(g_optimize || g_quick_optimization || \
-                g_optimize_mft) op_name = "optimization";
+                g_optimize_mft || g_zoned_optimization)
+                op_name = "optimization";
 
             if(pi->pass_number > 1)
                 printf("\r%c: %s: 100.00%%, %lu passes, fragmented/total = %lu/%lu",
@@ -321,6 +323,7 @@ static bool process_single_volume(char letter)
     else if(g_optimize) job_type = FULL_OPTIMIZATION_JOB;
     else if(g_quick_optimization) job_type = QUICK_OPTIMIZATION_JOB;
     else if(g_optimize_mft) job_type = MFT_OPTIMIZATION_JOB;
+    else if(g_zoned_optimization) job_type = ZONED_OPTIMIZATION_JOB;
 
     int flags = g_shellex ? UD_JOB_CONTEXT_MENU_HANDLER : 0;
 
@@ -115,6 +115,7 @@ extern bool g_analyze;
 extern bool g_optimize;
 extern bool g_quick_optimization;
 extern bool g_optimize_mft;
+extern bool g_zoned_optimization;
 extern bool g_all;
 extern bool g_all_fixed;
 extern bool g_list_volumes;
@@ -116,8 +116,19 @@ void init_map(char letter)
 void redraw_map(udefrag_progress_info *pi)
 {
     if(pi){
-        if(pi->cluster_map && pi->cluster_map_size == g_map_rows * g_map_symbols_per_line)
-            memcpy(g_map,pi->cluster_map,pi->cluster_map_size);
+        if(pi->cluster_map && \
+          pi->cluster_map_size == g_map_rows * g_map_symbols_per_line){
+            if(pi->map_changes){
+                // copy changed cells only
+                for(int i = 0; i < pi->map_changes_count; i++){
+                    memcpy(g_map + pi->map_changes[i].first,
+                        pi->cluster_map + pi->map_changes[i].first,
+                        pi->map_changes[i].count);
+                }
+            } else {
+                memcpy(g_map,pi->cluster_map,pi->cluster_map_size);
+            }
+        }
     }
 
     printf("\n\n");
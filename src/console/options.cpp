@@ -61,6 +61,7 @@ static const wxCmdLineEntryDesc opts[] = {
     {wxCMD_LINE_SWITCH, "o",  "optimize"},
     {wxCMD_LINE_SWITCH, "q",  "quick-optimization"},
     {wxCMD_LINE_SWITCH, NULL, "optimize-mft"},
+    {wxCMD_LINE_SWITCH, NULL, "zoned-optimization"},
 
     // drives selection switches
     {wxCMD_LINE_SWITCH, NULL, "all"},
@@ -166,6 +167,7 @@ bool parse_cmdline(int argc, char **argv)
     g_optimize = parser.Found(wxT("o"));
     g_quick_optimization = parser.Found(wxT("q"));
     g_optimize_mft = parser.Found(wxT("optimize-mft"));
+    g_zoned_optimization = parser.Found(wxT("zoned-optimization"));
 
     // support obsolete --quick-optimize option
     if(parser.Found(wxT("quick-optimize")))
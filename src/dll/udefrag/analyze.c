@@ -68,11 +68,14 @@ fs_type_struct fs_types[8] = {
  * @brief Defines how many clusters to move at once in the move_file routine.
  * @details This algorithm has been suggested by Joachim Otahal:
  * http://sourceforge.net/projects/ultradefrag/forums/forum/709672/topic/4779581
+ * It provides the initial value only, unless the target latency of moves
+ * is set to zero; the move_file_clusters routine adjusts it afterwards
+ * within the bounds defined here.
  */
 static void adjust_move_at_once_parameter(udefrag_job_parameters *jp)
 {
-    ULONGLONG bytes_at_once;
-    char buffer[32];
+    ULONGLONG bytes_at_once, min_bytes, max_bytes;
+    char buffer[32], min_buffer[32], max_buffer[32];
     
     /* comply with "one half second to stop defragmentation" rule */
     if(jp->v_info.device_capacity < _20G){
@@ -94,6 +97,31 @@ static void adjust_move_at_once_parameter(udefrag_job_parameters *jp)
     winx_bytes_to_hr(bytes_at_once,0,buffer,sizeof(buffer));
     itrace("the program will move %s (%I64u clusters) at once",
         buffer, jp->clusters_at_once);
+
+    /* define bounds of the adaptive sizing of moves */
+    memset(&jp->m_stats,0,sizeof(struct move_chunk_stats));
+    min_bytes = jp->udo.move_min_size ? \
+        jp->udo.move_min_size : DEFAULT_MOVE_MIN_SIZE;
+    max_bytes = jp->udo.move_max_size ? \
+        jp->udo.move_max_size : DEFAULT_MOVE_MAX_SIZE;
+    if(max_bytes < min_bytes) max_bytes = min_bytes;
+    jp->m_stats.min_clusters = min_bytes / jp->v_info.bytes_per_cluster;
+    if(jp->m_stats.min_clusters == 0)
+        jp->m_stats.min_clusters ++;
+    jp->m_stats.max_clusters = max_bytes / jp->v_info.bytes_per_cluster;
+    if(jp->m_stats.max_clusters == 0)
+        jp->m_stats.max_clusters ++;
+    if(jp->udo.move_target_latency){
+        if(jp->clusters_at_once < jp->m_stats.min_clusters)
+            jp->clusters_at_once = jp->m_stats.min_clusters;
+        if(jp->clusters_at_once > jp->m_stats.max_clusters)
+            jp->clusters_at_once = jp->m_stats.max_clusters;
+        winx_bytes_to_hr(min_bytes,0,min_buffer,sizeof(min_buffer));
+        winx_bytes_to_hr(max_bytes,0,max_buffer,sizeof(max_buffer));
+        itrace("it will be adjusted within %s - %s to make moves last %u ms",
+            min_buffer, max_buffer, jp->udo.move_target_latency);
+    }
+    jp->m_stats.smallest = jp->m_stats.largest = jp->clusters_at_once;
 }
 
 /**
@@ -389,24 +417,24 @@ int exclude_by_size(winx_file_info *f,udefrag_job_parameters *jp)
  * @internal
  * @brief Excludes files according to UD_IN_FILTER and UD_EX_FILTER filters.
  */
-int exclude_by_path(winx_file_info *f,udefrag_job_parameters *jp)
+int exclude_by_path(wchar_t *path,udefrag_job_parameters *jp)
 {
     /* note that paths have the \??\ internal prefix while patterns haven't */
-    if(wcslen(f->path) < 0x4)
+    if(wcslen(path) < 0x4)
         return 1; /* the path is invalid */
     
     if(jp->udo.ex_filter.count){
-        if(winx_patcmp(f->path + 0x4,&jp->udo.ex_filter))
+        if(winx_patcmp(path + 0x4,&jp->udo.ex_filter))
             return 1;
     }
     
     if(jp->udo.cut_filter.count){
-        if(!winx_patcmp(f->path + 0x4,&jp->udo.cut_filter))
+        if(!winx_patcmp(path + 0x4,&jp->udo.cut_filter))
             return 1;
     }
 
     if(jp->udo.in_filter.count == 0) return 0;
-    return !winx_patcmp(f->path + 0x4,&jp->udo.in_filter);
+    return !winx_patcmp(path + 0x4,&jp->udo.in_filter);
 }
 
 /**
@@ -417,24 +445,27 @@ int exclude_by_path(winx_file_info *f,udefrag_job_parameters *jp)
 static int filter(winx_file_info *f,void *user_defined_data)
 {
     udefrag_job_parameters *jp = (udefrag_job_parameters *)user_defined_data;
+    wchar_t path[MAX_PATH];
     int length;
     
     /* START OF AUX CODE */
     
     /* skip entries with empty path, as well as their children */
-    if(f->path == NULL) goto skip_file_and_children;
-    if(f->path[0] == 0) goto skip_file_and_children;
+    length = winx_get_file_path(f,path,MAX_PATH);
+    if(length <= 0) goto skip_file_and_children;
     
     /*
     * Remove trailing dot from the root
     * directory path, otherwise we'll not
     * be able to defragment it.
     */
-    length = (int)wcslen(f->path);
-    if(length >= 2){
-        if(f->path[length - 1] == '.' && f->path[length - 2] == '\\'){
+    if(length >= 2 && length < MAX_PATH - 1){
+        if(path[length - 1] == '.' && path[length - 2] == '\\'){
             itrace("root directory detected, its trailing dot will be removed");
-            f->path[length - 1] = 0;
+            path[length - 1] = 0;
+            /* the path cannot be built from names anymore, so keep it */
+            if(winx_file_path(f))
+                f->path[length - 1] = 0;
         }
     }
     
@@ -446,13 +477,13 @@ static int filter(winx_file_info *f,void *user_defined_data)
     /* comment it out after testing to speed things up */
     /*
     if(is_sparse(f))
-        dtrace("sparse file found: %ws",f->path);
+        dtrace("sparse file found: %ws",path);
     if(is_reparse_point(f))
-        dtrace("reparse point found: %ws",f->path);
-    if(winx_wcsistr(f->path,L"$BITMAP"))
-        dtrace("bitmap found: %ws",f->path);
-    if(winx_wcsistr(f->path,L"$ATTRIBUTE_LIST"))
-        dtrace("attribute list found: %ws",f->path);
+        dtrace("reparse point found: %ws",path);
+    if(winx_wcsistr(path,L"$BITMAP"))
+        dtrace("bitmap found: %ws",path);
+    if(winx_wcsistr(path,L"$ATTRIBUTE_LIST"))
+        dtrace("attribute list found: %ws",path);
     */
     
     /* START OF FILTERING */
@@ -478,7 +509,7 @@ static int filter(winx_file_info *f,void *user_defined_data)
         goto skip_file;
     
     /* filter files by their paths */
-    if(exclude_by_path(f,jp)){
+    if(exclude_by_path(path,jp)){
         /*
         * Don't skip children however since 
         * their paths may match patterns.
@@ -495,7 +526,7 @@ accept_file:
     /* count everything in context menu handler to avoid ambiguity */
     if(jp->udo.job_flags & UD_JOB_CONTEXT_MENU_HANDLER){
         if(jp->udo.cut_filter.count){
-            if(winx_patcmp(f->path + 0x4,&jp->udo.cut_filter))
+            if(winx_patcmp(path + 0x4,&jp->udo.cut_filter))
                 update_progress_counters(f,jp);
         } else {
             update_progress_counters(f,jp);
@@ -622,6 +653,9 @@ static int find_files(udefrag_job_parameters *jp)
             filter,progress_callback,terminator,(void *)jp);
     } else {
     scan_entire_disk:
+        winx_set_mft_read_parameters(
+            (unsigned long)min(jp->udo.mft_buffer_size,0xffffffff),
+            jp->udo.mft_queue_depth);
         jp->filelist = winx_scan_disk(jp->volume_letter,
             WINX_FTW_DUMP_FILES | WINX_FTW_ALLOW_PARTIAL_SCAN | \
             WINX_FTW_SKIP_RESIDENT_STREAMS,
@@ -711,13 +745,14 @@ static int is_well_known_locked_file(winx_file_info *f,udefrag_job_parameters *j
         L"$Secure",
         NULL
     };
-    int i, length = (int)wcslen(f->path);
+    wchar_t path[MAX_PATH];
+    int i, length = winx_get_file_path(f,path,MAX_PATH);
     
     /* search for well known locked NTFS meta files */
     if(length >= 9){ /* ensure that we have at least \??\X:\$x */
-        if(f->path[7] == '$'){
+        if(path[7] == '$'){
             for(i = 0; locked_files[i]; i++){
-                if(winx_wcsistr(f->path,locked_files[i]))
+                if(winx_wcsistr(path,locked_files[i]))
                     return 1;
             }
         }
@@ -754,9 +789,9 @@ static void redraw_well_known_locked_files(udefrag_job_parameters *jp)
             if(is_well_known_locked_file(f,jp)){
                 if(!is_file_locked(f,jp)){
                     /* possibility of this case should be reduced */
-                    dtrace("file wasn't locked: %ws",f->path);
+                    dtrace("file wasn't locked: %ws",winx_file_path(f));
                 } else {
-                    itrace("locked file DETECTED:  %ws",f->path);
+                    itrace("locked file DETECTED:  %ws",winx_file_path(f));
                     ++n;
                 }
             }
@@ -787,7 +822,82 @@ static int fragmented_files_compare(const void *prb_a, const void *prb_b, void *
         return (a->disp.fragments < b->disp.fragments) ? 1 : (-1);
 
     /* if files have equal number of fragments, sort 'em by path */
-    return winx_wcsicmp(a->path, b->path);
+    return compare_file_paths(a,b);
+}
+
+/**
+ * @internal
+ * @brief Retrieves the full path of the file,
+ * regardless of its length.
+ * @param[in] f the file.
+ * @param[in] buffer the buffer of MAX_PATH
+ * characters receiving paths fitting there.
+ * @return Either the buffer or a buffer allocated
+ * for a longer path, to be released by
+ * release_full_file_path. NULL indicates failure.
+ * Unknown paths are returned as empty strings.
+ */
+wchar_t *get_full_file_path(winx_file_info *f,wchar_t *buffer)
+{
+    wchar_t *path = buffer;
+    int length;
+
+    length = winx_get_file_path_length(f);
+    if(length >= MAX_PATH){
+        path = winx_tmalloc((length + 1) * sizeof(wchar_t));
+        if(path == NULL){
+            etrace("cannot allocate %u bytes of memory",
+                (length + 1) * sizeof(wchar_t));
+            return NULL;
+        }
+        (void)winx_get_file_path(f,path,length + 1);
+    } else {
+        (void)winx_get_file_path(f,path,MAX_PATH);
+    }
+    return path;
+}
+
+/**
+ * @internal
+ * @brief Releases the path retrieved
+ * by get_full_file_path.
+ */
+void release_full_file_path(wchar_t *path,wchar_t *buffer)
+{
+    if(path != buffer) winx_free(path);
+}
+
+/**
+ * @internal
+ * @brief Compares paths of two files,
+ * case insensitively.
+ * @note Paths get built on the fly,
+ * without keeping them in memory.
+ */
+int compare_file_paths(winx_file_info *a,winx_file_info *b)
+{
+    wchar_t buffer_a[MAX_PATH], buffer_b[MAX_PATH];
+    wchar_t *path_a, *path_b;
+    int result;
+
+    /* files of the same directory differ by names only */
+    if(a->path == NULL && b->path == NULL && \
+      a->internal.ParentDirectory && \
+      a->internal.ParentDirectory == b->internal.ParentDirectory)
+        return winx_wcsicmp(a->name,b->name);
+
+    /* compare entire paths, truncated ones may be equal */
+    path_a = get_full_file_path(a,buffer_a);
+    path_b = get_full_file_path(b,buffer_b);
+    if(path_a && path_b){
+        result = winx_wcsicmp(path_a,path_b);
+    } else {
+        /* keep different files apart at least */
+        result = (a == b) ? 0 : ((a < b) ? (-1) : 1);
+    }
+    if(path_a) release_full_file_path(path_a,buffer_a);
+    if(path_b) release_full_file_path(path_b,buffer_b);
+    return result;
 }
 
 /**
@@ -812,7 +922,7 @@ int expand_fragmented_files_list(winx_file_info *f,udefrag_job_parameters *jp)
 
     //if(!is_excluded(f)){
         p = prb_probe(jp->fragmented_files,(void *)f);
-        if(p && *p != f) etrace("a duplicate found for %ws",f->path);
+        if(p && *p != f) etrace("a duplicate found for %ws",winx_file_path(f));
     //}
     return 0;
 }
@@ -824,7 +934,7 @@ int expand_fragmented_files_list(winx_file_info *f,udefrag_job_parameters *jp)
 void truncate_fragmented_files_list(winx_file_info *f,udefrag_job_parameters *jp)
 {
     if(!prb_delete(jp->fragmented_files,(void *)f))
-        etrace("%ws is not found in the tree",f->path);
+        etrace("%ws is not found in the tree",winx_file_path(f));
 }
 
 /**
@@ -838,7 +948,11 @@ static void produce_list_of_fragmented_files(udefrag_job_parameters *jp)
     ULONGLONG bad_clusters = 0;
 
     itrace("started creation of fragmented files list");
-    jp->fragmented_files = prb_create(fragmented_files_compare,(void *)jp,NULL);
+    /* nodes share the arena holding the list of files */
+    create_node_pool(&jp->ffa,winx_get_arena(jp->filelist),
+        sizeof(struct prb_node));
+    jp->fragmented_files = prb_create(fragmented_files_compare,
+        (void *)jp,&jp->ffa.allocator);
     for(f = jp->filelist; f; f = f->next){
         if(is_fragmented(f) && !is_excluded(f)){
             expand_fragmented_files_list(f,jp);
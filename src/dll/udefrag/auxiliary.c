@@ -148,7 +148,10 @@ void dbg_print_performance_counters(udefrag_job_parameters *jp)
     dbg_print_single_counter(jp,jp->p_counters.analysis_time,             "analysis ...............");
     dbg_print_single_counter(jp,jp->p_counters.searching_time,            "searching ..............");
     dbg_print_single_counter(jp,jp->p_counters.moving_time,               "moving .................");
+    dbg_print_single_counter(jp,jp->p_counters.verification_time,
+        "verification of moves ..");
     dbg_print_single_counter(jp,jp->p_counters.temp_space_releasing_time, "releasing temp space ...");
+    dbg_print_move_statistics(jp);
 }
 
 /**
@@ -170,4 +173,100 @@ double calc_percentage(ULONGLONG x,ULONGLONG y)
     return (y == 0) ? 0.00 : (double)x / (double)y * 100.00;
 }
 
+/************************************************************/
+/*                       Node pools                         */
+/************************************************************/
+
+/**
+ * @internal
+ * @brief libavl_allocator interface of node pools.
+ */
+static void *node_pool_malloc(struct libavl_allocator *allocator,size_t size)
+{
+    return node_pool_alloc((struct node_pool *)allocator,size);
+}
+
+/**
+ * @internal
+ * @brief libavl_allocator interface of node pools.
+ */
+static void node_pool_release(struct libavl_allocator *allocator,void *block)
+{
+    node_pool_free((struct node_pool *)allocator,block);
+}
+
+/**
+ * @internal
+ * @brief Initializes a pool of nodes of a tree.
+ * @param[out] pool the pool to be initialized.
+ * @param[in] arena the arena to allocate nodes from.
+ * If NULL, the pool creates an arena of its own.
+ * @param[in] node_size size of the nodes, in bytes.
+ * @note The pool can be passed to prb_create
+ * as the allocator of the tree.
+ */
+void create_node_pool(struct node_pool *pool,winx_arena *arena,size_t node_size)
+{
+    pool->allocator.libavl_malloc = node_pool_malloc;
+    pool->allocator.libavl_free = node_pool_release;
+    pool->own_arena = (arena == NULL);
+    pool->arena = arena ? arena : winx_create_arena();
+    pool->node_size = max(node_size,sizeof(void *));
+    pool->free_nodes = NULL;
+}
+
+/**
+ * @internal
+ * @brief Allocates a node from the pool.
+ * @details Blocks smaller than the node
+ * size get expanded to be reusable as nodes.
+ * Aborts the application on failure.
+ */
+void *node_pool_alloc(struct node_pool *pool,size_t size)
+{
+    void *p;
+
+    if(size <= pool->node_size && pool->free_nodes){
+        p = pool->free_nodes;
+        pool->free_nodes = *(void **)p;
+        return p;
+    }
+    return winx_arena_alloc(pool->arena,max(size,pool->node_size),
+        MALLOC_ABORT_ON_FAILURE);
+}
+
+/**
+ * @internal
+ * @brief Keeps a node removed from a tree
+ * for reuse, as the arena releases its
+ * memory at once only.
+ */
+void node_pool_free(struct node_pool *pool,void *block)
+{
+    if(block && pool->arena && winx_get_arena(block) == pool->arena){
+        *(void **)block = pool->free_nodes;
+        pool->free_nodes = block;
+    } else {
+        /* the arena ran out of space */
+        winx_free(block);
+    }
+}
+
+/**
+ * @internal
+ * @brief Releases all nodes of the pool
+ * along with the arena owned by the pool.
+ * @note Nodes allocated on the heap when
+ * the arena runs out of space must be
+ * freed through node_pool_free before.
+ */
+void destroy_node_pool(struct node_pool *pool)
+{
+    if(pool->own_arena)
+        winx_destroy_arena(pool->arena);
+    pool->arena = NULL;
+    pool->own_arena = 0;
+    pool->free_nodes = NULL;
+}
+
 /** @} */
@@ -58,21 +58,21 @@ void test_move(winx_file_info *f,udefrag_job_parameters *jp)
         return;
     }
     if(move_file(f,f->disp.blockmap->vcn,1,target_rgn->lcn,jp) < 0){
-        etrace("move failed for %ws",f->path);
+        etrace("move failed for %ws",winx_file_path(f));
         return;
     } else {
-        dtrace("move succeeded for %ws",f->path);
+        dtrace("move succeeded for %ws",winx_file_path(f));
     }
     /* try to move the first cluster back */
     if(can_move(f,jp->is_fat)){
         if(move_file(f,f->disp.blockmap->vcn,1,source_lcn,jp) < 0){
-            etrace("move failed for %ws",f->path);
+            etrace("move failed for %ws",winx_file_path(f));
             return;
         } else {
-            dtrace("move succeeded for %ws",f->path);
+            dtrace("move succeeded for %ws",winx_file_path(f));
         }
     } else {
-        etrace("file became unmovable %ws",f->path);
+        etrace("file became unmovable %ws",winx_file_path(f));
     }
     /* release temporarily allocated space */
     release_temp_space_regions(jp);
@@ -93,16 +93,16 @@ void test_special_files_defrag(udefrag_job_parameters *jp)
         if(can_move(f,jp->is_fat)){
             special_file = 0;
             if(is_reparse_point(f)){
-                dtrace("reparse point detected: %ws",f->path);
+                dtrace("reparse point detected: %ws",winx_file_path(f));
                 special_file = 1;
             } else if(is_encrypted(f)){
-                dtrace("encrypted file detected: %ws",f->path);
+                dtrace("encrypted file detected: %ws",winx_file_path(f));
                 special_file = 1;
-            } else if(winx_wcsistr(f->path,L"$BITMAP")){
-                dtrace("bitmap detected: %ws",f->path);
+            } else if(winx_wcsistr(winx_file_path(f),L"$BITMAP")){
+                dtrace("bitmap detected: %ws",winx_file_path(f));
                 special_file = 1;
-            } else if(winx_wcsistr(f->path,L"$ATTRIBUTE_LIST")){
-                dtrace("attribute list detected: %ws",f->path);
+            } else if(winx_wcsistr(winx_file_path(f),L"$ATTRIBUTE_LIST")){
+                dtrace("attribute list detected: %ws",winx_file_path(f));
                 special_file = 1;
             }
             if(special_file)
@@ -148,32 +148,13 @@ static int can_defragment(winx_file_info *f,udefrag_job_parameters *jp)
     return 1;
 }
 
-/**
- * @internal
- * @brief build_fragments_list helper.
- */
-static winx_blockmap *add_fragment(winx_blockmap **fragments,
-    winx_blockmap **prev_fragment, ULONGLONG vcn, ULONGLONG lcn,
-    ULONGLONG length)
-{
-    winx_blockmap *fragment;
-    
-    fragment = (winx_blockmap *)winx_list_insert((list_entry **)(void *)fragments,
-        (list_entry *)*prev_fragment,sizeof(winx_blockmap));
-    fragment->vcn = vcn;
-    fragment->lcn = lcn;
-    fragment->length = length;
-    *prev_fragment = fragment;
-    return fragment;
-}
-
 /**
  * @internal
  * @brief Enumerates fragments of a file.
  */
 winx_blockmap *build_fragments_list(winx_file_info *f,ULONGLONG *n_fragments)
 {
-    winx_blockmap *block, *p = NULL, *fragments = NULL;
+    winx_blockmap *block, *fragments = NULL;
     ULONGLONG vcn = 0, lcn = 0, length = 0;
     
     if(n_fragments) *n_fragments = 0;
@@ -188,7 +169,7 @@ winx_blockmap *build_fragments_list(winx_file_info *f,ULONGLONG *n_fragments)
                 length += block->length;
             } else {
                 if(length){
-                    if(!add_fragment(&fragments,&p,vcn,lcn,length))
+                    if(!winx_blockmap_append(&fragments,vcn,lcn,length))
                         break;
                     if(n_fragments) (*n_fragments) ++;
                 }
@@ -201,7 +182,7 @@ winx_blockmap *build_fragments_list(winx_file_info *f,ULONGLONG *n_fragments)
     }
     
     if(length){
-        if(add_fragment(&fragments,&p,vcn,lcn,length)){
+        if(winx_blockmap_append(&fragments,vcn,lcn,length)){
             if(n_fragments) (*n_fragments) ++;
         }
     }
@@ -216,7 +197,126 @@ winx_blockmap *build_fragments_list(winx_file_info *f,ULONGLONG *n_fragments)
  */
 void release_fragments_list(winx_blockmap **fragments)
 {
-    winx_list_destroy((list_entry **)(void *)fragments);
+    winx_blockmap_destroy(fragments);
+}
+
+/**
+ * @internal
+ * @brief Returns the index of fragments of a file.
+ * @details The index gets built once and is reused
+ * until invalidate_fragment_index is called for the file,
+ * so the fragments of a file aren't enumerated again
+ * and again while the file stays in place.
+ * @return Pointer to the index, NULL if the file
+ * has no clusters or there is not enough memory.
+ */
+struct fragment_index *get_fragment_index(winx_file_info *f,
+    udefrag_job_parameters *jp)
+{
+    struct fragment_index *fi = &jp->f_index;
+    winx_blockmap *block;
+    ULONGLONG n, i;
+
+    if(fi->f == f){
+        fi->reuses ++;
+        return fi;
+    }
+    fi->f = NULL;
+
+    /* count fragments */
+    n = 0;
+    for(block = f->disp.blockmap; block; block = block->next){
+        if(block == f->disp.blockmap || \
+          block->lcn != block->prev->lcn + block->prev->length) n ++;
+        if(block->next == f->disp.blockmap) break;
+    }
+    if(n == 0) return NULL;
+
+    if(n > fi->allocated){
+        winx_free(fi->fragments);
+        winx_free(fi->offsets);
+        fi->allocated = 0;
+        fi->fragments = winx_tmalloc((size_t)n * sizeof(struct file_fragment));
+        fi->offsets = winx_tmalloc((size_t)(n + 1) * sizeof(ULONGLONG));
+        if(fi->fragments == NULL || fi->offsets == NULL){
+            etrace("cannot allocate %I64u bytes of memory",
+                n * (sizeof(struct file_fragment) + sizeof(ULONGLONG)));
+            winx_free(fi->fragments);
+            winx_free(fi->offsets);
+            fi->fragments = NULL;
+            fi->offsets = NULL;
+            return NULL;
+        }
+        fi->allocated = n;
+    }
+
+    /* join adjacent blocks, the same way as build_fragments_list does */
+    n = 0;
+    for(block = f->disp.blockmap; block; block = block->next){
+        if(n && block->lcn == block->prev->lcn + block->prev->length){
+            fi->fragments[n - 1].length += block->length;
+        } else {
+            fi->fragments[n].vcn = block->vcn;
+            fi->fragments[n].lcn = block->lcn;
+            fi->fragments[n].length = block->length;
+            n ++;
+        }
+        if(block->next == f->disp.blockmap) break;
+    }
+    fi->n_fragments = n;
+    fi->offsets[0] = 0;
+    for(i = 0; i < n; i++)
+        fi->offsets[i + 1] = fi->offsets[i] + fi->fragments[i].length;
+    fi->f = f;
+    fi->builds ++;
+    return fi;
+}
+
+/**
+ * @internal
+ * @brief Searches for the first fragment
+ * starting at the VCN or after it.
+ * @return Index of the fragment, n_fragments
+ * if all the fragments start before the VCN.
+ */
+ULONGLONG find_fragment(struct fragment_index *fi,ULONGLONG vcn)
+{
+    ULONGLONG lo = 0, hi = fi->n_fragments, i;
+
+    while(lo < hi){
+        i = lo + (hi - lo) / 2;
+        if(fi->fragments[i].vcn < vcn) lo = i + 1;
+        else hi = i;
+    }
+    return lo;
+}
+
+/**
+ * @internal
+ * @brief Drops the index of fragments
+ * when the file's disposition changes.
+ */
+void invalidate_fragment_index(winx_file_info *f,udefrag_job_parameters *jp)
+{
+    if(jp->f_index.f == f)
+        jp->f_index.f = NULL;
+}
+
+/**
+ * @internal
+ * @brief Releases the index of fragments.
+ */
+void destroy_fragment_index(udefrag_job_parameters *jp)
+{
+    struct fragment_index *fi = &jp->f_index;
+
+    if(fi->builds){
+        dtrace("fragment index: %I64u builds, %I64u reuses",
+            fi->builds,fi->reuses);
+    }
+    winx_free(fi->fragments);
+    winx_free(fi->offsets);
+    memset(fi,0,sizeof(struct fragment_index));
 }
 
 /**
@@ -231,6 +331,7 @@ void clear_currently_excluded_flag(udefrag_job_parameters *jp)
         f->user_defined_flags &= ~UD_FILE_CURRENTLY_EXCLUDED;
         if(f->next == jp->filelist) break;
     }
+    reset_file_blocks_summary(jp);
 }
 
 /**
@@ -256,10 +357,270 @@ static ULONGLONG defrag_cc_routine(udefrag_job_parameters *jp)
     return n;
 }
 
+/**
+ * @internal
+ * @brief Defines whether a file is
+ * to be moved entirely or not.
+ */
+static int must_be_moved_entirely(winx_file_info *f,udefrag_job_parameters *jp)
+{
+    if(f->disp.clusters * jp->v_info.bytes_per_cluster \
+      < 2 * jp->udo.fragment_size_threshold) return 1;
+    if(jp->win_version < WINDOWS_XP && jp->fs_type == FS_NTFS)
+        return 1; /* keep algorithm simple */
+    return 0;
+}
+
+/************************************************************/
+/*                      Move planning                       */
+/************************************************************/
+
+/*
+* Files to be moved entirely get assigned to free regions
+* before any data moves, by the best-fit decreasing heuristic:
+* the biggest files get placed first, each one into the smallest
+* region able to hold it. Thus little files never consume gaps
+* needed by the bigger ones, while the biggest regions remain
+* available for files defragmented partially.
+*/
+
+struct planned_move {
+    winx_file_info *file;   /* file to be moved */
+    ULONGLONG target;       /* the target free region */
+};
+
+struct move_plan {
+    struct planned_move *moves; /* moves of the biggest files first */
+    ULONGLONG n_moves;          /* number of moves */
+    ULONGLONG clusters;         /* number of clusters to be moved */
+    int failed;                 /* nonzero if planning failed */
+};
+
+/* a part of a free region not assigned yet */
+struct plan_region {
+    ULONGLONG lcn;
+    ULONGLONG length;
+};
+
+/**
+ * @internal
+ * @brief Sorts files in descending order of their sizes.
+ */
+static int planned_files_compare(const void *prb_a,
+    const void *prb_b, void *prb_param)
+{
+    winx_file_info *a = (winx_file_info *)prb_a;
+    winx_file_info *b = (winx_file_info *)prb_b;
+
+    if(a->disp.clusters != b->disp.clusters)
+        return (a->disp.clusters > b->disp.clusters) ? (-1) : 1;
+    if(a->disp.blockmap->lcn != b->disp.blockmap->lcn)
+        return (a->disp.blockmap->lcn < b->disp.blockmap->lcn) ? (-1) : 1;
+    return (a < b) ? (-1) : ((a > b) ? 1 : 0);
+}
+
+/**
+ * @internal
+ * @brief Sorts free regions in ascending order of their sizes.
+ */
+static int plan_regions_compare(const void *prb_a,
+    const void *prb_b, void *prb_param)
+{
+    struct plan_region *a = (struct plan_region *)prb_a;
+    struct plan_region *b = (struct plan_region *)prb_b;
+
+    if(a->length != b->length)
+        return (a->length < b->length) ? (-1) : 1;
+    if(a->lcn != b->lcn)
+        return (a->lcn < b->lcn) ? (-1) : 1;
+    return 0;
+}
+
+/**
+ * @internal
+ * @brief Returns the smallest region
+ * able to hold the specified number
+ * of clusters, NULL if there is none.
+ */
+static struct plan_region *find_best_fit(struct prb_table *rt,ULONGLONG length)
+{
+    struct prb_node *node = rt->prb_root;
+    struct plan_region *r, *best = NULL;
+
+    while(node){
+        r = (struct plan_region *)node->prb_data;
+        if(r->length >= length){
+            best = r;
+            node = node->prb_link[0];
+        } else {
+            node = node->prb_link[1];
+        }
+    }
+    return best;
+}
+
+/**
+ * @internal
+ * @brief Assigns files to be moved entirely
+ * to free regions before any data moves.
+ * @details Nothing gets moved here; the plan
+ * is executed by the execute_move_plan routine.
+ * Files get placed in descending order of their
+ * sizes, so all the larger files are placed already
+ * when a region gets chosen: a lookahead reserving
+ * regions for them would have nothing to reserve.
+ * Files the plan cannot place are left to the greedy
+ * placement of the defrag_routine.
+ */
+static void plan_entire_moves(udefrag_job_parameters *jp,struct move_plan *plan)
+{
+    struct node_pool pool;
+    struct prb_table *ft = NULL, *rt = NULL;
+    struct prb_traverser t;
+    struct plan_region *regions = NULL, *r;
+    winx_volume_region *rgn;
+    winx_file_info *file;
+    ULONGLONG n_regions = 0, i;
+    ULONGLONG time;
+    void **p;
+
+    memset(plan,0,sizeof(struct move_plan));
+    time = winx_xtime();
+    /* both trees share a single arena, as it reserves a lot of address space */
+    create_node_pool(&pool,NULL,sizeof(struct prb_node));
+
+    /* sort out files to be moved entirely */
+    ft = prb_create(planned_files_compare,NULL,&pool.allocator);
+    if(ft == NULL) goto fail;
+    prb_t_init(&t,jp->fragmented_files);
+    file = prb_t_first(&t,jp->fragmented_files);
+    for(; file; file = prb_t_next(&t)){
+        if(jp->termination_router((void *)jp)) goto done;
+        if(can_defragment(file,jp) && must_be_moved_entirely(file,jp)){
+            p = prb_probe(ft,(void *)file);
+            if(p == NULL) goto fail;
+        }
+    }
+    if(prb_count(ft) == 0) goto done;
+
+    /* sort out free regions */
+    for(rgn = jp->free_regions; rgn; rgn = rgn->next){
+        n_regions ++;
+        if(rgn->next == jp->free_regions) break;
+    }
+    if(n_regions == 0) goto done;
+    regions = winx_tmalloc(n_regions * sizeof(struct plan_region));
+    plan->moves = winx_tmalloc(prb_count(ft) * sizeof(struct planned_move));
+    rt = prb_create(plan_regions_compare,NULL,&pool.allocator);
+    if(regions == NULL || plan->moves == NULL || rt == NULL) goto fail;
+    for(rgn = jp->free_regions, i = 0; rgn; rgn = rgn->next, i++){
+        regions[i].lcn = rgn->lcn;
+        regions[i].length = rgn->length;
+        if(prb_probe(rt,(void *)&regions[i]) == NULL) goto fail;
+        if(rgn->next == jp->free_regions) break;
+    }
+
+    /*
+    * Place the biggest files first,
+    * each one into the smallest region fitting it.
+    */
+    prb_t_init(&t,ft);
+    for(file = prb_t_first(&t,ft); file; file = prb_t_next(&t)){
+        if(jp->termination_router((void *)jp)) break;
+        r = find_best_fit(rt,file->disp.clusters);
+        if(r == NULL) continue;
+        (void)prb_delete(rt,(void *)r);
+        plan->moves[plan->n_moves].file = file;
+        plan->moves[plan->n_moves].target = r->lcn;
+        plan->n_moves ++;
+        plan->clusters += file->disp.clusters;
+        r->lcn += file->disp.clusters;
+        r->length -= file->disp.clusters;
+        if(r->length){
+            if(prb_probe(rt,(void *)r) == NULL) goto fail;
+        }
+    }
+    goto done;
+
+fail:
+    etrace("not enough memory, move planning disabled");
+    winx_free(plan->moves);
+    memset(plan,0,sizeof(struct move_plan));
+    plan->failed = 1;
+
+done:
+    if(ft) prb_destroy(ft,NULL);
+    if(rt) prb_destroy(rt,NULL);
+    destroy_node_pool(&pool);
+    winx_free(regions);
+    jp->p_counters.searching_time += winx_xtime() - time;
+    if(plan->n_moves){
+        itrace("%I64u files planned to be moved entirely, %I64u clusters",
+            plan->n_moves, plan->clusters);
+    }
+}
+
+/*
+* Counters of files moved entirely
+* in the defrag_routine.
+*/
+struct entire_moves {
+    udefrag_job_parameters *jp;
+    ULONGLONG files;    /* number of files moved successfully */
+    ULONGLONG clusters; /* number of clusters moved by them */
+};
+
+/**
+ * @internal
+ * @brief Receives results of moves
+ * issued in the defrag_routine.
+ */
+static void entire_move_completed(winx_file_info *f,int result,
+    ULONGLONG moved_clusters,void *user_defined_data)
+{
+    struct entire_moves *em = (struct entire_moves *)user_defined_data;
+
+    if(result == 0){
+        if(em->jp->udo.dbgprint_level >= DBG_DETAILED)
+            itrace("Defrag success for %ws",winx_file_path(f));
+        em->files ++;
+        em->clusters += moved_clusters;
+    } else if(result < 0){
+        etrace("Defrag failure for %ws",winx_file_path(f));
+    }
+}
+
+/**
+ * @internal
+ * @brief Executes a plan built by
+ * the plan_entire_moves routine.
+ */
+static void execute_move_plan(udefrag_job_parameters *jp,
+    struct move_plan *plan,struct entire_moves *em)
+{
+    struct planned_move *m;
+    ULONGLONG i;
+
+    for(i = 0; i < plan->n_moves; i++){
+        if(jp->termination_router((void *)jp)) break;
+        m = &plan->moves[i];
+        /* skip files changed by moves of other files */
+        if(!can_defragment(m->file,jp)) continue;
+        (void)move_file_async(m->file,m->file->disp.blockmap->vcn,
+            m->file->disp.clusters,m->target,entire_move_completed,em,jp);
+    }
+    complete_moves(jp);
+    winx_free(plan->moves);
+    plan->moves = NULL;
+}
+
 /**
  * @internal
  * @brief Eliminates little fragments respect
  * to the fragment size threshold filter.
+ * @details Files moved entirely go through
+ * the queue of moves, so moves of different
+ * files can be in progress at once.
  */
 static void defrag_routine(udefrag_job_parameters *jp)
 {
@@ -268,16 +629,21 @@ static void defrag_routine(udefrag_job_parameters *jp)
     winx_file_info *file, *next_file;
     int move_entirely;
     ULONGLONG defragmented_files;
-    ULONGLONG defragmented_entirely = 0, defragmented_partially = 0;
-    ULONGLONG x, moved_entirely = 0, moved_partially = 0;
+    ULONGLONG defragmented_entirely, defragmented_partially = 0;
+    ULONGLONG x, moved_entirely, moved_partially = 0;
+    struct entire_moves em;
+    struct move_plan plan;
     ULONGLONG min_vcn, max_vcn; /* used to avoid infinite loops */
-    winx_blockmap *fragments, *fr, *fr2, *next_fr, *head_fr;
+    struct fragment_index *fi;
+    struct file_fragment *fr, *fr2;
+    ULONGLONG first, last, i, j;
     ULONGLONG vcn, length, n, new_min_vcn;
     ULONGLONG cut_length;
     int defrag_succeeded;
     char buffer[32];
 
     winx_dbg_print_header(0,0,I"defragmentation pass #%u",++jp->pi.pass_number);
+    jp->d_counters.passes ++;
     jp->pi.current_operation = VOLUME_DEFRAGMENTATION;
     jp->pi.moved_clusters = 0;
 
@@ -289,6 +655,24 @@ static void defrag_routine(udefrag_job_parameters *jp)
 
     jp->pi.clusters_to_process = \
         jp->pi.processed_clusters + defrag_cc_routine(jp);
+
+    (void)init_move_queue(jp);
+    memset(&em,0,sizeof(struct entire_moves));
+    em.jp = jp;
+
+    /*
+    * Move files to be moved entirely according to
+    * the plan, unless the greedy placement is requested.
+    */
+    memset(&plan,0,sizeof(struct move_plan));
+    plan.failed = 1;
+    if(!jp->udo.disable_move_planning){
+        plan_entire_moves(jp,&plan);
+        if(!plan.failed){
+            execute_move_plan(jp,&plan,&em);
+            jp->d_counters.planned_clusters += plan.clusters;
+        }
+    }
         
     /*
     dtrace(">>> %I64u\\%I64u <<<",
@@ -306,26 +690,14 @@ static void defrag_routine(udefrag_job_parameters *jp)
         if(jp->termination_router((void *)jp)) break;
         next_file = prb_t_next(&t);
         if(can_defragment(file,jp)){
-            move_entirely = 0;
-            if(file->disp.clusters * jp->v_info.bytes_per_cluster \
-              < 2 * jp->udo.fragment_size_threshold) move_entirely = 1;
-            else if(jp->win_version < WINDOWS_XP && jp->fs_type == FS_NTFS)
-                move_entirely = 1; /* keep algorithm simple */
+            move_entirely = must_be_moved_entirely(file,jp);
             if(move_entirely){
-                /* move the entire file */
+                /* files moved by the plan aren't fragmented already */
                 rgn = find_first_free_region(jp,0,file->disp.clusters,NULL);
                 if(rgn){
-                    x = jp->pi.moved_clusters;
-                    if(move_file(file,file->disp.blockmap->vcn,
-                     file->disp.clusters,rgn->lcn,jp) >= 0){
-                        if(jp->udo.dbgprint_level >= DBG_DETAILED)
-                            itrace("Defrag success for %ws",file->path);
-                        defragmented_files ++;
-                        defragmented_entirely ++;
-                        moved_entirely += (jp->pi.moved_clusters - x);
-                    } else {
-                        etrace("Defrag failure for %ws",file->path);
-                    }
+                    (void)move_file_async(file,file->disp.blockmap->vcn,
+                        file->disp.clusters,rgn->lcn,
+                        entire_move_completed,&em,jp);
                 }
             } else {
                 /* eliminate little fragments */
@@ -335,19 +707,16 @@ static void defrag_routine(udefrag_job_parameters *jp)
                 defrag_succeeded = 0;
                 x = jp->pi.moved_clusters;
                 while(min_vcn < max_vcn && can_defragment(file,jp)){
-                    /* build list of fragments */
-                    fragments = build_fragments_list(file,NULL);
-                    if(fragments == NULL) break;
+                    /* get fragments, they change when the file moves */
+                    fi = get_fragment_index(file,jp);
+                    if(fi == NULL) break;
                     
-                    /* cut off already processed fragments and data after max_vcn */
-                    for(fr = fragments; fr; fr = next_fr){
-                        head_fr = fragments;
-                        next_fr = fr->next;
-                        if(fr->vcn < min_vcn || (fr->vcn + fr->length > max_vcn))
-                            winx_list_remove((list_entry **)(void *)&fragments,(list_entry *)(void *)fr);
-                        if(fragments == NULL) goto completed;
-                        if(next_fr == head_fr) break;
-                    }
+                    /* skip processed fragments and data after max_vcn */
+                    first = find_fragment(fi,min_vcn);
+                    last = find_fragment(fi,max_vcn);
+                    while(last > first && fi->fragments[last - 1].vcn + \
+                      fi->fragments[last - 1].length > max_vcn) last --;
+                    if(first == last) goto completed;
                     
                     /* how much clusters can we join together? */
                     largest_rgn = find_largest_free_region(jp);
@@ -355,30 +724,38 @@ static void defrag_routine(udefrag_job_parameters *jp)
                     
                     /* find clusters needing optimization */
                     vcn = length = n = new_min_vcn = 0;
-                    for(fr = fragments; fr; fr = fr->next){
+                    for(i = first; i < last; i++){
+                        fr = &fi->fragments[i];
                         /* find the first little fragment */
                         if(fr->length * jp->v_info.bytes_per_cluster < jp->udo.fragment_size_threshold){
                             if(fr->length >= largest_rgn->length) break;
-                            vcn = fr->vcn;
-                            length = fr->length, n++;
-                            new_min_vcn = fr->vcn + fr->length;
                             /* look forward for the next little fragments */
-                            for(fr2 = fr->next; fr2 != fragments; fr2 = fr2->next){
-                                if(fr2->length * jp->v_info.bytes_per_cluster >= jp->udo.fragment_size_threshold)
-                                    break;
-                                if(length + fr2->length > largest_rgn->length) goto move_clusters;
-                                length += fr2->length, n++;
-                                new_min_vcn = fr2->vcn + fr2->length;
+                            for(j = i + 1; j < last; j++){
+                                if(fi->fragments[j].length \
+                                  * jp->v_info.bytes_per_cluster \
+                                  >= jp->udo.fragment_size_threshold) break;
+                                if(fi->offsets[j + 1] - fi->offsets[i] \
+                                  > largest_rgn->length) break;
                             }
+                            vcn = fr->vcn;
+                            length = fi->offsets[j] - fi->offsets[i], n = j - i;
+                            new_min_vcn = fi->fragments[j - 1].vcn \
+                                + fi->fragments[j - 1].length;
+                            if(j < last && fi->fragments[j].length \
+                              * jp->v_info.bytes_per_cluster \
+                              < jp->udo.fragment_size_threshold)
+                                goto move_clusters;
                             if(largest_rgn->length * jp->v_info.bytes_per_cluster < jp->udo.fragment_size_threshold) break;
                             if(length * jp->v_info.bytes_per_cluster < jp->udo.fragment_size_threshold){
                                 cut_length = jp->udo.fragment_size_threshold / jp->v_info.bytes_per_cluster;
                                 if(cut_length * jp->v_info.bytes_per_cluster != jp->udo.fragment_size_threshold)
                                     cut_length ++;
                                 cut_length -= length;
-                                if(fr2 != fragments){
+                                if(j < last){
                                     /* let's cut from the next fragment */
-                                    if((fr2->length - cut_length) * jp->v_info.bytes_per_cluster \
+                                    fr2 = &fi->fragments[j];
+                                    if((fr2->length - cut_length) \
+                                      * jp->v_info.bytes_per_cluster \
                                       < jp->udo.fragment_size_threshold){
                                         length += fr2->length, n++;
                                         new_min_vcn = fr2->vcn + fr2->length;
@@ -386,21 +763,23 @@ static void defrag_routine(udefrag_job_parameters *jp)
                                         length += cut_length, n++;
                                         new_min_vcn = fr2->vcn + cut_length;
                                     }
-                                } else if(fr != fragments){
+                                } else if(i > first){
                                     /* let's cut from the previous fragment */
-                                    if((fr->prev->length - cut_length) * jp->v_info.bytes_per_cluster \
+                                    fr2 = &fi->fragments[i - 1];
+                                    if((fr2->length - cut_length) \
+                                      * jp->v_info.bytes_per_cluster \
                                       < jp->udo.fragment_size_threshold){
-                                        vcn = fr->prev->vcn;
-                                        length += fr->prev->length, n++;
+                                        vcn = fr2->vcn;
+                                        length += fr2->length, n++;
                                     } else {
-                                        vcn = fr->prev->vcn + (fr->prev->length - cut_length);
+                                        vcn = fr2->vcn \
+                                            + (fr2->length - cut_length);
                                         length += cut_length, n++;
                                     }
                                 }
                             }
                             break;
                         }
-                        if(fr->next == fragments) break;
                     }
                     
 move_clusters:                    
@@ -412,17 +791,16 @@ move_clusters:
                         if(rgn){
                             if(move_file(file,vcn,length,rgn->lcn,jp) >= 0){
                                 if(jp->udo.dbgprint_level >= DBG_DETAILED)
-                                    itrace("Defrag success for %ws",file->path);
+                                    itrace("Defrag success for %ws",
+                                        winx_file_path(file));
                                 defrag_succeeded = 1;
                             } else {
-                                etrace("Defrag failure for %ws",file->path);
+                                etrace("Defrag failure for %ws",
+                                    winx_file_path(file));
                             }
                         }
                         min_vcn = new_min_vcn;
                     }
-                    
-                    /* release list of fragments */
-                    release_fragments_list(&fragments);
                 }
                 if(defrag_succeeded){
                     defragmented_files ++;
@@ -436,6 +814,13 @@ completed:
         file = next_file;
     }
     
+    /* wait for the moves in progress */
+    destroy_move_queue(jp);
+    defragmented_files += em.files;
+    defragmented_entirely = em.files;
+    moved_entirely = em.clusters;
+    jp->d_counters.moved_clusters += jp->pi.moved_clusters;
+
     /*
     dtrace(">>> %I64u\\%I64u <<<",
         jp->pi.processed_clusters,jp->pi.clusters_to_process);
@@ -508,6 +893,7 @@ int defragment(udefrag_job_parameters *jp)
     winx_file_info *file;
     int second_attempt = 0;
     ULONGLONG time;
+    char planned[32], moved[32];
     
     if(jp->job_type == DEFRAGMENTATION_JOB){
         /* analyze the disk */
@@ -527,6 +913,7 @@ int defragment(udefrag_job_parameters *jp)
     }
     
     time = start_timing("defragmentation",jp);
+    memset(&jp->d_counters,0,sizeof(struct defrag_counters));
 
     /* do the job */
     defrag_sequence(jp);
@@ -546,8 +933,22 @@ int defragment(udefrag_job_parameters *jp)
         }
         file = prb_t_next(&t);
     }
-    if(second_attempt) defrag_sequence(jp);
+    if(second_attempt){
+        reset_file_blocks_summary(jp);
+        defrag_sequence(jp);
+    }
     
+    /* compare the plan against the results */
+    winx_bytes_to_hr(jp->d_counters.planned_clusters \
+        * jp->v_info.bytes_per_cluster,1,planned,sizeof(planned));
+    winx_bytes_to_hr(jp->d_counters.moved_clusters \
+        * jp->v_info.bytes_per_cluster,1,moved,sizeof(moved));
+    itrace("defragmentation completed in %u passes",jp->d_counters.passes);
+    if(jp->udo.disable_move_planning)
+        itrace("  %s moved, greedy placement",moved);
+    else
+        itrace("  %s moved, %s of entire files planned",moved,planned);
+
     stop_timing("defragmentation",time,jp);
     return 0;
 }
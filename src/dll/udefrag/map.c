@@ -45,9 +45,329 @@
 * cells and draws them on the map afterwards.
 *
 * Each cell keeps information on how much
-* clusters of each kind belongs to it.
+* clusters of each kind belongs to it, along
+* with the color it has to be drawn in. The color
+* gets updated each time the cell changes, so
+* the map refresh is a plain copy of colors.
 */
 
+#define MAX_CELL_COUNT ((ULONG) -1)
+
+/*
+* Cells changed since the previous progress
+* update are delivered to the caller as a list
+* of ranges. If there are too many of them,
+* the entire map is reported as changed.
+*/
+#define MAX_MAP_CHANGES 4096
+
+/**
+ * @internal
+ * @brief Returns number of clusters a cell consists of.
+ */
+static ULONGLONG get_cell_capacity(udefrag_job_parameters *jp,ULONGLONG cell)
+{
+    if(jp->cluster_map.opposite_order)
+        return 1;
+    if(cell == jp->cluster_map.map_size - jp->cluster_map.unused_cells - 1)
+        return jp->cluster_map.clusters_per_last_cell;
+    return jp->cluster_map.clusters_per_cell;
+}
+
+/**
+ * @internal
+ * @brief Returns number of clusters
+ * of the specified color in a cell.
+ */
+static ULONG get_cell_count(udefrag_job_parameters *jp,cmap_cell *c,int color)
+{
+    int i;
+
+    if(c->extended)
+        return jp->cluster_map.counters[c->count[0] * \
+            jp->cluster_map.n_colors + color];
+    for(i = 0; i < CMAP_CELL_SLOTS; i++){
+        if(c->count[i] && c->color[i] == color)
+            return c->count[i];
+    }
+    return 0;
+}
+
+/**
+ * @internal
+ * @brief Switches a cell to a full set of counters.
+ * @return Zero for success, negative value otherwise.
+ */
+static int extend_cell(udefrag_job_parameters *jp,cmap_cell *c)
+{
+    cmap *m = &jp->cluster_map;
+    ULONG *counters, *set;
+    ULONG n;
+    int i;
+
+    if(m->n_counters == m->max_counters){
+        n = m->max_counters ? m->max_counters * 2 : 64;
+        counters = winx_tmalloc(n * m->n_colors * sizeof(ULONG));
+        if(counters == NULL){
+            etrace("cannot allocate %u bytes of memory",
+                n * m->n_colors * sizeof(ULONG));
+            return (-1);
+        }
+        if(m->counters){
+            memcpy(counters,m->counters,
+                m->n_counters * m->n_colors * sizeof(ULONG));
+            winx_free(m->counters);
+        }
+        m->counters = counters;
+        m->max_counters = n;
+    }
+
+    set = m->counters + m->n_counters * m->n_colors;
+    memset(set,0,m->n_colors * sizeof(ULONG));
+    for(i = 0; i < CMAP_CELL_SLOTS; i++){
+        if(c->count[i]) set[c->color[i]] = c->count[i];
+    }
+    c->count[0] = m->n_counters ++;
+    c->extended = 1;
+    return 0;
+}
+
+/**
+ * @internal
+ * @brief Sets number of clusters
+ * of the specified color in a cell.
+ */
+static void set_cell_count(udefrag_job_parameters *jp,
+        cmap_cell *c,int color,ULONGLONG n)
+{
+    int i, slot = -1;
+
+    if(n > MAX_CELL_COUNT) n = MAX_CELL_COUNT;
+
+    if(!c->extended){
+        for(i = 0; i < CMAP_CELL_SLOTS; i++){
+            if(c->count[i] && c->color[i] == color){
+                c->count[i] = (ULONG)n;
+                return;
+            }
+            if(c->count[i] == 0 && slot < 0) slot = i;
+        }
+        if(n == 0) return;
+        if(slot >= 0){
+            c->count[slot] = (ULONG)n;
+            c->color[slot] = (UCHAR)color;
+            return;
+        }
+        if(extend_cell(jp,c) < 0){
+            /* drop the smallest counter, the map becomes a bit less accurate */
+            slot = (c->count[0] < c->count[1]) ? 0 : 1;
+            c->count[slot] = (ULONG)n;
+            c->color[slot] = (UCHAR)color;
+            return;
+        }
+    }
+    jp->cluster_map.counters[c->count[0] * \
+        jp->cluster_map.n_colors + color] = (ULONG)n;
+}
+
+/**
+ * @internal
+ * @brief Returns a node of the pyramid.
+ */
+static cmap_cell *get_node(cmap *m,int level,int index)
+{
+    return &m->nodes[m->level_offset[level] - m->map_size + index];
+}
+
+/**
+ * @brief Defines color of a node of the pyramid.
+ * @details The node is drawn as $Mft when it covers
+ * some cells of $Mft, otherwise in the color having
+ * the most cells, the colors following in the list
+ * of colors win on a tie.
+ */
+static void update_node_color(udefrag_job_parameters *jp,cmap_cell *node)
+{
+    ULONG maximum, n;
+    int k, index;
+
+    if(get_cell_count(jp,node,MFT_SPACE)){
+        node->dominant = MFT_SPACE;
+        return;
+    }
+    maximum = get_cell_count(jp,node,0);
+    index = 0;
+    for(k = 1; k < jp->cluster_map.n_colors; k++){
+        n = get_cell_count(jp,node,k);
+        if(n >= maximum){
+            maximum = n;
+            index = k;
+        }
+    }
+    node->dominant = (UCHAR)(maximum ? index : DEFAULT_COLOR);
+}
+
+/**
+ * @brief Updates all nodes of the pyramid
+ * covering a cell which color has changed.
+ */
+static void update_pyramid(udefrag_job_parameters *jp,
+        int cell,int old_color,int new_color)
+{
+    cmap *m = &jp->cluster_map;
+    cmap_cell *node;
+    ULONG n;
+    int level;
+
+    for(level = 1; level <= m->n_levels; level++){
+        node = get_node(m,level,cell >> level);
+        /* release the slot of the old color first */
+        n = get_cell_count(jp,node,old_color);
+        set_cell_count(jp,node,old_color,n ? n - 1 : 0);
+        n = get_cell_count(jp,node,new_color);
+        set_cell_count(jp,node,new_color,(ULONGLONG)n + 1);
+        update_node_color(jp,node);
+    }
+}
+
+/**
+ * @brief Builds the pyramid from scratch.
+ */
+static void build_pyramid(udefrag_job_parameters *jp)
+{
+    cmap *m = &jp->cluster_map;
+    cmap_cell *node;
+    int level, i, color;
+
+    if(m->n_levels == 0)
+        return;
+
+    memset(m->nodes,0,(m->level_offset[m->n_levels] + \
+        m->level_size[m->n_levels] - m->map_size) * sizeof(cmap_cell));
+    for(i = 0; i < m->map_size; i++){
+        color = m->cells[i].dominant;
+        for(level = 1; level <= m->n_levels; level++){
+            node = get_node(m,level,i >> level);
+            set_cell_count(jp,node,color,
+                (ULONGLONG)get_cell_count(jp,node,color) + 1);
+        }
+    }
+    for(level = 1; level <= m->n_levels; level++){
+        for(i = 0; i < m->level_size[level]; i++)
+            update_node_color(jp,get_node(m,level,i));
+    }
+}
+
+/**
+ * @brief Marks a cell as changed.
+ * @note The map gets refilled in the thread
+ * delivering progress information, so the bit
+ * has to be set atomically, after all the
+ * nodes covering the cell get updated.
+ */
+static void mark_cell_dirty(udefrag_job_parameters *jp,ULONGLONG cell)
+{
+    LONG volatile *word;
+    LONG bit, w;
+
+    word = (LONG volatile *)&jp->cluster_map.dirty_cells[cell >> 5];
+    bit = (LONG)((ULONG)1 << (cell & 31));
+    do {
+        w = *word;
+        if(w & bit) return;
+    } while(InterlockedCompareExchange(word,w | bit,w) != w);
+}
+
+/**
+ * @brief Defines color of a cell.
+ * @details The color having the most clusters
+ * wins, the colors following in the list of colors
+ * win on a tie. Cells of the free space entirely
+ * inside of the MFT zone are shown as the MFT zone.
+ */
+static void update_cell_color(udefrag_job_parameters *jp,ULONGLONG cell)
+{
+    cmap_cell *c = &jp->cluster_map.cells[cell];
+    ULONGLONG capacity = get_cell_capacity(jp,cell);
+    ULONG maximum, n;
+    int mft_zone_detected, k, index, old_index;
+
+    /* check for mft zone to apply special rules there */
+    mft_zone_detected = (get_cell_count(jp,c,MFT_ZONE_SPACE) >= capacity);
+    if(mft_zone_detected && get_cell_count(jp,c,FREE_SPACE) >= capacity){
+        index = MFT_ZONE_SPACE;
+        goto done;
+    }
+
+    maximum = get_cell_count(jp,c,0);
+    index = 0;
+    for(k = 1; k < jp->cluster_map.n_colors; k++){
+        n = get_cell_count(jp,c,k);
+        if(n >= maximum){ /* support of colors precedence */
+            if((k != MFT_ZONE_SPACE && k != FREE_SPACE) || !mft_zone_detected){
+                maximum = n;
+                index = k;
+            }
+        }
+    }
+    if(maximum == 0)
+        index = DEFAULT_COLOR;
+
+done:
+    if(c->dominant != index){
+        old_index = c->dominant;
+        c->dominant = (UCHAR)index;
+        update_pyramid(jp,(int)cell,old_index,index);
+        if(jp->cluster_map.dirty_cells)
+            mark_cell_dirty(jp,cell);
+    }
+}
+
+/**
+ * @internal
+ * @brief Moves clusters of a cell from one color to another.
+ * @note If the new color is equal to MFT_ZONE_SPACE,
+ * the old color is ignored.
+ */
+static void recolor_cell(udefrag_job_parameters *jp,
+        ULONGLONG cell,ULONGLONG n,int new_color,int old_color)
+{
+    cmap_cell *c = &jp->cluster_map.cells[cell];
+    ULONG old_n;
+
+    set_cell_count(jp,c,new_color,get_cell_count(jp,c,new_color) + n);
+    if(new_color != MFT_ZONE_SPACE){
+        old_n = get_cell_count(jp,c,old_color);
+        set_cell_count(jp,c,old_color,(old_n >= n) ? old_n - n : 0);
+    }
+    update_cell_color(jp,cell);
+}
+
+/**
+ * @brief Locates a level of the cluster map.
+ * @details The cluster map delivered to the
+ * progress callback is followed by cluster_map_levels
+ * coarser levels. Each cell of level k covers 2^k cells
+ * of the map and is drawn in the color prevailing there,
+ * so the map can be shrunk without walking all its cells.
+ * @param[in] map_size the number of cells of the map.
+ * @param[in] level the level, zero stands for the map itself.
+ * @param[out] level_size the number of cells of the level.
+ * Can be NULL.
+ * @return Offset of the level from the beginning of the map.
+ */
+int udefrag_get_map_level(int map_size,int level,int *level_size)
+{
+    int offset = 0, size = map_size, i;
+
+    for(i = 0; i < level; i++){
+        offset += size;
+        size = (size + 1) / 2;
+    }
+    if(level_size) *level_size = size;
+    return offset;
+}
+
 /**
  * @internal
  * @brief Allocates cluster map.
@@ -57,7 +377,7 @@
  */
 int allocate_map(int map_size,udefrag_job_parameters *jp)
 {
-    int array_size;
+    int array_size, total_size, n_levels, level;
     ULONGLONG used_cells;
     
     itrace("map size = %u",map_size);
@@ -77,15 +397,22 @@ int allocate_map(int map_size,udefrag_job_parameters *jp)
         return -1;
     }
 
+    /* the map is followed by its coarser levels up to a single node */
+    for(n_levels = 0, array_size = map_size; array_size > 1; n_levels ++){
+        if(n_levels == CMAP_MAX_LEVELS - 1) break;
+        array_size = (array_size + 1) / 2;
+    }
+    total_size = udefrag_get_map_level(map_size,n_levels + 1,NULL);
+
     /* allocate memory */
-    jp->pi.cluster_map = winx_tmalloc(map_size);
+    jp->pi.cluster_map = winx_tmalloc(total_size);
     if(jp->pi.cluster_map == NULL){
-        etrace("cannot allocate %u bytes of memory",map_size);
+        etrace("cannot allocate %u bytes of memory",total_size);
         return UDEFRAG_NO_MEM;
     }
-    array_size = map_size * SPACE_STATES * sizeof(ULONGLONG);
-    jp->cluster_map.array = winx_tmalloc(array_size);
-    if(jp->cluster_map.array == NULL){
+    array_size = map_size * sizeof(cmap_cell);
+    jp->cluster_map.cells = winx_tmalloc(array_size);
+    if(jp->cluster_map.cells == NULL){
         etrace("cannot allocate %u bytes of memory",
             array_size);
         winx_free(jp->pi.cluster_map);
@@ -93,6 +420,28 @@ int allocate_map(int map_size,udefrag_job_parameters *jp)
         return UDEFRAG_NO_MEM;
     }
     
+    /* without these ones the entire map gets delivered each time */
+    jp->cluster_map.dirty_cells = winx_tmalloc(
+        (map_size + 31) / 32 * sizeof(ULONG));
+    jp->cluster_map.changes = winx_tmalloc(
+        MAX_MAP_CHANGES * sizeof(udefrag_map_range));
+
+    /* without this one the caller has to downscale the map itself */
+    if(n_levels){
+        array_size = (total_size - map_size) * sizeof(cmap_cell);
+        jp->cluster_map.nodes = winx_tmalloc(array_size);
+        if(jp->cluster_map.nodes == NULL){
+            etrace("cannot allocate %u bytes of memory",array_size);
+            n_levels = 0;
+        }
+    }
+    for(level = 0; level <= n_levels; level++){
+        jp->cluster_map.level_offset[level] = udefrag_get_map_level(map_size,
+            level,&jp->cluster_map.level_size[level]);
+    }
+    jp->cluster_map.n_levels = n_levels;
+    jp->pi.cluster_map_levels = n_levels;
+
     /* set internal data */
     jp->pi.cluster_map_size = map_size;
     jp->cluster_map.map_size = map_size;
@@ -132,24 +481,113 @@ int allocate_map(int map_size,udefrag_job_parameters *jp)
  */
 void reset_cluster_map(udefrag_job_parameters *jp)
 {
-    ULONGLONG i, j;
+    ULONGLONG i, used_cells;
+    cmap_cell *c;
     
-    if(jp->cluster_map.array == NULL)
+    if(jp->cluster_map.cells == NULL)
         return;
 
-    memset(jp->cluster_map.array,0,jp->cluster_map.map_size * jp->cluster_map.n_colors * sizeof(ULONGLONG));
-    if(jp->cluster_map.opposite_order == 0){
-        for(i = 0; i < jp->cluster_map.map_size - jp->cluster_map.unused_cells - 1; i++)
-            jp->cluster_map.array[i][DEFAULT_COLOR] = jp->cluster_map.clusters_per_cell;
-        jp->cluster_map.array[i][DEFAULT_COLOR] = jp->cluster_map.clusters_per_last_cell;
-        for(j = 0, i++; j < jp->cluster_map.unused_cells; j++)
-            jp->cluster_map.array[i+j][UNUSED_MAP_SPACE] = jp->cluster_map.clusters_per_cell;
-    } else {
-        for(i = 0; i < jp->cluster_map.map_size - jp->cluster_map.unused_cells; i++)
-            jp->cluster_map.array[i][DEFAULT_COLOR] = 1;
-        for(j = 0; j < jp->cluster_map.unused_cells; j++)
-            jp->cluster_map.array[i+j][UNUSED_MAP_SPACE] = 1;
+    memset(jp->cluster_map.cells,0,
+        jp->cluster_map.map_size * sizeof(cmap_cell));
+    jp->cluster_map.n_counters = 0;
+    (void)InterlockedExchange(&jp->cluster_map.all_dirty,1);
+
+    used_cells = jp->cluster_map.map_size - jp->cluster_map.unused_cells;
+    for(i = 0; i < jp->cluster_map.map_size; i++){
+        c = &jp->cluster_map.cells[i];
+        c->color[0] = (i < used_cells) ? DEFAULT_COLOR : UNUSED_MAP_SPACE;
+        c->count[0] = (ULONG)min(get_cell_capacity(jp,i),MAX_CELL_COUNT);
+        c->dominant = c->color[0];
     }
+    build_pyramid(jp);
+}
+
+/**
+ * @brief Copies colors of all nodes
+ * of the pyramid to the delivered map.
+ */
+static void refill_pyramid(udefrag_job_parameters *jp)
+{
+    cmap *m = &jp->cluster_map;
+    int i, n;
+
+    n = m->level_offset[m->n_levels] + m->level_size[m->n_levels] - m->map_size;
+    for(i = 0; i < n; i++)
+        jp->pi.cluster_map[m->map_size + i] = (char)m->nodes[i].dominant;
+}
+
+/**
+ * @internal
+ * @brief Copies colors of the changed
+ * cells to the map delivered to the caller.
+ * @param[in] jp the job parameters.
+ * @param[out] count number of ranges of changed cells.
+ * @return List of ranges of changed cells, NULL
+ * indicates that the entire map has been refilled.
+ */
+udefrag_map_range *refill_cluster_map(udefrag_job_parameters *jp,int *count)
+{
+    cmap *m = &jp->cluster_map;
+    udefrag_map_range *changes = m->changes;
+    int i, cell, n = 0, overflow = 0;
+    int level, first, last, node;
+    ULONG w;
+
+    *count = 0;
+
+    /*
+    * The job thread changes the map concurrently,
+    * so clear the bits before reading the colors:
+    * cells changed meanwhile will be marked again.
+    */
+    if(InterlockedExchange(&m->all_dirty,0) || \
+      m->dirty_cells == NULL || changes == NULL){
+        if(m->dirty_cells){
+            for(i = 0; i < (m->map_size + 31) / 32; i++)
+                (void)InterlockedExchange((LONG *)&m->dirty_cells[i],0);
+        }
+        for(i = 0; i < m->map_size; i++)
+            jp->pi.cluster_map[i] = (char)m->cells[i].dominant;
+        refill_pyramid(jp);
+        return NULL;
+    }
+
+    for(i = 0; i < (m->map_size + 31) / 32; i++){
+        if(m->dirty_cells[i] == 0) continue;
+        w = (ULONG)InterlockedExchange((LONG *)&m->dirty_cells[i],0);
+        for(cell = i * 32; w; w >>= 1, cell ++){
+            if(!(w & 1)) continue;
+            jp->pi.cluster_map[cell] = (char)m->cells[cell].dominant;
+            if(n && changes[n - 1].first + changes[n - 1].count == cell){
+                changes[n - 1].count ++;
+            } else if(n < MAX_MAP_CHANGES){
+                changes[n].first = cell;
+                changes[n].count = 1;
+                n ++;
+            } else {
+                overflow = 1;
+            }
+        }
+    }
+
+    /* refill the nodes covering the changed cells */
+    if(overflow){
+        refill_pyramid(jp);
+        return NULL;
+    }
+    for(i = 0; i < n; i++){
+        for(level = 1; level <= m->n_levels; level++){
+            first = changes[i].first >> level;
+            last = (changes[i].first + changes[i].count - 1) >> level;
+            for(node = first; node <= last; node++){
+                jp->pi.cluster_map[m->level_offset[level] + node] = \
+                    (char)get_node(m,level,node)->dominant;
+            }
+        }
+    }
+
+    *count = n;
+    return changes;
 }
 
 /**
@@ -161,11 +599,11 @@ void reset_cluster_map(udefrag_job_parameters *jp)
 void colorize_map_region(udefrag_job_parameters *jp,
         ULONGLONG lcn, ULONGLONG length, int new_color, int old_color)
 {
-    ULONGLONG i, j, n, cell, offset, ncells;
-    ULONGLONG *c;
+    ULONGLONG i, n, cell, offset, ncells;
+    cmap_cell *c;
     
     /* validate parameters */
-    if(jp->cluster_map.array == NULL)
+    if(jp->cluster_map.cells == NULL)
         return;
     if(!check_region(jp,lcn,length))
         return;
@@ -189,33 +627,28 @@ void colorize_map_region(udefrag_job_parameters *jp,
         if(cell >= jp->cluster_map.map_size) return;
         while(cell < (jp->cluster_map.map_size - 1) && length){
             n = min(length,jp->cluster_map.clusters_per_cell - offset);
-            jp->cluster_map.array[cell][new_color] += n;
-            if(new_color != MFT_ZONE_SPACE){
-                c = &jp->cluster_map.array[cell][old_color];
-                if(*c >= n) *c -= n; else *c = 0;
-            }
+            recolor_cell(jp,cell,n,new_color,old_color);
             length -= n;
             cell ++;
             offset = 0;
         }
         if(length){
             n = min(length,jp->cluster_map.clusters_per_last_cell - offset);
-            jp->cluster_map.array[cell][new_color] += n;
-            if(new_color != MFT_ZONE_SPACE){
-                c = &jp->cluster_map.array[cell][old_color];
-                if(*c >= n) *c -= n; else *c = 0;
-            }
+            recolor_cell(jp,cell,n,new_color,old_color);
         }
     } else {
         /* clusters < cells */
         cell = lcn * jp->cluster_map.cells_per_cluster;
         ncells = length * jp->cluster_map.cells_per_cluster;
         for(i = 0; i < ncells; i++){
+            c = &jp->cluster_map.cells[cell + i];
             if(new_color != MFT_ZONE_SPACE){
-                for(j = 0; j < jp->cluster_map.n_colors; j++)
-                    jp->cluster_map.array[cell + i][j] = 0;
+                /* a single cluster has a single color */
+                memset(c->count,0,sizeof(c->count));
+                c->extended = 0;
             }
-            jp->cluster_map.array[cell + i][new_color] = 1;
+            set_cell_count(jp,c,new_color,1);
+            update_cell_color(jp,cell + i);
         }
     }
 }
@@ -239,7 +672,7 @@ int is_mft(winx_file_info *f, fs_type_enum fs_type)
     if(is_not_mft_file(f)) return 0;
     if(is_mft_file(f)) return 1;
     
-    length = (int)wcslen(f->path);
+    length = winx_get_file_path_length(f);
     if(length == 11){
         if(winx_wcsistr(f->name,mft_name)){
             f->user_defined_flags |= UD_FILE_MFT_FILE;
@@ -307,9 +740,14 @@ void colorize_file(udefrag_job_parameters *jp, winx_file_info *f, int old_color)
 void free_map(udefrag_job_parameters *jp)
 {
     winx_free(jp->pi.cluster_map);
-    winx_free(jp->cluster_map.array);
+    winx_free(jp->cluster_map.cells);
+    winx_free(jp->cluster_map.counters);
+    winx_free(jp->cluster_map.dirty_cells);
+    winx_free(jp->cluster_map.changes);
+    winx_free(jp->cluster_map.nodes);
     jp->pi.cluster_map = NULL;
     jp->pi.cluster_map_size = 0;
+    jp->pi.cluster_map_levels = 0;
     memset(&jp->cluster_map,0,sizeof(cmap));
 }
 
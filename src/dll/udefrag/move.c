@@ -91,6 +91,7 @@ int can_move(winx_file_info *f, fs_type_enum fstype)
         L"*\\bootsqm.dat",   /* part of Windows */
         NULL
     };
+    wchar_t path[MAX_PATH];
     int i;
 
     /* skip files already moved to front in optimization */
@@ -124,18 +125,19 @@ int can_move(winx_file_info *f, fs_type_enum fstype)
     /* keep the computer bootable */
     if(is_not_essential_file(f)) return 1;
     if(is_essential_boot_file(f)) return 0;
+    (void)winx_get_file_path(f,path,MAX_PATH);
     if (is_fstype_FAT(fstype) && !is_fragmented(f)) {
         for(i = 0; dos_files[i]; i++){
-            if(winx_wcsmatch(f->path,dos_files[i],WINX_PAT_ICASE)){
-                itrace("essential dos file detected: %ws",f->path);    
+            if(winx_wcsmatch(path,dos_files[i],WINX_PAT_ICASE)){
+                itrace("essential dos file detected: %ws",path);    
                 f->user_defined_flags |= UD_FILE_ESSENTIAL_BOOT_FILE;
                 return 0;
             }
         }
     }
     for(i = 0; boot_files[i]; i++){
-        if(winx_wcsmatch(f->path,boot_files[i],WINX_PAT_ICASE)){
-            itrace("essential boot file detected: %ws",f->path);
+        if(winx_wcsmatch(path,boot_files[i],WINX_PAT_ICASE)){
+            itrace("essential boot file detected: %ws",path);
             f->user_defined_flags |= UD_FILE_ESSENTIAL_BOOT_FILE;
             return 0;
         }
@@ -186,6 +188,77 @@ static winx_blockmap *get_first_block_of_cluster_chain(winx_file_info *f,ULONGLO
     return NULL;
 }
 
+/**
+ * @internal
+ * @brief Adjusts the number of clusters moved
+ * at once towards the target latency of moves.
+ * @param[in] jp the job parameters.
+ * @param[in] clusters the number of clusters
+ * moved by the last FSCTL_MOVE_FILE call.
+ * @param[in] time the duration of the call,
+ * in milliseconds.
+ * @details The number shrinks in proportion to the
+ * excess of the latency and grows twice at most when
+ * the calls complete in less than half of the target
+ * time. Moves of partial chunks tell nothing about
+ * the larger ones, so they never let it grow.
+ */
+static void adjust_move_chunk_size(udefrag_job_parameters *jp,
+    ULONGLONG clusters, ULONGLONG time)
+{
+    struct move_chunk_stats *s = &jp->m_stats;
+    ULONGLONG target = (ULONGLONG)jp->udo.move_target_latency;
+    ULONGLONG n = jp->clusters_at_once;
+
+    s->calls ++;
+    s->clusters += clusters;
+    s->time += time;
+
+    if(target == 0 || clusters == 0) return;
+
+    if(time > target){
+        n = clusters * target / time;
+    } else if(time < target / 2 && clusters == jp->clusters_at_once){
+        n = clusters * 2;
+        if(time) n = min(n,clusters * target / time);
+    }
+    if(n < s->min_clusters) n = s->min_clusters;
+    if(n > s->max_clusters) n = s->max_clusters;
+    if(n == jp->clusters_at_once) return;
+
+    if(jp->udo.dbgprint_level >= DBG_DETAILED){
+        itrace("%I64u clusters moved in %I64u ms, "
+            "%I64u clusters will be moved at once",clusters,time,n);
+    }
+    jp->clusters_at_once = n;
+    s->adjustments ++;
+    if(n < s->smallest) s->smallest = n;
+    if(n > s->largest) s->largest = n;
+}
+
+/**
+ * @internal
+ * @brief Displays sizes of the moves
+ * and the throughput they achieved.
+ */
+void dbg_print_move_statistics(udefrag_job_parameters *jp)
+{
+    struct move_chunk_stats *s = &jp->m_stats;
+    ULONGLONG bpc = jp->v_info.bytes_per_cluster;
+    char smallest[32], largest[32], current[32], speed[32];
+
+    if(s->calls == 0) return;
+
+    winx_bytes_to_hr(s->smallest * bpc,0,smallest,sizeof(smallest));
+    winx_bytes_to_hr(s->largest * bpc,0,largest,sizeof(largest));
+    winx_bytes_to_hr(jp->clusters_at_once * bpc,0,current,sizeof(current));
+    itrace("Move Size = %s - %s, %s at last, %I64u adjustments",
+        smallest, largest, current, s->adjustments);
+    winx_bytes_to_hr(s->time ? s->clusters * bpc * 1000 / s->time : 0,
+        3,speed,sizeof(speed));
+    itrace("Move Speed = %s/s, %I64u moves",speed,s->calls);
+}
+
 /**
  * @internal
  * @brief Moves file clusters.
@@ -202,6 +275,7 @@ static int move_file_clusters(winx_file_info *f,HANDLE hFile,ULONGLONG startVcn,
     IO_STATUS_BLOCK iosb;
     MOVEFILE_DESCRIPTOR mfd;
     ULONGLONG clusters_to_move;
+    ULONGLONG time;
 
     if(jp->udo.dbgprint_level >= DBG_DETAILED){
         itrace("sVcn: %I64u,tLcn: %I64u,n: %u",
@@ -212,15 +286,28 @@ static int move_file_clusters(winx_file_info *f,HANDLE hFile,ULONGLONG startVcn,
         return (-1);
     
     if(jp->udo.dry_run){
-        jp->pi.moved_clusters += n_clusters;
-        jp->pi.processed_clusters += n_clusters;
+        if(jp->udo.simulated_move_latency == 0){
+            jp->pi.moved_clusters += n_clusters;
+            jp->pi.processed_clusters += n_clusters;
+            return 0;
+        }
+        /* let the moves take time of a real device */
+        while(n_clusters){
+            if(jp->termination_router((void *)jp)) return (-1);
+            clusters_to_move = min(jp->clusters_at_once,n_clusters);
+            winx_sleep(jp->udo.simulated_move_latency);
+            jp->pi.moved_clusters += clusters_to_move;
+            jp->pi.processed_clusters += clusters_to_move;
+            n_clusters -= clusters_to_move;
+        }
         return 0;
     }
 
     /*
     * Execution of FSCTL_MOVE_FILE request
     * cannot be interrupted, so let's move
-    * little portions of data at once.
+    * little portions of data at once; their
+    * size follows the measured latency.
     */
     while(n_clusters){
         if(jp->termination_router((void *)jp)) return (-1);
@@ -235,6 +322,7 @@ static int move_file_clusters(winx_file_info *f,HANDLE hFile,ULONGLONG startVcn,
 #else
         mfd.NumVcns = (ULONG)clusters_to_move;
 #endif
+        time = winx_xtime();
         status = NtFsControlFile(winx_fileno(jp->fVolume),NULL,NULL,0,&iosb,
                             FSCTL_MOVE_FILE,&mfd,sizeof(MOVEFILE_DESCRIPTOR),
                             NULL,0);
@@ -242,12 +330,16 @@ static int move_file_clusters(winx_file_info *f,HANDLE hFile,ULONGLONG startVcn,
             NtWaitForSingleObject(winx_fileno(jp->fVolume),FALSE,NULL);
             status = iosb.Status;
         }
+        time = winx_xtime() - time;
         jp->last_move_status = status;
         if(!NT_SUCCESS(status)){
-            strace(status,"cannot move file clusters of %ws",f->path);
+            strace(status,"cannot move file clusters of %ws",winx_file_path(f));
             jp->pi.processed_clusters += n_clusters;
             return (-1);
         }
+        /* concurrent moves make the device slower */
+        if(jp->mq.n_requests == 0)
+            adjust_move_chunk_size(jp,clusters_to_move,time);
         jp->pi.moved_clusters += clusters_to_move;
         jp->pi.processed_clusters += clusters_to_move;
         startVcn += clusters_to_move;
@@ -320,17 +412,7 @@ static void DbgPrintBlocksOfFile(winx_blockmap *blockmap)
  */
 static winx_blockmap *add_new_block(winx_blockmap **head,ULONGLONG vcn,ULONGLONG lcn,ULONGLONG length)
 {
-    winx_blockmap *block, *last_block = NULL;
-    
-    if(*head != NULL)
-        last_block = (*head)->prev;
-    
-    block = (winx_blockmap *)winx_list_insert((list_entry **)head,
-                (list_entry *)last_block,sizeof(winx_blockmap));
-    block->vcn = vcn;
-    block->lcn = lcn;
-    block->length = length;
-    return block;
+    return winx_blockmap_append(head,vcn,lcn,length);
 }
 
 /**
@@ -359,7 +441,8 @@ static void calculate_file_disposition(winx_file_info *f,ULONGLONG vcn,
     
     first_block = get_first_block_of_cluster_chain(f,vcn);
     if(first_block == NULL){
-        etrace("get_first_block_of_cluster_chain failed for %ws",f->path);
+        etrace("get_first_block_of_cluster_chain failed for %ws",
+            winx_file_path(f));
         new_file_info->disp.clusters = 0;
         return;
     }
@@ -415,14 +498,14 @@ static void calculate_file_disposition(winx_file_info *f,ULONGLONG vcn,
     
     /* replace list of blocks by list of fragments */
     fragments = build_fragments_list(new_file_info,&n);
-    winx_list_destroy((list_entry **)(void *)&new_file_info->disp.blockmap);
+    winx_blockmap_destroy(&new_file_info->disp.blockmap);
     new_file_info->disp.blockmap = fragments;
     new_file_info->disp.fragments = n;
     return;
     
 fail:
-    etrace("not enough memory for %ws",f->path);
-    winx_list_destroy((list_entry **)(void *)&new_file_info->disp.blockmap);
+    etrace("not enough memory for %ws",winx_file_path(f));
+    winx_blockmap_destroy(&new_file_info->disp.blockmap);
     new_file_info->disp.fragments = 0;
     new_file_info->disp.clusters = 0;
 }
@@ -486,6 +569,110 @@ static int dump_terminator(void *user_defined_data)
     return jp->termination_router((void *)jp);
 }
 
+/**
+ * @internal
+ * @brief Appends parts of blocks located
+ * between the specified VCNs to a file map.
+ * @return Zero for success, negative value otherwise.
+ */
+static int append_blocks(winx_blockmap **head,winx_blockmap *map,
+    ULONGLONG start_vcn,ULONGLONG end_vcn)
+{
+    winx_blockmap *block;
+    ULONGLONG vcn, next_vcn;
+
+    for(block = map; block; block = block->next){
+        if(block->vcn >= end_vcn) break;
+        vcn = max(block->vcn,start_vcn);
+        next_vcn = min(block->vcn + block->length,end_vcn);
+        if(vcn < next_vcn){
+            if(!add_new_block(head,vcn,block->lcn + (vcn - block->vcn),
+                next_vcn - vcn)) return (-1);
+        }
+        if(block->next == map) break;
+    }
+    return 0;
+}
+
+/**
+ * @internal
+ * @brief Retrieves disposition of a file
+ * after the move of a cluster chain.
+ * @details Only the moved range of VCNs gets
+ * retrieved, the rest of the disposition is
+ * taken from the file information, so moves
+ * of small parts of huge files don't need
+ * to dump all the blocks again.
+ * @param[in] f pointer to structure
+ * containing the initial disposition.
+ * @param[in] vcn VCN of the moved cluster chain.
+ * @param[in] length length of the moved cluster chain.
+ * @param[out] new_file_info pointer to structure
+ * receiving the updated file information.
+ * @param[in] jp the job parameters.
+ * @return Zero for success, negative value otherwise.
+ */
+static int redump_moved_range(winx_file_info *f,ULONGLONG vcn,
+    ULONGLONG length,winx_file_info *new_file_info,udefrag_job_parameters *jp)
+{
+    winx_blockmap *block, *moved_blocks, *fragments;
+    ULONGLONG end_vcn, n;
+    ULONGLONG time = winx_xtime();
+    int result = -1;
+
+    /* duplicate file information */
+    memcpy(new_file_info,f,sizeof(winx_file_info));
+
+    /* reset new file disposition */
+    new_file_info->disp.blockmap = NULL;
+    new_file_info->disp.fragments = 0;
+    new_file_info->disp.clusters = 0;
+
+    /* find the end of the moved cluster chain */
+    end_vcn = vcn;
+    block = get_first_block_of_cluster_chain(f,vcn);
+    for(; block; block = block->next){
+        n = min(block->length - (end_vcn - block->vcn),length);
+        end_vcn += n;
+        length -= n;
+        if(!length || block->next == f->disp.blockmap) break;
+        end_vcn = block->next->vcn;
+    }
+
+    if(winx_ftw_dump_file_range(f,vcn,end_vcn,&moved_blocks,
+        dump_terminator,(void *)jp) < 0) goto done;
+
+    /* put the moved blocks between the other ones */
+    if(append_blocks(&new_file_info->disp.blockmap,
+        f->disp.blockmap,0,vcn) < 0 \
+      || append_blocks(&new_file_info->disp.blockmap,
+        moved_blocks,vcn,end_vcn) < 0 \
+      || append_blocks(&new_file_info->disp.blockmap,
+        f->disp.blockmap,end_vcn,(ULONGLONG) -1) < 0){
+        etrace("not enough memory for %ws",winx_file_path(f));
+        winx_blockmap_destroy(&new_file_info->disp.blockmap);
+        winx_blockmap_destroy(&moved_blocks);
+        goto done;
+    }
+    winx_blockmap_destroy(&moved_blocks);
+
+    for(block = new_file_info->disp.blockmap; block; block = block->next){
+        new_file_info->disp.clusters += block->length;
+        if(block->next == new_file_info->disp.blockmap) break;
+    }
+
+    /* replace list of blocks by list of fragments */
+    fragments = build_fragments_list(new_file_info,&n);
+    winx_blockmap_destroy(&new_file_info->disp.blockmap);
+    new_file_info->disp.blockmap = fragments;
+    new_file_info->disp.fragments = n;
+    result = 0;
+
+done:
+    jp->p_counters.verification_time += winx_xtime() - time;
+    return result;
+}
+
 /************************************************************/
 /*                    move_file routine                     */
 /************************************************************/
@@ -494,7 +681,7 @@ static int dump_terminator(void *user_defined_data)
  * @internal
  * @brief File moving results.
  * @details Intended for use in
- * the move_file routine only.
+ * the file moving routines only.
  */
 typedef enum {
     CALCULATED_MOVING_SUCCESS,          /* file has been moved successfully, but its new map of blocks is just calculated */
@@ -505,57 +692,33 @@ typedef enum {
 
 /**
  * @internal
- * @brief Moves a cluster chain of a file.
- * @param[in] f pointer to structure describing the file to be moved.
- * @param[in] vcn the VCN of the first cluster to be moved.
- * @param[in] length length of the cluster chain to be moved.
- * @param[in] target the LCN of the target free region.
- * @param[in] jp the job parameters.
- * @return Zero for success, negative value otherwise.
- * @note 
- * - This routine cannot move the first fragment of MFT
- * on NTFS as well as first clusters of FAT directories.
- * - The volume must be opened before this call,
- * jp->fVolume must contain a proper handle.
- * - If this function returns a negative value, it sets also one of the
- * file status flags defined in udefrag_internals.h file. This helps to
- * display the file moving status in fragmentation reports.
+ * @brief Prepares a move of a cluster chain of a file.
+ * @details Validates parameters, saves properties
+ * of the file and opens it.
+ * @return Positive value when the file is ready to be
+ * moved, zero when there is nothing to move, negative
+ * value otherwise.
  */
-int move_file(winx_file_info *f,
-              ULONGLONG vcn,
-              ULONGLONG length,
-              ULONGLONG target,
-              udefrag_job_parameters *jp
-              )
+static int begin_move(struct move_request *r,winx_file_info *f,
+    ULONGLONG vcn,ULONGLONG length,ULONGLONG target,
+    udefrag_job_parameters *jp)
 {
-    ULONGLONG time;
     wchar_t *path;
+    wchar_t path_buffer[MAX_PATH];
     NTSTATUS status;
-    HANDLE hFile;
-    int old_color, new_color;
-    int was_fragmented, became_fragmented;
-    int was_excluded;
-    int dump_result;
-    winx_blockmap *block, *first_block;
-    ULONGLONG clusters_to_redraw;
-    ULONGLONG curr_vcn, lcn, n;
-    winx_file_info desired_file_info;
-    winx_file_info new_file_info;
-    ud_file_moving_result moving_result;
-    int r1, r2, r3;
     
-    time = winx_xtime();
     jp->last_move_status = 0;
     
     /* validate parameters */
     if(f == NULL){
         etrace("invalid parameter");
-        f->user_defined_flags |= UD_FILE_IMPROPER_STATE;
-        jp->p_counters.moving_time += winx_xtime() - time;
         return (-1);
     }
     
-    path = f->path ? f->path : L"(null)";
+    /* never keep paths of files being moved, they are too many */
+    path = path_buffer;
+    if(winx_get_file_path(f,path_buffer,MAX_PATH) < 0)
+        path = L"(null)";
     if(jp->udo.dbgprint_level >= DBG_DETAILED){
         itrace("%ws",path);
         itrace("vcn = %I64u, length = %I64u, target = %I64u",vcn,length,target);
@@ -565,13 +728,11 @@ int move_file(winx_file_info *f,
         etrace("move of zero number "
             "of clusters requested for %ws",path);
         f->user_defined_flags |= UD_FILE_IMPROPER_STATE;
-        jp->p_counters.moving_time += winx_xtime() - time;
         return 0; /* nothing to move */
     }
     
     if(f->disp.clusters == 0 || f->disp.fragments == 0 || f->disp.blockmap == NULL){
         f->user_defined_flags |= UD_FILE_IMPROPER_STATE;
-        jp->p_counters.moving_time += winx_xtime() - time;
         return 0; /* nothing to move */
     }
     
@@ -580,16 +741,13 @@ int move_file(winx_file_info *f,
             "the end of the file requested for %ws",path);
         DbgPrintBlocksOfFile(f->disp.blockmap);
         f->user_defined_flags |= UD_FILE_IMPROPER_STATE;
-        jp->p_counters.moving_time += winx_xtime() - time;
         return (-1);
     }
     
-    first_block = get_first_block_of_cluster_chain(f,vcn);
-    if(first_block == NULL){
+    if(get_first_block_of_cluster_chain(f,vcn) == NULL){
         etrace("data move out of "
             "file bounds requested for %ws",path);
         f->user_defined_flags |= UD_FILE_IMPROPER_STATE;
-        jp->p_counters.moving_time += winx_xtime() - time;
         return (-1);
     }
     
@@ -597,39 +755,68 @@ int move_file(winx_file_info *f,
         etrace("there is no sufficient "
             "free space available on target block for %ws",path);
         f->user_defined_flags |= UD_FILE_IMPROPER_STATE;
-        jp->p_counters.moving_time += winx_xtime() - time;
         return (-1);
     }
     
     /* save file properties */
-    old_color = get_file_color(jp,f);
-    was_fragmented = is_fragmented(f);
-    was_excluded = is_excluded(f);
+    r->f = f;
+    r->vcn = vcn;
+    r->length = length;
+    r->target = target;
+    r->old_color = get_file_color(jp,f);
+    r->was_fragmented = is_fragmented(f);
+    r->was_excluded = is_excluded(f);
 
     /* open the file */
-    status = winx_defrag_fopen(f,WINX_OPEN_FOR_MOVE,&hFile);
+    status = winx_defrag_fopen(f,WINX_OPEN_FOR_MOVE,&r->hFile);
     if(status != STATUS_SUCCESS){
         strace(status,"cannot open %ws",path);
         f->user_defined_flags |= UD_FILE_LOCKED;
         /* redraw space */
-        colorize_file(jp,f,old_color);
+        colorize_file(jp,f,r->old_color);
         /*jp->pi.processed_clusters += length;*/
-        jp->p_counters.moving_time += winx_xtime() - time;
+        r->f = NULL;
         return (-1);
     }
+    return 1;
+}
+
+/**
+ * @internal
+ * @brief Completes a move of a cluster chain of a file.
+ * @details Checks what has been moved actually, then
+ * updates the map, the free space pool, the statistics
+ * and the file information. The file must be closed
+ * before this call.
+ * @return Zero for success, negative value otherwise.
+ */
+static int finish_move(struct move_request *r,udefrag_job_parameters *jp)
+{
+    winx_file_info *f = r->f;
+    ULONGLONG vcn = r->vcn, length = r->length, target = r->target;
+    wchar_t *path;
+    wchar_t path_buffer[MAX_PATH];
+    int new_color;
+    int became_fragmented;
+    int dump_result;
+    winx_blockmap *block, *first_block;
+    ULONGLONG clusters_to_redraw;
+    ULONGLONG curr_vcn, lcn, n;
+    winx_file_info desired_file_info;
+    winx_file_info new_file_info;
+    ud_file_moving_result moving_result;
+    int r1, r2, r3;
     
-    /* move the file */
-    move_file_helper(hFile,f,vcn,length,target,jp);
-    winx_defrag_fclose(hFile);
+    path = path_buffer;
+    if(winx_get_file_path(f,path_buffer,MAX_PATH) < 0)
+        path = L"(null)";
     
     /* get file moving result */
     calculate_file_disposition(f,vcn,length,target,&desired_file_info);
     if(jp->udo.dry_run){
         dump_result = -1;
     } else {
-        memcpy(&new_file_info,f,sizeof(winx_file_info));
-        new_file_info.disp.blockmap = NULL;
-        dump_result = winx_ftw_dump_file(&new_file_info,dump_terminator,(void *)jp);
+        dump_result = redump_moved_range(f,vcn,length,&new_file_info,jp);
         if(dump_result < 0)
             etrace("cannot redump the file");
     }
@@ -666,16 +853,15 @@ int move_file(winx_file_info *f,
             }
         }
         /* release calculated disposition */
-        winx_list_destroy((list_entry **)(void *)&desired_file_info.disp.blockmap);
+        winx_blockmap_destroy(&desired_file_info.disp.blockmap);
     }
     
     /* handle a case when nothing has been moved */
     if(moving_result == DETERMINED_MOVING_FAILURE){
-        winx_list_destroy((list_entry **)(void *)&new_file_info.disp.blockmap);
+        winx_blockmap_destroy(&new_file_info.disp.blockmap);
         f->user_defined_flags |= UD_FILE_MOVING_FAILED;
         /* remove target space from the free space pool */
         jp->free_regions = winx_sub_volume_region(jp->free_regions,target,length);
-        jp->p_counters.moving_time += winx_xtime() - time;
         return (-1);
     }
 
@@ -684,7 +870,7 @@ int move_file(winx_file_info *f,
     * files as we cannot say for sure whether it's
     * still fragmented right now or not.
     */
-    if(was_fragmented && !was_excluded)
+    if(r->was_fragmented && !r->was_excluded)
         truncate_fragmented_files_list(f,jp);
     
     /*
@@ -713,9 +899,10 @@ int move_file(winx_file_info *f,
     jp->free_regions = winx_sub_volume_region(jp->free_regions,target,length);
     
     /* redraw file clusters in the new color */
-    if(new_color != old_color){
+    if(new_color != r->old_color){
         for(block = f->disp.blockmap; block; block = block->next){
-            colorize_map_region(jp,block->lcn,block->length,new_color,old_color);
+            colorize_map_region(jp,block->lcn,block->length,
+                new_color,r->old_color);
             if(block->next == f->disp.blockmap) break;
         }
     }
@@ -747,7 +934,7 @@ int move_file(winx_file_info *f,
     /* adjust statistics */
     became_fragmented = is_fragmented(&new_file_info);
     if(became_fragmented && !is_excluded(f)){
-        if(!was_fragmented || was_excluded){
+        if(!r->was_fragmented || r->was_excluded){
             jp->pi.fragmented ++;
             jp->pi.fragments += (new_file_info.disp.fragments - 1);
             jp->pi.bad_fragments += new_file_info.disp.fragments;
@@ -759,7 +946,7 @@ int move_file(winx_file_info *f,
         }
     }
     if(!became_fragmented || is_excluded(f)){
-        if(was_fragmented && !was_excluded){
+        if(r->was_fragmented && !r->was_excluded){
             jp->pi.fragmented --;
             jp->pi.fragments -= (f->disp.fragments - 1);
             jp->pi.bad_fragments -= f->disp.fragments;
@@ -768,12 +955,13 @@ int move_file(winx_file_info *f,
     }
 
     /* new block map is available - use it */
+    invalidate_fragment_index(f,jp);
     for(block = f->disp.blockmap; block; block = block->next){
         /* all blocks must be removed! */
         (void)remove_block_from_file_blocks_tree(jp,block);
         if(block->next == f->disp.blockmap) break;
     }
-    winx_list_destroy((list_entry **)(void *)&f->disp.blockmap);
+    winx_blockmap_destroy(&f->disp.blockmap);
     memcpy(&f->disp,&new_file_info.disp,sizeof(winx_file_disposition));
     for(block = f->disp.blockmap; block; block = block->next){
         if(add_block_to_file_blocks_tree(jp,f,block) < 0) break;
@@ -784,8 +972,476 @@ int move_file(winx_file_info *f,
     if(is_fragmented(f) && !is_excluded(f))
         expand_fragmented_files_list(f,jp);
 
-    jp->p_counters.moving_time += winx_xtime() - time;
     return (moving_result == DETERMINED_MOVING_PARTIAL_SUCCESS) ? (-1) : 0;
 }
 
+/**
+ * @internal
+ * @brief Moves a cluster chain of a file.
+ * @param[in] f pointer to structure describing the file to be moved.
+ * @param[in] vcn the VCN of the first cluster to be moved.
+ * @param[in] length length of the cluster chain to be moved.
+ * @param[in] target the LCN of the target free region.
+ * @param[in] jp the job parameters.
+ * @return Zero for success, negative value otherwise.
+ * @note 
+ * - This routine cannot move the first fragment of MFT
+ * on NTFS as well as first clusters of FAT directories.
+ * - The volume must be opened before this call,
+ * jp->fVolume must contain a proper handle.
+ * - If this function returns a negative value, it sets also one of the
+ * file status flags defined in udefrag_internals.h file. This helps to
+ * display the file moving status in fragmentation reports.
+ */
+int move_file(winx_file_info *f,
+              ULONGLONG vcn,
+              ULONGLONG length,
+              ULONGLONG target,
+              udefrag_job_parameters *jp
+              )
+{
+    ULONGLONG time;
+    struct move_request r;
+    int result;
+
+    time = winx_xtime();
+    memset(&r,0,sizeof(struct move_request));
+    result = begin_move(&r,f,vcn,length,target,jp);
+    if(result > 0){
+        /* move the file */
+        move_file_helper(r.hFile,f,vcn,length,target,jp);
+        winx_defrag_fclose(r.hFile);
+        result = finish_move(&r,jp);
+    }
+    jp->p_counters.moving_time += winx_xtime() - time;
+    return result;
+}
+
+/************************************************************/
+/*                    Concurrent moves                      */
+/************************************************************/
+
+/**
+ * @internal
+ * @brief Prepares the queue of moves.
+ * @details Moves of different files issued through
+ * move_file_async get executed concurrently, up to
+ * %UD_MOVE_QUEUE_DEPTH at once. In dry run, calls of
+ * a simulated device complete in %UD_DRY_RUN_LATENCY
+ * milliseconds instead.
+ * @return Zero for success, negative value otherwise.
+ * In case of failure moves become sequential.
+ */
+int init_move_queue(udefrag_job_parameters *jp)
+{
+    wchar_t path[] = L"\\??\\A:";
+    UNICODE_STRING us;
+    OBJECT_ATTRIBUTES oa;
+    IO_STATUS_BLOCK iosb;
+    struct move_queue *mq = &jp->mq;
+    NTSTATUS status;
+    int i;
+
+    memset(mq,0,sizeof(struct move_queue));
+    if(jp->udo.move_queue_depth <= 1)
+        return 0;
+
+    if(!jp->udo.dry_run){
+        /* open the volume for asynchronous moves */
+        path[4] = winx_toupper(jp->volume_letter);
+        RtlInitUnicodeString(&us,path);
+        InitializeObjectAttributes(&oa,&us,OBJ_CASE_INSENSITIVE,NULL,NULL);
+        status = NtCreateFile(&mq->hVolume,FILE_GENERIC_READ,
+            &oa,&iosb,NULL,FILE_ATTRIBUTE_NORMAL,
+            FILE_SHARE_READ | FILE_SHARE_WRITE,FILE_OPEN,0,NULL,0);
+        if(!NT_SUCCESS(status)){
+            strace(status,"cannot open %ws",path);
+            mq->hVolume = NULL;
+            goto fail;
+        }
+    }
+
+    /* allocate the queue */
+    mq->requests = winx_tmalloc(jp->udo.move_queue_depth \
+        * sizeof(struct move_request));
+    if(mq->requests == NULL){
+        etrace("cannot allocate %u bytes of memory",
+            jp->udo.move_queue_depth * sizeof(struct move_request));
+        goto fail;
+    }
+    memset(mq->requests,0,jp->udo.move_queue_depth \
+        * sizeof(struct move_request));
+    mq->depth = jp->udo.move_queue_depth;
+    for(i = 0; i < mq->depth; i++){
+        status = NtCreateEvent(&mq->requests[i].hEvent,
+            STANDARD_RIGHTS_ALL | 0x1ff,NULL,NotificationEvent,0);
+        if(!NT_SUCCESS(status)){
+            strace(status,"cannot create event");
+            mq->requests[i].hEvent = NULL;
+            goto fail;
+        }
+    }
+    return 0;
+
+fail:
+    itrace("concurrent moves disabled");
+    destroy_move_queue(jp);
+    return (-1);
+}
+
+/**
+ * @internal
+ * @brief Returns the size of the next
+ * portion of data moved by a single call.
+ * @details Skips gaps between the file blocks
+ * and joins blocks following each other.
+ */
+static ULONGLONG get_next_chunk(winx_file_info *f,
+    ULONGLONG *vcn,ULONGLONG limit)
+{
+    winx_blockmap *block;
+    ULONGLONG n = 0;
+
+    for(block = f->disp.blockmap; block; block = block->next){
+        if(block->vcn + block->length > *vcn) break;
+        if(block->next == f->disp.blockmap) return 0;
+    }
+    if(block == NULL) return 0;
+    if(block->vcn > *vcn) *vcn = block->vcn;
+
+    n = block->vcn + block->length - *vcn;
+    while(n < limit){
+        if(block->next == f->disp.blockmap) break;
+        if(block->next->vcn != block->vcn + block->length) break;
+        block = block->next;
+        n += block->length;
+    }
+    return min(n,limit);
+}
+
+/**
+ * @internal
+ * @brief Issues the next FSCTL_MOVE_FILE call of a move.
+ */
+static void issue_move_call(struct move_request *r,udefrag_job_parameters *jp)
+{
+    struct move_request *q;
+    NTSTATUS status;
+    int i;
+
+    if(jp->termination_router((void *)jp)) return;
+
+    r->chunk = get_next_chunk(r->f,&r->next_vcn,
+        min(jp->clusters_at_once,r->remaining));
+    if(r->chunk == 0){
+        etrace("cluster chain of %ws ends unexpectedly",winx_file_path(r->f));
+        r->failed = 1;
+        return;
+    }
+
+    /* mark calls overlapping each other */
+    r->shared = 0;
+    for(i = 0; i < jp->mq.depth; i++){
+        q = &jp->mq.requests[i];
+        if(q != r && q->pending){
+            q->shared = 1;
+            r->shared = 1;
+        }
+    }
+    r->issue_time = winx_xtime();
+    r->pending = 1;
+    if(jp->udo.dry_run) return;
+
+    /* setup movefile descriptor and make the call */
+    memset(&r->mfd,0,sizeof(MOVEFILE_DESCRIPTOR));
+    r->mfd.FileHandle = r->hFile;
+    r->mfd.StartVcn.QuadPart = r->next_vcn;
+    r->mfd.TargetLcn.QuadPart = r->next_target;
+#ifdef _WIN64
+    r->mfd.NumVcns = r->chunk;
+#else
+    r->mfd.NumVcns = (ULONG)r->chunk;
+#endif
+    status = NtFsControlFile(jp->mq.hVolume,r->hEvent,NULL,NULL,&r->iosb,
+                        FSCTL_MOVE_FILE,&r->mfd,sizeof(MOVEFILE_DESCRIPTOR),
+                        NULL,0);
+    if(!NT_SUCCESS(status)){
+        jp->last_move_status = status;
+        strace(status,"cannot move file clusters of %ws",winx_file_path(r->f));
+        r->pending = 0;
+        r->failed = 1;
+    }
+}
+
+/**
+ * @internal
+ * @brief Waits for completion of the
+ * pending FSCTL_MOVE_FILE call of a move.
+ * @note Calls overlapping calls of other moves
+ * get serviced in turn, so the time passed since
+ * their issue includes the time spent on the others.
+ * Therefore only calls made alone adjust the size
+ * of the moved chunks.
+ */
+static void wait_for_move_call(struct move_request *r,
+    udefrag_job_parameters *jp)
+{
+    ULONGLONG time;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    if(!r->pending)
+        return;
+
+    if(jp->udo.dry_run){
+        /* the simulated device completes calls in the specified time */
+        time = winx_xtime() - r->issue_time;
+        if(time < (ULONGLONG)jp->udo.simulated_move_latency)
+            winx_sleep((int)(jp->udo.simulated_move_latency - time));
+    } else {
+        status = NtWaitForSingleObject(r->hEvent,FALSE,NULL);
+        if(NT_SUCCESS(status)) status = r->iosb.Status;
+        jp->last_move_status = status;
+    }
+    r->pending = 0;
+
+    if(!NT_SUCCESS(status)){
+        strace(status,"cannot move file clusters of %ws",winx_file_path(r->f));
+        r->failed = 1;
+        return;
+    }
+    if(!jp->udo.dry_run && !r->shared)
+        adjust_move_chunk_size(jp,r->chunk,winx_xtime() - r->issue_time);
+    jp->pi.moved_clusters += r->chunk;
+    jp->pi.processed_clusters += r->chunk;
+    r->moved_clusters += r->chunk;
+    r->next_vcn += r->chunk;
+    r->next_target += r->chunk;
+    r->remaining -= r->chunk;
+}
+
+/**
+ * @internal
+ * @brief Completes a move issued through the queue
+ * and delivers its result to the caller.
+ */
+static void complete_move_request(struct move_request *r,
+    udefrag_job_parameters *jp)
+{
+    move_completion_routine cb = r->cb;
+    winx_file_info *f = r->f;
+    void *p = r->p;
+    int result;
+
+    /* count all unprocessed clusters here */
+    jp->pi.processed_clusters += r->remaining;
+
+    winx_defrag_fclose(r->hFile);
+    result = finish_move(r,jp);
+
+    r->f = NULL;
+    jp->mq.n_requests --;
+    if(cb) cb(f,result,r->moved_clusters,p);
+}
+
+/**
+ * @internal
+ * @brief Waits for the pending call of a move, then
+ * issues the next one or completes the move.
+ */
+static void service_move_request(struct move_request *r,
+    udefrag_job_parameters *jp)
+{
+    wait_for_move_call(r,jp);
+    if(!r->failed && r->remaining){
+        issue_move_call(r,jp);
+        if(r->pending) return;
+    }
+    complete_move_request(r,jp);
+}
+
+/**
+ * @internal
+ * @brief Services busy slots of the queue
+ * in turn until one of them becomes free.
+ */
+static struct move_request *get_free_slot(udefrag_job_parameters *jp)
+{
+    struct move_queue *mq = &jp->mq;
+    struct move_request *r;
+    int i;
+
+    while(mq->n_requests == mq->depth){
+        r = &mq->requests[mq->next];
+        mq->next = (mq->next + 1) % mq->depth;
+        if(r->f) service_move_request(r,jp);
+    }
+    for(i = 0; i < mq->depth; i++){
+        if(mq->requests[i].f == NULL)
+            return &mq->requests[i];
+    }
+    return NULL;
+}
+
+/**
+ * @internal
+ * @brief Moves a cluster chain of a file
+ * along with moves of other files.
+ * @details The target region gets reserved
+ * immediately, so the next targets found
+ * never overlap it. The result gets delivered
+ * to the callback when the move completes,
+ * the latest in complete_moves call. Without
+ * the queue, the file gets moved at once.
+ * @param[in] f pointer to structure describing the file to be moved.
+ * @param[in] vcn the VCN of the first cluster to be moved.
+ * @param[in] length length of the cluster chain to be moved.
+ * @param[in] target the LCN of the target free region.
+ * @param[in] cb routine receiving the result, may be NULL.
+ * It receives a positive value when there is nothing to move.
+ * @param[in] user_defined_data data passed to the routine.
+ * @param[in] jp the job parameters.
+ * @return Negative value when the move fails
+ * immediately, zero otherwise.
+ */
+int move_file_async(winx_file_info *f,
+                    ULONGLONG vcn,
+                    ULONGLONG length,
+                    ULONGLONG target,
+                    move_completion_routine cb,
+                    void *user_defined_data,
+                    udefrag_job_parameters *jp
+                    )
+{
+    struct move_queue *mq = &jp->mq;
+    struct move_request *r;
+    ULONGLONG time, x;
+    int i, result;
+
+    if(mq->depth == 0){
+        x = jp->pi.moved_clusters;
+        result = move_file(f,vcn,length,target,jp);
+        if(cb){
+            x = jp->pi.moved_clusters - x;
+            /* a move of nothing is no success */
+            cb(f,(result == 0 && x == 0) ? 1 : result,x,user_defined_data);
+        }
+        return result;
+    }
+
+    time = winx_xtime();
+    for(i = 0; i < mq->depth; i++){
+        r = &mq->requests[i];
+        if(r->f == NULL) continue;
+        /* a file can be moved by a single call at once */
+        while(r->f == f) service_move_request(r,jp);
+        /* never let targets overlap */
+        if(r->f && target < r->target + r->length \
+          && r->target < target + length){
+            etrace("target of %ws overlaps a move in progress",
+                winx_file_path(f));
+            result = -1;
+            goto done;
+        }
+    }
+
+    r = get_free_slot(jp);
+    result = begin_move(r,f,vcn,length,target,jp);
+    if(result <= 0)
+        goto done;
+
+    /* reserve the target region */
+    jp->free_regions = winx_sub_volume_region(jp->free_regions,target,length);
+
+    r->next_vcn = vcn;
+    r->next_target = target;
+    r->remaining = length;
+    r->moved_clusters = 0;
+    r->failed = 0;
+    r->cb = cb;
+    r->p = user_defined_data;
+    mq->n_requests ++;
+    mq->max_requests = max(mq->max_requests,mq->n_requests);
+    mq->moves ++;
+
+    issue_move_call(r,jp);
+    if(!r->pending) complete_move_request(r,jp);
+    jp->p_counters.moving_time += winx_xtime() - time;
+    return 0;
+
+done:
+    /* begin_move returns zero when there is nothing to move */
+    if(cb) cb(f,(result == 0) ? 1 : result,0,user_defined_data);
+    jp->p_counters.moving_time += winx_xtime() - time;
+    return result;
+}
+
+/**
+ * @internal
+ * @brief Returns the lowest target LCN of
+ * the moves in progress, total number of
+ * clusters if there are no such moves.
+ */
+ULONGLONG get_lowest_pending_target(udefrag_job_parameters *jp)
+{
+    struct move_queue *mq = &jp->mq;
+    ULONGLONG lcn = jp->v_info.total_clusters;
+    int i;
+
+    for(i = 0; i < mq->depth; i++){
+        if(mq->requests[i].f && mq->requests[i].target < lcn)
+            lcn = mq->requests[i].target;
+    }
+    return lcn;
+}
+
+/**
+ * @internal
+ * @brief Waits for completion of all
+ * the moves issued through the queue.
+ */
+void complete_moves(udefrag_job_parameters *jp)
+{
+    struct move_queue *mq = &jp->mq;
+    struct move_request *r;
+    ULONGLONG time;
+
+    if(mq->n_requests == 0)
+        return;
+
+    time = winx_xtime();
+    while(mq->n_requests){
+        r = &mq->requests[mq->next];
+        mq->next = (mq->next + 1) % mq->depth;
+        if(r->f) service_move_request(r,jp);
+    }
+    jp->p_counters.moving_time += winx_xtime() - time;
+}
+
+/**
+ * @internal
+ * @brief Completes all the moves
+ * and releases the queue of moves.
+ */
+void destroy_move_queue(udefrag_job_parameters *jp)
+{
+    struct move_queue *mq = &jp->mq;
+    int i;
+
+    complete_moves(jp);
+    if(mq->moves){
+        itrace("%I64u files moved through the queue, up to %u at once",
+            mq->moves,mq->max_requests);
+    }
+    if(mq->requests){
+        for(i = 0; i < jp->udo.move_queue_depth; i++){
+            if(mq->requests[i].hEvent)
+                NtClose(mq->requests[i].hEvent);
+        }
+        winx_free(mq->requests);
+    }
+    if(mq->hVolume)
+        NtClose(mq->hVolume);
+    memset(mq,0,sizeof(struct move_queue));
+}
+
 /** @} */
@@ -121,7 +121,7 @@ static ULONGLONG advance_vcn(winx_file_info *f,ULONGLONG vcn,ULONGLONG n)
         }
         if(block->next == f->disp.blockmap) break;
     }
-    etrace("vcn calculation failed for %ws",f->path);
+    etrace("vcn calculation failed for %ws",winx_file_path(f));
     return 0;
 }
 
@@ -149,7 +149,7 @@ static int optimize_file(winx_file_info *f,udefrag_job_parameters *jp)
     ULONGLONG first_cluster;       /* LCN of the first file cluster */
     ULONGLONG start_lcn;           /* address of space not processed yet */
     ULONGLONG clusters_to_move;    /* number of clusters intended for the current move */
-    winx_volume_region *rgn, *target_rgn;
+    winx_volume_region *target_rgn;
     winx_file_info *first_file;
     winx_blockmap *first_block;
     ULONGLONG end_lcn, min_lcn, next_vcn;
@@ -186,14 +186,9 @@ try_again:
         if(jp->free_regions == NULL) break;
         
         /* search for the first free region after start_lcn */
-        target_rgn = NULL; tm = winx_xtime();
-        for(rgn = jp->free_regions; rgn; rgn = rgn->next){
-            if(rgn->lcn >= start_lcn && rgn->length){
-                target_rgn = rgn;
-                break;
-            }
-            if(rgn->next == jp->free_regions) break;
-        }
+        tm = winx_xtime();
+        target_rgn = winx_find_first_volume_region(jp->free_regions,
+            start_lcn,1,NULL);
         jp->p_counters.searching_time += winx_xtime() - tm;
         
         /* process file blocks between start_lcn and target_rgn */
@@ -277,6 +272,7 @@ move_the_file:
             }
             /* go forward and try to cleanup next blocks */
             f->user_defined_flags &= ~UD_FILE_MOVING_FAILED;
+            reset_file_blocks_summary(jp);
             start_lcn = target + clusters_to_move;
             continue;
         }
@@ -341,6 +337,7 @@ static int optimize_directories(udefrag_job_parameters *jp)
             file->user_defined_flags |= UD_FILE_CURRENTLY_EXCLUDED;
         if(file->next == jp->filelist) break;
     }
+    reset_file_blocks_summary(jp);
 
     /* open the volume */
     jp->fVolume = winx_vopen(winx_toupper(jp->volume_letter));
@@ -473,6 +470,7 @@ static int optimize_mft_routine(udefrag_job_parameters *jp)
     //re-use the buffer charbuffer to display the average transfer speed in human readable form.
     winx_bytes_to_hr((ULONGLONG)overall_speed,3,buffer,sizeof(buffer));
     itrace("Avg. Speed = %s/s", buffer);
+    dbg_print_move_statistics(jp);
     /* cleanup */
     clear_currently_excluded_flag(jp);
     winx_fclose(jp->fVolume);
@@ -480,312 +478,1361 @@ static int optimize_mft_routine(udefrag_job_parameters *jp)
     return result;
 }
 
+/************************************************************/
+/*                    Ordering of files                     */
+/************************************************************/
+
+/* maximum number of threads sorting paths of files */
+#define MAX_SORTING_THREADS 8
+
+/* smaller sets of files get sorted by a single thread */
+#define MIN_FILES_PER_SORTING_THREAD 65536
+
+/*
+* A file along with its sort keys: the primary key is
+* the size or the time the files get sorted by, the path
+* rank is the position of the file's path among the paths
+* of all the files sorted, so files having equal primary
+* keys get sorted by path without comparing paths again.
+* Files listed in the layout order file go first, by
+* their positions in the list.
+*/
+struct file_sort_key {
+    ULONGLONG primary;
+    ULONG path_rank;
+    ULONG layout_position;
+    winx_file_info *f;
+};
+
+/*
+* Files sorted by the requested criteria.
+*/
+struct sorted_files {
+    struct file_sort_key *keys; /* files in the sorted order */
+    ULONG n;                    /* number of files */
+    ULONG current;              /* the file to be processed next */
+};
+
+/*
+* Part of the files whose paths get
+* sorted by a separate thread.
+*/
+typedef struct _sorting_thread {
+    struct file_sort_key *keys; /* all the files sorted */
+    wchar_t **paths;            /* their case folded paths */
+    ULONG *order;               /* indices of files in order of their paths */
+    ULONG *temp;                /* buffer used by the merge sort */
+    ULONG first;                /* the first file of the part */
+    ULONG n;                    /* number of files in the part */
+    winx_arena *arena;          /* the arena holding the paths */
+    int result;                 /* zero for success, negative value otherwise */
+    HANDLE hDoneEvent;          /* signaled when the part gets sorted */
+} sorting_thread;
+
 /**
  * @internal
- * @brief Exclusively defines rules for the file sorting on the disk.
+ * @brief Returns the key files get
+ * sorted by before their paths.
  */
-static int files_compare(const void *prb_a, const void *prb_b, void *prb_param)
+static ULONGLONG get_primary_sort_key(udefrag_job_parameters *jp,
+        winx_file_info *f)
 {
-    winx_file_info *a, *b;
-    udefrag_job_parameters *jp;
-    int result;
-    
-    a = (winx_file_info *)prb_a;
-    b = (winx_file_info *)prb_b;
-    jp = (udefrag_job_parameters *)prb_param;
-    
-    if(jp->udo.sorting_flags & UD_SORT_BY_SIZE){
-        /* sort files of equal sizes by path */
-        if(a->disp.clusters == b->disp.clusters) goto paths_compare;
-        result = (a->disp.clusters > b->disp.clusters) ? 1 : (-1);
-        goto done;
-    }
-    
-    if(jp->udo.sorting_flags & UD_SORT_BY_CREATION_TIME){
-        /* sort files of equal creation times by path */
-        if(a->creation_time == b->creation_time) goto paths_compare;
-        result = (a->creation_time > b->creation_time) ? 1 : (-1);
-        goto done;
-    }
+    if(jp->udo.sorting_flags & UD_SORT_BY_SIZE)
+        return f->disp.clusters;
+    if(jp->udo.sorting_flags & UD_SORT_BY_CREATION_TIME)
+        return f->creation_time;
+    if(jp->udo.sorting_flags & UD_SORT_BY_MODIFICATION_TIME)
+        return f->last_modification_time;
+    if(jp->udo.sorting_flags & UD_SORT_BY_ACCESS_TIME)
+        return f->last_access_time;
+    return 0;
+}
 
-    if(jp->udo.sorting_flags & UD_SORT_BY_MODIFICATION_TIME){
-        /* sort files of equal last modification times by path */
-        if(a->last_modification_time == b->last_modification_time) goto paths_compare;
-        result = (a->last_modification_time > b->last_modification_time) ? 1 : (-1);
-        goto done;
+/**
+ * @internal
+ * @brief Merges two sorted sequences of
+ * indices of paths lying one after another.
+ */
+static void merge_paths(ULONG *src,ULONG n1,ULONG n2,ULONG *dst,wchar_t **paths)
+{
+    ULONG *a = src, *a_end = src + n1;
+    ULONG *b = a_end, *b_end = a_end + n2;
+
+    while(a < a_end && b < b_end){
+        /* keep equal paths in their original order */
+        if(wcscmp(paths[*b],paths[*a]) < 0) *dst++ = *b++;
+        else *dst++ = *a++;
     }
+    while(a < a_end) *dst++ = *a++;
+    while(b < b_end) *dst++ = *b++;
+}
 
-    if(jp->udo.sorting_flags & UD_SORT_BY_ACCESS_TIME){
-        /* sort files of equal last access times by path */
-        if(a->last_access_time == b->last_access_time) goto paths_compare;
-        result = (a->last_access_time > b->last_access_time) ? 1 : (-1);
-        goto done;
+/**
+ * @internal
+ * @brief Sorts indices of paths by the merge sort.
+ * @details Paths are compared by wcscmp, since
+ * they're case folded already.
+ */
+static void sort_paths(ULONG *order,ULONG *temp,ULONG n,wchar_t **paths)
+{
+    ULONG i, j, x, half;
+
+    if(n <= 16){
+        for(i = 1; i < n; i++){
+            x = order[i];
+            for(j = i; j > 0 && wcscmp(paths[x],paths[order[j - 1]]) < 0; j--)
+                order[j] = order[j - 1];
+            order[j] = x;
+        }
+        return;
     }
 
-paths_compare:    
-    result = winx_wcsicmp(a->path, b->path);
-    
-done:
-    if(jp->udo.sorting_flags & UD_SORT_DESCENDING) result *= (-1);
-    return result;
+    half = n / 2;
+    sort_paths(order,temp,half,paths);
+    sort_paths(order + half,temp + half,n - half,paths);
+    merge_paths(order,half,n - half,temp,paths);
+    memcpy(order,temp,n * sizeof(ULONG));
 }
 
 /**
  * @internal
- * @brief Moves small files to the 
- * beginning of the disk, sorted.
- * @param[in] jp the job parameters.
- * @param[in,out] start_lcn the beginning
- * of the region not optimized yet.
- * @param[in] end_lcn the first LCN beyond
- * of the region intended for placement of
- * sorted out files.
- * @param[in] t pointer to structure
- * used to traverse the tree of files.
+ * @brief Builds case folded paths
+ * of a part of files and sorts them.
  */
-static void move_files_to_front(udefrag_job_parameters *jp,
-    ULONGLONG *start_lcn, ULONGLONG end_lcn, struct prb_traverser *t)
+static void sort_part_of_paths(sorting_thread *st)
 {
-    winx_file_info *file;
-    winx_volume_region *rgn;
-    int region_not_found;
-    ULONGLONG skipped_files = 0;
-    ULONGLONG lcn;
-    ULONGLONG time;
-    char buffer[32];
-    
-    time = start_timing("file moving to front",jp);
-    jp->pi.moved_clusters = 0;
-    /* release temporarily allocated space */
-    release_temp_space_regions(jp);
-
-    /* do the job */
-    file = (winx_file_info*)prb_t_cur(t);
-    while(file){
-        if(can_move_entirely(file, jp->fs_type)){
-            region_not_found = 1;
-            rgn = find_first_free_region(jp,*start_lcn,file->disp.clusters,NULL);
-            if(rgn){
-                if(rgn->lcn < end_lcn)
-                    region_not_found = 0;
-            }
-            if(region_not_found){
-                if(file->user_defined_flags & UD_FILE_REGION_NOT_FOUND){
-                    /* whenever it's impossible to find a suitable region twice, skip the file */
-                    file = (winx_file_info*)prb_t_next(t);
-                    skipped_files ++;
-                    continue;
-                } else {
-                    if(skipped_files && !jp->pi.moved_clusters){
-                        /* skip all subsequent big files too */
-                        file = (winx_file_info*)prb_t_next(t);
-                        skipped_files ++;
-                        continue;
-                    } else {
-                        file->user_defined_flags |= UD_FILE_REGION_NOT_FOUND;
-                        break;
-                    }
-                }
-            }
-            /* move the file */
-            lcn = rgn->lcn;
-            if(move_file(file,file->disp.blockmap->vcn,
-              file->disp.clusters,rgn->lcn,jp) >= 0){
-                jp->pi.total_moves ++;
-                if(file->disp.clusters * jp->v_info.bytes_per_cluster \
-                  < OPTIMIZER_MAGIC_CONSTANT){
-                    *start_lcn = lcn + 1;
-                }
-            }
-            file->user_defined_flags |= UD_FILE_MOVED_TO_FRONT;
+    wchar_t buffer[MAX_PATH];
+    wchar_t *path;
+    ULONG i;
+
+    for(i = st->first; i < st->first + st->n; i++){
+        /* truncated paths could receive equal ranks */
+        path = get_full_file_path(st->keys[i].f,buffer);
+        if(path == NULL){
+            st->result = -1;
+            return;
+        }
+        (void)winx_wcslwr(path);
+        st->paths[i] = winx_arena_wcsdup(st->arena,path);
+        release_full_file_path(path,buffer);
+        if(st->paths[i] == NULL){
+            st->result = -1;
+            return;
         }
-        file = (winx_file_info*)prb_t_next(t);
+        st->order[i] = i;
     }
-    
-    /* display amount of moved data */
-    itrace("%I64u clusters moved",jp->pi.moved_clusters);
-    winx_bytes_to_hr(jp->pi.moved_clusters * jp->v_info.bytes_per_cluster,1,buffer,sizeof(buffer));
-    itrace("%s moved",buffer);
-    stop_timing("file moving to front",time,jp);
+    sort_paths(st->order + st->first,st->temp + st->first,st->n,st->paths);
+    st->result = 0;
+}
+
+static DWORD WINAPI sorting_thread_proc(LPVOID p)
+{
+    sorting_thread *st = (sorting_thread *)p;
+
+    sort_part_of_paths(st);
+    (void)NtSetEvent(st->hDoneEvent,NULL);
+    winx_exit_thread(0);
+    return 0;
 }
 
 /**
  * @internal
- * @brief Defines whether a file block deserves
- * to be moved to the end of the disk or not in
- * the move_files_to_back routine.
- * @note Optimized for speed.
+ * @brief Returns the number of
+ * threads to be used for sorting.
  */
-static int is_block_quite_small(udefrag_job_parameters *jp,
-    winx_file_info *file,winx_blockmap *block)
+static int get_number_of_sorting_threads(ULONG n)
 {
-    ULONGLONG file_size, block_size;
-    ULONGLONG fragment_size;
-    winx_blockmap *fragments, *fr;
-    
-    file_size = file->disp.clusters * jp->v_info.bytes_per_cluster;
-    block_size = block->length * jp->v_info.bytes_per_cluster;
+    int n_threads;
+
+    n_threads = (int)NtCurrentTeb()->Peb->NumberOfProcessors;
+    if(n_threads > MAX_SORTING_THREADS) n_threads = MAX_SORTING_THREADS;
+    if(n_threads > (int)(n / MIN_FILES_PER_SORTING_THREAD))
+        n_threads = (int)(n / MIN_FILES_PER_SORTING_THREAD);
+    if(n_threads < 1) n_threads = 1;
+    return n_threads;
+}
 
-    /* move everything which need to be sorted out */
-    if(file_size < jp->udo.optimizer_size_limit) return 1;
-    
-    /* skip big not fragmented files */
-    if(!is_fragmented(file)) return 0;
-    
-    /* move everything fragmented if the fragment size threshold isn't set */
-    if(jp->udo.fragment_size_threshold == DEFAULT_FRAGMENT_SIZE_THRESHOLD) return 1;
-    
-    /* move files which need to be defragmented entirely */
-    if(file_size < 2 * jp->udo.fragment_size_threshold) return 1;
-    
-    /* skip fragments which probably won't get moved in defragmentation */
-    if(block_size >= 2 * jp->udo.fragment_size_threshold) return 0;
+/**
+ * @internal
+ * @brief Ranks paths of files.
+ * @details Case folded paths get built
+ * once per file and sorted in parallel,
+ * part by part, then the parts get merged.
+ * Files having equal paths receive equal ranks.
+ * @param[in,out] keys the files.
+ * @param[in] n number of files.
+ * @param[out] order receives indices
+ * of files in order of their paths.
+ * @return Zero for success,
+ * negative value otherwise.
+ */
+static int rank_paths(struct file_sort_key *keys,ULONG n,ULONG *order)
+{
+    sorting_thread st[MAX_SORTING_THREADS];
+    wchar_t **paths = NULL;
+    ULONG *temp = NULL;
+    winx_arena *arena;
+    ULONG i, rank, n1, n2;
+    int n_threads, n_parts, k;
+    NTSTATUS status;
+    int result = -1;
+
+    paths = winx_tmalloc(n * sizeof(wchar_t *));
+    temp = winx_tmalloc(n * sizeof(ULONG));
+    if(paths == NULL || temp == NULL){
+        etrace("cannot allocate %I64u bytes of memory",
+            (ULONGLONG)n * (sizeof(wchar_t *) + sizeof(ULONG)));
+        winx_free(paths);
+        winx_free(temp);
+        return (-1);
+    }
+    memset(paths,0,n * sizeof(wchar_t *));
+
+    /* the paths share the lifetime, the heap gets used when this fails */
+    arena = winx_create_arena();
+
+    /* split the files to parts */
+    n_threads = get_number_of_sorting_threads(n);
+    memset(st,0,sizeof(st));
+    for(k = 0; k < n_threads; k++){
+        st[k].keys = keys;
+        st[k].paths = paths;
+        st[k].order = order;
+        st[k].temp = temp;
+        st[k].first = (ULONG)((ULONGLONG)n * k / n_threads);
+        st[k].n = (ULONG)((ULONGLONG)n * (k + 1) / n_threads) - st[k].first;
+        st[k].arena = arena;
+        st[k].result = -1;
+    }
 
-    /* move small fragments needing defragmentation */
-    fragments = build_fragments_list(file,NULL);
-    for(fr = fragments; fr; fr = fr->next){
-        if(block->lcn >= fr->lcn && block->lcn < fr->lcn + fr->length){
-            fragment_size = fr->length * jp->v_info.bytes_per_cluster;
-            if(fragment_size >= 2 * jp->udo.fragment_size_threshold){
-                release_fragments_list(&fragments);
-                return 0;
-            }
-            break;
+    /* sort all the parts except of the first one in separate threads */
+    for(k = 1; k < n_threads; k++){
+        status = NtCreateEvent(&st[k].hDoneEvent,STANDARD_RIGHTS_ALL | 0x1ff,
+            NULL,SynchronizationEvent,0);
+        if(!NT_SUCCESS(status)){
+            strace(status,"cannot create event");
+            st[k].hDoneEvent = NULL;
+        } else if(winx_create_thread(sorting_thread_proc,(LPVOID)&st[k]) < 0){
+            NtClose(st[k].hDoneEvent);
+            st[k].hDoneEvent = NULL;
         }
-        if(fr->next == fragments) break;
     }
-    release_fragments_list(&fragments);
-    return 1;
+    for(k = 0; k < n_threads; k++){
+        if(st[k].hDoneEvent == NULL)
+            sort_part_of_paths(&st[k]);
+    }
+    for(k = 1; k < n_threads; k++){
+        if(st[k].hDoneEvent){
+            (void)NtWaitForSingleObject(st[k].hDoneEvent,FALSE,NULL);
+            NtClose(st[k].hDoneEvent);
+        }
+    }
+    for(k = 0; k < n_threads; k++){
+        if(st[k].result < 0){
+            etrace("cannot allocate memory for paths");
+            goto cleanup;
+        }
+    }
+
+    /* merge the sorted parts */
+    for(n_parts = n_threads; n_parts > 1; n_parts = (n_parts + 1) / 2){
+        for(k = 0; k + 1 < n_parts; k += 2){
+            n1 = st[k].n, n2 = st[k + 1].n;
+            merge_paths(order + st[k].first,n1,n2,temp + st[k].first,paths);
+            memcpy(order + st[k].first,temp + st[k].first,
+                (n1 + n2) * sizeof(ULONG));
+            st[k / 2].first = st[k].first;
+            st[k / 2].n = n1 + n2;
+        }
+        if(k < n_parts) st[k / 2] = st[k];
+    }
+
+    /* rank the paths */
+    for(i = 0, rank = 0; i < n; i++){
+        if(i && wcscmp(paths[order[i]],paths[order[i - 1]]) != 0) rank ++;
+        keys[order[i]].path_rank = rank;
+    }
+    result = 0;
+
+cleanup:
+    /* the blocks allocated from the arena get ignored */
+    for(i = 0; i < n; i++) winx_free(paths[i]);
+    if(arena) winx_destroy_arena(arena);
+    winx_free(paths);
+    winx_free(temp);
+    return result;
 }
 
 /**
  * @internal
- * @brief Cleans up the beginning
- * of the disk by moving small files
- * and fragments to the end.
- * @param[in] jp the job parameters.
- * @param[in,out] start_lcn the beginning
- * of the region not optimized yet.
+ * @brief Sorts files by their primary keys.
+ * @details Uses the LSD radix sort, which keeps
+ * files having equal keys in their original order.
+ * Bytes equal for all the files get skipped.
+ * @param[in,out] keys the files.
+ * @param[in] temp buffer of the same size.
+ * @param[in] n number of files.
  */
-static void move_files_to_back(udefrag_job_parameters *jp,ULONGLONG *start_lcn)
+static void sort_by_primary_keys(struct file_sort_key *keys,
+    struct file_sort_key *temp,ULONG n)
 {
-    winx_file_info *first_file;
-    winx_blockmap *first_block;
-    ULONGLONG lcn, min_lcn;
-    int move_block;
-    int result;
-    ULONGLONG time;
-    char buffer[32];
-    
-    time = start_timing("file moving to end",jp);
-    jp->pi.moved_clusters = 0;
-    /* release temporarily allocated space */
-    release_temp_space_regions(jp);
+    ULONG counts[sizeof(ULONGLONG)][256];
+    struct file_sort_key *src = keys, *dst = temp, *swap;
+    ULONG i, sum, x;
+    int b, shift;
+
+    memset(counts,0,sizeof(counts));
+    for(i = 0; i < n; i++){
+        for(b = 0; b < (int)sizeof(ULONGLONG); b++)
+            counts[b][(keys[i].primary >> (b * 8)) & 0xff] ++;
+    }
 
-    /* do the job */
-    min_lcn = *start_lcn;
-    while(!jp->termination_router((void *)jp)){
-        first_block = find_first_block(jp, &min_lcn,
-            SKIP_PARTIALLY_MOVABLE_FILES, &first_file);
-        if(first_block == NULL) break;
-        move_block = is_block_quite_small(jp,first_file,first_block);
-        if(move_block){
-            lcn = first_block->lcn;
-            result = cleanup_space(jp, first_file,
-                first_block, first_block->length,
-                0, first_block->lcn + first_block->length - 1);
-            if(result == 0)
-                jp->pi.total_moves ++;
-            if(result == -1){
-                /* no more free space beyond exists */
-                *start_lcn = lcn;
-                goto done;
-            }
+    for(b = 0; b < (int)sizeof(ULONGLONG); b++){
+        shift = b * 8;
+        if(counts[b][(keys[0].primary >> shift) & 0xff] == n) continue;
+        for(i = 0, sum = 0; i < 256; i++){
+            x = counts[b][i];
+            counts[b][i] = sum;
+            sum += x;
         }
+        for(i = 0; i < n; i++)
+            dst[counts[b][(src[i].primary >> shift) & 0xff] ++] = src[i];
+        swap = src, src = dst, dst = swap;
     }
-    *start_lcn = jp->v_info.total_clusters;
+    if(src != keys) memcpy(keys,src,n * sizeof(struct file_sort_key));
+}
 
-done:
-    /* display amount of moved data */
-    itrace("%I64u clusters moved",jp->pi.moved_clusters);
-    winx_bytes_to_hr(jp->pi.moved_clusters * jp->v_info.bytes_per_cluster,1,buffer,sizeof(buffer));
-    itrace("%s moved",buffer);
-    stop_timing("file moving to end",time,jp);
+/*
+* Directories of the volume, indexed by their
+* mft ids. Files of each directory get placed
+* right behind the directory itself, while the
+* directories follow each other in depth-first
+* or breadth-first order of the directory tree.
+*/
+#define NO_DIRECTORY ((ULONG) -1)
+#define NO_LCN       ((ULONGLONG) -1)
+
+/* mft id of the root directory on NTFS */
+#define ROOT_DIRECTORY_MFT_ID 5
+
+struct tree_directory {
+    winx_file_info *f;          /* the directory */
+    ULONGLONG parent_mft_id;    /* mft id of its parent directory */
+    ULONGLONG lcn;              /* its first cluster, NO_LCN if none */
+    ULONG first_child;          /* subdirectories, in order of their paths */
+    ULONG last_child;           /**/
+    ULONG next_sibling;         /**/
+    ULONG cursor;               /* the next subdirectory to be visited */
+    ULONG position;             /* tree order, NO_DIRECTORY if unvisited */
+};
+
+struct directory_index {
+    ULONG *by_mft_id;               /* directories by their mft ids */
+    ULONGLONG max_mft_id;           /* the largest mft id of files */
+    struct tree_directory *dirs;    /* the directories */
+    ULONG n_dirs;                   /* number of directories */
+};
+
+static void release_directory_index(struct directory_index *di)
+{
+    winx_free(di->by_mft_id);
+    winx_free(di->dirs);
+    memset(di,0,sizeof(struct directory_index));
 }
 
 /**
  * @internal
- * @brief Marks a group of
- * files as already optimized.
+ * @brief Indexes all directories
+ * of the volume by their mft ids.
+ * @details Relies on mft ids of files
+ * and their parents recorded by the NTFS
+ * scanner, so it works on NTFS only.
+ * @return Zero for success, negative value otherwise.
  */
-static void cut_off_group_of_files(udefrag_job_parameters *jp,
-    struct prb_table *pt,winx_file_info *first_file,ULONGLONG n,
-    ULONGLONG length)
+static int build_directory_index(udefrag_job_parameters *jp,
+    struct directory_index *di)
 {
-    struct prb_traverser t;
-    winx_file_info *file;
-    ULONGLONG magic_length;
-    
-    /* the group should be larger than 20 MB or should contain at least 10 files */
-    magic_length = min(OPTIMIZER_MAGIC_CONSTANT,jp->udo.optimizer_size_limit);
-    if(length * jp->v_info.bytes_per_cluster < magic_length){
-        if(n < OPTIMIZER_MAGIC_CONSTANT_N)
-            return;
+    winx_file_info *f;
+    struct tree_directory *d;
+    ULONGLONG mft_id;
+    ULONG i, n = 0;
+
+    memset(di,0,sizeof(struct directory_index));
+    if(jp->fs_type != FS_NTFS) return (-1);
+
+    for(f = jp->filelist; f; f = f->next){
+        if(f->internal.BaseMftId > di->max_mft_id)
+            di->max_mft_id = f->internal.BaseMftId;
+        if(is_directory(f)) n ++;
+        if(f->next == jp->filelist) break;
     }
-    
-    prb_t_init(&t,pt);
-    file = (winx_file_info*)prb_t_find(&t,pt,first_file);
-    while(file && n){
-        file->user_defined_flags |= UD_FILE_MOVED_TO_FRONT;
-        n --;
-        jp->already_optimized_clusters += file->disp.clusters;
-        file = (winx_file_info*)prb_t_next(&t);
+    if(n == 0 || di->max_mft_id >= NO_DIRECTORY) return (-1);
+
+    di->by_mft_id = winx_tmalloc((size_t)(di->max_mft_id + 1) * sizeof(ULONG));
+    di->dirs = winx_tmalloc(n * sizeof(struct tree_directory));
+    if(di->by_mft_id == NULL || di->dirs == NULL){
+        etrace("cannot allocate %I64u bytes of memory",
+            (di->max_mft_id + 1) * sizeof(ULONG) \
+            + n * sizeof(struct tree_directory));
+        release_directory_index(di);
+        return (-1);
     }
-    if(n > 0){
-        etrace("cannot find file in tree");
+    for(mft_id = 0; mft_id <= di->max_mft_id; mft_id++)
+        di->by_mft_id[mft_id] = NO_DIRECTORY;
+
+    /* streams of a directory share a single entry */
+    for(f = jp->filelist; f; f = f->next){
+        if(is_directory(f)){
+            i = di->by_mft_id[f->internal.BaseMftId];
+            if(i == NO_DIRECTORY){
+                i = di->by_mft_id[f->internal.BaseMftId] = di->n_dirs ++;
+                d = &di->dirs[i];
+                d->f = f;
+                d->parent_mft_id = f->internal.ParentDirectoryMftId;
+                d->lcn = NO_LCN;
+                d->first_child = d->last_child = d->next_sibling = NO_DIRECTORY;
+                d->position = NO_DIRECTORY;
+            }
+            d = &di->dirs[i];
+            /* the default stream represents the directory */
+            if(wcsstr(f->name,L":$") == NULL) d->f = f;
+            if(d->lcn == NO_LCN && f->disp.blockmap && f->disp.clusters)
+                d->lcn = f->disp.blockmap->lcn;
+        }
+        if(f->next == jp->filelist) break;
     }
+    return 0;
 }
 
 /**
  * @internal
- * @brief Marks all sorted out groups
- * of files as already optimized.
+ * @brief Returns the index of the directory
+ * containing a file, NO_DIRECTORY if unknown.
+ * @note Streams of a directory belong to it.
  */
-static void cut_off_sorted_out_files(udefrag_job_parameters *jp,struct prb_table *pt)
+static ULONG get_parent_directory(struct directory_index *di,winx_file_info *f)
 {
-    struct prb_traverser t;
-    winx_file_info *file;
-    winx_file_info *first_file; /* the first file of the group */
-    ULONGLONG n;                /* number of files in the group */
-    ULONGLONG length;           /* length of the group, in clusters */
-    ULONGLONG pplcn;            /* LCN of the (i - 2)-th file */
-    ULONGLONG plcn;             /* LCN of the (i - 1)-th file */
-    ULONGLONG lcn;
-    ULONGLONG distance;
-    ULONGLONG file_length;
-    winx_file_info *prev_file;
-    #define INVALID_LCN ((ULONGLONG) -1)
-    int belongs_to_group;
-    ULONGLONG magic_length;
-    ULONGLONG second_magic_length;
-    ULONGLONG time;
-    char buffer[32];
-    
+    ULONGLONG mft_id;
+
+    mft_id = is_directory(f) ? f->internal.BaseMftId \
+        : f->internal.ParentDirectoryMftId;
+    return (mft_id <= di->max_mft_id) ? di->by_mft_id[mft_id] : NO_DIRECTORY;
+}
+
+/**
+ * @internal
+ * @brief Numbers directories reachable
+ * from the specified one in the tree order.
+ * @param[in] di the directory index.
+ * @param[in] first the directory to start from.
+ * @param[in] breadth_first nonzero value selects
+ * the breadth-first order, zero the depth-first one.
+ * @param[in] stack buffer for n_dirs indices
+ * of directories being visited.
+ * @param[in,out] position the next position.
+ */
+static void number_directories(struct directory_index *di,ULONG first,
+    int breadth_first,ULONG *stack,ULONG *position)
+{
+    struct tree_directory *d;
+    ULONG head = 0, tail = 0, child;
+
+    di->dirs[first].position = (*position) ++;
+    di->dirs[first].cursor = di->dirs[first].first_child;
+    stack[tail ++] = first;
+
+    while(head < tail){
+        /* a queue for breadth-first order, a stack for depth-first */
+        d = breadth_first ? &di->dirs[stack[head]] : &di->dirs[stack[tail - 1]];
+        child = d->cursor;
+        if(child == NO_DIRECTORY){
+            if(breadth_first) head ++; else tail --;
+            continue;
+        }
+        d->cursor = di->dirs[child].next_sibling;
+        /* cyclic references may lead to a visited directory */
+        if(di->dirs[child].position != NO_DIRECTORY) continue;
+        di->dirs[child].position = (*position) ++;
+        di->dirs[child].cursor = di->dirs[child].first_child;
+        stack[tail ++] = child;
+    }
+}
+
+/**
+ * @internal
+ * @brief Sets primary keys of files
+ * to their positions in the tree order.
+ * @details Each directory followed by its files forms
+ * a group, groups follow each other in the tree order.
+ * Subdirectories of a directory as well as files of
+ * a group get sorted by their paths. Files which
+ * parent directories are unknown go last.
+ * @return Zero for success, negative value otherwise.
+ */
+static int set_tree_order_keys(udefrag_job_parameters *jp,
+    struct file_sort_key *keys,ULONG n)
+{
+    struct directory_index di;
+    struct file_sort_key *dir_keys = NULL;
+    struct tree_directory *d, *parent;
+    ULONG *order = NULL;
+    ULONG i, k, position = 0;
+    int breadth_first = (jp->udo.sorting_flags & UD_SORT_BREADTH_FIRST) ? 1 : 0;
+    int result = -1;
+
+    if(build_directory_index(jp,&di) < 0){
+        itrace("directory tree is unavailable, files get sorted by path");
+        return (-1);
+    }
+
+    /* link subdirectories in order of their paths */
+    dir_keys = winx_tmalloc(di.n_dirs * sizeof(struct file_sort_key));
+    order = winx_tmalloc(di.n_dirs * sizeof(ULONG));
+    if(dir_keys == NULL || order == NULL){
+        etrace("cannot allocate %I64u bytes of memory",
+            (ULONGLONG)di.n_dirs \
+            * (sizeof(struct file_sort_key) + sizeof(ULONG)));
+        goto cleanup;
+    }
+    for(i = 0; i < di.n_dirs; i++)
+        dir_keys[i].f = di.dirs[i].f;
+    if(rank_paths(dir_keys,di.n_dirs,order) < 0)
+        goto cleanup;
+    for(i = 0; i < di.n_dirs; i++){
+        d = &di.dirs[order[i]];
+        if(d->parent_mft_id > di.max_mft_id) continue;
+        k = di.by_mft_id[d->parent_mft_id];
+        if(k == NO_DIRECTORY || k == order[i]) continue;
+        parent = &di.dirs[k];
+        if(parent->last_child == NO_DIRECTORY) parent->first_child = order[i];
+        else di.dirs[parent->last_child].next_sibling = order[i];
+        parent->last_child = order[i];
+    }
+
+    /* number directories starting from the root, then the unreachable ones */
+    if(ROOT_DIRECTORY_MFT_ID <= di.max_mft_id \
+      && di.by_mft_id[ROOT_DIRECTORY_MFT_ID] != NO_DIRECTORY){
+        number_directories(&di,di.by_mft_id[ROOT_DIRECTORY_MFT_ID],
+            breadth_first,order,&position);
+    }
+    for(i = 0; i < di.n_dirs; i++){
+        if(di.dirs[i].position == NO_DIRECTORY)
+            number_directories(&di,i,breadth_first,order,&position);
+    }
+
+    /* directories go first in their groups */
+    for(i = 0; i < n; i++){
+        k = get_parent_directory(&di,keys[i].f);
+        position = (k == NO_DIRECTORY) ? di.n_dirs : di.dirs[k].position;
+        keys[i].primary = ((ULONGLONG)position << 1) \
+            | (is_directory(keys[i].f) ? 0 : 1);
+    }
+    result = 0;
+
+cleanup:
+    winx_free(dir_keys);
+    winx_free(order);
+    release_directory_index(&di);
+    return result;
+}
+
+/**
+ * @internal
+ * @brief Displays the average distance between
+ * files and their directories, an estimate of seeks
+ * needed to read directories along with their contents.
+ */
+static void dbg_print_directory_locality(udefrag_job_parameters *jp)
+{
+    struct directory_index di;
+    winx_file_info *f;
+    ULONGLONG lcn, distance = 0, n = 0;
+    ULONG k;
+    char buffer[32];
+
+    if(build_directory_index(jp,&di) < 0) return;
+    for(f = jp->filelist; f; f = f->next){
+        if(!is_directory(f) && f->disp.blockmap && f->disp.clusters){
+            k = get_parent_directory(&di,f);
+            if(k != NO_DIRECTORY && di.dirs[k].lcn != NO_LCN){
+                lcn = f->disp.blockmap->lcn;
+                distance += (lcn > di.dirs[k].lcn) ? \
+                    (lcn - di.dirs[k].lcn) : (di.dirs[k].lcn - lcn);
+                n ++;
+            }
+        }
+        if(f->next == jp->filelist) break;
+    }
+    release_directory_index(&di);
+    if(n == 0) return;
+
+    winx_bytes_to_hr(distance / n * jp->v_info.bytes_per_cluster,
+        1,buffer,sizeof(buffer));
+    itrace("files are %I64u clusters (%s) away "
+        "from their directories on average",distance / n,buffer);
+}
+
+/**
+ * @internal
+ * @brief Sorts files by the requested criteria.
+ * @details Sort keys get computed once per file,
+ * then the files get sorted by paths and after that
+ * by the primary keys. In the directory tree order
+ * the primary keys are positions of directories. Files of equal keys and paths
+ * are reported as duplicates and excluded.
+ * @param[in] jp the job parameters.
+ * @param[in,out] sf the files to be sorted.
+ * @return Zero for success, negative value otherwise.
+ */
+static int sort_files(udefrag_job_parameters *jp,struct sorted_files *sf)
+{
+    struct file_sort_key *keys = sf->keys, *sorted, x;
+    ULONG *order;
+    ULONG i, j, n = sf->n;
+    ULONGLONG time = winx_xtime();
+
+    sf->current = 0;
+    if(n == 0) return 0;
+
+    order = winx_tmalloc(n * sizeof(ULONG));
+    sorted = winx_tmalloc(n * sizeof(struct file_sort_key));
+    if(order == NULL || sorted == NULL){
+        etrace("cannot allocate %I64u bytes of memory",
+            (ULONGLONG)n * (sizeof(ULONG) + sizeof(struct file_sort_key)));
+        goto fail;
+    }
+
+    for(i = 0; i < n; i++)
+        keys[i].primary = get_primary_sort_key(jp,keys[i].f);
+    if(jp->udo.sorting_flags & UD_SORT_BY_DIRECTORY_TREE)
+        (void)set_tree_order_keys(jp,keys,n);
+    if(rank_paths(keys,n,order) < 0)
+        goto fail;
+
+    /* put files in order of their paths, then sort them by the primary keys */
+    for(i = 0; i < n; i++) sorted[i] = keys[order[i]];
+    sort_by_primary_keys(sorted,keys,n);
+
+    /* exclude duplicates */
+    for(i = 1, j = 1; i < n; i++){
+        if(sorted[i].primary == sorted[j - 1].primary \
+          && sorted[i].path_rank == sorted[j - 1].path_rank){
+            etrace("a duplicate found for %ws",winx_file_path(sorted[i].f));
+            continue;
+        }
+        sorted[j++] = sorted[i];
+    }
+    n = j;
+
+    if(jp->udo.sorting_flags & UD_SORT_DESCENDING){
+        for(i = 0, j = n - 1; i < j; i++, j--)
+            x = sorted[i], sorted[i] = sorted[j], sorted[j] = x;
+    }
+
+    winx_free(keys);
+    winx_free(order);
+    sf->keys = sorted;
+    sf->n = n;
+    itrace("%u files sorted in %I64u ms",n,winx_xtime() - time);
+    return 0;
+
+fail:
+    winx_free(order);
+    winx_free(sorted);
+    return (-1);
+}
+
+/*
+* Paths listed in the layout order file, indexed by
+* a hash table with open addressing. Names of the listed
+* files get hashed into a bit array as well, so most
+* of the files need no path building to be looked up.
+*/
+struct layout_order {
+    wchar_t *buffer;            /* the paths, one per line */
+    wchar_t **paths;            /* case folded paths in order of the file */
+    ULONG *table;               /* path indices, NOT_LISTED if empty */
+    ULONG *name_filter;         /* bits set for hashes of listed names */
+    ULONG n;                    /* number of the paths */
+    ULONG mask;                 /* size of the table minus one */
+};
+
+#define NOT_LISTED ((ULONG) -1)
+
+/**
+ * @internal
+ * @brief FNV-1a hash of a string.
+ */
+static ULONG hash_string(const wchar_t *s)
+{
+    ULONG hash = 2166136261u;
+
+    for(; *s; s++){
+        hash ^= *s;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * @internal
+ * @brief FNV-1a hash of a string
+ * converted to lowercase.
+ */
+static ULONG hash_lowercase_string(const wchar_t *s)
+{
+    ULONG hash = 2166136261u;
+
+    for(; *s; s++){
+        hash ^= winx_towlower(*s);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * @internal
+ * @brief Cuts off the native prefix of a path.
+ */
+static wchar_t *skip_native_prefix(wchar_t *path)
+{
+    if(wcsstr(path,L"\\??\\") == path)
+        return path + 4;
+    return path;
+}
+
+/**
+ * @internal
+ * @brief Returns the name of
+ * a file listed in a path.
+ */
+static wchar_t *get_listed_name(wchar_t *path)
+{
+    wchar_t *name = wcsrchr(path,'\\');
+    return name ? name + 1 : path;
+}
+
+/**
+ * @internal
+ * @brief Reads the layout order file.
+ * @details The file lists paths of files
+ * one per line, either in UTF-16 marked
+ * by the byte order mark or in UTF-8.
+ * @return The paths, NULL indicates failure.
+ */
+static wchar_t *read_layout_order_file(wchar_t *filename,size_t *length)
+{
+    wchar_t *path, *buffer;
+    char *contents;
+    size_t bytes_read, i, n;
+    int k;
+
+    *length = 0;
+    path = winx_swprintf(L"\\??\\%ws",filename);
+    if(path == NULL){
+        etrace("cannot build path of %ws",filename);
+        return NULL;
+    }
+    contents = winx_get_file_contents(path,&bytes_read);
+    winx_free(path);
+    if(contents == NULL){
+        etrace("cannot read %ws",filename);
+        return NULL;
+    }
+
+    /* UTF-16 */
+    if(bytes_read >= sizeof(wchar_t) && *(wchar_t *)contents == 0xFEFF){
+        buffer = (wchar_t *)contents;
+        n = bytes_read / sizeof(wchar_t);
+        buffer[n] = 0;
+        buffer[0] = '\n';
+        *length = n;
+        return buffer;
+    }
+
+    /* UTF-8 */
+    buffer = winx_tmalloc((bytes_read + 1) * sizeof(wchar_t));
+    if(buffer == NULL){
+        etrace("cannot allocate %I64u bytes of memory",
+            (ULONGLONG)(bytes_read + 1) * sizeof(wchar_t));
+        winx_release_file_contents(contents);
+        return NULL;
+    }
+    for(i = 0, n = 0; i < bytes_read; n++){
+        k = unicode_utf8_to_wchar(&buffer[n],contents + i,bytes_read - i);
+        if(k > 0){
+            i += k;
+        } else {
+            /* keep invalid bytes as they are */
+            buffer[n] = (unsigned char)contents[i ++];
+        }
+    }
+    buffer[n] = 0;
+    /* skip the byte order mark */
+    if(n && buffer[0] == 0xFEFF) buffer[0] = '\n';
+    winx_release_file_contents(contents);
+    *length = n;
+    return buffer;
+}
+
+static void release_layout_order(struct layout_order *lo)
+{
+    winx_free(lo->buffer);
+    winx_free(lo->paths);
+    winx_free(lo->table);
+    winx_free(lo->name_filter);
+    memset(lo,0,sizeof(struct layout_order));
+}
+
+/**
+ * @internal
+ * @brief Loads the layout order file
+ * defined by the UD_LAYOUT_ORDER_FILE
+ * environment variable.
+ * @details Paths get case folded and
+ * indexed; the ones listed repeatedly
+ * keep their first position.
+ * @return Zero for success, negative value otherwise.
+ */
+static int load_layout_order(udefrag_job_parameters *jp,struct layout_order *lo)
+{
+    wchar_t *line, *end, *path;
+    size_t length, i;
+    ULONG n = 0, size, slot, hash;
+    ULONGLONG time = winx_xtime();
+
+    memset(lo,0,sizeof(struct layout_order));
+    if(jp->udo.layout_order_file[0] == 0) return 0;
+
+    lo->buffer = read_layout_order_file(jp->udo.layout_order_file,&length);
+    if(lo->buffer == NULL) return (-1);
+
+    /* split the buffer to lines */
+    for(i = 0; i < length; i++){
+        if(lo->buffer[i] == '\n' || lo->buffer[i] == '\r'){
+            lo->buffer[i] = 0;
+        } else if(i == 0 || lo->buffer[i - 1] == 0){
+            n ++;
+        }
+    }
+    if(n == 0) goto done;
+
+    /* keep the table filled by half at most */
+    for(size = 1024; size < n * 2; size <<= 1){}
+    lo->paths = winx_tmalloc(n * sizeof(wchar_t *));
+    lo->table = winx_tmalloc(size * sizeof(ULONG));
+    lo->name_filter = winx_tmalloc(size / 8);
+    if(lo->paths == NULL || lo->table == NULL || lo->name_filter == NULL){
+        etrace("cannot allocate %I64u bytes of memory",
+            (ULONGLONG)n * sizeof(wchar_t *) + size * sizeof(ULONG) + size / 8);
+        release_layout_order(lo);
+        return (-1);
+    }
+    memset(lo->table,0xFF,size * sizeof(ULONG));
+    memset(lo->name_filter,0,size / 8);
+    lo->mask = size - 1;
+
+    for(i = 0; i < length; i++){
+        if(lo->buffer[i] == 0 || (i && lo->buffer[i - 1])) continue;
+        line = lo->buffer + i;
+        /* trim spaces and quotes */
+        while(*line == ' ' || *line == '\t' || *line == '\"') line ++;
+        end = line + wcslen(line);
+        while(end > line && (end[-1] == ' ' \
+          || end[-1] == '\t' || end[-1] == '\"')) end --;
+        *end = 0;
+        if(*line == 0) continue;
+
+        path = skip_native_prefix(winx_wcslwr(line));
+        hash = hash_string(path);
+        slot = hash & lo->mask;
+        for(; lo->table[slot] != NOT_LISTED; slot = (slot + 1) & lo->mask){
+            if(!wcscmp(lo->paths[lo->table[slot]],path)) break;
+        }
+        if(lo->table[slot] != NOT_LISTED) continue;
+        lo->paths[lo->n] = path;
+        lo->table[slot] = lo->n ++;
+        hash = hash_string(get_listed_name(path)) & lo->mask;
+        lo->name_filter[hash >> 5] |= 1u << (hash & 31);
+    }
+
+done:
+    itrace("%u paths of the layout order loaded in %I64u ms",
+        lo->n,winx_xtime() - time);
+    return 0;
+}
+
+/**
+ * @internal
+ * @brief Returns position of a file in
+ * the layout order, NOT_LISTED if the
+ * file isn't listed there.
+ */
+static ULONG get_layout_position(struct layout_order *lo,winx_file_info *f)
+{
+    wchar_t buffer[MAX_PATH];
+    wchar_t *full_path, *path;
+    ULONG hash, slot, position = NOT_LISTED;
+
+    if(lo->n == 0 || f->name == NULL) return NOT_LISTED;
+
+    /* check the name first */
+    hash = hash_lowercase_string(f->name) & lo->mask;
+    if(!(lo->name_filter[hash >> 5] & (1u << (hash & 31))))
+        return NOT_LISTED;
+
+    /* long paths can be listed as well */
+    if(winx_get_file_path_length(f) < 0)
+        return NOT_LISTED;
+    full_path = get_full_file_path(f,buffer);
+    if(full_path == NULL){
+        etrace("cannot check whether %ws is listed",f->name);
+        return NOT_LISTED;
+    }
+    path = skip_native_prefix(winx_wcslwr(full_path));
+    hash = hash_string(path);
+    slot = hash & lo->mask;
+    for(; lo->table[slot] != NOT_LISTED; slot = (slot + 1) & lo->mask){
+        if(!wcscmp(lo->paths[lo->table[slot]],path)){
+            position = lo->table[slot];
+            break;
+        }
+    }
+    release_full_file_path(full_path,buffer);
+    return position;
+}
+
+/**
+ * @internal
+ * @brief Moves files listed in the layout
+ * order ahead of the rest, in order of the list.
+ * @return Zero for success, negative value otherwise.
+ */
+static int apply_layout_order(struct sorted_files *sf)
+{
+    struct file_sort_key *keys, *temp;
+    ULONG i, m = 0, n = 0;
+
+    for(i = 0; i < sf->n; i++){
+        if(sf->keys[i].layout_position != NOT_LISTED) m ++;
+    }
+    if(m == 0) return 0;
+
+    keys = winx_tmalloc(sf->n * sizeof(struct file_sort_key));
+    temp = winx_tmalloc(m * sizeof(struct file_sort_key));
+    if(keys == NULL || temp == NULL){
+        etrace("cannot allocate %I64u bytes of memory",
+            (ULONGLONG)(sf->n + m) * sizeof(struct file_sort_key));
+        winx_free(keys);
+        winx_free(temp);
+        return (-1);
+    }
+
+    /* sort the listed files by their positions */
+    for(i = 0; i < sf->n; i++){
+        if(sf->keys[i].layout_position != NOT_LISTED){
+            keys[n] = sf->keys[i];
+            keys[n++].primary = sf->keys[i].layout_position;
+        }
+    }
+    sort_by_primary_keys(keys,temp,m);
+
+    /* the rest keep the requested order */
+    for(i = 0; i < sf->n; i++){
+        if(sf->keys[i].layout_position == NOT_LISTED)
+            keys[n++] = sf->keys[i];
+    }
+
+    itrace("%u files of the layout order go first",m);
+    winx_free(temp);
+    winx_free(sf->keys);
+    sf->keys = keys;
+    return 0;
+}
+
+/**
+ * @internal
+ * @brief Collects files to be sorted out
+ * in optimization and sorts them.
+ * @details Files listed in the layout order
+ * file get sorted out regardless of their size.
+ * @return Zero for success, negative value otherwise.
+ */
+static int build_sorted_files(udefrag_job_parameters *jp,
+        struct sorted_files *sf)
+{
+    struct layout_order lo;
+    winx_file_info *f;
+    ULONG n = 0, position;
+    int result;
+
+    memset(sf,0,sizeof(struct sorted_files));
+    for(f = jp->filelist; f; f = f->next){
+        n ++;
+        if(f->next == jp->filelist) break;
+    }
+    if(n == 0) return 0;
+
+    sf->keys = winx_tmalloc(n * sizeof(struct file_sort_key));
+    if(sf->keys == NULL){
+        etrace("cannot allocate %I64u bytes of memory",
+            (ULONGLONG)n * sizeof(struct file_sort_key));
+        return (-1);
+    }
+
+    /* the job goes on without the layout order if it cannot be loaded */
+    (void)load_layout_order(jp,&lo);
+
+    for(f = jp->filelist; f; f = f->next){
+        if(can_move_entirely(f, jp->fs_type)){
+            position = get_layout_position(&lo,f);
+            if(position != NOT_LISTED || f->disp.clusters \
+              * jp->v_info.bytes_per_cluster < jp->udo.optimizer_size_limit){
+                sf->keys[sf->n].layout_position = position;
+                sf->keys[sf->n ++].f = f;
+            }
+        }
+        if(f->next == jp->filelist) break;
+    }
+
+    result = sort_files(jp,sf);
+    if(result == 0 && lo.n)
+        result = apply_layout_order(sf);
+    release_layout_order(&lo);
+    return result;
+}
+
+static void release_sorted_files(struct sorted_files *sf)
+{
+    winx_free(sf->keys);
+    memset(sf,0,sizeof(struct sorted_files));
+}
+
+/**
+ * @internal
+ * @brief Returns the file to be
+ * processed next, NULL if no more
+ * files need to be processed.
+ */
+static winx_file_info *get_current_file(struct sorted_files *sf)
+{
+    return (sf->current < sf->n) ? sf->keys[sf->current].f : NULL;
+}
+
+/**
+ * @internal
+ * @brief Advances to the next file.
+ * @return The next file, NULL if
+ * there are no more files.
+ */
+static winx_file_info *get_next_file(struct sorted_files *sf)
+{
+    if(sf->current < sf->n) sf->current ++;
+    return get_current_file(sf);
+}
+
+/*
+* State of moves issued in
+* the move_files_to_front routine.
+*/
+struct front_moves {
+    udefrag_job_parameters *jp;
+    ULONGLONG *start_lcn;   /* the region not optimized yet, or NULL */
+    ULONGLONG limit;        /* the lowest target of the failed moves */
+};
+
+/**
+ * @internal
+ * @brief Receives results of moves issued
+ * in the move_files_to_front routine.
+ * @details Successful moves of small files let
+ * the region not optimized yet shrink, but never
+ * beyond targets of the moves still in progress
+ * or of the failed ones, which remain free.
+ */
+static void move_to_front_completed(winx_file_info *f,int result,
+    ULONGLONG moved_clusters,void *user_defined_data)
+{
+    struct front_moves *fm = (struct front_moves *)user_defined_data;
+    udefrag_job_parameters *jp = fm->jp;
+    ULONGLONG lcn;
+
+    if(fm->start_lcn == NULL){
+        if(result == 0) jp->pi.total_moves ++;
+        return;
+    }
+    if(result < 0){
+        /* the target lies at or beyond the start */
+        if(*fm->start_lcn < fm->limit)
+            fm->limit = *fm->start_lcn;
+        return;
+    }
+    if(result > 0) return;
+    jp->pi.total_moves ++;
+    if(is_fragmented(f) || f->disp.clusters * \
+      jp->v_info.bytes_per_cluster >= OPTIMIZER_MAGIC_CONSTANT)
+        return;
+    lcn = min(f->disp.blockmap->lcn + 1,get_lowest_pending_target(jp));
+    lcn = min(lcn,fm->limit);
+    if(lcn > *fm->start_lcn) *fm->start_lcn = lcn;
+}
+
+/**
+ * @internal
+ * @brief Moves small files to the 
+ * beginning of the disk, sorted.
+ * @param[in] jp the job parameters.
+ * @param[in,out] start_lcn the beginning
+ * of the region not optimized yet.
+ * @param[in] end_lcn the first LCN beyond
+ * of the region intended for placement of
+ * sorted out files.
+ * @param[in,out] sf the sorted files,
+ * processing starts from the current one.
+ * @note Files get moved through the queue of
+ * moves, so moves of several files can be
+ * in progress at once.
+ */
+static void move_files_to_front(udefrag_job_parameters *jp,
+    ULONGLONG *start_lcn, ULONGLONG end_lcn, struct sorted_files *sf)
+{
+    winx_file_info *file;
+    winx_volume_region *rgn;
+    struct front_moves fm;
+    int region_not_found;
+    ULONGLONG skipped_files = 0;
+    ULONGLONG time;
+    char buffer[32];
+    
+    time = start_timing("file moving to front",jp);
+    fm.jp = jp;
+    fm.start_lcn = start_lcn;
+    fm.limit = jp->v_info.total_clusters;
+    jp->pi.moved_clusters = 0;
+    /* release temporarily allocated space */
+    release_temp_space_regions(jp);
+    (void)init_move_queue(jp);
+
+    /* do the job */
+    file = get_current_file(sf);
+    while(file){
+        if(can_move_entirely(file, jp->fs_type)){
+            region_not_found = 1;
+            rgn = find_first_free_region(jp,*start_lcn,file->disp.clusters,NULL);
+            if(rgn){
+                if(rgn->lcn < end_lcn)
+                    region_not_found = 0;
+            }
+            if(region_not_found){
+                if(file->user_defined_flags & UD_FILE_REGION_NOT_FOUND){
+                    /* whenever it's impossible to find a suitable region twice, skip the file */
+                    file = get_next_file(sf);
+                    skipped_files ++;
+                    continue;
+                } else {
+                    complete_moves(jp);
+                    if(skipped_files && !jp->pi.moved_clusters){
+                        /* skip all subsequent big files too */
+                        file = get_next_file(sf);
+                        skipped_files ++;
+                        continue;
+                    } else {
+                        file->user_defined_flags |= UD_FILE_REGION_NOT_FOUND;
+                        break;
+                    }
+                }
+            }
+            /* move the file, the start advances on completion */
+            (void)move_file_async(file,file->disp.blockmap->vcn,
+                file->disp.clusters,rgn->lcn,
+                move_to_front_completed,(void *)&fm,jp);
+            file->user_defined_flags |= UD_FILE_MOVED_TO_FRONT;
+        }
+        file = get_next_file(sf);
+    }
+    
+    /* wait for the moves in progress */
+    destroy_move_queue(jp);
+
+    /* display amount of moved data */
+    itrace("%I64u clusters moved",jp->pi.moved_clusters);
+    winx_bytes_to_hr(jp->pi.moved_clusters * jp->v_info.bytes_per_cluster,1,buffer,sizeof(buffer));
+    itrace("%s moved",buffer);
+    stop_timing("file moving to front",time,jp);
+}
+
+/**
+ * @internal
+ * @brief Defines whether a file block deserves
+ * to be moved to the end of the disk or not in
+ * the move_files_to_back routine.
+ * @note Optimized for speed.
+ */
+static int is_block_quite_small(udefrag_job_parameters *jp,
+    winx_file_info *file,winx_blockmap *block)
+{
+    ULONGLONG file_size, block_size;
+    ULONGLONG fragment_size;
+    struct fragment_index *fi;
+    struct file_fragment *fr;
+    ULONGLONG i;
+    
+    file_size = file->disp.clusters * jp->v_info.bytes_per_cluster;
+    block_size = block->length * jp->v_info.bytes_per_cluster;
+
+    /* move everything which need to be sorted out */
+    if(file_size < jp->udo.optimizer_size_limit) return 1;
+    
+    /* skip big not fragmented files */
+    if(!is_fragmented(file)) return 0;
+    
+    /* move everything fragmented if the fragment size threshold isn't set */
+    if(jp->udo.fragment_size_threshold == DEFAULT_FRAGMENT_SIZE_THRESHOLD) return 1;
+    
+    /* move files which need to be defragmented entirely */
+    if(file_size < 2 * jp->udo.fragment_size_threshold) return 1;
+    
+    /* skip fragments which probably won't get moved in defragmentation */
+    if(block_size >= 2 * jp->udo.fragment_size_threshold) return 0;
+
+    /* move small fragments needing defragmentation */
+    fi = get_fragment_index(file,jp);
+    if(fi == NULL) return 1;
+
+    /*
+    * The fragment containing the block is
+    * the last one starting at its VCN or before.
+    */
+    i = find_fragment(fi,block->vcn + 1);
+    if(i == 0) return 1;
+    fr = &fi->fragments[i - 1];
+    if(block->lcn >= fr->lcn && block->lcn < fr->lcn + fr->length){
+        fragment_size = fr->length * jp->v_info.bytes_per_cluster;
+        if(fragment_size >= 2 * jp->udo.fragment_size_threshold)
+            return 0;
+    }
+    return 1;
+}
+
+/**
+ * @internal
+ * @brief Cleans up the beginning
+ * of the disk by moving small files
+ * and fragments to the end.
+ * @param[in] jp the job parameters.
+ * @param[in,out] start_lcn the beginning
+ * of the region not optimized yet.
+ */
+static void move_files_to_back(udefrag_job_parameters *jp,ULONGLONG *start_lcn)
+{
+    winx_file_info *first_file;
+    winx_blockmap *first_block;
+    ULONGLONG lcn, min_lcn;
+    int move_block;
+    int result;
+    ULONGLONG time;
+    char buffer[32];
+    
+    time = start_timing("file moving to end",jp);
+    jp->pi.moved_clusters = 0;
+    /* release temporarily allocated space */
+    release_temp_space_regions(jp);
+
+    /* do the job */
+    min_lcn = *start_lcn;
+    while(!jp->termination_router((void *)jp)){
+        first_block = find_first_block(jp, &min_lcn,
+            SKIP_PARTIALLY_MOVABLE_FILES, &first_file);
+        if(first_block == NULL) break;
+        move_block = is_block_quite_small(jp,first_file,first_block);
+        if(move_block){
+            lcn = first_block->lcn;
+            result = cleanup_space(jp, first_file,
+                first_block, first_block->length,
+                0, first_block->lcn + first_block->length - 1);
+            if(result == 0)
+                jp->pi.total_moves ++;
+            if(result == -1){
+                /* no more free space beyond exists */
+                *start_lcn = lcn;
+                goto done;
+            }
+        }
+    }
+    *start_lcn = jp->v_info.total_clusters;
+
+done:
+    /* display amount of moved data */
+    itrace("%I64u clusters moved",jp->pi.moved_clusters);
+    winx_bytes_to_hr(jp->pi.moved_clusters * jp->v_info.bytes_per_cluster,1,buffer,sizeof(buffer));
+    itrace("%s moved",buffer);
+    stop_timing("file moving to end",time,jp);
+}
+
+/**
+ * @internal
+ * @brief Marks a group of
+ * files as already optimized.
+ */
+static void cut_off_group_of_files(udefrag_job_parameters *jp,
+    struct sorted_files *sf,ULONG first_file,ULONGLONG n,
+    ULONGLONG length)
+{
+    ULONG i;
+    ULONGLONG magic_length;
+    
+    /* the group should be larger than 20 MB or should contain at least 10 files */
+    magic_length = min(OPTIMIZER_MAGIC_CONSTANT,jp->udo.optimizer_size_limit);
+    if(length * jp->v_info.bytes_per_cluster < magic_length){
+        if(n < OPTIMIZER_MAGIC_CONSTANT_N)
+            return;
+    }
+    
+    for(i = first_file; i < sf->n && n; i++, n--){
+        sf->keys[i].f->user_defined_flags |= UD_FILE_MOVED_TO_FRONT;
+        jp->already_optimized_clusters += sf->keys[i].f->disp.clusters;
+    }
+}
+
+/**
+ * @internal
+ * @brief Marks all sorted out groups
+ * of files as already optimized.
+ */
+static void cut_off_sorted_out_files(udefrag_job_parameters *jp,
+        struct sorted_files *sf)
+{
+    winx_file_info *file;
+    ULONG i;                    /* index of the current file */
+    ULONG first_file;           /* index of the first file of the group */
+    ULONGLONG n;                /* number of files in the group */
+    ULONGLONG length;           /* length of the group, in clusters */
+    ULONGLONG pplcn;            /* LCN of the (i - 2)-th file */
+    ULONGLONG plcn;             /* LCN of the (i - 1)-th file */
+    ULONGLONG lcn;
+    ULONGLONG distance;
+    ULONGLONG file_length;
+    winx_file_info *prev_file;
+    #define INVALID_LCN ((ULONGLONG) -1)
+    int belongs_to_group;
+    ULONGLONG magic_length;
+    ULONGLONG second_magic_length;
+    ULONGLONG time;
+    char buffer[32];
+    
     time = start_timing("cutting off sorted out files",jp);
     jp->already_optimized_clusters = 0;
     magic_length = min(OPTIMIZER_MAGIC_CONSTANT,jp->udo.optimizer_size_limit);
     
     /* select the first not fragmented file */
-    prb_t_init(&t,pt);
-    file = (winx_file_info*)prb_t_first(&t,pt);
-    while(file){
-        if(!is_fragmented(file)) break;
-        file = (winx_file_info*)prb_t_next(&t);
+    for(i = 0; i < sf->n; i++){
+        if(!is_fragmented(sf->keys[i].f)) break;
     }
-    if(file == NULL) goto done;
+    if(i == sf->n) goto done;
+    file = sf->keys[i].f;
 
     /* initialize the group */
-    first_file = file;
+    first_file = i;
     n = 1;
     length = file->disp.clusters;
     pplcn = INVALID_LCN;
@@ -793,8 +1840,8 @@ static void cut_off_sorted_out_files(udefrag_job_parameters *jp,struct prb_table
     prev_file = file;
     
     /* analyze subsequent files */
-    file = (winx_file_info*)prb_t_next(&t);
-    while(file){
+    for(i ++; i < sf->n; i++){
+        file = sf->keys[i].f;
         /* check whether the file belongs to the group or not */
         belongs_to_group = 1;
         /* 1. the file must be not fragmented */
@@ -835,99 +1882,608 @@ static void cut_off_sorted_out_files(udefrag_job_parameters *jp,struct prb_table
         } else {
             if(n > 1){
                 /* remark all files in the previous group */
-                cut_off_group_of_files(jp,pt,first_file,n,length);
+                cut_off_group_of_files(jp,sf,first_file,n,length);
             }
             /* reset the group */
-            while(file){
-                if(!is_fragmented(file)) break;
-                file = (winx_file_info*)prb_t_next(&t);
+            for(; i < sf->n; i++){
+                if(!is_fragmented(sf->keys[i].f)) break;
             }
-            if(file == NULL) goto done;
-            first_file = file;
+            if(i == sf->n) goto done;
+            file = sf->keys[i].f;
+            first_file = i;
             n = 1;
             length = file->disp.clusters;
             pplcn = INVALID_LCN;
             plcn = file->disp.blockmap->lcn;
             prev_file = file;
         }
-        file = (winx_file_info*)prb_t_next(&t);
     }
     
     if(n > 1){
         /* remark all files in the group */
-        cut_off_group_of_files(jp,pt,first_file,n,length);
+        cut_off_group_of_files(jp,sf,first_file,n,length);
+    }
+
+done:
+    itrace("%I64u clusters skipped",jp->already_optimized_clusters);
+    winx_bytes_to_hr(jp->already_optimized_clusters * jp->v_info.bytes_per_cluster,1,buffer,sizeof(buffer));
+    itrace("%s skipped",buffer);
+    stop_timing("cutting off sorted out files",time,jp);
+}
+
+/**
+ * @internal
+ * @brief Calculates number of allocated clusters
+ * between start_lcn and the end of the disk.
+ */
+static ULONGLONG count_clusters(udefrag_job_parameters *jp,ULONGLONG start_lcn)
+{
+    winx_volume_region *rgn;
+    ULONGLONG n = 0;
+    const ULONGLONG time = winx_xtime();
+
+    /* actualize the list of free regions */
+    release_temp_space_regions(jp);
+
+    for(rgn = jp->free_regions; rgn; rgn = rgn->next){
+        if(jp->termination_router((void *)jp)) break;
+        if(rgn->lcn >= start_lcn){
+            n += rgn->length;
+        } else if(rgn->lcn + rgn->length > start_lcn){
+            n += rgn->length - (start_lcn - rgn->lcn);
+        }
+        if(rgn->next == jp->free_regions) break;
+    }
+    jp->p_counters.searching_time += winx_xtime() - time;
+    return (jp->v_info.total_clusters - start_lcn - n);
+}
+
+/**
+ * @internal
+ * @brief Calculates number of clusters still needing to be optimized.
+ */
+static ULONGLONG clusters_to_optimize(udefrag_job_parameters *jp,
+        struct sorted_files *sf)
+{
+    winx_file_info *f;
+    ULONG i;
+    ULONGLONG n = 0;
+
+    for(i = 0; i < sf->n; i++){
+        f = sf->keys[i].f;
+        if(!is_moved_to_front(f)){
+            if(can_move_entirely(f, jp->fs_type))
+                n += f->disp.clusters;
+        }
+    }
+    return n;
+}
+
+/************************************************************/
+/*                 Incremental optimization                 */
+/************************************************************/
+
+/*
+* The layout saved after optimization lists files
+* sorted out, in their order, along with their positions.
+* Quick optimization repairs the saved layout then instead
+* of looking for groups of sorted out files: files lying
+* still where they've been placed stay there, the rest
+* get reinserted between them. Files are identified by
+* their mft ids and hashes of their names, so the layout
+* is supported on NTFS only.
+*/
+#define SAVED_LAYOUT_SIGNATURE 0x4f4c4455 /* UDLO */
+#define SAVED_LAYOUT_VERSION   1
+
+struct saved_layout_header {
+    ULONG signature;
+    ULONG version;
+    ULONGLONG volume_serial_number;
+    ULONGLONG total_clusters;
+    ULONGLONG optimizer_size_limit;
+    ULONG bytes_per_cluster;
+    int sorting_flags;
+    ULONG n;                    /* number of entries */
+    ULONG reserved;
+};
+
+struct saved_layout_entry {
+    ULONGLONG mft_id;
+    ULONGLONG lcn;
+    ULONGLONG clusters;
+    ULONG name_hash;
+    ULONG reserved;
+};
+
+struct saved_layout {
+    struct saved_layout_entry *entries;
+    ULONG *table;               /* entry indices, NO_ENTRY if empty */
+    ULONG n;                    /* number of entries */
+    ULONG mask;                 /* size of the table minus one */
+};
+
+#define NO_ENTRY ((ULONG) -1)
+
+/* the largest region rearranged around files reinserted in the layout */
+#define REPAIR_WINDOW_MAGIC_CONSTANT (64 * 1024 * 1024)
+
+/* states of files in the layout repair */
+#define FILE_NEEDS_PLACEMENT 0
+#define FILE_LIES_IN_PLACE   1
+#define FILE_PINNED          2
+
+/**
+ * @internal
+ * @brief Returns the hash of
+ * the case folded file name.
+ */
+static ULONG get_name_hash(winx_file_info *f)
+{
+    wchar_t buffer[MAX_PATH];
+
+    if(f->name == NULL) return 0;
+    (void)_snwprintf(buffer,MAX_PATH,L"%ws",f->name);
+    buffer[MAX_PATH - 1] = 0;
+    return hash_string(winx_wcslwr(buffer));
+}
+
+static ULONG hash_entry(ULONGLONG mft_id,ULONG name_hash)
+{
+    return ((ULONG)(mft_id ^ (mft_id >> 32)) * 2654435761u) ^ name_hash;
+}
+
+/**
+ * @internal
+ * @brief Fills the header of the saved layout.
+ */
+static void init_saved_layout_header(udefrag_job_parameters *jp,
+    struct saved_layout_header *h,ULONG n)
+{
+    memset(h,0,sizeof(struct saved_layout_header));
+    h->signature = SAVED_LAYOUT_SIGNATURE;
+    h->version = SAVED_LAYOUT_VERSION;
+    h->volume_serial_number = jp->v_info.ntfs_data.VolumeSerialNumber.QuadPart;
+    h->total_clusters = jp->v_info.total_clusters;
+    h->optimizer_size_limit = jp->udo.optimizer_size_limit;
+    h->bytes_per_cluster = jp->v_info.bytes_per_cluster;
+    h->sorting_flags = jp->udo.sorting_flags;
+    h->n = n;
+}
+
+/**
+ * @internal
+ * @brief Saves positions of
+ * the sorted out files.
+ */
+static void save_layout(udefrag_job_parameters *jp,struct sorted_files *sf)
+{
+    struct saved_layout_header h;
+    struct saved_layout_entry e;
+    winx_file_info *f;
+    wchar_t *path;
+    WINX_FILE *file;
+    ULONG i, n = 0;
+
+    for(i = 0; i < sf->n; i++){
+        f = sf->keys[i].f;
+        if(f->disp.blockmap && !is_fragmented(f)) n ++;
+    }
+
+    path = get_report_path(jp,L"layout",L"dat");
+    if(path == NULL) return;
+    file = winx_fbopen(path,"w",1024 * 1024);
+    if(file == NULL) file = winx_fopen(path,"w");
+    if(file == NULL){
+        etrace("cannot open %ws",path);
+        winx_free(path);
+        return;
+    }
+
+    init_saved_layout_header(jp,&h,n);
+    if(!winx_fwrite(&h,sizeof(h),1,file)) goto fail;
+    memset(&e,0,sizeof(e));
+    for(i = 0; i < sf->n; i++){
+        f = sf->keys[i].f;
+        if(f->disp.blockmap && !is_fragmented(f)){
+            e.mft_id = f->internal.BaseMftId;
+            e.lcn = f->disp.blockmap->lcn;
+            e.clusters = f->disp.clusters;
+            e.name_hash = get_name_hash(f);
+            if(!winx_fwrite(&e,sizeof(e),1,file)) goto fail;
+        }
+    }
+    winx_fclose(file);
+    itrace("layout of %u files saved",n);
+    winx_free(path);
+    return;
+
+fail:
+    etrace("cannot write %ws",path);
+    winx_fclose(file);
+    (void)winx_delete_file(path);
+    winx_free(path);
+}
+
+static void release_saved_layout(struct saved_layout *sl)
+{
+    winx_free(sl->entries);
+    winx_free(sl->table);
+    memset(sl,0,sizeof(struct saved_layout));
+}
+
+/**
+ * @internal
+ * @brief Loads the layout saved by the
+ * preceding optimization and indexes it.
+ * @return Zero for success, negative value
+ * if no suitable layout has been saved.
+ */
+static int load_saved_layout(udefrag_job_parameters *jp,struct saved_layout *sl)
+{
+    struct saved_layout_header h, expected;
+    wchar_t *path;
+    WINX_FILE *f;
+    ULONG i, size, slot;
+
+    memset(sl,0,sizeof(struct saved_layout));
+    path = get_report_path(jp,L"layout",L"dat");
+    if(path == NULL) return (-1);
+    f = winx_fopen(path,"r");
+    winx_free(path);
+    if(f == NULL){
+        itrace("no layout saved yet");
+        return (-1);
+    }
+
+    /* check whether the layout fits the disk and the options */
+    init_saved_layout_header(jp,&expected,0);
+    if(!winx_fread(&h,sizeof(h),1,f)) goto invalid;
+    expected.n = h.n;
+    if(memcmp(&h,&expected,sizeof(h))) goto invalid;
+    if(winx_fsize(f) != sizeof(h) \
+      + (ULONGLONG)h.n * sizeof(struct saved_layout_entry)) goto invalid;
+
+    for(size = 1024; size < h.n * 2; size <<= 1){}
+    sl->entries = winx_tmalloc((h.n + 1) * sizeof(struct saved_layout_entry));
+    sl->table = winx_tmalloc(size * sizeof(ULONG));
+    if(sl->entries == NULL || sl->table == NULL){
+        etrace("cannot allocate %I64u bytes of memory",
+            (ULONGLONG)(h.n + 1) * sizeof(struct saved_layout_entry) \
+            + size * sizeof(ULONG));
+        goto fail;
+    }
+    if(h.n && winx_fread(sl->entries,
+      sizeof(struct saved_layout_entry),h.n,f) != h.n) goto invalid;
+    winx_fclose(f);
+
+    memset(sl->table,0xFF,size * sizeof(ULONG));
+    sl->mask = size - 1;
+    sl->n = h.n;
+    for(i = 0; i < sl->n; i++){
+        slot = hash_entry(sl->entries[i].mft_id,
+            sl->entries[i].name_hash) & sl->mask;
+        while(sl->table[slot] != NO_ENTRY) slot = (slot + 1) & sl->mask;
+        sl->table[slot] = i;
+    }
+    itrace("layout of %u files loaded",sl->n);
+    return 0;
+
+invalid:
+    itrace("the saved layout doesn\'t fit the disk or options");
+fail:
+    winx_fclose(f);
+    release_saved_layout(sl);
+    return (-1);
+}
+
+/**
+ * @internal
+ * @brief Searches for the saved
+ * position of a file.
+ * @return The entry, NULL if
+ * the file isn't found there.
+ */
+static struct saved_layout_entry *find_saved_position(
+    struct saved_layout *sl,winx_file_info *f)
+{
+    ULONG name_hash, slot;
+    struct saved_layout_entry *e;
+
+    name_hash = get_name_hash(f);
+    slot = hash_entry(f->internal.BaseMftId,name_hash) & sl->mask;
+    for(; sl->table[slot] != NO_ENTRY; slot = (slot + 1) & sl->mask){
+        e = &sl->entries[sl->table[slot]];
+        if(e->mft_id == f->internal.BaseMftId && e->name_hash == name_hash)
+            return e;
+    }
+    return NULL;
+}
+
+/**
+ * @internal
+ * @brief Pins files lying in place which
+ * follow each other on the disk in their
+ * sorted order; the rest of them need to
+ * be placed again.
+ * @details Keeps the longest increasing
+ * sequence of positions, so a single file
+ * moved far away in the order doesn't break
+ * the entire layout.
+ * @return Zero for success, negative value otherwise.
+ */
+static int pin_files_in_order(struct sorted_files *sf,UCHAR *state)
+{
+    ULONG *tails, *prev;
+    ULONG i, length = 0, lo, hi, mid;
+    ULONGLONG lcn;
+
+    tails = winx_tmalloc(sf->n * sizeof(ULONG));
+    prev = winx_tmalloc(sf->n * sizeof(ULONG));
+    if(tails == NULL || prev == NULL){
+        etrace("cannot allocate %I64u bytes of memory",
+            (ULONGLONG)sf->n * sizeof(ULONG) * 2);
+        winx_free(tails);
+        winx_free(prev);
+        return (-1);
+    }
+
+    for(i = 0; i < sf->n; i++){
+        if(state[i] != FILE_LIES_IN_PLACE) continue;
+        lcn = sf->keys[i].f->disp.blockmap->lcn;
+        /* find the shortest sequence ending at or beyond the file */
+        for(lo = 0, hi = length; lo < hi;){
+            mid = (lo + hi) / 2;
+            if(sf->keys[tails[mid]].f->disp.blockmap->lcn < lcn) lo = mid + 1;
+            else hi = mid;
+        }
+        prev[i] = lo ? tails[lo - 1] : NO_ENTRY;
+        tails[lo] = i;
+        if(lo == length) length ++;
     }
 
-done:
-    itrace("%I64u clusters skipped",jp->already_optimized_clusters);
-    winx_bytes_to_hr(jp->already_optimized_clusters * jp->v_info.bytes_per_cluster,1,buffer,sizeof(buffer));
-    itrace("%s skipped",buffer);
-    stop_timing("cutting off sorted out files",time,jp);
+    if(length){
+        for(i = tails[length - 1]; i != NO_ENTRY; i = prev[i])
+            state[i] = FILE_PINNED;
+    }
+    winx_free(tails);
+    winx_free(prev);
+    return 0;
 }
 
 /**
  * @internal
- * @brief Calculates number of allocated clusters
- * between start_lcn and the end of the disk.
+ * @brief Places a file in a window
+ * between pinned files, right behind
+ * the files placed there already.
+ * @details Blocks standing in the way get
+ * moved beyond the window, so gaps get
+ * compacted inside of the window only.
+ * @param[in] jp the job parameters.
+ * @param[in] file the file to be placed.
+ * @param[in,out] lcn the first LCN not
+ * occupied by the files placed already.
+ * @param[in] window_start the first LCN of the window.
+ * @param[in] window_end the first LCN beyond of the window.
+ * @return Zero for success, negative value otherwise.
  */
-static ULONGLONG count_clusters(udefrag_job_parameters *jp,ULONGLONG start_lcn)
+static int place_file_in_window(udefrag_job_parameters *jp,winx_file_info *file,
+    ULONGLONG *lcn,ULONGLONG window_start,ULONGLONG window_end)
 {
     winx_volume_region *rgn;
-    ULONGLONG n = 0;
-    const ULONGLONG time = winx_xtime();
+    winx_blockmap *block;
+    winx_file_info *first_file;
+    ULONGLONG min_lcn;
 
-    /* actualize the list of free regions */
-    release_temp_space_regions(jp);
+    while(!jp->termination_router((void *)jp)){
+        /* the file may lie in place already */
+        if(!is_fragmented(file) && file->disp.blockmap->lcn == *lcn){
+            *lcn += file->disp.clusters;
+            return 0;
+        }
 
-    for(rgn = jp->free_regions; rgn; rgn = rgn->next){
-        if(jp->termination_router((void *)jp)) break;
-        if(rgn->lcn >= start_lcn){
-            n += rgn->length;
-        } else if(rgn->lcn + rgn->length > start_lcn){
-            n += rgn->length - (start_lcn - rgn->lcn);
+        rgn = find_first_free_region(jp,*lcn,file->disp.clusters,NULL);
+        if(rgn && rgn->lcn + file->disp.clusters > window_end) rgn = NULL;
+
+        /* move the block standing in the way beyond the window */
+        min_lcn = *lcn;
+        block = find_first_block(jp,&min_lcn,
+            SKIP_PARTIALLY_MOVABLE_FILES,&first_file);
+        if(block && block->lcn < window_end \
+          && (rgn == NULL || block->lcn < rgn->lcn)){
+            if(cleanup_space(jp,first_file,block,block->length,
+              window_start,window_end - 1) == 0) continue;
         }
-        if(rgn->next == jp->free_regions) break;
+
+        /* move the file */
+        if(rgn == NULL) return (-1);
+        *lcn = rgn->lcn;
+        if(move_file(file,file->disp.blockmap->vcn,
+          file->disp.clusters,*lcn,jp) < 0) return (-1);
+        *lcn += file->disp.clusters;
+        return 0;
     }
-    jp->p_counters.searching_time += winx_xtime() - time;
-    return (jp->v_info.total_clusters - start_lcn - n);
+    return (-1);
 }
 
 /**
  * @internal
- * @brief Calculates number of clusters still needing to be optimized.
+ * @brief Repairs the layout saved by
+ * the preceding optimization.
+ * @details Files lying still where they've been
+ * placed stay there. Files added, resized or moved
+ * since then get reinserted between files pinned in
+ * their sorted order. When they don't fit between
+ * two pinned files, the subsequent pinned files get
+ * placed again as well, until the window is large
+ * enough or reaches REPAIR_WINDOW_MAGIC_CONSTANT.
+ * Files not fitting there get appended to the layout.
+ * @return Zero for success, negative value otherwise.
  */
-static ULONGLONG clusters_to_optimize(udefrag_job_parameters *jp,struct prb_table *pt)
+static int repair_layout(udefrag_job_parameters *jp,
+    struct sorted_files *sf,struct saved_layout *sl)
 {
+    struct saved_layout_entry *e;
     winx_file_info *f;
-    struct prb_traverser t;
-    ULONGLONG n = 0;
+    UCHAR *state;
+    ULONG i, j, first;
+    ULONG added = 0, resized = 0, moved = 0, matched = 0;
+    ULONG kept = 0, placed = 0, appended = 0, failed = 0;
+    ULONG unpinned;
+    ULONGLONG window_start, window_end, needed;
+    ULONGLONG lcn, clusters = 0;
+    ULONGLONG time;
+    int result = 0;
 
-    prb_t_init(&t,pt);
-    f = (winx_file_info*)prb_t_first(&t,pt);
-    while(f){
-        if(!is_moved_to_front(f)){
-            if(can_move_entirely(f, jp->fs_type))
-                n += f->disp.clusters;
+    time = start_timing("layout repair",jp);
+    state = winx_tmalloc(sf->n + 1);
+    if(state == NULL){
+        etrace("cannot allocate %u bytes of memory",sf->n + 1);
+        result = -1;
+        goto done;
+    }
+
+    /* detect files changed since the saved layout */
+    for(i = 0; i < sf->n; i++){
+        f = sf->keys[i].f;
+        state[i] = FILE_NEEDS_PLACEMENT;
+        e = find_saved_position(sl,f);
+        if(e == NULL){
+            added ++;
+        } else {
+            matched ++;
+            if(f->disp.clusters != e->clusters){
+                resized ++;
+            } else if(is_fragmented(f) || f->disp.blockmap->lcn != e->lcn){
+                moved ++;
+            } else {
+                state[i] = FILE_LIES_IN_PLACE;
+            }
         }
-        f = (winx_file_info*)prb_t_next(&t);
     }
-    return n;
+    itrace("since the saved layout %u files added, %u resized, "
+        "%u moved, %u deleted",added,resized,moved,sl->n - matched);
+    if(pin_files_in_order(sf,state) < 0){
+        result = -1;
+        goto done;
+    }
+
+    /* files lying in place stay there */
+    jp->already_optimized_clusters = 0;
+    for(i = 0; i < sf->n; i++){
+        f = sf->keys[i].f;
+        if(state[i] != FILE_NEEDS_PLACEMENT){
+            f->user_defined_flags |= UD_FILE_MOVED_TO_FRONT;
+            jp->already_optimized_clusters += f->disp.clusters;
+            kept ++;
+        } else {
+            clusters += f->disp.clusters;
+        }
+    }
+    itrace("%u files stay in place",kept);
+    jp->pi.clusters_to_process = jp->pi.processed_clusters + clusters * 2;
+
+    /* reinsert the rest between pinned files */
+    release_temp_space_regions(jp);
+    window_start = 0;
+    for(i = 0; i < sf->n && !jp->termination_router((void *)jp);){
+        f = sf->keys[i].f;
+        if(state[i] == FILE_PINNED){
+            window_start = f->disp.blockmap->lcn + f->disp.clusters;
+            i ++;
+            continue;
+        }
+
+        /* define the window, extend it until the files fit there */
+        first = i;
+        needed = 0;
+        unpinned = 0;
+        for(j = i; ; j++){
+            for(; j < sf->n && state[j] != FILE_PINNED; j++){
+                if(state[j] == FILE_NEEDS_PLACEMENT)
+                    needed += sf->keys[j].f->disp.clusters;
+            }
+            window_end = (j < sf->n) ? \
+                sf->keys[j].f->disp.blockmap->lcn : jp->v_info.total_clusters;
+            if(j == sf->n || window_end - window_start >= needed) break;
+            if((window_end - window_start) * jp->v_info.bytes_per_cluster \
+              >= REPAIR_WINDOW_MAGIC_CONSTANT) break;
+            /* place the pinned file again */
+            f = sf->keys[j].f;
+            f->user_defined_flags &= ~UD_FILE_MOVED_TO_FRONT;
+            jp->already_optimized_clusters -= f->disp.clusters;
+            needed += f->disp.clusters;
+            state[j] = FILE_NEEDS_PLACEMENT;
+            unpinned ++;
+        }
+        /* let the search find blocks of files movable again */
+        if(unpinned) reset_file_blocks_summary(jp);
+
+        /* place the files */
+        lcn = window_start;
+        for(i = first; i < j; i++){
+            if(state[i] != FILE_NEEDS_PLACEMENT) continue;
+            f = sf->keys[i].f;
+            if(!can_move_entirely(f,jp->fs_type)){
+                state[i] = FILE_LIES_IN_PLACE;
+                failed ++;
+            } else if(place_file_in_window(jp,f,&lcn,
+              window_start,window_end) >= 0){
+                f->user_defined_flags |= UD_FILE_MOVED_TO_FRONT;
+                state[i] = FILE_LIES_IN_PLACE;
+                placed ++;
+            }
+        }
+    }
+
+    /* append files not fitting in their windows to the layout */
+    window_start = 0;
+    for(i = 0; i < sf->n; i++){
+        f = sf->keys[i].f;
+        if(state[i] != FILE_NEEDS_PLACEMENT && !is_fragmented(f)){
+            lcn = f->disp.blockmap->lcn + f->disp.clusters;
+            if(lcn > window_start) window_start = lcn;
+        }
+    }
+    lcn = window_start;
+    for(i = 0; i < sf->n; i++){
+        if(state[i] != FILE_NEEDS_PLACEMENT) continue;
+        f = sf->keys[i].f;
+        if(place_file_in_window(jp,f,&lcn,
+          window_start,jp->v_info.total_clusters) >= 0) appended ++;
+        else
+            failed ++;
+        f->user_defined_flags |= UD_FILE_MOVED_TO_FRONT;
+    }
+
+    itrace("%u files reinserted, %u files appended, %u files cannot be placed",
+        placed,appended,failed);
+
+done:
+    stop_timing("layout repair",time,jp);
+    winx_free(state);
+    return result;
 }
 
+/************************************************************/
+/*                   Sorting out of files                   */
+/************************************************************/
+
 /**
  * @internal
  * @brief Sorts out small files on the disk.
+ * @details Quick optimization repairs the layout
+ * saved by the preceding optimization when the
+ * incremental optimization is turned on.
  * @return Zero for success, negative value otherwise.
  */
 static int optimize_routine(udefrag_job_parameters *jp)
 {
-    winx_file_info *f;
-    struct prb_table *pt;
-    struct prb_traverser t;
+    struct sorted_files sf;
+    struct saved_layout sl;
     ULONGLONG start_lcn, end_lcn;
-    void **p;
     ULONGLONG time;
-    const int result = 0;
+    int result = 0;
 
     jp->pi.current_operation = VOLUME_OPTIMIZATION;
 
@@ -941,27 +2497,30 @@ static int optimize_routine(udefrag_job_parameters *jp)
     /* no files are excluded by this task currently */
     clear_currently_excluded_flag(jp);
 
-    /* build a tree of files sorted by the requested criteria */
-    pt = prb_create(files_compare,(void *)jp,NULL);
-    for(f = jp->filelist; f; f = f->next){
-        if(f->disp.clusters * jp->v_info.bytes_per_cluster \
-          < jp->udo.optimizer_size_limit){
-            if(can_move_entirely(f, jp->fs_type)){
-                p = prb_probe(pt,(void *)f);
-                if(p && *p != f) etrace("a duplicate found for %ws",f->path);
-            }
-        }
-        if(f->next == jp->filelist) break;
+    if(jp->udo.sorting_flags & UD_SORT_BY_DIRECTORY_TREE)
+        dbg_print_directory_locality(jp);
+
+    /* sort files by the requested criteria */
+    if(build_sorted_files(jp,&sf) < 0){
+        result = -1;
+        goto done;
     }
     
     if(jp->job_type == QUICK_OPTIMIZATION_JOB){
+        if(jp->udo.incremental_optimization && jp->fs_type == FS_NTFS){
+            if(load_saved_layout(jp,&sl) >= 0){
+                /* repair the saved layout */
+                result = repair_layout(jp,&sf,&sl);
+                release_saved_layout(&sl);
+                goto done;
+            }
+        }
         /* cut off already sorted out groups of files */
-        cut_off_sorted_out_files(jp,pt);
+        cut_off_sorted_out_files(jp,&sf);
     }
     
     /* do the job */
-    prb_t_init(&t,pt);
-    if((winx_file_info*)prb_t_first(&t,pt) == NULL) goto done;
+    if(get_current_file(&sf) == NULL) goto done;
     start_lcn = end_lcn = 0;
     while(!jp->termination_router((void *)jp)){
         winx_dbg_print_header(0,0,I"volume optimization"
@@ -969,27 +2528,401 @@ static int optimize_routine(udefrag_job_parameters *jp)
         jp->pi.clusters_to_process = \
             jp->pi.processed_clusters \
             + count_clusters(jp,start_lcn) \
-            + clusters_to_optimize(jp,pt);
+            + clusters_to_optimize(jp,&sf);
         
         /* cleanup space in the beginning of the disk (fragments?) */
         move_files_to_back(jp,&end_lcn);
         if(jp->termination_router((void *)jp)) break;
         
         /* move small files back, sorted */
-        move_files_to_front(jp,&start_lcn,end_lcn,&t);
+        move_files_to_front(jp,&start_lcn,end_lcn,&sf);
         
         /* break if no more files need optimization */
-        if((winx_file_info*)prb_t_cur(&t) == NULL) break;
+        if(get_current_file(&sf) == NULL) break;
     }
     
 done:
+    if(result == 0 && jp->udo.incremental_optimization \
+      && jp->fs_type == FS_NTFS){
+        if(!jp->termination_router((void *)jp))
+            save_layout(jp,&sf);
+    }
+    if(jp->udo.sorting_flags & UD_SORT_BY_DIRECTORY_TREE)
+        dbg_print_directory_locality(jp);
     stop_timing("optimization",time,jp);
 
     /* cleanup */
     clear_currently_excluded_flag(jp);
     winx_fclose(jp->fVolume);
     jp->fVolume = NULL;
-    if(pt) prb_destroy(pt,NULL);
+    release_sorted_files(&sf);
+    return result;
+}
+
+/************************************************************/
+/*                    Zoned optimization                    */
+/************************************************************/
+
+/*
+* Files accessed recently go to the hot zone at the beginning
+* of the disk, files not accessed for a long time go to the
+* cold zone at the end of the disk, all the rest is placed
+* in the warm zone between them.
+*/
+#define HOT_ZONE        0
+#define WARM_ZONE       1
+#define COLD_ZONE       2
+#define NUMBER_OF_ZONES 3
+
+/* number of 100-nanosecond intervals in a day */
+#define DAY_LENGTH ((ULONGLONG)24 * 60 * 60 * 1000 * 1000 * 10)
+
+static const char *zone_names[NUMBER_OF_ZONES] = { "hot", "warm", "cold" };
+
+/**
+ * @internal
+ * @brief Defines zone of a file
+ * by the time of its last access.
+ * @param[in] jp the job parameters.
+ * @param[in] f the file.
+ * @param[in] now the current system time.
+ */
+static int get_file_zone(udefrag_job_parameters *jp,
+    winx_file_info *f,ULONGLONG now)
+{
+    ULONGLONG age = 0;
+
+    if(now > f->last_access_time)
+        age = (now - f->last_access_time) / DAY_LENGTH;
+    if(age < (ULONGLONG)jp->udo.hot_zone_age)
+        return HOT_ZONE;
+    if(age >= (ULONGLONG)jp->udo.cold_zone_age)
+        return COLD_ZONE;
+    return WARM_ZONE;
+}
+
+/**
+ * @internal
+ * @brief Checks whether a file
+ * lies in the hot zone or not.
+ */
+static int intersects_hot_zone(winx_file_info *f,ULONGLONG hot_zone_end)
+{
+    winx_blockmap *block;
+
+    for(block = f->disp.blockmap; block; block = block->next){
+        if(block->lcn < hot_zone_end) return 1;
+        if(block->next == f->disp.blockmap) break;
+    }
+    return 0;
+}
+
+/**
+ * @internal
+ * @brief Defines zone of a file to be placed
+ * in the zoned optimization, (-1) if the file
+ * needs no placement.
+ * @details Small files get placed in all the
+ * zones, big files are moved to the cold zone
+ * only when they're cold and lie in the hot zone.
+ */
+static int get_target_zone(udefrag_job_parameters *jp,
+    winx_file_info *f,ULONGLONG now,ULONGLONG hot_zone_end)
+{
+    int zone;
+
+    if(!can_move_entirely(f, jp->fs_type))
+        return (-1);
+    zone = get_file_zone(jp,f,now);
+    if(f->disp.clusters * jp->v_info.bytes_per_cluster \
+      < jp->udo.optimizer_size_limit)
+        return zone;
+    if(zone == COLD_ZONE && intersects_hot_zone(f,hot_zone_end))
+        return zone;
+    return (-1);
+}
+
+/**
+ * @internal
+ * @brief Collects files to be placed
+ * in each zone and sorts them.
+ * @param[in] jp the job parameters.
+ * @param[out] zf array of NUMBER_OF_ZONES
+ * lists of sorted files.
+ * @param[in] hot_zone_end the first LCN
+ * beyond of the hot zone.
+ * @return Zero for success, negative value otherwise.
+ */
+static int build_zone_files(udefrag_job_parameters *jp,
+    struct sorted_files *zf,ULONGLONG hot_zone_end)
+{
+    winx_file_info *f;
+    LARGE_INTEGER now;
+    NTSTATUS status;
+    ULONG n[NUMBER_OF_ZONES] = {0};
+    int i, zone;
+
+    memset(zf,0,NUMBER_OF_ZONES * sizeof(struct sorted_files));
+    status = NtQuerySystemTime(&now);
+    if(status != STATUS_SUCCESS){
+        strace(status,"cannot get the system time");
+        return (-1);
+    }
+
+    /* count files of each zone */
+    for(f = jp->filelist; f; f = f->next){
+        zone = get_target_zone(jp,f,now.QuadPart,hot_zone_end);
+        if(zone >= 0) n[zone] ++;
+        if(f->next == jp->filelist) break;
+    }
+
+    for(i = 0; i < NUMBER_OF_ZONES; i++){
+        if(n[i] == 0) continue;
+        zf[i].keys = winx_tmalloc(n[i] * sizeof(struct file_sort_key));
+        if(zf[i].keys == NULL){
+            etrace("cannot allocate %I64u bytes of memory",
+                (ULONGLONG)n[i] * sizeof(struct file_sort_key));
+            return (-1);
+        }
+    }
+
+    for(f = jp->filelist; f; f = f->next){
+        zone = get_target_zone(jp,f,now.QuadPart,hot_zone_end);
+        if(zone >= 0) zf[zone].keys[zf[zone].n ++].f = f;
+        if(f->next == jp->filelist) break;
+    }
+
+    for(i = 0; i < NUMBER_OF_ZONES; i++){
+        itrace("%s zone: %u files",zone_names[i],zf[i].n);
+        if(sort_files(jp,&zf[i]) < 0) return (-1);
+    }
+    return 0;
+}
+
+/**
+ * @internal
+ * @brief Puts files of the hot zone which
+ * didn't fit there ahead of files of the warm zone.
+ * @return Zero for success, negative value otherwise.
+ */
+static int add_overflowed_files(struct sorted_files *hot,
+    struct sorted_files *warm)
+{
+    struct file_sort_key *keys;
+    ULONG i, n = 0;
+
+    for(i = 0; i < hot->n; i++){
+        if(!is_moved_to_front(hot->keys[i].f)) n ++;
+    }
+    if(n == 0) return 0;
+
+    itrace("%u files don't fit in the hot zone",n);
+    keys = winx_tmalloc((n + warm->n) * sizeof(struct file_sort_key));
+    if(keys == NULL){
+        etrace("cannot allocate %I64u bytes of memory",
+            (ULONGLONG)(n + warm->n) * sizeof(struct file_sort_key));
+        return (-1);
+    }
+    for(i = 0, n = 0; i < hot->n; i++){
+        if(!is_moved_to_front(hot->keys[i].f)){
+            /* give the file one more chance */
+            hot->keys[i].f->user_defined_flags &= ~UD_FILE_REGION_NOT_FOUND;
+            keys[n++] = hot->keys[i];
+        }
+    }
+    for(i = 0; i < warm->n; i++) keys[n++] = warm->keys[i];
+
+    winx_free(warm->keys);
+    warm->keys = keys;
+    warm->n = n;
+    warm->current = 0;
+    return 0;
+}
+
+/**
+ * @internal
+ * @brief Moves files to the end of the
+ * cold zone, the last ones first.
+ * @param[in] jp the job parameters.
+ * @param[in] start_lcn the beginning
+ * of the cold zone.
+ * @param[in] sf the sorted files.
+ * @return Number of clusters moved.
+ */
+static ULONGLONG move_files_to_cold_zone(udefrag_job_parameters *jp,
+    ULONGLONG start_lcn, struct sorted_files *sf)
+{
+    winx_file_info *file;
+    winx_volume_region *rgn;
+    struct front_moves fm;
+    ULONGLONG skipped_files = 0;
+    ULONGLONG lcn;
+    ULONGLONG time;
+    ULONG i;
+    char buffer[32];
+
+    time = start_timing("file moving to cold zone",jp);
+    fm.jp = jp;
+    fm.start_lcn = NULL;
+    fm.limit = jp->v_info.total_clusters;
+    jp->pi.moved_clusters = 0;
+    /* release temporarily allocated space */
+    release_temp_space_regions(jp);
+    (void)init_move_queue(jp);
+
+    /* do the job */
+    for(i = sf->n; i > 0; i--){
+        if(jp->termination_router((void *)jp)) break;
+        file = sf->keys[i - 1].f;
+        if(!can_move_entirely(file, jp->fs_type)) continue;
+        /* keep files already lying in the cold zone */
+        if(!is_fragmented(file) && file->disp.blockmap->lcn >= start_lcn){
+            file->user_defined_flags |= UD_FILE_MOVED_TO_FRONT;
+            continue;
+        }
+        rgn = find_last_free_region(jp,start_lcn,file->disp.clusters,NULL);
+        if(rgn == NULL){
+            /* smaller files may fit still */
+            skipped_files ++;
+            continue;
+        }
+        /* move the file */
+        lcn = rgn->lcn + rgn->length - file->disp.clusters;
+        (void)move_file_async(file,file->disp.blockmap->vcn,
+            file->disp.clusters,lcn,move_to_front_completed,(void *)&fm,jp);
+        file->user_defined_flags |= UD_FILE_MOVED_TO_FRONT;
+    }
+
+    /* wait for the moves in progress */
+    destroy_move_queue(jp);
+
+    /* display amount of moved data */
+    if(skipped_files)
+        itrace("%I64u files don't fit in the cold zone",skipped_files);
+    itrace("%I64u clusters moved",jp->pi.moved_clusters);
+    winx_bytes_to_hr(jp->pi.moved_clusters * jp->v_info.bytes_per_cluster,
+        1,buffer,sizeof(buffer));
+    itrace("%s moved",buffer);
+    stop_timing("file moving to cold zone",time,jp);
+    return jp->pi.moved_clusters;
+}
+
+/**
+ * @internal
+ * @brief Sorts out files in a zone
+ * the same way the regular optimization
+ * sorts out them on the entire disk.
+ * @param[in] jp the job parameters.
+ * @param[in] start_lcn the beginning of the zone.
+ * @param[in] end_lcn the first LCN beyond of the zone.
+ * @param[in,out] sf the sorted files.
+ * @return Number of clusters moved to the zone.
+ */
+static ULONGLONG fill_zone(udefrag_job_parameters *jp,
+    ULONGLONG start_lcn, ULONGLONG end_lcn, struct sorted_files *sf)
+{
+    ULONGLONG cleaned_lcn = start_lcn;
+    ULONGLONG moved_clusters = 0;
+
+    if(get_current_file(sf) == NULL) return 0;
+    while(!jp->termination_router((void *)jp)){
+        winx_dbg_print_header(0,0,I"volume optimization"
+        " pass #%u",++jp->pi.pass_number);
+        jp->pi.clusters_to_process = \
+            jp->pi.processed_clusters \
+            + count_clusters(jp,start_lcn) \
+            + clusters_to_optimize(jp,sf);
+
+        /* cleanup space in the zone */
+        move_files_to_back(jp,&cleaned_lcn);
+        if(jp->termination_router((void *)jp)) break;
+
+        /* move files back, sorted */
+        move_files_to_front(jp,&start_lcn,min(cleaned_lcn,end_lcn),sf);
+        moved_clusters += jp->pi.moved_clusters;
+
+        /* break if no more files need optimization */
+        if(get_current_file(sf) == NULL) break;
+    }
+    return moved_clusters;
+}
+
+/**
+ * @internal
+ * @brief Places files in zones
+ * by the time of their last access.
+ * @details Cold files go to the cold zone first,
+ * releasing space in the rest of the disk. Then hot
+ * files get sorted out in the hot zone and the warm
+ * ones behind it, along with hot files which didn't
+ * fit in the hot zone. Big files get moved only when
+ * they're cold and lie in the hot zone.
+ * @return Zero for success, negative value otherwise.
+ */
+static int zoned_optimize_routine(udefrag_job_parameters *jp)
+{
+    struct sorted_files zf[NUMBER_OF_ZONES];
+    ULONGLONG placed[NUMBER_OF_ZONES] = {0};
+    ULONGLONG hot_zone_end, cold_zone_start;
+    ULONGLONG time;
+    int result = 0;
+    int i;
+    char buffer[32];
+
+    jp->pi.current_operation = VOLUME_OPTIMIZATION;
+
+    /* open the volume */
+    jp->fVolume = winx_vopen(winx_toupper(jp->volume_letter));
+    if(jp->fVolume == NULL)
+        return -1;
+
+    time = start_timing("zoned optimization",jp);
+
+    /* no files are excluded by this task currently */
+    clear_currently_excluded_flag(jp);
+
+    /* define the zones */
+    hot_zone_end = jp->v_info.total_clusters * jp->udo.hot_zone_size / 100;
+    cold_zone_start = jp->v_info.total_clusters \
+        - jp->v_info.total_clusters * jp->udo.cold_zone_size / 100;
+    itrace("hot zone: LCN 0 - %I64u",hot_zone_end);
+    itrace("cold zone: LCN %I64u - %I64u",
+        cold_zone_start,jp->v_info.total_clusters);
+
+    /* sort files of each zone by the requested criteria */
+    if(build_zone_files(jp,zf,hot_zone_end) < 0){
+        result = -1;
+        goto done;
+    }
+
+    /* do the job */
+    if(cold_zone_start < jp->v_info.total_clusters)
+        placed[COLD_ZONE] = move_files_to_cold_zone(jp,
+            cold_zone_start,&zf[COLD_ZONE]);
+    if(jp->termination_router((void *)jp)) goto done;
+    placed[HOT_ZONE] = fill_zone(jp,0,hot_zone_end,&zf[HOT_ZONE]);
+    if(jp->termination_router((void *)jp)) goto done;
+    if(add_overflowed_files(&zf[HOT_ZONE],&zf[WARM_ZONE]) < 0){
+        result = -1;
+        goto done;
+    }
+    placed[WARM_ZONE] = fill_zone(jp,hot_zone_end,
+        cold_zone_start,&zf[WARM_ZONE]);
+
+done:
+    for(i = 0; i < NUMBER_OF_ZONES; i++){
+        winx_bytes_to_hr(placed[i] * jp->v_info.bytes_per_cluster,
+            1,buffer,sizeof(buffer));
+        itrace("%s zone: %s placed",zone_names[i],buffer);
+    }
+    stop_timing("zoned optimization",time,jp);
+
+    /* cleanup */
+    clear_currently_excluded_flag(jp);
+    winx_fclose(jp->fVolume);
+    jp->fVolume = NULL;
+    for(i = 0; i < NUMBER_OF_ZONES; i++)
+        release_sorted_files(&zf[i]);
     return result;
 }
 
@@ -1005,6 +2938,8 @@ done:
  * directories and NTFS master file tables get
  * fixed up as well by placing their fragments
  * close to each other behind the first ones.
+ * The zoned optimization places files in zones
+ * by the time of their last access instead.
  * @return Zero for success, negative value otherwise.
  */
 int optimize(udefrag_job_parameters *jp)
@@ -1052,7 +2987,10 @@ int optimize(udefrag_job_parameters *jp)
     }
     
     /* optimize the disk */
-    result = optimize_routine(jp);
+    if(jp->job_type == ZONED_OPTIMIZATION_JOB)
+        result = zoned_optimize_routine(jp);
+    else
+        result = optimize_routine(jp);
     if(result == 0){
         /* optimization succeeded */
         overall_result = 0;
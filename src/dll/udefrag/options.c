@@ -43,12 +43,19 @@ int get_options(udefrag_job_parameters *jp)
     int i, z, index = 0;
     char *methods[] = {
         "path", "path", "size", "creation time",
-        "last modification time", "last access time"
+        "last modification time", "last access time",
+        "directory tree (depth first)",
+        "directory tree (breadth first)"
     };
 
     /* reset all options */
     memset(&jp->udo,0,sizeof(udefrag_options));
     jp->udo.refresh_interval = DEFAULT_REFRESH_INTERVAL;
+    jp->udo.move_target_latency = DEFAULT_MOVE_TARGET_LATENCY;
+    jp->udo.hot_zone_age = DEFAULT_HOT_ZONE_AGE;
+    jp->udo.cold_zone_age = DEFAULT_COLD_ZONE_AGE;
+    jp->udo.hot_zone_size = DEFAULT_HOT_ZONE_SIZE;
+    jp->udo.cold_zone_size = DEFAULT_COLD_ZONE_SIZE;
     
     /* set filters */
     buffer = winx_getenv(L"UD_IN_FILTER");
@@ -124,6 +131,17 @@ int get_options(udefrag_job_parameters *jp)
             index = 4, jp->udo.sorting_flags |= UD_SORT_BY_MODIFICATION_TIME;
         else if(!wcscmp(buffer,L"a_time"))
             index = 5, jp->udo.sorting_flags |= UD_SORT_BY_ACCESS_TIME;
+        else if(!wcscmp(buffer,L"tree"))
+            index = 6, jp->udo.sorting_flags |= UD_SORT_BY_DIRECTORY_TREE;
+        else if(!wcscmp(buffer,L"tree_bfs"))
+            index = 7, jp->udo.sorting_flags |= \
+                UD_SORT_BY_DIRECTORY_TREE | UD_SORT_BREADTH_FIRST;
+        winx_free(buffer);
+    }
+    buffer = winx_getenv(L"UD_LAYOUT_ORDER_FILE");
+    if(buffer){
+        (void)_snwprintf(jp->udo.layout_order_file,MAX_PATH,L"%ws",buffer);
+        jp->udo.layout_order_file[MAX_PATH] = 0;
         winx_free(buffer);
     }
     buffer = winx_getenv(L"UD_SORTING_ORDER");
@@ -134,6 +152,42 @@ int get_options(udefrag_job_parameters *jp)
         winx_free(buffer);
     }
     
+    /* set zones of the zoned optimization */
+    buffer = winx_getenv(L"UD_HOT_ZONE_AGE");
+    if(buffer){
+        jp->udo.hot_zone_age = _wtoi(buffer);
+        if(jp->udo.hot_zone_age < 0)
+            jp->udo.hot_zone_age = 0;
+        winx_free(buffer);
+    }
+    buffer = winx_getenv(L"UD_COLD_ZONE_AGE");
+    if(buffer){
+        jp->udo.cold_zone_age = _wtoi(buffer);
+        winx_free(buffer);
+    }
+    /* files cannot be hot and cold at once */
+    if(jp->udo.cold_zone_age < jp->udo.hot_zone_age)
+        jp->udo.cold_zone_age = jp->udo.hot_zone_age;
+    buffer = winx_getenv(L"UD_HOT_ZONE_SIZE");
+    if(buffer){
+        jp->udo.hot_zone_size = _wtoi(buffer);
+        if(jp->udo.hot_zone_size < 0)
+            jp->udo.hot_zone_size = 0;
+        if(jp->udo.hot_zone_size > 100)
+            jp->udo.hot_zone_size = 100;
+        winx_free(buffer);
+    }
+    buffer = winx_getenv(L"UD_COLD_ZONE_SIZE");
+    if(buffer){
+        jp->udo.cold_zone_size = _wtoi(buffer);
+        if(jp->udo.cold_zone_size < 0)
+            jp->udo.cold_zone_size = 0;
+        winx_free(buffer);
+    }
+    /* the zones must not overlap */
+    if(jp->udo.cold_zone_size > 100 - jp->udo.hot_zone_size)
+        jp->udo.cold_zone_size = 100 - jp->udo.hot_zone_size;
+
     /* set time limit */
     buffer = winx_getenv(L"UD_TIME_LIMIT");
     if(buffer){
@@ -158,6 +212,22 @@ int get_options(udefrag_job_parameters *jp)
         winx_free(buffer);
     }
 
+    /* check for disable_move_planning option */
+    buffer = winx_getenv(L"UD_DISABLE_MOVE_PLANNING");
+    if(buffer){
+        if(!wcscmp(buffer,L"1"))
+            jp->udo.disable_move_planning = 1;
+        winx_free(buffer);
+    }
+
+    /* check for incremental_optimization option */
+    buffer = winx_getenv(L"UD_INCREMENTAL_OPTIMIZATION");
+    if(buffer){
+        if(!wcscmp(buffer,L"1"))
+            jp->udo.incremental_optimization = 1;
+        winx_free(buffer);
+    }
+
     /* set debug print level */
     buffer = winx_getenv(L"UD_DBGPRINT_LEVEL");
     if(buffer){
@@ -179,7 +249,58 @@ int get_options(udefrag_job_parameters *jp)
         }
         winx_free(buffer);
     }
+    buffer = winx_getenv(L"UD_DRY_RUN_LATENCY");
+    if(buffer){
+        jp->udo.simulated_move_latency = _wtoi(buffer);
+        if(jp->udo.simulated_move_latency < 0)
+            jp->udo.simulated_move_latency = 0;
+        winx_free(buffer);
+    }
     
+    /* set parameters of the MFT reading */
+    buffer = winx_getenv(L"UD_MFT_BUFFER_SIZE");
+    if(buffer){
+        (void)_snprintf(buf,sizeof(buf) - 1,"%ws",buffer);
+        buf[sizeof(buf) - 1] = 0;
+        jp->udo.mft_buffer_size = winx_hr_to_bytes(buf);
+        winx_free(buffer);
+    }
+    buffer = winx_getenv(L"UD_MFT_QUEUE_DEPTH");
+    if(buffer){
+        jp->udo.mft_queue_depth = _wtoi(buffer);
+        winx_free(buffer);
+    }
+
+    /* set parameters of the file moving */
+    buffer = winx_getenv(L"UD_MOVE_TARGET_LATENCY");
+    if(buffer){
+        jp->udo.move_target_latency = _wtoi(buffer);
+        if(jp->udo.move_target_latency < 0)
+            jp->udo.move_target_latency = 0;
+        winx_free(buffer);
+    }
+    buffer = winx_getenv(L"UD_MOVE_MIN_SIZE");
+    if(buffer){
+        (void)_snprintf(buf,sizeof(buf) - 1,"%ws",buffer);
+        buf[sizeof(buf) - 1] = 0;
+        jp->udo.move_min_size = winx_hr_to_bytes(buf);
+        winx_free(buffer);
+    }
+    buffer = winx_getenv(L"UD_MOVE_MAX_SIZE");
+    if(buffer){
+        (void)_snprintf(buf,sizeof(buf) - 1,"%ws",buffer);
+        buf[sizeof(buf) - 1] = 0;
+        jp->udo.move_max_size = winx_hr_to_bytes(buf);
+        winx_free(buffer);
+    }
+    buffer = winx_getenv(L"UD_MOVE_QUEUE_DEPTH");
+    if(buffer){
+        jp->udo.move_queue_depth = _wtoi(buffer);
+        if(jp->udo.move_queue_depth > MAX_MOVE_QUEUE_DEPTH)
+            jp->udo.move_queue_depth = MAX_MOVE_QUEUE_DEPTH;
+        winx_free(buffer);
+    }
+
     /* set fragmentation threshold */
     buffer = winx_getenv(L"UD_FRAGMENTATION_THRESHOLD");
     if(buffer){
@@ -222,10 +343,40 @@ int get_options(udefrag_job_parameters *jp)
     itrace("file fragments threshold                  = %I64u",jp->udo.fragments_limit);
     itrace("files will be sorted by %s in %s order",methods[index],
         (jp->udo.sorting_flags & UD_SORT_DESCENDING) ? "descending" : "ascending");
+    if(jp->udo.layout_order_file[0])
+        itrace("files listed in %ws will go first",jp->udo.layout_order_file);
+    if(jp->job_type == ZONED_OPTIMIZATION_JOB){
+        itrace("hot zone: %u %% of the disk, files accessed within %u days",
+            jp->udo.hot_zone_size,jp->udo.hot_zone_age);
+        itrace("cold zone: %u %% of the disk, files not accessed for %u days",
+            jp->udo.cold_zone_size,jp->udo.cold_zone_age);
+    }
     itrace("time limit                                = %I64u seconds",jp->udo.time_limit);
     itrace("progress refresh interval                 = %u msec",jp->udo.refresh_interval);
+    if(jp->udo.mft_buffer_size){
+        (void)winx_bytes_to_hr(jp->udo.mft_buffer_size,1,buf,sizeof(buf));
+        itrace("mft read buffer size                      = %s",buf);
+    }
+    if(jp->udo.mft_queue_depth)
+        itrace("mft read queue depth                      = %u",
+            jp->udo.mft_queue_depth);
+    if(jp->udo.move_target_latency)
+        itrace("target latency of moves                   = %u msec",
+            jp->udo.move_target_latency);
+    else
+        itrace("adaptive sizing of moves disabled");
+    if(jp->udo.move_queue_depth > 1)
+        itrace("files moved at once                       = %u",
+            jp->udo.move_queue_depth);
+    if(jp->udo.dry_run && jp->udo.simulated_move_latency)
+        itrace("simulated latency of moves                = %u msec",
+            jp->udo.simulated_move_latency);
     if(jp->udo.disable_reports) itrace("reports disabled");
     else itrace("reports enabled");
+    if(jp->udo.disable_move_planning)
+        itrace("greedy placement of files in defragmentation");
+    if(jp->udo.incremental_optimization)
+        itrace("incremental optimization enabled");
     switch(jp->udo.dbgprint_level){
     case DBG_DETAILED:
         itrace("detailed debug level set");
@@ -193,6 +193,7 @@ int query_get_VCNlist(udefrag_job_parameters *jp)
     winx_file_info *file;
     wchar_t *native_path;
     wchar_t *buffer;
+    wchar_t path[MAX_PATH];
     buffer = winx_getenv(L"UD_CUT_FILTER");
     dtrace("Inside GUI result was (Buffer = CUT_FILTER): Path was: %ws", buffer);
     winx_free(buffer);
@@ -202,7 +203,8 @@ int query_get_VCNlist(udefrag_job_parameters *jp)
     
     /* iterate through the filelist to check (no other way) */
     for(file = jp->filelist; file != NULL; file = file->next){
-        if(_wcsicmp(file->path,native_path) == 0) break;
+        (void)winx_get_file_path(file,path,MAX_PATH);
+        if(_wcsicmp(path,native_path) == 0) break;
         if(file->next == jp->filelist){
             etrace("Abnormal error. Could not match path to any scanned file...");
             return (-1);
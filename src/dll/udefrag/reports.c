@@ -59,8 +59,16 @@ static void convert_to_utf8_path(char *dst,int size,wchar_t *src)
 
 /**
  * @internal
+ * @brief Builds path of a file kept
+ * in the reports directory for the
+ * disk processed, like fraglist_c.luar.
+ * @param[in] jp the job parameters.
+ * @param[in] name the file name prefix.
+ * @param[in] extension the file extension.
+ * @return The path, NULL indicates failure.
  */
-static wchar_t *get_report_path(udefrag_job_parameters *jp)
+wchar_t *get_report_path(udefrag_job_parameters *jp,
+    wchar_t *name,wchar_t *extension)
 {
     wchar_t *instdir, *fpath;
     wchar_t *isportable;//genBTC
@@ -81,8 +89,8 @@ static wchar_t *get_report_path(udefrag_job_parameters *jp)
                 (void)winx_create_directory(path);
                 winx_free(path);
             }
-            path = winx_swprintf(L"\\??\\%ws\\reports\\fraglist_%c.luar",
-                fpath,winx_tolower(jp->volume_letter));
+            path = winx_swprintf(L"\\??\\%ws\\reports\\%ws_%c.%ws",
+                fpath,name,winx_tolower(jp->volume_letter),extension);
             if(path == NULL)
                 etrace("not enough memory (case 2)");
             winx_free(fpath);
@@ -97,8 +105,8 @@ static wchar_t *get_report_path(udefrag_job_parameters *jp)
             (void)winx_create_directory(path);
             winx_free(path);
         }
-        path = winx_swprintf(L"\\??\\%ws\\reports\\fraglist_%c.luar",
-            instdir,winx_tolower(jp->volume_letter));
+        path = winx_swprintf(L"\\??\\%ws\\reports\\%ws_%c.%ws",
+            instdir,name,winx_tolower(jp->volume_letter),extension);
         if(path == NULL)
             etrace("not enough memory (case 4)");
         winx_free(instdir);
@@ -122,6 +130,7 @@ static int save_lua_report(udefrag_job_parameters *jp)
     char *comment;
     char *status;
     int length;
+    wchar_t file_path[MAX_PATH];
     winx_time tm;
 
     char *utf8_path;
@@ -132,7 +141,7 @@ static int save_lua_report(udefrag_job_parameters *jp)
         return (-1);
     }
     
-    path = get_report_path(jp);
+    path = get_report_path(jp,L"fraglist",L"luar");
     if(path == NULL)
         return UDEFRAG_NO_MEM;
     
@@ -218,13 +227,14 @@ static int save_lua_report(udefrag_job_parameters *jp)
         buffer[sizeof(buffer) - 1] = 0;
         (void)winx_fwrite(buffer,1,strlen(buffer),f);
 
-        if(file->path != NULL){
+        length = winx_get_file_path(file,file_path,MAX_PATH);
+        if(length >= 0){
             /* skip \??\ sequence in the beginning of the path */
-            length = (int)wcslen(file->path);
             if(length > 4){
-                convert_to_utf8_path(utf8_path,MAX_UTF8_PATH_LENGTH,file->path + 4);
+                convert_to_utf8_path(utf8_path,MAX_UTF8_PATH_LENGTH,
+                    file_path + 4);
             } else {
-                convert_to_utf8_path(utf8_path,MAX_UTF8_PATH_LENGTH,file->path);
+                convert_to_utf8_path(utf8_path,MAX_UTF8_PATH_LENGTH,file_path);
             }
             (void)winx_fwrite(utf8_path,1,strlen(utf8_path),f);
         }
@@ -301,7 +311,7 @@ void remove_fragmentation_report(udefrag_job_parameters *jp)
     }
     
     /* remove reports from the reports directory */
-    new_path = get_report_path(jp);
+    new_path = get_report_path(jp,L"fraglist",L"luar");
     if(new_path){
         (void)winx_delete_file(new_path);
         winx_path_remove_extension(new_path);
@@ -47,26 +47,16 @@
 winx_volume_region *find_first_free_region(udefrag_job_parameters *jp,
         ULONGLONG min_lcn,ULONGLONG min_length,ULONGLONG *max_length)
 {
-    winx_volume_region *rgn;
+    winx_volume_region *rgn = NULL;
     const ULONGLONG time = winx_xtime();
 
     if(max_length) *max_length = 0;
-    for(rgn = jp->free_regions; rgn; rgn = rgn->next){
-        if(jp->termination_router((void *)jp)) break;
-        if(rgn->lcn >= min_lcn){
-            if(max_length){
-                if(rgn->length > *max_length)
-                    *max_length = rgn->length;
-            }
-            if(rgn->length >= min_length){
-                jp->p_counters.searching_time += winx_xtime() - time;
-                return rgn;
-            }
-        }
-        if(rgn->next == jp->free_regions) break;
+    if(!jp->termination_router((void *)jp)){
+        rgn = winx_find_first_volume_region(jp->free_regions,
+            min_lcn,min_length,max_length);
     }
     jp->p_counters.searching_time += winx_xtime() - time;
-    return NULL;
+    return rgn;
 }
 
 /**
@@ -81,27 +71,16 @@ winx_volume_region *find_first_free_region(udefrag_job_parameters *jp,
 winx_volume_region *find_last_free_region(udefrag_job_parameters *jp,
         ULONGLONG min_lcn,ULONGLONG min_length,ULONGLONG *max_length)
 {
-    winx_volume_region *rgn;
+    winx_volume_region *rgn = NULL;
     const ULONGLONG time = winx_xtime();
 
     if(max_length) *max_length = 0;
-    if(jp->free_regions){
-        for(rgn = jp->free_regions->prev; rgn; rgn = rgn->prev){
-            if(jp->termination_router((void *)jp)) break;
-            if(rgn->lcn < min_lcn) break;
-            if(max_length){
-                if(rgn->length > *max_length)
-                    *max_length = rgn->length;
-            }
-            if(rgn->length >= min_length){
-                jp->p_counters.searching_time += winx_xtime() - time;
-                return rgn;
-            }
-            if(rgn->prev == jp->free_regions->prev) break;
-        }
+    if(!jp->termination_router((void *)jp)){
+        rgn = winx_find_last_volume_region(jp->free_regions,
+            min_lcn,min_length,max_length);
     }
     jp->p_counters.searching_time += winx_xtime() - time;
-    return NULL;
+    return rgn;
 }
 
 #if 0
@@ -157,22 +136,11 @@ winx_volume_region *find_matching_free_region(udefrag_job_parameters *jp,
  */
 winx_volume_region *find_largest_free_region(udefrag_job_parameters *jp)
 {
-    winx_volume_region *rgn, *rgn_largest;
-    ULONGLONG length;
+    winx_volume_region *rgn_largest = NULL;
     const ULONGLONG time = winx_xtime();
     
-    rgn_largest = NULL, length = 0;
-    for(rgn = jp->free_regions; rgn; rgn = rgn->next){
-        if(jp->termination_router((void *)jp)){
-            jp->p_counters.searching_time += winx_xtime() - time;
-            return NULL;
-        }
-        if(rgn->length > length){
-            rgn_largest = rgn;
-            length = rgn->length;
-        }
-        if(rgn->next == jp->free_regions) break;
-    }
+    if(!jp->termination_router((void *)jp))
+        rgn_largest = winx_find_largest_volume_region(jp->free_regions);
     jp->p_counters.searching_time += winx_xtime() - time;
     return rgn_largest;
 }
@@ -181,46 +149,274 @@ winx_volume_region *find_largest_free_region(udefrag_job_parameters *jp)
 /*                    Auxiliary routines                    */
 /************************************************************/
 
+/*
+* All file blocks are kept in a B+ tree sorted by LCN.
+* Each block and each node remember the last epoch in which
+* they have been found to hold nothing suitable for moving,
+* separately for each mode of the search, so find_first_block
+* skips entire subtrees of unmovable or locked data instead of
+* checking all their blocks again and again. Within an epoch
+* files may only turn from movable to unmovable; the epoch has
+* to be advanced when some files may become movable again.
+*/
+#define BLOCKS_PER_NODE 32 /* keeps nodes within a few hundred bytes */
+#define SEARCH_MODES    2  /* with and without SKIP_PARTIALLY_MOVABLE_FILES */
+
 /**
  * @internal
- * @brief An auxiliary structure used to save file blocks in a binary tree.
+ * @brief An auxiliary structure used to save file blocks in the tree.
  */
 struct file_block {
     winx_file_info *file;
     winx_blockmap *block;
+    ULONG skipped[SEARCH_MODES]; /* epoch of finding the block unsuitable */
+};
+
+/**
+ * @internal
+ * @brief A node of the tree of file blocks.
+ * @details Keys of leaves are LCNs of the blocks.
+ * Keys of inner nodes separate their children:
+ * each child holds blocks starting at its key
+ * or after, up to the key of the next child.
+ * The first key of inner nodes is not used.
+ */
+struct file_blocks_node {
+    struct file_blocks_node *parent;
+    int leaf;
+    int n;                       /* number of blocks or children */
+    ULONG skipped[SEARCH_MODES]; /* epoch of finding the subtree unsuitable */
+    ULONGLONG lcn[BLOCKS_PER_NODE];
+    union {
+        struct file_block block[BLOCKS_PER_NODE];
+        struct file_blocks_node *child[BLOCKS_PER_NODE];
+    } u;
+};
+
+/**
+ * @internal
+ * @brief The tree of all file blocks.
+ */
+struct file_blocks_tree {
+    struct file_blocks_node *root;
+    ULONG epoch;
+    struct node_pool pool;  /* reuses nodes released by merges */
 };
 
 /**
  * @internal
- * @brief An auxiliary routine used to sort file blocks in the binary tree.
+ * @brief Allocates an empty node of the tree.
  */
-static int blocks_compare(const void *prb_a, const void *prb_b, void *prb_param)
+static struct file_blocks_node *alloc_node(struct file_blocks_tree *tree,
+        int leaf)
 {
-    struct file_block *a, *b;
+    struct file_blocks_node *node;
     
-    a = (struct file_block *)prb_a;
-    b = (struct file_block *)prb_b;
+    node = node_pool_alloc(&tree->pool,sizeof(struct file_blocks_node));
+    memset(node,0,sizeof(struct file_blocks_node));
+    node->leaf = leaf;
+    return node;
+}
+
+/**
+ * @internal
+ * @brief Returns index of the first key
+ * of a node not less than the specified LCN.
+ */
+static int lower_bound(struct file_blocks_node *node,ULONGLONG lcn)
+{
+    int lo = 0, hi = node->n, mid;
     
-    if(a->block->lcn < b->block->lcn)
-        return (-1);
-    if(a->block->lcn == b->block->lcn)
-        return 0;
-    return 1;
+    while(lo < hi){
+        mid = (lo + hi) / 2;
+        if(node->lcn[mid] < lcn) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/**
+ * @internal
+ * @brief Returns index of the child
+ * of an inner node covering an LCN.
+ */
+static int child_index(struct file_blocks_node *node,ULONGLONG lcn)
+{
+    int lo = 1, hi = node->n, mid;
+
+    /* the first child covers everything below the second key */
+    while(lo < hi){
+        mid = (lo + hi) / 2;
+        if(node->lcn[mid] <= lcn) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo - 1;
+}
+
+/**
+ * @internal
+ * @brief Returns index of a node in its parent.
+ */
+static int node_index(struct file_blocks_node *node)
+{
+    struct file_blocks_node *parent = node->parent;
+    int i;
+
+    for(i = 0; i < parent->n - 1; i++)
+        if(parent->u.child[i] == node) break;
+    return i;
+}
+
+/**
+ * @internal
+ * @brief Searches for the leaf where
+ * a block starting at an LCN belongs to.
+ */
+static struct file_blocks_node *find_leaf(struct file_blocks_tree *tree,
+    ULONGLONG lcn)
+{
+    struct file_blocks_node *node = tree->root;
+
+    while(!node->leaf)
+        node = node->u.child[child_index(node,lcn)];
+    return node;
+}
+
+/**
+ * @internal
+ * @brief Splits a full node in halves.
+ */
+static void split_node(struct file_blocks_tree *tree,
+    struct file_blocks_node *node)
+{
+    struct file_blocks_node *parent, *right;
+    int i, half = node->n / 2;
+
+    parent = node->parent;
+    if(parent == NULL){
+        /* grow the tree up */
+        parent = alloc_node(tree,0);
+        parent->n = 1;
+        parent->lcn[0] = node->lcn[0];
+        parent->u.child[0] = node;
+        node->parent = parent;
+        tree->root = parent;
+    } else if(parent->n == BLOCKS_PER_NODE){
+        split_node(tree,parent);
+        parent = node->parent;
+    }
+
+    right = alloc_node(tree,node->leaf);
+    right->n = node->n - half;
+    memcpy(right->skipped,node->skipped,sizeof(node->skipped));
+    memcpy(right->lcn,node->lcn + half,right->n * sizeof(ULONGLONG));
+    if(node->leaf){
+        memcpy(right->u.block,node->u.block + half,
+            right->n * sizeof(struct file_block));
+    } else {
+        memcpy(right->u.child,node->u.child + half,
+            right->n * sizeof(struct file_blocks_node *));
+        for(i = 0; i < right->n; i++)
+            right->u.child[i]->parent = right;
+    }
+    node->n = half;
+
+    /* link the new node after the split one */
+    i = node_index(node) + 1;
+    memmove(parent->lcn + i + 1,parent->lcn + i,
+        (parent->n - i) * sizeof(ULONGLONG));
+    memmove(parent->u.child + i + 1,parent->u.child + i,
+        (parent->n - i) * sizeof(struct file_blocks_node *));
+    parent->lcn[i] = right->lcn[0];
+    parent->u.child[i] = right;
+    parent->n ++;
+    right->parent = parent;
 }
 
 /**
  * @internal
- * @brief An auxiliary routine used to free memory allocated for the tree items.
+ * @brief Merges a node having lost
+ * some of its items with a neighbour.
  */
-static void free_item (void *prb_item, void *prb_param)
+static void merge_node(struct file_blocks_tree *tree,
+    struct file_blocks_node *node)
 {
-    struct file_block *item = (struct file_block *)prb_item;
-    winx_free(item);
+    struct file_blocks_node *parent, *left, *right, *root;
+    int i, j;
+
+    parent = node->parent;
+    if(parent == NULL){
+        /* shrink the tree */
+        while(!tree->root->leaf && tree->root->n == 1){
+            root = tree->root;
+            tree->root = root->u.child[0];
+            tree->root->parent = NULL;
+            node_pool_free(&tree->pool,root);
+        }
+        if(tree->root->n == 0) tree->root->leaf = 1;
+        return;
+    }
+
+    if(node->n >= BLOCKS_PER_NODE / 4) return;
+    i = node_index(node);
+    if(parent->n == 1){
+        if(node->n == 0){
+            node_pool_free(&tree->pool,node);
+            parent->n = 0;
+            merge_node(tree,parent);
+        }
+        return;
+    }
+    j = (i > 0) ? i : i + 1;
+    left = parent->u.child[j - 1];
+    right = parent->u.child[j];
+    if(left->n + right->n > BLOCKS_PER_NODE) return;
+
+    /* move all items of the right node to the left one */
+    memcpy(left->lcn + left->n,right->lcn,right->n * sizeof(ULONGLONG));
+    if(left->leaf){
+        memcpy(left->u.block + left->n,right->u.block,
+            right->n * sizeof(struct file_block));
+    } else {
+        memcpy(left->u.child + left->n,right->u.child,
+            right->n * sizeof(struct file_blocks_node *));
+        for(i = 0; i < right->n; i++)
+            right->u.child[i]->parent = left;
+    }
+    left->n += right->n;
+    for(i = 0; i < SEARCH_MODES; i++){
+        if(left->skipped[i] != right->skipped[i])
+            left->skipped[i] = 0;
+    }
+    node_pool_free(&tree->pool,right);
+
+    memmove(parent->lcn + j,parent->lcn + j + 1,
+        (parent->n - j - 1) * sizeof(ULONGLONG));
+    memmove(parent->u.child + j,parent->u.child + j + 1,
+        (parent->n - j - 1) * sizeof(struct file_blocks_node *));
+    parent->n --;
+    merge_node(tree,parent);
+}
+
+/**
+ * @internal
+ * @brief Frees memory allocated for a subtree.
+ */
+static void destroy_node(struct file_blocks_tree *tree,
+        struct file_blocks_node *node)
+{
+    int i;
+
+    if(!node->leaf){
+        for(i = 0; i < node->n; i++)
+            destroy_node(tree,node->u.child[i]);
+    }
+    node_pool_free(&tree->pool,node);
 }
 
 /**
  * @internal
- * @brief Creates and initializes a binary
+ * @brief Creates and initializes a
  * tree to store all the file blocks into.
  * @return Zero for success, negative value otherwise.
  * @note jp->file_blocks must be initialized by NULL
@@ -230,48 +426,69 @@ int create_file_blocks_tree(udefrag_job_parameters *jp)
 {
     itrace("create_file_blocks_tree called");
     if(jp->file_blocks) destroy_file_blocks_tree(jp);
-    jp->file_blocks = prb_create(blocks_compare,NULL,NULL);
+    jp->file_blocks = winx_malloc(sizeof(struct file_blocks_tree));
+    create_node_pool(&jp->file_blocks->pool,NULL,
+        sizeof(struct file_blocks_node));
+    jp->file_blocks->root = alloc_node(jp->file_blocks,1);
+    jp->file_blocks->epoch = 1;
     return 0;
 }
 
 /**
  * @internal
- * @brief Adds a file block to the binary tree.
+ * @brief Adds a file block to the tree.
  * @return Zero for success, negative value otherwise.
- * @note Destroys the tree in case of errors.
  */
 int add_block_to_file_blocks_tree(udefrag_job_parameters *jp, winx_file_info *file, winx_blockmap *block)
 {
+    struct file_blocks_node *leaf, *node;
     struct file_block *fb;
-	void **p;
+    int i;
 
-	if(file == NULL || block == NULL)
+    if(file == NULL || block == NULL)
         return (-1);
     
     if(jp->file_blocks == NULL)
         return (-1);
 
-    fb = (struct file_block *)winx_malloc(sizeof *fb);
-    fb->file = file;
-    fb->block = block;
-    p = prb_probe(jp->file_blocks,(void *)fb);
-    /* if a duplicate item exists... */
-    if(p && *p != fb){
+    leaf = find_leaf(jp->file_blocks,block->lcn);
+    i = lower_bound(leaf,block->lcn);
+    if(i < leaf->n && leaf->lcn[i] == block->lcn){
         etrace("a duplicate found");
-        winx_free(fb);
+        return 0;
     }
+    if(leaf->n == BLOCKS_PER_NODE){
+        split_node(jp->file_blocks,leaf);
+        leaf = find_leaf(jp->file_blocks,block->lcn);
+        i = lower_bound(leaf,block->lcn);
+    }
+
+    memmove(leaf->lcn + i + 1,leaf->lcn + i,
+        (leaf->n - i) * sizeof(ULONGLONG));
+    memmove(leaf->u.block + i + 1,leaf->u.block + i,
+        (leaf->n - i) * sizeof(struct file_block));
+    leaf->lcn[i] = block->lcn;
+    fb = &leaf->u.block[i];
+    fb->file = file;
+    fb->block = block;
+    memset(fb->skipped,0,sizeof(fb->skipped));
+    leaf->n ++;
+
+    /* the subtree may hold a suitable block now */
+    for(node = leaf; node; node = node->parent)
+        memset(node->skipped,0,sizeof(node->skipped));
     return 0;
 }
 
 /**
  * @internal
- * @brief Removes a file block from the binary tree.
+ * @brief Removes a file block from the tree.
  * @return Zero for success, negative value otherwise.
  */
 int remove_block_from_file_blocks_tree(udefrag_job_parameters *jp, winx_blockmap *block)
 {
-    struct file_block *fb;
-    struct file_block b;
+    struct file_blocks_node *leaf;
+    int i;
     
     if(block == NULL)
         return (-1);
@@ -279,10 +496,9 @@ int remove_block_from_file_blocks_tree(udefrag_job_parameters *jp, winx_blockmap
     if(jp->file_blocks == NULL)
         return (-1);
 
-    b.file = NULL;
-    b.block = block;
-    fb = (struct file_block*)prb_delete(jp->file_blocks,&b);
-    if(fb == NULL){
+    leaf = find_leaf(jp->file_blocks,block->lcn);
+    i = lower_bound(leaf,block->lcn);
+    if(i == leaf->n || leaf->lcn[i] != block->lcn){
         /* the following debugging output indicates either
            a bug, or file system inconsistency */
         etrace("failed for %p: VCN = %I64u, LCN = %I64u, LEN = %I64u",
@@ -290,19 +506,43 @@ int remove_block_from_file_blocks_tree(udefrag_job_parameters *jp, winx_blockmap
         /* if block does not exist in the tree, we have nothing to cleanup */
         return 0;
     }
-    winx_free(fb);
+
+    memmove(leaf->lcn + i,leaf->lcn + i + 1,
+        (leaf->n - i - 1) * sizeof(ULONGLONG));
+    memmove(leaf->u.block + i,leaf->u.block + i + 1,
+        (leaf->n - i - 1) * sizeof(struct file_block));
+    leaf->n --;
+    merge_node(jp->file_blocks,leaf);
     return 0;
 }
 
 /**
  * @internal
- * @brief Destroys the binary tree containing all the file blocks.
+ * @brief Forgets which blocks have been found
+ * unsuitable for moving. Must be called when
+ * flags preventing files from being moved get
+ * cleared.
+ */
+void reset_file_blocks_summary(udefrag_job_parameters *jp)
+{
+    if(jp->file_blocks){
+        jp->file_blocks->epoch ++;
+        if(jp->file_blocks->epoch == 0)
+            jp->file_blocks->epoch ++;
+    }
+}
+
+/**
+ * @internal
+ * @brief Destroys the tree containing all the file blocks.
  */
 void destroy_file_blocks_tree(udefrag_job_parameters *jp)
 {
     itrace("Cleanup: destroying binary trees for all file blocks");
     if(jp->file_blocks){
-        prb_destroy(jp->file_blocks,free_item);
+        destroy_node(jp->file_blocks,jp->file_blocks->root);
+        destroy_node_pool(&jp->file_blocks->pool);
+        winx_free(jp->file_blocks);
         jp->file_blocks = NULL;
     }
 }
@@ -311,6 +551,51 @@ void destroy_file_blocks_tree(udefrag_job_parameters *jp)
 /*                  File blocks searching                   */
 /************************************************************/
 
+/**
+ * @internal
+ * @brief Defines whether a file block
+ * is suitable for find_first_block or not.
+ */
+static int is_block_suitable(udefrag_job_parameters *jp,
+    struct file_block *fb,int flags)
+{
+    int movable_file;
+
+    if(flags & SKIP_PARTIALLY_MOVABLE_FILES){
+        movable_file = can_move_entirely(fb->file, jp->fs_type);
+    } else {
+        movable_file = can_move(fb->file, jp->fs_type);
+    }
+    if(!movable_file || is_file_locked(fb->file,jp))
+        return 0;
+
+    /* skip first fragments of FAT directories */
+    if(jp->is_fat && is_directory(fb->file) \
+      && fb->block == fb->file->disp.blockmap)
+        return 0;
+    return 1;
+}
+
+/**
+ * @internal
+ * @brief Remembers that a node holds no suitable
+ * blocks when all its items have been found unsuitable.
+ */
+static void check_skipped_node(struct file_blocks_node *node,
+    int mode,ULONG epoch)
+{
+    int i;
+
+    for(i = 0; i < node->n; i++){
+        if(node->leaf){
+            if(node->u.block[i].skipped[mode] != epoch) return;
+        } else {
+            if(node->u.child[i]->skipped[mode] != epoch) return;
+        }
+    }
+    node->skipped[mode] = epoch;
+}
+
 /**
  * @internal
  * @brief Searches for the first movable file block.
@@ -328,62 +613,54 @@ void destroy_file_blocks_tree(udefrag_job_parameters *jp)
 winx_blockmap *find_first_block(udefrag_job_parameters *jp,
     ULONGLONG *min_lcn, int flags, winx_file_info **first_file)
 {
-    winx_file_info *found_file;
-    winx_blockmap *first_block;
-    winx_blockmap b;
-    struct file_block fb, *item;
-    struct prb_traverser t;
-    int movable_file;
+    struct file_blocks_node *node;
+    struct file_block *fb;
+    int i, mode;
+    ULONG epoch;
     const ULONGLONG tm = winx_xtime();
     
     if(min_lcn == NULL || first_file == NULL)
         return NULL;
     
-    found_file = NULL; first_block = NULL;
-    b.lcn = *min_lcn; fb.block = &b;
-    prb_t_init(&t,jp->file_blocks);
-    item = (struct file_block *)prb_t_insert(&t,jp->file_blocks,&fb);
-    if(item == &fb){
-        /* block at min_lcn not found */
-        item = (struct file_block *)prb_t_next(&t);
-        if(prb_delete(jp->file_blocks,&fb) == NULL){
-            etrace("cannot remove block from the tree");
-            winx_flush_dbg_log(0); /* 'cause the error is critical */
-        }
-    }
-    if(item){
-        found_file = item->file;
-        first_block = item->block;
-    }
+    *first_file = NULL;
+    if(jp->file_blocks == NULL)
+        return NULL;
+
+    mode = (flags & SKIP_PARTIALLY_MOVABLE_FILES) ? 1 : 0;
+    epoch = jp->file_blocks->epoch;
+    node = find_leaf(jp->file_blocks,*min_lcn);
+    i = lower_bound(node,*min_lcn);
     while(!jp->termination_router((void *)jp)){
-        if(found_file == NULL) break;
-        if(flags & SKIP_PARTIALLY_MOVABLE_FILES){
-            movable_file = can_move_entirely(found_file, jp->fs_type);
-        } else {
-            movable_file = can_move(found_file, jp->fs_type);
-        }
-        if(is_file_locked(found_file,jp)) movable_file = 0;
-        if(movable_file){
-            if(jp->is_fat && is_directory(found_file) && first_block == found_file->disp.blockmap){
-                /* skip first fragments of FAT directories */
+        if(i == node->n){
+            /* the node is over, go up */
+            check_skipped_node(node,mode,epoch);
+            if(node->parent == NULL) break;
+            i = node_index(node) + 1;
+            node = node->parent;
+        } else if(!node->leaf){
+            /* go down unless the subtree holds nothing suitable */
+            if(node->u.child[i]->skipped[mode] == epoch){
+                i ++;
             } else {
-                /* desired block found */
-                *min_lcn = first_block->lcn + 1; /* the current block will be skipped later anyway in this case */
-                *first_file = found_file;
-                jp->p_counters.searching_time += winx_xtime() - tm;
-                return first_block;
+                node = node->u.child[i];
+                i = 0;
+            }
+        } else {
+            fb = &node->u.block[i];
+            if(fb->skipped[mode] != epoch){
+                if(is_block_suitable(jp,fb,flags)){
+                    /* desired block found */
+                    /* the current block will be skipped later anyway */
+                    *min_lcn = fb->block->lcn + 1;
+                    *first_file = fb->file;
+                    jp->p_counters.searching_time += winx_xtime() - tm;
+                    return fb->block;
+                }
+                fb->skipped[mode] = epoch;
             }
+            i ++;
         }
-        
-        /* skip the current block */
-        *min_lcn = *min_lcn + 1;
-        /* and go to the next one */
-        item = (struct file_block *)prb_t_next(&t);
-        if(item == NULL) break;
-        found_file = item->file;
-        first_block = item->block;
     }
-    *first_file = NULL;
     jp->p_counters.searching_time += winx_xtime() - tm;
     return NULL;
 }
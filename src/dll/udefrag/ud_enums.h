@@ -28,7 +28,8 @@ typedef enum {
     QUICK_OPTIMIZATION_JOB,
     MFT_OPTIMIZATION_JOB,
     SINGLE_FILE_MOVE_FRONT_JOB,
-    SINGLE_FILE_MOVE_END_JOB
+    SINGLE_FILE_MOVE_END_JOB,
+    ZONED_OPTIMIZATION_JOB
 } udefrag_job_type;
 
 typedef enum {
@@ -30,6 +30,17 @@
 /************************************************************/
 #define DEFAULT_REFRESH_INTERVAL 100
 
+/*
+* Desired duration of a single FSCTL_MOVE_FILE call, in milliseconds,
+* and default bounds of the amount of data moved by it at once.
+*/
+#define DEFAULT_MOVE_TARGET_LATENCY 200
+#define DEFAULT_MOVE_MIN_SIZE       (64 * 1024)
+#define DEFAULT_MOVE_MAX_SIZE       (256 * 1024 * 1024)
+
+/* maximum number of files moved concurrently */
+#define MAX_MOVE_QUEUE_DEPTH 64
+
 /* fragment size threshold for partial defragmentation */
 #define PART_DEFRAG_MAGIC_CONSTANT  (20 * 1024 * 1024)
 
@@ -40,6 +51,15 @@
 #define OPTIMIZER_MAGIC_CONSTANT_N  10
 #define OPTIMIZER_MAGIC_CONSTANT_M  1
 
+/*
+* Default zones of the zoned optimization: ages of
+* files are in days, sizes in percents of the disk.
+*/
+#define DEFAULT_HOT_ZONE_AGE   30
+#define DEFAULT_COLD_ZONE_AGE  180
+#define DEFAULT_HOT_ZONE_SIZE  25
+#define DEFAULT_COLD_ZONE_SIZE 50
+
 #define DEFAULT_FRAGMENT_SIZE_THRESHOLD (MAX_FILE_SIZE / 2)
 /************************************************************/
 /*                Prototypes, constants etc.                */
@@ -131,6 +151,8 @@
 #define UD_SORT_BY_MODIFICATION_TIME  0x8
 #define UD_SORT_BY_ACCESS_TIME        0x10
 #define UD_SORT_DESCENDING            0x20
+#define UD_SORT_BY_DIRECTORY_TREE     0x40
+#define UD_SORT_BREADTH_FIRST         0x80 /* for the directory tree order */
 
 #define TINY_FILE_SIZE            0 * 1024  /* < 10 KB */
 #define SMALL_FILE_SIZE          10 * 1024  /* 10 - 100 KB */
@@ -37,6 +37,14 @@ typedef struct {
     ULONGLONG bytes_per_cluster;
 } volume_info;
 
+/*
+* A range of cells of the cluster map.
+*/
+typedef struct {
+    int first;                        /* index of the first cell */
+    int count;                        /* number of cells */
+} udefrag_map_range;
+
 typedef struct {
     unsigned long files;              /* number of files */
     unsigned long directories;        /* number of directories */
@@ -59,10 +67,16 @@ typedef struct {
     int completion_status;            /* zero for running jobs, positive value for succeeded, negative for failed */
     char *cluster_map;                /* the cluster map */
     int cluster_map_size;             /* size of the cluster map, (the number of cells.) */
+    int cluster_map_levels;           /* number of coarser levels following
+                                      the map, see udefrag_get_map_level */
     ULONGLONG moved_clusters;         /* number of moved clusters */
     ULONGLONG total_moves;            /* number of moves by move_files_to_front/back functions */
     int isfragfileslist;             /* Bool to prove that the fragmented files list has been filled by Analyze.c */
     struct prb_table *fragmented_files_prb; /* list of fragmented files; does not contain filtered out files */
+    udefrag_map_range *map_changes;   /* cells of the map changed since the
+                                      previous progress update; NULL means
+                                      that the entire map has to be redrawn */
+    int map_changes_count;            /* number of entries in map_changes */
 } udefrag_progress_info;
 
 typedef struct {
@@ -77,10 +91,24 @@ typedef struct {
     ULONGLONG time_limit;       /* processing time limit, in seconds */
     int refresh_interval;       /* progress refresh interval, in milliseconds */
     int disable_reports;        /* nonzero value disables generation of the file fragmentation reports */
+    int disable_move_planning;  /* nonzero forces greedy defragmentation */
+    int incremental_optimization; /* repair saved layout in quick mode */
     int dbgprint_level;         /* controls amount of debugging output */
     int dry_run;                /* set %UD_DRY_RUN% variable to avoid actual data moving in tests */
+    ULONGLONG mft_buffer_size;  /* MFT chunk size, zero selects the default */
+    int mft_queue_depth;        /* MFT chunks in memory, zero for the default */
+    int move_target_latency;    /* target move time, ms; zero = fixed */
+    ULONGLONG move_min_size;    /* min data moved at once, zero = default */
+    ULONGLONG move_max_size;    /* max data moved at once, zero = default */
+    int move_queue_depth;       /* files moved at once, <= 1 = sequential */
+    int simulated_move_latency; /* move time in dry run, ms */
     int job_flags;              /* flags triggering algorithm features */
     int sorting_flags;          /* flags triggering file sorting features (UD_SORT_xxx flags) */
+    int hot_zone_age;           /* days since access for the hot zone */
+    int cold_zone_age;          /* days since access for the cold zone */
+    int hot_zone_size;          /* hot zone size, in percents */
+    int cold_zone_size;         /* cold zone size, in percents */
+    wchar_t layout_order_file[MAX_PATH + 1]; /* files placed first */
     int algorithm_defined_fst;  /* nonzero value indicates that the fragment size threshold
                                 is set by the algorithm and not by the user */
     double fragmentation_threshold; /* fragmentation level threshold */
@@ -103,11 +131,42 @@ typedef struct {
 } fs_type_struct;
 
 /*
-* More info at http://www.thescripts.com/forum/thread617704.html
-* ('Dynamically-allocated Multi-dimensional Arrays - C').
+* Most cells of the cluster map contain clusters
+* of one or two colors only, so each cell counts
+* clusters of two colors at most. Cells containing
+* more colors get full sets of counters allocated
+* separately; the first counter of such a cell
+* holds index of its set then.
+*/
+#define CMAP_CELL_SLOTS 2
+
+typedef struct {
+    ULONG count[CMAP_CELL_SLOTS];  /* number of clusters of each color */
+    UCHAR color[CMAP_CELL_SLOTS];  /* colors counted by the cell */
+    UCHAR dominant;                /* color the cell is drawn in */
+    UCHAR extended;                /* nonzero if a set of counters is used */
+} cmap_cell;
+
+/*
+* Coarser levels of the cluster map make a pyramid:
+* each node of level k covers 2^k cells and counts
+* cells of each color there, the same way as cells
+* count clusters.
 */
+#define CMAP_MAX_LEVELS 32
+
 typedef struct {
-    ULONGLONG(*array)[18];
+    cmap_cell *cells;
+    ULONG *counters;      /* full sets of counters, n_colors each */
+    ULONG n_counters;     /* number of sets in use */
+    ULONG max_counters;   /* number of sets allocated */
+    ULONG *dirty_cells;   /* cells whose color changed since the refill */
+    LONG all_dirty;       /* nonzero if the entire map needs to be refilled */
+    udefrag_map_range *changes; /* changed cells delivered to the caller */
+    cmap_cell *nodes;     /* all levels of the pyramid, starting from level 1 */
+    int n_levels;         /* number of levels above the cells */
+    int level_offset[CMAP_MAX_LEVELS]; /* offset of each level in the map */
+    int level_size[CMAP_MAX_LEVELS];   /* number of nodes in each level */
     ULONGLONG field_size;
     int map_size;
     int n_colors;
@@ -123,9 +182,117 @@ struct performance_counters {
     ULONGLONG analysis_time;              /* time spent for volume analysis */
     ULONGLONG searching_time;             /* time spent for searching */
     ULONGLONG moving_time;                /* time spent for file moves */
+    ULONGLONG verification_time;          /* time spent to verify moves */
     ULONGLONG temp_space_releasing_time;  /* time spent to release space temporarily allocated by system */
 };
 
+struct defrag_counters {
+    ULONGLONG planned_clusters;     /* clusters planned to be moved entirely */
+    ULONGLONG moved_clusters;       /* clusters moved in all the passes */
+    unsigned long passes;           /* number of defragmentation passes */
+};
+
+struct file_fragment {
+    ULONGLONG vcn;
+    ULONGLONG lcn;
+    ULONGLONG length;
+};
+
+/*
+* Fragments of a single file sorted by VCN, along with
+* prefix sums of their lengths: offsets[i] is the number
+* of clusters in fragments preceding the i-th one.
+* The index is kept until a move changes the file.
+*/
+struct fragment_index {
+    winx_file_info *f;                  /* the file indexed, NULL if none */
+    struct file_fragment *fragments;    /* array of fragments */
+    ULONGLONG *offsets;                 /* n_fragments + 1 prefix sums */
+    ULONGLONG n_fragments;              /* number of fragments */
+    ULONGLONG allocated;                /* fragments the arrays can hold */
+    ULONGLONG builds;                   /* times the index has been built */
+    ULONGLONG reuses;                   /* number of times it has been reused */
+};
+
+/*
+* Statistics of the amount of data moved by a single
+* FSCTL_MOVE_FILE call; the amount gets adjusted
+* towards the target latency of the call.
+*/
+struct move_chunk_stats {
+    ULONGLONG min_clusters;     /* lower bound of the chunk size */
+    ULONGLONG max_clusters;     /* upper bound of the chunk size */
+    ULONGLONG smallest;         /* smallest chunk size chosen */
+    ULONGLONG largest;          /* largest chunk size chosen */
+    ULONGLONG adjustments;      /* number of chunk size changes */
+    ULONGLONG calls;            /* number of move calls */
+    ULONGLONG clusters;         /* number of clusters moved by them */
+    ULONGLONG time;             /* time spent in them, in milliseconds */
+};
+
+/*
+* Routine receiving the result of a move issued
+* through the queue of moves: zero for success,
+* positive value when there was nothing to move,
+* negative value otherwise, as well as
+* the number of clusters actually moved.
+*/
+typedef void (*move_completion_routine)(winx_file_info *f,
+    int result,ULONGLONG moved_clusters,void *user_defined_data);
+
+/*
+* A move of a file issued along with moves of other files.
+* Its data moves chunk by chunk, while chunks of the other
+* files are being moved as well.
+*/
+struct move_request {
+    winx_file_info *f;          /* file being moved, NULL for free slots */
+    HANDLE hFile;               /* handle of the file */
+    ULONGLONG vcn;              /* the first cluster to be moved */
+    ULONGLONG length;           /* number of clusters to be moved */
+    ULONGLONG target;           /* target region, reserved till the end */
+    ULONGLONG next_vcn;         /* the first cluster not moved yet */
+    ULONGLONG next_target;      /* its destination */
+    ULONGLONG remaining;        /* number of clusters not moved yet */
+    ULONGLONG chunk;            /* clusters moved by the pending call */
+    ULONGLONG moved_clusters;   /* clusters moved by completed calls */
+    ULONGLONG issue_time;       /* time of the pending call, in milliseconds */
+    int pending;                /* nonzero while a call is in progress */
+    int shared;                 /* nonzero if other calls overlapped it */
+    int failed;                 /* nonzero if a call has failed */
+    int old_color;              /* file properties saved before the move */
+    int was_fragmented;         /**/
+    int was_excluded;           /**/
+    HANDLE hEvent;              /* signaled when the call completes */
+    IO_STATUS_BLOCK iosb;       /* status of the call */
+    MOVEFILE_DESCRIPTOR mfd;    /* parameters of the call */
+    move_completion_routine cb; /* routine receiving the result of the move */
+    void *p;                    /* data passed to it */
+};
+
+struct move_queue {
+    HANDLE hVolume;                 /* volume opened for async moves */
+    struct move_request *requests;  /* slots of the queue */
+    int depth;                      /* number of slots, zero if sequential */
+    int n_requests;                 /* number of busy slots */
+    int next;                       /* the slot to be serviced next */
+    int max_requests;               /* max moves in progress at once */
+    ULONGLONG moves;                /* moves issued through the queue */
+};
+
+/*
+* Pool of nodes of a tree. Nodes get allocated from an
+* arena, either shared with the data they point to or
+* owned by the pool, while removed nodes get reused.
+* Serves as libavl_allocator for prb trees as well.
+*/
+struct node_pool {
+    struct libavl_allocator allocator;    /* must be the first member */
+    winx_arena *arena;                    /* arena holding the nodes */
+    int own_arena;                        /* nonzero if the pool owns it */
+    size_t node_size;                     /* the smallest block handed out */
+    void *free_nodes;                     /* removed nodes to be reused */
+};
 
 struct file_counters {
     unsigned long tiny_files;
@@ -73,13 +73,18 @@ typedef struct _udefrag_job_parameters {
     int is_ntfs;                                /* quick indicate that it is NTFS: */
     winx_file_info *filelist;                   /* list of files */
     struct prb_table *fragmented_files;         /* list of fragmented files; does not contain filtered out files */
+    struct node_pool ffa;                       /* nodes of fragmented_files */
     winx_volume_region *free_regions;           /* list of free space regions */
     unsigned long free_regions_count;           /* number of free space regions */
     ULONGLONG clusters_at_once;                 /* number of clusters to be moved at once */
+    struct move_chunk_stats m_stats;            /* adaptive move sizing stats */
+    struct move_queue mq;                       /* concurrent moves of files */
     cmap cluster_map;                           /* cluster map's internal data */
     WINX_FILE *fVolume;                         /* handle of the volume, intended for use by file moving routines */
     struct performance_counters p_counters;     /* performance counters */
-    struct prb_table *file_blocks;              /* pointer to the binary tree of all file blocks found on the volume */
+    struct defrag_counters d_counters;          /* move planning results */
+    struct fragment_index f_index;              /* fragments of the last file */
+    struct file_blocks_tree *file_blocks;       /* tree of all file blocks */
     struct file_counters f_counters;            /* file counters */
     NTSTATUS last_move_status;                  /* status of the last move file operation; zero by default */
     ULONGLONG already_optimized_clusters;       /* number of clusters needing no sorting in optimization */
@@ -93,6 +98,8 @@ typedef struct _udefrag_job_parameters {
 int get_options(udefrag_job_parameters *jp);
 void release_options(udefrag_job_parameters *jp);
 
+wchar_t *get_report_path(udefrag_job_parameters *jp,
+    wchar_t *name,wchar_t *extension);
 int save_fragmentation_report(udefrag_job_parameters *jp);
 void remove_fragmentation_report(udefrag_job_parameters *jp);
 
@@ -101,11 +108,13 @@ void dbg_print_file_counters(udefrag_job_parameters *jp);
 int allocate_map(int map_size,udefrag_job_parameters *jp);
 void free_map(udefrag_job_parameters *jp);
 void reset_cluster_map(udefrag_job_parameters *jp);
+udefrag_map_range *refill_cluster_map(udefrag_job_parameters *jp,int *count);
 void colorize_map_region(udefrag_job_parameters *jp,
         ULONGLONG lcn, ULONGLONG length, int new_color, int old_color);
 void colorize_file(udefrag_job_parameters *jp, winx_file_info *f, int old_color);
 int get_file_color(udefrag_job_parameters *jp, winx_file_info *f);
 void release_temp_space_regions(udefrag_job_parameters *jp);
+void dbg_print_move_statistics(udefrag_job_parameters *jp);
 //void redraw_all_temporary_system_space_as_free(udefrag_job_parameters *jp);
 
 int analyze(udefrag_job_parameters *jp);
@@ -120,6 +129,11 @@ ULONGLONG start_timing(char *operation_name,udefrag_job_parameters *jp);
 ULONGLONG stop_timing(char *operation_name,ULONGLONG start_time,udefrag_job_parameters *jp);
 void dbg_print_performance_counters(udefrag_job_parameters *jp);
 void dbg_print_footer(udefrag_job_parameters *jp);
+void create_node_pool(struct node_pool *pool,winx_arena *arena,
+        size_t node_size);
+void *node_pool_alloc(struct node_pool *pool,size_t size);
+void node_pool_free(struct node_pool *pool,void *block);
+void destroy_node_pool(struct node_pool *pool);
 
 int check_region(udefrag_job_parameters *jp,ULONGLONG lcn,ULONGLONG length);
 
@@ -129,10 +143,18 @@ int is_mft(winx_file_info *f, fs_type_enum fs_type);    //genBTC
 int exclude_by_fragment_size(winx_file_info *f,udefrag_job_parameters *jp);
 int exclude_by_fragments(winx_file_info *f,udefrag_job_parameters *jp);
 int exclude_by_size(winx_file_info *f,udefrag_job_parameters *jp);
+wchar_t *get_full_file_path(winx_file_info *f,wchar_t *buffer);
+void release_full_file_path(wchar_t *path,wchar_t *buffer);
+int compare_file_paths(winx_file_info *a,winx_file_info *b);
 int expand_fragmented_files_list(winx_file_info *f,udefrag_job_parameters *jp);
 void truncate_fragmented_files_list(winx_file_info *f,udefrag_job_parameters *jp);
 winx_blockmap* build_fragments_list(winx_file_info *f,ULONGLONG *n_fragments);
 void release_fragments_list(winx_blockmap **fragments);
+struct fragment_index *get_fragment_index(winx_file_info *f,
+    udefrag_job_parameters *jp);
+ULONGLONG find_fragment(struct fragment_index *fi,ULONGLONG vcn);
+void invalidate_fragment_index(winx_file_info *f,udefrag_job_parameters *jp);
+void destroy_fragment_index(udefrag_job_parameters *jp);
 void clear_currently_excluded_flag(udefrag_job_parameters *jp);
 
 winx_volume_region *find_first_free_region(udefrag_job_parameters *jp,
@@ -147,6 +169,7 @@ winx_volume_region *find_largest_free_region(udefrag_job_parameters *jp);
 int create_file_blocks_tree(udefrag_job_parameters *jp);
 int add_block_to_file_blocks_tree(udefrag_job_parameters *jp, winx_file_info *file, winx_blockmap *block);
 int remove_block_from_file_blocks_tree(udefrag_job_parameters *jp, winx_blockmap *block);
+void reset_file_blocks_summary(udefrag_job_parameters *jp);
 void destroy_file_blocks_tree(udefrag_job_parameters *jp);
 winx_blockmap *find_first_block(udefrag_job_parameters *jp,
     ULONGLONG *min_lcn, int flags, winx_file_info **first_file);
@@ -169,6 +192,18 @@ int move_file(winx_file_info *f,
     ULONGLONG target,
     udefrag_job_parameters *jp
 );
+int init_move_queue(udefrag_job_parameters *jp);
+int move_file_async(winx_file_info *f,
+    ULONGLONG vcn,
+    ULONGLONG length,
+    ULONGLONG target,
+    move_completion_routine cb,
+    void *user_defined_data,
+    udefrag_job_parameters *jp
+);
+ULONGLONG get_lowest_pending_target(udefrag_job_parameters *jp);
+void complete_moves(udefrag_job_parameters *jp);
+void destroy_move_queue(udefrag_job_parameters *jp);
 int can_move(winx_file_info *f, fs_type_enum fstype);   //genBTC
 int can_move_entirely(winx_file_info *f, fs_type_enum fstype);
 
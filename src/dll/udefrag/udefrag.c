@@ -123,10 +123,7 @@ void udefrag_unload_library(void)
 void deliver_progress_info(udefrag_job_parameters *jp,int completion_status)
 {
     udefrag_progress_info pi;
-    int i, k, index, p1, p2;
-    int mft_zone_detected;
-    int free_cell_detected;
-    ULONGLONG maximum, n;
+    int p1, p2;
     
     if(jp->cb == NULL)
         return;
@@ -153,43 +150,12 @@ void deliver_progress_info(udefrag_job_parameters *jp,int completion_status)
     /* calculate fragmentation percentage #2 (bad clusters / used clusters) */
     pi.fragmentation = calc_percentage(jp->pi.bad_clusters,jp->pi.used_clusters);
     
-    /* refill cluster map */
-    if(jp->pi.cluster_map && jp->cluster_map.array \
+    /* refill cluster map, copy cells changed since the previous update */
+    pi.map_changes = NULL;
+    pi.map_changes_count = 0;
+    if(jp->pi.cluster_map && jp->cluster_map.cells \
       && jp->pi.cluster_map_size == jp->cluster_map.map_size){
-        for(i = 0; i < jp->cluster_map.map_size; i++){
-            /* check for mft zone to apply special rules there */
-            mft_zone_detected = free_cell_detected = 0;
-            maximum = 1; /* for jp->cluster_map.opposite_order */
-            if(!jp->cluster_map.opposite_order){
-                if(i == jp->cluster_map.map_size - jp->cluster_map.unused_cells - 1)
-                    maximum = jp->cluster_map.clusters_per_last_cell;
-                else
-                    maximum = jp->cluster_map.clusters_per_cell;
-            }
-            if(jp->cluster_map.array[i][MFT_ZONE_SPACE] >= maximum)
-                mft_zone_detected = 1;
-            if(jp->cluster_map.array[i][FREE_SPACE] >= maximum)
-                free_cell_detected = 1;
-            if(mft_zone_detected && free_cell_detected){
-                jp->pi.cluster_map[i] = MFT_ZONE_SPACE;
-            } else {
-                maximum = jp->cluster_map.array[i][0];
-                index = 0;
-                for(k = 1; k < jp->cluster_map.n_colors; k++){
-                    n = jp->cluster_map.array[i][k];
-                    if(n >= maximum){ /* support of colors precedence  */
-                        if((k != MFT_ZONE_SPACE && k != FREE_SPACE) || !mft_zone_detected){
-                            maximum = n;
-                            index = k;
-                        }
-                    }
-                }
-                if(maximum == 0)
-                    jp->pi.cluster_map[i] = DEFAULT_COLOR;
-                else
-                    jp->pi.cluster_map[i] = (char)index;
-            }
-        }
+        pi.map_changes = refill_cluster_map(jp,&pi.map_changes_count);
     }
     
     /* deliver information to the caller */
@@ -265,6 +231,8 @@ static DWORD WINAPI start_job(LPVOID p)
     else if(jp->job_type == MFT_OPTIMIZATION_JOB) action = "MFT optimization";
     else if(jp->job_type == SINGLE_FILE_MOVE_FRONT_JOB) action = "Single File Move to Front";
     else if(jp->job_type == SINGLE_FILE_MOVE_END_JOB) action = "Single File Move to End";
+    else if(jp->job_type == ZONED_OPTIMIZATION_JOB)
+        action = "Zoned optimization";
     else action = "Analysis";
 
     winx_dbg_print_header(0,0,I"%s of disk %c: started",action,jp->volume_letter);
@@ -285,6 +253,7 @@ static DWORD WINAPI start_job(LPVOID p)
         break;
     case FULL_OPTIMIZATION_JOB:
     case QUICK_OPTIMIZATION_JOB:
+    case ZONED_OPTIMIZATION_JOB:
         result = optimize(jp);
         break;
     case MFT_OPTIMIZATION_JOB:
@@ -329,7 +298,11 @@ void destroy_lists(udefrag_job_parameters *jp)
         //dtrace("Destroying PRB jp->fragmented_files for Drive: %c...",jp->volume_letter);
         prb_destroy(jp->fragmented_files, NULL);
         jp->fragmented_files = NULL;
+        /* the nodes go away along with the list of files */
+        destroy_node_pool(&jp->ffa);
     }
+    /* the index refers to a file of the list */
+    destroy_fragment_index(jp);
     if (jp->filelist) {
         //dtrace("Releasing jp->filelist...");
         winx_ftw_release(jp->filelist);
@@ -808,6 +781,7 @@ int movefile_to_start_or_end(udefrag_job_parameters *jp,int start_or_end)
     winx_volume_region *region;
     winx_file_info *file;
     wchar_t *path, *native_path;
+    wchar_t file_path[MAX_PATH];
     winx_file_disposition oldfiledisp;
     winx_blockmap *block;
 
@@ -846,7 +820,8 @@ int movefile_to_start_or_end(udefrag_job_parameters *jp,int start_or_end)
             goto cleanup;
         /* iterate through the filelist (no other way) */
         for(file = jp->filelist; file; file = file->next){
-            if(_wcsicmp(file->path,native_path) == 0) break;
+            (void)winx_get_file_path(file,file_path,MAX_PATH);
+            if(_wcsicmp(file_path,native_path) == 0) break;
             if(file->next == jp->filelist){
                 etrace("Abnormal error. Could not match path to any scanned file...");
                 result = -1; goto cleanup;
@@ -855,7 +830,7 @@ int movefile_to_start_or_end(udefrag_job_parameters *jp,int start_or_end)
         /* at this point we should have the file's winx_file_info object in *file */
         //dtrace("The file's Native Path is: %ws",native_path);
         if(jp->udo.dbgprint_level >= DBG_DETAILED){
-            dtrace("The File's path is: %ws",file->path);
+            dtrace("The File's path is: %ws",file_path);
             dtrace("Before: The File has %I64u fragments & resides @ LCN: %I64u",file->disp.fragments,file->disp.blockmap->lcn);
         }
         /* check whether we can move it or not */
@@ -929,6 +904,7 @@ cleanup:
     itrace("Finished. Total Files Moved: %I64u out of %d. (%s) ",jp->pi.total_moves,jp->udo.cut_filter.count,buffer);
     winx_bytes_to_hr((ULONGLONG)overall_speed,3,buffer,sizeof buffer);
     itrace("Avg. Speed = %s/s", buffer);
+    dbg_print_move_statistics(jp);
 endnicely:    
     winx_flush_dbg_log(0);
     clear_currently_excluded_flag(jp); //again?
@@ -46,6 +46,8 @@ typedef int   (*udefrag_terminator)(void *p);
 int udefrag_start_job(char volume_letter,udefrag_job_type job_type,int flags,
     int cluster_map_size,udefrag_progress_callback cb,udefrag_terminator t,void *p);
 
+int udefrag_get_map_level(int map_size,int level,int *level_size);
+
 char *udefrag_get_results(udefrag_progress_info *pi);
 void udefrag_release_results(char *results);
 
@@ -567,16 +567,22 @@ NTSTATUS winx_defrag_fopen(winx_file_info *f,int action,HANDLE *phandle)
     ULONG flags = FILE_SYNCHRONOUS_IO_NONALERT;
     int i, length;
     char volume_letter;
-    wchar_t *path;
+    wchar_t *file_path, *path;
     wchar_t buffer[MAX_PATH + 1];
+    wchar_t path_buffer[MAX_PATH];
 
     if(f == NULL || phandle == NULL)
         return STATUS_INVALID_PARAMETER;
     
-    if(f->path == NULL)
-        return STATUS_INVALID_PARAMETER;
+    /* paths of files found by winx_scan_disk are built on demand */
+    file_path = f->path;
+    if(file_path == NULL){
+        if(winx_get_file_path(f,path_buffer,MAX_PATH) < 0)
+            return STATUS_INVALID_PARAMETER;
+        file_path = path_buffer;
+    }
     
-    if(f->path[0] == 0)
+    if(file_path[0] == 0)
         return STATUS_INVALID_PARAMETER;
     
     if(is_directory(f)){
@@ -627,19 +633,20 @@ NTSTATUS winx_defrag_fopen(winx_file_info *f,int action,HANDLE *phandle)
     * Handle special cases, according to
     * http://msdn.microsoft.com/en-us/library/windows/desktop/aa363911(v=vs.85).aspx
     */
-    path = f->path;
-    length = (int)wcslen(f->path);
+    path = file_path;
+    length = (int)wcslen(file_path);
     if(length >= 9){ /* to ensure that we have at least \??\X:\$x */
-        if(f->path[7] == '$'){
-            volume_letter = (char)f->path[4];
+        if(file_path[7] == '$'){
+            volume_letter = (char)file_path[4];
             for(i = 0; special_file_names[i].original_name; i++){
-                if(winx_wcsistr(f->path,special_file_names[i].original_name)){
-                    if(wcslen(f->path) == wcslen(special_file_names[i].original_name) + 0x7){
+                if(winx_wcsistr(file_path,special_file_names[i].original_name)){
+                    if(length == 0x7 + \
+                      wcslen(special_file_names[i].original_name)){
                         _snwprintf(buffer,MAX_PATH,L"\\??\\%c:\\%ws",volume_letter,
                             special_file_names[i].accepted_name);
                         buffer[MAX_PATH] = 0;
                         path = buffer;
-                        dtrace("%ws used instead of %ws",path,f->path);
+                        dtrace("%ws used instead of %ws",path,file_path);
                         break;
                     }
                 }
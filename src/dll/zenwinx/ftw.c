@@ -51,10 +51,54 @@
  */
 #define LLINVALID ((ULONGLONG) -1)
 
+/**
+ * @internal
+ * @brief Length of the separator between the
+ * directory path and names of its contents.
+ * @details Path of the root directory contains
+ * the trailing backslash already.
+ */
+#define dir_separator_length(node) ((node)->parent ? 1 : 0)
+
 /* external functions prototypes */
+void winx_release_dir_node(winx_dir_node *node);
 winx_file_info *ntfs_scan_disk(char volume_letter,
     int flags, ftw_filter_callback fcb, ftw_progress_callback pcb, 
-    ftw_terminator t, void *user_defined_data);
+    ftw_terminator t, void *user_defined_data, winx_arena *arena);
+
+/**
+ * @internal
+ * @brief Inserts a new entry to the
+ * head of the file list.
+ * @param[in,out] filelist pointer to
+ * variable pointing to the list's head.
+ * @param[in] arena the arena to allocate
+ * the entry from, NULL forces use of the heap.
+ * @return Address of the inserted entry.
+ * In case of allocation failure this routine
+ * calls the killer registered by the winx_set_killer
+ * routine and returns NULL afterwards.
+ */
+winx_file_info *winx_ftw_insert_file(winx_file_info **filelist,
+        winx_arena *arena)
+{
+    winx_file_info *f, *head = *filelist;
+
+    f = (winx_file_info *)winx_arena_alloc(arena,
+        sizeof(winx_file_info),MALLOC_ABORT_ON_FAILURE);
+    if(f == NULL) return NULL;
+
+    if(head == NULL){
+        f->next = f->prev = f;
+    } else {
+        f->prev = head->prev;
+        f->next = head;
+        head->prev->next = f;
+        head->prev = f;
+    }
+    *filelist = f;
+    return f;
+}
 
 /**
  * @internal
@@ -71,6 +115,113 @@ static int ftw_check_for_termination(ftw_terminator t,void *user_defined_data)
     return t(user_defined_data);
 }
 
+/**
+ * @internal
+ * @brief Returns the first block
+ * of a contiguous map of file blocks.
+ * @details Maps are allocated as arrays
+ * of blocks linked in the ascending order,
+ * so the first block is the one following
+ * the block placed at the highest address.
+ * The head may point to any block then,
+ * as some programs move it to the block
+ * having the lowest LCN.
+ */
+static winx_blockmap *get_blockmap_base(winx_blockmap *map)
+{
+    winx_blockmap *block;
+
+    if(map->prev >= map) return map;
+
+    for(block = map; block->next > block; block = block->next) {}
+    return block->next;
+}
+
+/**
+ * @brief Appends a block to a map of file blocks.
+ * @details Blocks are kept in a single array
+ * growing twice each time when it gets full,
+ * so heavily fragmented files don't need
+ * a separate allocation for each block.
+ * Blocks are linked to each other
+ * as usual, thus the map can be walked
+ * through like any other list. When the
+ * variable pointing to the map belongs to
+ * an arena, the first array holding a single
+ * block is allocated from it. Larger arrays
+ * come from the heap, as arrays outgrown in
+ * an arena would stay there until its end.
+ * @param[in,out] map pointer to variable
+ * pointing to the map's head.
+ * @param[in] vcn the virtual cluster number.
+ * @param[in] lcn the logical cluster number.
+ * @param[in] length size of the block, in clusters.
+ * @return Pointer to the appended block,
+ * NULL indicates failure.
+ * @note Addresses of all the blocks
+ * may change during this call.
+ */
+winx_blockmap *winx_blockmap_append(winx_blockmap **map,
+    ULONGLONG vcn,ULONGLONG lcn,ULONGLONG length)
+{
+    winx_blockmap *base, *new_base, *block;
+    winx_arena *arena;
+    size_t i, n = 0;
+
+    DbgCheck1(map,NULL);
+
+    base = *map;
+    if(base){
+        base = get_blockmap_base(base);
+        n = base->prev - base + 1;
+    }
+
+    /* reallocate the array when its size is a power of two */
+    if((n & (n - 1)) == 0){
+        arena = n ? NULL : winx_get_arena(map);
+        new_base = (winx_blockmap *)winx_arena_alloc(arena,
+            (n ? n * 2 : 1) * sizeof(winx_blockmap),MALLOC_ABORT_ON_FAILURE);
+        if(new_base == NULL) return NULL;
+        if(n){
+            memcpy(new_base,base,n * sizeof(winx_blockmap));
+            winx_free(base);
+            /* relink the moved blocks */
+            for(i = 1; i < n; i++){
+                new_base[i - 1].next = &new_base[i];
+                new_base[i].prev = &new_base[i - 1];
+            }
+        }
+        base = new_base;
+    }
+
+    block = &base[n];
+    block->vcn = vcn;
+    block->lcn = lcn;
+    block->length = length;
+
+    /* link the new block */
+    block->prev = n ? &base[n - 1] : block;
+    block->prev->next = block;
+    block->next = base;
+    base->prev = block;
+    *map = base;
+    return block;
+}
+
+/**
+ * @brief Destroys a map of file blocks
+ * built by the winx_blockmap_append routine.
+ * @param[in,out] map pointer to variable
+ * pointing to the map's head.
+ */
+void winx_blockmap_destroy(winx_blockmap **map)
+{
+    if(map == NULL || *map == NULL) return;
+
+    winx_free(get_blockmap_base(*map));
+    *map = NULL;
+}
+
 /**
  * @internal
  * @brief Validates a map of file blocks,
@@ -99,69 +250,58 @@ void validate_blockmap(winx_file_info *f)
     if(b1) b2 = b1->next;
     if(b1 && b2 && b2 != b1){
         if(b1->vcn == b2->vcn){
-            etrace("%ws: wrong map detected:", f->path);
+            etrace("%ws: wrong map detected:", winx_file_path(f));
             for(b1 = f->disp.blockmap; b1; b1 = b1->next){
                 etrace("VCN = %I64u, LCN = %I64u, LEN = %I64u",
                     b1->vcn, b1->lcn, b1->length);
                 if(b1->next == f->disp.blockmap) break;
             }
-            winx_list_destroy((list_entry **)(void *)&f->disp.blockmap);
+            winx_blockmap_destroy(&f->disp.blockmap);
         }
     }
 #endif
 }
 
+/*
+* Results of get_file_blocks other than zero and -1.
+*/
+#define EMPTY_MAP_DETECTED 1
+#define DUMP_TERMINATED    2
+
 /**
- * @brief Retrieves disposition of a file.
- * @param[out] f pointer to structure
- * receiving the information.
- * @param[in] t address of procedure to be called
- * each time when winx_ftw_dump_file would like
- * to know whether it must be terminated or not.
- * Nonzero value, returned by the registered
- * routine, terminates the dump immediately.
- * @param[in] user_defined_data pointer to data
- * to be passed to the registered terminator.
- * @return Zero for success, negative value otherwise.
- * @note
- * - The callback procedure should complete as quickly
- * as possible to avoid slowdown of the scan.
- * - For resident NTFS streams (small files and
- * directories located inside MFT) this function resets
- * all the file disposition structure fields to zero.
+ * @internal
+ * @brief Retrieves blocks of an opened file
+ * located between the specified VCNs.
+ * @param[in] hFile handle of the file.
+ * @param[in] path path of the file.
+ * @param[in] start_vcn the first VCN to be retrieved.
+ * @param[in] end_vcn the VCN following the last one
+ * to be retrieved, LLINVALID stands for the end of the file.
+ * @param[out] map pointer to variable receiving
+ * the list of blocks; blocks are cut at the bounds.
+ * @param[in] t the terminator.
+ * @param[in] user_defined_data data passed to the terminator.
+ * @return Zero for success, EMPTY_MAP_DETECTED or
+ * DUMP_TERMINATED with the list destroyed,
+ * negative value on failures.
  */
-int winx_ftw_dump_file(winx_file_info *f,
-        ftw_terminator t, void *user_defined_data)
+static int get_file_blocks(HANDLE hFile,wchar_t *path,
+        ULONGLONG start_vcn,ULONGLONG end_vcn,winx_blockmap **map,
+        ftw_terminator t,void *user_defined_data)
 {
     GET_RETRIEVAL_DESCRIPTOR *filemap;
-    HANDLE hFile;
-    ULONGLONG startVcn;
+    ULONGLONG startVcn, vcn, next_vcn;
     long counter; /* counts number of attempts to receive information */
     #define MAX_COUNT 1000
     IO_STATUS_BLOCK iosb;
     NTSTATUS status;
-    int i;
-    winx_blockmap *block = NULL;
-    
-    DbgCheck1(f,-1);
-    
-    /* reset disposition related fields */
-    f->disp.clusters = 0;
-    f->disp.fragments = 0;
-    winx_list_destroy((list_entry **)(void *)&f->disp.blockmap);
-    
-    /* open the file */
-    status = winx_defrag_fopen(f,WINX_OPEN_FOR_DUMP,&hFile);
-    if(status != STATUS_SUCCESS){
-        strace(status,"cannot open %ws",f->path);
-        return 0; /* the file is locked by system */
-    }
+    int i, result = 0;
     
     /* allocate memory */
     filemap = winx_malloc(FILE_MAP_SIZE);
     
     /* dump the file */
-    startVcn = 0;
+    startVcn = start_vcn;
     counter = 0;
     do {
         memset(filemap,0,FILE_MAP_SIZE);
@@ -176,22 +316,28 @@ int winx_ftw_dump_file(winx_file_info *f,
         }
         if(status != STATUS_SUCCESS && status != STATUS_BUFFER_OVERFLOW){
             /* it always returns STATUS_END_OF_FILE for small files placed inside MFT */
-            if(status == STATUS_END_OF_FILE) goto empty_map_detected;
-            strace(status,"dump failed for %ws",f->path);
-            goto dump_failed;
+            if(status == STATUS_END_OF_FILE){
+                result = EMPTY_MAP_DETECTED;
+                goto done;
+            }
+            strace(status,"dump failed for %ws",path);
+            result = -1;
+            goto done;
         }
 
         if(ftw_check_for_termination(t,user_defined_data)){
             if(counter > MAX_COUNT)
-                etrace("%ws: infinite main loop?",f->path);
+                etrace("%ws: infinite main loop?",path);
             /* reset incomplete maps */
-            goto cleanup;
+            result = DUMP_TERMINATED;
+            goto done;
         }
         
         /* check for an empty map */
         if(!filemap->NumberOfPairs && status != STATUS_SUCCESS){
-            etrace("%ws: empty map of file detected",f->path);
-            goto empty_map_detected;
+            etrace("%ws: empty map of file detected",path);
+            result = EMPTY_MAP_DETECTED;
+            goto done;
         }
         
         /* loop through the buffer of number/cluster pairs */
@@ -203,55 +349,146 @@ int winx_ftw_dump_file(winx_file_info *f,
             
             /* the following is usual for 3.99 GB files on FAT32 under XP */
             if(filemap->Pair[i].Vcn == 0){
-                etrace("%ws: wrong map of file detected",f->path);
-                goto dump_failed;
+                etrace("%ws: wrong map of file detected",path);
+                result = -1;
+                goto done;
             }
             
-            block = (winx_blockmap *)winx_list_insert((list_entry **)&f->disp.blockmap,
-                (list_entry *)block,sizeof(winx_blockmap));
-            block->lcn = filemap->Pair[i].Lcn;
-            block->length = filemap->Pair[i].Vcn - startVcn;
-            block->vcn = startVcn;
+            /* cut the block at the bounds */
+            vcn = max(startVcn,start_vcn);
+            next_vcn = min(filemap->Pair[i].Vcn,end_vcn);
+            if(vcn >= next_vcn) continue;
             
-            //trace(D"VCN = %I64u, LCN = %I64u, LENGTH = %I64u",
-            //    block->vcn,block->lcn,block->length);
-            f->disp.clusters += block->length;
-            
-            /*
-            * Sometimes files have more than one fragment, 
-            * but are not fragmented yet. In case of compressed
-            * files this happens quite frequently.
-            */
-            if(block == f->disp.blockmap || \
-              block->lcn != (block->prev->lcn + block->prev->length)){
-                f->disp.fragments ++;
+            if(winx_blockmap_append(map,vcn,filemap->Pair[i].Lcn + \
+              (vcn - startVcn),next_vcn - vcn) == NULL){
+                result = -1;
+                goto done;
             }
+
+            //trace(D"VCN = %I64u, LCN = %I64u, LENGTH = %I64u",
+            //    vcn,filemap->Pair[i].Lcn + (vcn - startVcn),next_vcn - vcn);
         }
-    } while(status != STATUS_SUCCESS);
+    } while(status != STATUS_SUCCESS && startVcn < end_vcn);
     /* small directories placed inside MFT have empty list of fragments... */
 
-    /* the dump is completed */
-    validate_blockmap(f);
+done:
+    if(result) winx_blockmap_destroy(map);
     winx_free(filemap);
-    winx_defrag_fclose(hFile);
-    return 0;
+    return result;
+}
+
+/**
+ * @brief Retrieves disposition of a file.
+ * @param[out] f pointer to structure
+ * receiving the information.
+ * @param[in] t address of procedure to be called
+ * each time when winx_ftw_dump_file would like
+ * to know whether it must be terminated or not.
+ * Nonzero value, returned by the registered
+ * routine, terminates the dump immediately.
+ * @param[in] user_defined_data pointer to data
+ * to be passed to the registered terminator.
+ * @return Zero for success, negative value otherwise.
+ * @note
+ * - The callback procedure should complete as quickly
+ * as possible to avoid slowdown of the scan.
+ * - For resident NTFS streams (small files and
+ * directories located inside MFT) this function resets
+ * all the file disposition structure fields to zero.
+ */
+int winx_ftw_dump_file(winx_file_info *f,
+        ftw_terminator t, void *user_defined_data)
+{
+    HANDLE hFile;
+    NTSTATUS status;
+    winx_blockmap *block;
+    wchar_t path[MAX_PATH];
+    int result;
     
-cleanup:
-empty_map_detected:
+    DbgCheck1(f,-1);
+
+    /* the file may be a temporary copy, so never cache its path */
+    (void)winx_get_file_path(f,path,MAX_PATH);
+
+    /* reset disposition related fields */
     f->disp.clusters = 0;
     f->disp.fragments = 0;
-    winx_list_destroy((list_entry **)(void *)&f->disp.blockmap);
-    winx_free(filemap);
+    winx_blockmap_destroy(&f->disp.blockmap);
+
+    /* open the file */
+    status = winx_defrag_fopen(f,WINX_OPEN_FOR_DUMP,&hFile);
+    if(status != STATUS_SUCCESS){
+        strace(status,"cannot open %ws",path);
+        return 0; /* the file is locked by system */
+    }
+
+    result = get_file_blocks(hFile,path,0,LLINVALID,
+        &f->disp.blockmap,t,user_defined_data);
     winx_defrag_fclose(hFile);
+    if(result < 0) return (-1);
+
+    for(block = f->disp.blockmap; block; block = block->next){
+        f->disp.clusters += block->length;
+
+        /*
+        * Sometimes files have more than one fragment, 
+        * but are not fragmented yet. In case of compressed
+        * files this happens quite frequently.
+        */
+        if(block == f->disp.blockmap || \
+          block->lcn != (block->prev->lcn + block->prev->length)){
+            f->disp.fragments ++;
+        }
+        if(block->next == f->disp.blockmap) break;
+    }
+
+    /* the dump is completed */
+    validate_blockmap(f);
     return 0;
+}
 
-dump_failed:
-    f->disp.clusters = 0;
-    f->disp.fragments = 0;
-    winx_list_destroy((list_entry **)(void *)&f->disp.blockmap);
-    winx_free(filemap);
+/**
+ * @brief Retrieves blocks of a file
+ * located between the specified VCNs.
+ * @details Intended to verify moves of
+ * parts of big files without dumping
+ * the entire map of blocks again.
+ * @param[in] f the file.
+ * @param[in] start_vcn the first VCN to be retrieved.
+ * @param[in] end_vcn the VCN following the last one to be retrieved.
+ * @param[out] map pointer to variable receiving the list
+ * of blocks. Blocks crossing the bounds are cut at them.
+ * The list must be destroyed by winx_blockmap_destroy.
+ * @param[in] t the terminator, see winx_ftw_dump_file.
+ * @param[in] user_defined_data pointer to data
+ * to be passed to the registered terminator.
+ * @return Zero for success, negative value otherwise,
+ * including termination and empty maps.
+ */
+int winx_ftw_dump_file_range(winx_file_info *f,
+        ULONGLONG start_vcn, ULONGLONG end_vcn, winx_blockmap **map,
+        ftw_terminator t, void *user_defined_data)
+{
+    HANDLE hFile;
+    NTSTATUS status;
+    wchar_t path[MAX_PATH];
+    int result;
+
+    DbgCheck2(f,map,-1);
+
+    *map = NULL;
+    (void)winx_get_file_path(f,path,MAX_PATH);
+
+    status = winx_defrag_fopen(f,WINX_OPEN_FOR_DUMP,&hFile);
+    if(status != STATUS_SUCCESS){
+        strace(status,"cannot open %ws",path);
+        return (-1);
+    }
+
+    result = get_file_blocks(hFile,path,start_vcn,end_vcn,
+        map,t,user_defined_data);
     winx_defrag_fclose(hFile);
-    return (-1);
+    return result ? (-1) : 0;
 }
 
 /**
@@ -264,7 +501,8 @@ static winx_file_info * ftw_add_entry_to_filelist(wchar_t *path,
     int flags, ftw_filter_callback fcb, ftw_progress_callback pcb,
     ftw_terminator t, void *user_defined_data,
     winx_file_info **filelist,
-    FILE_BOTH_DIR_INFORMATION *file_entry)
+    FILE_BOTH_DIR_INFORMATION *file_entry,
+    winx_arena *arena)
 {
     winx_file_info *f;
     int length;
@@ -279,11 +517,11 @@ static winx_file_info * ftw_add_entry_to_filelist(wchar_t *path,
     }
     
     /* insert new item to the file list */
-    f = (winx_file_info *)winx_list_insert((list_entry **)(void *)filelist,
-        NULL,sizeof(winx_file_info));
+    f = winx_ftw_insert_file(filelist,arena);
     
     /* extract filename */
-    f->name = winx_tmalloc(file_entry->FileNameLength + sizeof(wchar_t));
+    f->name = winx_arena_alloc(arena,
+        file_entry->FileNameLength + sizeof(wchar_t),0);
     if(f->name == NULL){
         etrace("cannot allocate %u bytes of memory",
             file_entry->FileNameLength + sizeof(wchar_t));
@@ -302,7 +540,7 @@ static winx_file_info * ftw_add_entry_to_filelist(wchar_t *path,
     length += (int)wcslen(f->name) + 1;
     if(!is_rootdir)
         length ++;
-    f->path = winx_tmalloc(length * sizeof(wchar_t));
+    f->path = winx_arena_alloc(arena,length * sizeof(wchar_t),0);
     if(f->path == NULL){
         etrace("cannot allocate %u bytes of memory",
             length * sizeof(wchar_t));
@@ -354,7 +592,7 @@ static winx_file_info * ftw_add_entry_to_filelist(wchar_t *path,
 static int ftw_add_root_directory(wchar_t *path, int flags,
     ftw_filter_callback fcb, ftw_progress_callback pcb, 
     ftw_terminator t, void *user_defined_data,
-    winx_file_info **filelist)
+    winx_file_info **filelist, winx_arena *arena)
 {
     winx_file_info *f;
     int length;
@@ -372,16 +610,17 @@ static int ftw_add_root_directory(wchar_t *path, int flags,
     }
     
     /* insert new item to the file list */
-    f = (winx_file_info *)winx_list_insert((list_entry **)(void *)filelist,
-        NULL,sizeof(winx_file_info));
+    f = winx_ftw_insert_file(filelist,arena);
     
     /* build path */
     length = (int)wcslen(path) + 1;
-    f->path = winx_malloc(length * sizeof(wchar_t));
+    f->path = winx_arena_alloc(arena,length * sizeof(wchar_t),
+        MALLOC_ABORT_ON_FAILURE);
     wcscpy(f->path,path);
     
     /* save . filename */
-    f->name = winx_malloc(2 * sizeof(wchar_t));
+    f->name = winx_arena_alloc(arena,2 * sizeof(wchar_t),
+        MALLOC_ABORT_ON_FAILURE);
     f->name[0] = '.';
     f->name[1] = 0;
     
@@ -479,7 +718,7 @@ static HANDLE ftw_open_directory(wchar_t *path)
 static int ftw_helper(wchar_t *path, int flags,
         ftw_filter_callback fcb, ftw_progress_callback pcb,
         ftw_terminator t, void *user_defined_data,
-        winx_file_info **filelist)
+        winx_file_info **filelist, winx_arena *arena)
 {
     FILE_BOTH_DIR_INFORMATION *file_listing, *file_entry;
     HANDLE hDir;
@@ -544,7 +783,7 @@ static int ftw_helper(wchar_t *path, int flags,
         
         /* add the entry to the file list */
         f = ftw_add_entry_to_filelist(path,flags,fcb,pcb,t,
-                user_defined_data,filelist,file_entry);
+                user_defined_data,filelist,file_entry,arena);
         if(f == NULL){
             winx_free(file_listing);
             NtClose(hDir);
@@ -573,7 +812,8 @@ static int ftw_helper(wchar_t *path, int flags,
         if(is_directory(f) && (flags & WINX_FTW_RECURSIVE) && !skip_children){
             /* don't follow reparse points! */
             if(!is_reparse_point(f)){
-                result = ftw_helper(f->path,flags,fcb,pcb,t,user_defined_data,filelist);
+                result = ftw_helper(f->path,flags,fcb,pcb,t,
+                    user_defined_data,filelist,arena);
                 if(result < 0){
                     winx_free(file_listing);
                     NtClose(hDir);
@@ -597,27 +837,31 @@ static int ftw_helper(wchar_t *path, int flags,
 static void ftw_remove_invalid_streams(winx_file_info **filelist, int flags)
 {
     winx_file_info *f, *head, *next = NULL;
+    winx_arena *arena = NULL;
     int invalid_entry;
 
     for(f = *filelist; f; f = next){
         head = *filelist;
         next = f->next;
+        if(arena == NULL) arena = winx_get_arena(f);
         invalid_entry = 0;
-        if(f->path == NULL)
-            invalid_entry = 1;
-        else if(f->path[0] == 0)
+        if(winx_get_file_path_length(f) <= 0)
             invalid_entry = 1;
         else if (flags & WINX_FTW_SKIP_RESIDENT_STREAMS && f->disp.fragments == 0)
             invalid_entry = 1;
         if(invalid_entry) {
             winx_free(f->name);
             winx_free(f->path);
-            winx_list_destroy((list_entry **)(void *)&f->disp.blockmap);
+            winx_release_dir_node(f->internal.ParentDirectory);
+            winx_blockmap_destroy(&f->disp.blockmap);
             winx_list_remove((list_entry **)(void *)filelist,(list_entry *)f);
         }
         if(*filelist == NULL) break;
         if(next == head) break;
     }
+
+    /* the arena isn't needed for empty lists */
+    if(*filelist == NULL) winx_destroy_arena(arena);
 }
 
 /**
@@ -694,6 +938,7 @@ winx_file_info *winx_ftw(wchar_t *path, int flags,
         ftw_terminator t, void *user_defined_data)
 {
     winx_file_info *filelist = NULL;
+    winx_arena *arena;
     
     DbgCheck1(path,NULL);
     
@@ -705,14 +950,20 @@ winx_file_info *winx_ftw(wchar_t *path, int flags,
         }
     }
     
-    if(ftw_helper(path,flags,fcb,pcb,t,user_defined_data,&filelist) == (-1) && \
+    /* keep the list in its own arena to release it at once */
+    arena = winx_create_arena();
+
+    if(ftw_helper(path,flags,fcb,pcb,t,user_defined_data,
+      &filelist,arena) == (-1) && \
       !(flags & WINX_FTW_ALLOW_PARTIAL_SCAN)){
         /* destroy the list */
-        winx_ftw_release(filelist);
+        if(filelist) winx_ftw_release(filelist);
+        else winx_destroy_arena(arena);
         return NULL;
     }
 
     /* get rid of invalid entries and WINX_FTW_SKIP_RESIDENT_STREAMS*/
+    if(filelist == NULL) winx_destroy_arena(arena);
     ftw_remove_invalid_streams(&filelist,flags);
     return filelist;
 }
@@ -738,6 +989,7 @@ winx_file_info *winx_scan_disk(char volume_letter, int flags,
     winx_file_info *filelist = NULL;
     wchar_t rootpath[] = L"\\??\\A:\\";
     winx_volume_information v;
+    winx_arena *arena;
     ULONGLONG time;
     
     /* ensure that it will work on w2k */
@@ -754,33 +1006,42 @@ winx_file_info *winx_scan_disk(char volume_letter, int flags,
         }
     }
     
+    /* keep the list in its own arena to release it at once */
+    arena = winx_create_arena();
+
     if(winx_get_volume_information(volume_letter,&v) >= 0){
         itrace("file system is %s",v.fs_name);
         if(!strcmp(v.fs_name,"NTFS")){
-            filelist = ntfs_scan_disk(volume_letter,flags,fcb,pcb,t,user_defined_data);
+            filelist = ntfs_scan_disk(volume_letter,flags,fcb,pcb,t,
+                user_defined_data,arena);
             goto cleanup;
         }
     }
     
     /* collect information about the root directory */
     rootpath[4] = (wchar_t)volume_letter;
-    if(ftw_add_root_directory(rootpath,flags,fcb,pcb,t,user_defined_data,&filelist) == (-1) && \
+    if(ftw_add_root_directory(rootpath,flags,fcb,pcb,t,user_defined_data,
+      &filelist,arena) == (-1) && \
       !(flags & WINX_FTW_ALLOW_PARTIAL_SCAN)){
         /* destroy the list */
-        winx_ftw_release(filelist);
+        if(filelist) winx_ftw_release(filelist);
+        else winx_destroy_arena(arena);
         filelist = NULL;
         goto done;
     }
 
     /* collect information about the entire directory tree */
     flags |= WINX_FTW_RECURSIVE;
-    if(ftw_helper(rootpath,flags,fcb,pcb,t,user_defined_data,&filelist) == (-1) && \
+    if(ftw_helper(rootpath,flags,fcb,pcb,t,user_defined_data,
+      &filelist,arena) == (-1) && \
       !(flags & WINX_FTW_ALLOW_PARTIAL_SCAN)){
         /* destroy the list */
-        winx_ftw_release(filelist);
+        if(filelist) winx_ftw_release(filelist);
+        else winx_destroy_arena(arena);
         filelist = NULL;
         goto done;
     }
+    if(filelist == NULL) winx_destroy_arena(arena);
 
 cleanup:
     /* get rid of invalid entries and WINX_FTW_SKIP_RESIDENT_STREAMS*/
@@ -795,21 +1056,214 @@ done:
 /**
  * @brief Releases resources allocated
  * by winx_ftw or winx_scan_disk.
+ * @details Most of the memory belongs to
+ * the arena holding the list, so winx_free
+ * calls below cost nearly nothing, while
+ * the arena gets released at once.
  * @param[in] filelist the list
  * of files to be released.
  */
 void winx_ftw_release(winx_file_info *filelist)
 {
     winx_file_info *f;
+    winx_arena *arena = NULL;
 
     /* walk through the list of files and free allocated memory */
     for(f = filelist; f != NULL; f = f->next){
+        if(arena == NULL) arena = winx_get_arena(f);
         winx_free(f->name);
         winx_free(f->path);
-        winx_list_destroy((list_entry **)(void *)&f->disp.blockmap);
+        winx_release_dir_node(f->internal.ParentDirectory);
+        winx_blockmap_destroy(&f->disp.blockmap);
         if(f->next == filelist) break;
     }
     winx_list_destroy((list_entry **)(void *)&filelist);
+    winx_destroy_arena(arena);
+}
+
+/**
+ * @internal
+ * @brief Creates a node of the directory
+ * to be shared by all its contents.
+ * @param[in] parent node of the parent
+ * directory, NULL for the root directory.
+ * @param[in] name the directory name; the
+ * native path including the trailing backslash
+ * for the root directory.
+ * @param[in] arena the arena to allocate the node
+ * from, NULL forces use of the heap.
+ * @return The node, NULL indicates failure.
+ * @note The node is referenced once by the caller.
+ * Each file assigned to the node must reference it
+ * as well, while winx_ftw_release releases them all.
+ */
+winx_dir_node *winx_create_dir_node(winx_dir_node *parent,
+        wchar_t *name,winx_arena *arena)
+{
+    winx_dir_node *node;
+
+    node = winx_arena_alloc(arena,sizeof(winx_dir_node),0);
+    if(node == NULL){
+        etrace("cannot allocate %u bytes of memory",
+            sizeof(winx_dir_node));
+        return NULL;
+    }
+    node->name = winx_arena_wcsdup(arena,name);
+    if(node->name == NULL){
+        etrace("cannot allocate %u bytes of memory",
+            (wcslen(name) + 1) * sizeof(wchar_t));
+        winx_free(node);
+        return NULL;
+    }
+    node->length = (int)wcslen(name);
+    node->parent = parent;
+    if(parent){
+        node->length += parent->length + dir_separator_length(parent);
+        parent->refcount ++;
+    }
+    node->refcount = 1;
+    return node;
+}
+
+/**
+ * @internal
+ * @brief Releases a reference to the
+ * directory node. When there are no more
+ * references, the node gets destroyed.
+ */
+void winx_release_dir_node(winx_dir_node *node)
+{
+    winx_dir_node *parent;
+
+    while(node){
+        if(-- node->refcount > 0) break;
+        parent = node->parent;
+        winx_free(node->name);
+        winx_free(node);
+        node = parent;
+    }
+}
+
+/**
+ * @internal
+ * @brief Copies a part of the path into
+ * the specified position of the buffer.
+ */
+static void copy_path_part(wchar_t *buffer,int start,
+    wchar_t *part,int part_length,int length)
+{
+    if(start >= length)
+        return;
+    if(part_length > length - start)
+        part_length = length - start;
+    memcpy(buffer + start,part,part_length * sizeof(wchar_t));
+}
+
+/**
+ * @brief Retrieves length of the full
+ * native path of the file, in characters.
+ * @return Negative value indicates
+ * that the path is unknown.
+ */
+int winx_get_file_path_length(winx_file_info *f)
+{
+    winx_dir_node *node;
+
+    DbgCheck1(f,-1);
+
+    if(f->path)
+        return (int)wcslen(f->path);
+
+    node = f->internal.ParentDirectory;
+    if(node == NULL || f->name == NULL)
+        return (-1);
+    return node->length + dir_separator_length(node) + (int)wcslen(f->name);
+}
+
+/**
+ * @brief Retrieves the full native path of the file.
+ * @details Unlike winx_file_path, never allocates
+ * memory, therefore it is preferred for walks
+ * through entire lists of files.
+ * @param[in] f the file.
+ * @param[out] buffer the buffer receiving the path.
+ * @param[in] length length of the buffer, in characters.
+ * Longer paths get truncated.
+ * @return Length of the path stored in the buffer,
+ * in characters. Negative value indicates that the
+ * path is unknown; the buffer receives an empty
+ * string then.
+ */
+int winx_get_file_path(winx_file_info *f,wchar_t *buffer,int length)
+{
+    winx_dir_node *node;
+    int path_length, start;
+
+    DbgCheck3(f,buffer,length > 0,-1);
+
+    buffer[0] = 0;
+    path_length = winx_get_file_path_length(f);
+    if(path_length < 0)
+        return (-1);
+    if(path_length > length - 1)
+        path_length = length - 1;
+
+    if(f->path){
+        memcpy(buffer,f->path,path_length * sizeof(wchar_t));
+        buffer[path_length] = 0;
+        return path_length;
+    }
+
+    /* fill the buffer from right to left */
+    node = f->internal.ParentDirectory;
+    start = node->length + dir_separator_length(node);
+    copy_path_part(buffer,start,f->name,(int)wcslen(f->name),path_length);
+    for(; node; node = node->parent){
+        if(dir_separator_length(node) && node->length < path_length)
+            buffer[node->length] = '\\';
+        start = node->parent ? node->parent->length + \
+            dir_separator_length(node->parent) : 0;
+        copy_path_part(buffer,start,node->name,
+            node->length - start,path_length);
+    }
+    buffer[path_length] = 0;
+    return path_length;
+}
+
+/**
+ * @brief Retrieves the full native path of the file.
+ * @details Builds the path on the first call and keeps
+ * it in f->path, so the file path can be accessed
+ * in a traditional way afterwards. The path shares
+ * the arena holding the file, if any.
+ * @return The path, NULL indicates failure.
+ * @note The entire path gets kept, as paths
+ * kept in f->path override the ones built
+ * from the directory nodes afterwards.
+ */
+wchar_t *winx_file_path(winx_file_info *f)
+{
+    wchar_t *path;
+    int length;
+
+    DbgCheck1(f,NULL);
+
+    if(f->path)
+        return f->path;
+
+    length = winx_get_file_path_length(f);
+    if(length < 0)
+        return NULL;
+
+    path = winx_arena_alloc(winx_get_arena(f),(length + 1) * sizeof(wchar_t),0);
+    if(path == NULL){
+        etrace("cannot allocate %u bytes of memory",
+            (length + 1) * sizeof(wchar_t));
+        return NULL;
+    }
+    (void)winx_get_file_path(f,path,length + 1);
+    f->path = path;
+    return f->path;
 }
 
 /** @} */
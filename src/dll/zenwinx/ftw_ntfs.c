@@ -41,6 +41,29 @@
 */
 //#define SHOW_ATTR_LISTS_INFO
 
+/*
+* Default size of chunks of the MFT
+* read directly from the disk, bypassing
+* FSCTL_GET_NTFS_FILE_RECORD, and default
+* number of chunks kept in memory at once.
+* Both can be adjusted by the
+* winx_set_mft_read_parameters call.
+*/
+#define MFT_BUFFER_SIZE       (4 * 1024 * 1024)
+#define MAX_MFT_BUFFER_SIZE   (64 * 1024 * 1024)
+#define MFT_QUEUE_DEPTH       3
+#define MAX_MFT_QUEUE_DEPTH   16
+
+/* indicates an absence of mft index */
+#define NO_MFT_ID ((ULONGLONG) -1)
+
+/*
+* Update sequence arrays protect
+* each 512-byte block of a record,
+* regardless of the sector size.
+*/
+#define NTFS_USA_BLOCK_SIZE 512
+
 /* internal structures */
 typedef struct _mft_layout {
     unsigned long file_record_size;         /* size of a single mft file record, in bytes */
@@ -68,6 +91,36 @@ typedef struct {
     ULONGLONG LastAccessTime;        /**/
 } my_file_information;
 
+typedef struct _mft_chunk {
+    char *data;                  /* file records read in bulk */
+    ULONGLONG first_mft_id;      /* the first record of the chunk */
+    ULONGLONG n_records;         /* number of records in the chunk */
+    HANDLE hEvent;               /* signaled when the read completes */
+    IO_STATUS_BLOCK iosb;        /* status of the read */
+    int pending;                 /* nonzero if the read is in progress */
+} mft_chunk;
+
+typedef struct _mft_buffer {
+    HANDLE hVolume;              /* volume opened for asynchronous reads */
+    mft_chunk *chunks;           /* queue of chunks, from right to left */
+    int queue_depth;             /* maximum number of chunks in the queue */
+    int head;                    /* index of the first chunk in the queue */
+    int n_chunks;                /* number of chunks in the queue */
+    ULONGLONG next_mft_id;       /* a record of the next chunk to queue */
+    unsigned long size;          /* size of a single chunk, in bytes */
+    char *data;                  /* records of the current chunk */
+    ULONGLONG first_mft_id;      /* the first record of the current chunk */
+    ULONGLONG n_records;         /* number of records in the current chunk */
+    ULONGLONG bulk_records;      /* number of records taken from chunks */
+    ULONGLONG fallback_records;  /* number of records retrieved by FSCTL */
+    ULONGLONG requests;          /* number of read requests */
+    ULONGLONG io_wait_time;      /* time spent waiting for reads, in ms */
+} mft_buffer;
+
+/* parameters of bulk reading, see winx_set_mft_read_parameters */
+static unsigned long mft_buffer_size = MFT_BUFFER_SIZE;
+static int mft_queue_depth = MFT_QUEUE_DEPTH;
+
 typedef struct _mft_scan_parameters {
     int mft_scan_direction;     /* mft scan direction, right to left in the current algorithm */
     mft_layout ml;              /* mft layout structure */
@@ -82,6 +135,12 @@ typedef struct _mft_scan_parameters {
     unsigned long processed_attr_list_entries; /* just for debugging purposes */
     unsigned long errors;       /* number of critical errors preventing gathering of complete information */
     winx_file_info **filelist;  /* list of files */
+    winx_arena *arena;          /* arena of the list of files, can be NULL */
+    winx_blockmap *mft_map;     /* map of the $Mft data stream */
+    mft_buffer mb;              /* file records read directly from the disk */
+    ULONGLONG *mft_bitmap;      /* $Mft:$BITMAP, one bit per file record */
+    ULONGLONG mft_bitmap_bits;  /* number of valid bits in the mft bitmap */
+    ULONGLONG skipped_records;  /* number of free records skipped */
 } mft_scan_parameters;
 
 /* an auxiliary structure for binary search */
@@ -101,8 +160,19 @@ typedef void (*attribute_handler)(PATTRIBUTE pattr,mft_scan_parameters *sp);
 static void analyze_resident_stream(PRESIDENT_ATTRIBUTE pr_attr,mft_scan_parameters *sp);
 static void analyze_non_resident_stream(PNONRESIDENT_ATTRIBUTE pnr_attr,mft_scan_parameters *sp);
 static winx_file_info * find_filelist_entry(wchar_t *attr_name,mft_scan_parameters *sp);
+static int check_run(ULONGLONG lcn,ULONGLONG length,mft_scan_parameters *sp);
+static ULONG RunLength(PUCHAR run);
+static LONGLONG RunLCN(PUCHAR run);
+static ULONGLONG RunCount(PUCHAR run);
+static ULONGLONG get_previous_used_record(ULONGLONG mft_id,
+        ULONGLONG first_mft_id,mft_scan_parameters *sp);
 
 void validate_blockmap(winx_file_info *f);
+winx_dir_node *winx_create_dir_node(winx_dir_node *parent,
+        wchar_t *name,winx_arena *arena);
+winx_file_info *winx_ftw_insert_file(winx_file_info **filelist,
+        winx_arena *arena);
+void winx_release_dir_node(winx_dir_node *node);
 
 /*
 **************************************************
@@ -365,12 +435,613 @@ static wchar_t * get_attribute_name(ATTRIBUTE *attr,mft_scan_parameters *sp)
     return attr_name;
 }
 
+/*
+**************************************************
+*         Bulk reading of file records
+**************************************************
+*/
+
+/**
+ * @brief Applies update sequence fixups to
+ * a file record read directly from the disk.
+ * @return Zero for success, negative value
+ * indicates that the record is either not
+ * a file record or torn.
+ */
+static int apply_fixups(FILE_RECORD_HEADER *frh,mft_scan_parameters *sp)
+{
+    USHORT *usa, *tail;
+    ULONG i;
+
+    if(!is_file_record(frh))
+        return (-1);
+
+    /* is the update sequence array valid? */
+    if(frh->Ntfs.UsaCount < 2 || (frh->Ntfs.UsaOffset & 0x1))
+        return (-1);
+    if(frh->Ntfs.UsaOffset + frh->Ntfs.UsaCount * sizeof(USHORT) \
+      > sp->ml.file_record_size) return (-1);
+    if((ULONG)(frh->Ntfs.UsaCount - 1) * NTFS_USA_BLOCK_SIZE \
+      != sp->ml.file_record_size) return (-1);
+
+    /* restore the last word of each block */
+    usa = (USHORT *)((char *)frh + frh->Ntfs.UsaOffset);
+    for(i = 1; i < frh->Ntfs.UsaCount; i++){
+        tail = (USHORT *)((char *)frh + \
+            i * NTFS_USA_BLOCK_SIZE - sizeof(USHORT));
+        if(*tail != usa[0]) return (-1);
+        *tail = usa[i];
+    }
+    return 0;
+}
+
+/**
+ * @brief Defines which portion of the MFT
+ * is to be read into a chunk to get the
+ * specified file record.
+ * @details Each chunk is a contiguous range
+ * of clusters which can be read by a single
+ * request. Therefore, chunks never cross
+ * boundaries of $Mft fragments.
+ * @return Zero for success. Otherwise the
+ * record cannot be read in bulk and the
+ * returned value is negative; in this case
+ * *first_mft_id receives index of the last
+ * record preceding the record and located
+ * inside the map of $Mft, or NO_MFT_ID
+ * if there are no such records.
+ */
+static int get_chunk_bounds(ULONGLONG mft_id,ULONGLONG *first_mft_id,
+        ULONGLONG *n_records,ULONGLONG *lcn,mft_scan_parameters *sp)
+{
+    ULONGLONG records_per_chunk, chunk_start, chunk_end;
+    ULONGLONG rs, cs, start_vcn, end_vcn;
+    ULONGLONG block_start, block_end;
+    winx_blockmap *block;
+
+    rs = sp->ml.file_record_size;
+    cs = sp->ml.cluster_size;
+    records_per_chunk = sp->mb.size / rs;
+    chunk_start = mft_id - mft_id % records_per_chunk;
+    chunk_end = min(chunk_start + records_per_chunk,
+        sp->ml.number_of_file_records);
+
+    /* clusters holding the record */
+    start_vcn = mft_id * rs / cs;
+    end_vcn = ((mft_id + 1) * rs + cs - 1) / cs;
+
+    *first_mft_id = NO_MFT_ID;
+    for(block = sp->mft_map; block; block = block->next){
+        if(block->vcn <= start_vcn && block->vcn + block->length >= end_vcn){
+            /* records entirely inside the fragment */
+            block_start = (block->vcn * cs + rs - 1) / rs;
+            block_end = (block->vcn + block->length) * cs / rs;
+            *first_mft_id = max(chunk_start,block_start);
+            *n_records = min(chunk_end,block_end) - *first_mft_id;
+            *lcn = block->lcn + *first_mft_id * rs / cs - block->vcn;
+            return 0;
+        }
+        if(block->vcn + block->length <= start_vcn){
+            block_end = (block->vcn + block->length) * cs / rs;
+            if(block_end && (*first_mft_id == NO_MFT_ID || \
+              block_end - 1 > *first_mft_id))
+                *first_mft_id = block_end - 1;
+        }
+        if(block->next == sp->mft_map) break;
+    }
+    return (-1);
+}
+
+/**
+ * @brief Waits for completion of a chunk read.
+ */
+static void wait_for_chunk(mft_chunk *c,mft_scan_parameters *sp)
+{
+    ULONGLONG time;
+    NTSTATUS status;
+
+    if(!c->pending)
+        return;
+
+    time = winx_xtime();
+    status = NtWaitForSingleObject(c->hEvent,FALSE,NULL);
+    if(NT_SUCCESS(status)) status = c->iosb.Status;
+    sp->mb.io_wait_time += winx_xtime() - time;
+    c->pending = 0;
+
+    if(!NT_SUCCESS(status)){
+        strace(status,"cannot read %I64u file records starting from %I64u",
+            c->n_records,c->first_mft_id);
+        /* records of the chunk will fail the signature check */
+        memset(c->data,0,sp->mb.size);
+    }
+}
+
+/**
+ * @brief Appends a read of the next chunk
+ * to the queue, until the queue becomes full.
+ */
+static void fill_chunk_queue(mft_scan_parameters *sp)
+{
+    ULONGLONG first_mft_id, n_records, lcn, skipped;
+    LARGE_INTEGER offset;
+    mft_chunk *c;
+    ULONG length;
+    NTSTATUS status;
+    int i;
+
+    while(sp->mb.n_chunks < sp->mb.queue_depth \
+      && sp->mb.next_mft_id != NO_MFT_ID){
+        if(get_chunk_bounds(sp->mb.next_mft_id,
+          &first_mft_id,&n_records,&lcn,sp) < 0){
+            /* the record cannot be read in bulk */
+            sp->mb.next_mft_id = first_mft_id;
+            continue;
+        }
+
+        i = (sp->mb.head + sp->mb.n_chunks) % sp->mb.queue_depth;
+        c = &sp->mb.chunks[i];
+        c->first_mft_id = first_mft_id;
+        c->n_records = n_records;
+        length = (ULONG)(n_records * sp->ml.file_record_size);
+        if(length % sp->ml.cluster_size)
+            length += (ULONG)(sp->ml.cluster_size - \
+                length % sp->ml.cluster_size);
+        offset.QuadPart = lcn * sp->ml.cluster_size;
+        status = NtReadFile(sp->mb.hVolume,c->hEvent,NULL,NULL,
+            &c->iosb,c->data,length,&offset,NULL);
+        if(NT_SUCCESS(status)){
+            c->pending = 1;
+        } else {
+            strace(status,"cannot read %I64u file records starting from %I64u",
+                n_records,first_mft_id);
+            memset(c->data,0,sp->mb.size);
+        }
+        sp->mb.requests ++;
+        sp->mb.n_chunks ++;
+
+        /* schedule the chunk preceding the first record in use */
+        if(first_mft_id == 0){
+            sp->mb.next_mft_id = NO_MFT_ID;
+        } else {
+            skipped = sp->skipped_records;
+            sp->mb.next_mft_id = \
+                get_previous_used_record(first_mft_id - 1,0,sp);
+            sp->skipped_records = skipped;
+        }
+    }
+}
+
+/**
+ * @brief Makes a chunk containing the specified
+ * file record the current one.
+ * @details Chunks preceding it in the queue
+ * get released, while the queue gets refilled
+ * by reads of chunks following it. So, the disk
+ * stays busy while the chunk is being analyzed.
+ */
+static void load_mft_chunk(ULONGLONG mft_id,mft_scan_parameters *sp)
+{
+    mft_chunk *c;
+    int restarted = 0;
+
+    /* release the current chunk */
+    if(sp->mb.data){
+        sp->mb.head = (sp->mb.head + 1) % sp->mb.queue_depth;
+        sp->mb.n_chunks --;
+        sp->mb.data = NULL;
+    }
+    sp->mb.first_mft_id = sp->mb.n_records = 0;
+
+    while(1){
+        /* skip chunks following the record */
+        while(sp->mb.n_chunks){
+            c = &sp->mb.chunks[sp->mb.head];
+            if(c->first_mft_id <= mft_id) break;
+            wait_for_chunk(c,sp);
+            sp->mb.head = (sp->mb.head + 1) % sp->mb.queue_depth;
+            sp->mb.n_chunks --;
+        }
+
+        if(sp->mb.n_chunks == 0){
+            /* the record is out of the queue, restart reading from it */
+            if(restarted) break;
+            sp->mb.next_mft_id = mft_id;
+            fill_chunk_queue(sp);
+            restarted = 1;
+            continue;
+        }
+
+        c = &sp->mb.chunks[sp->mb.head];
+        if(mft_id < c->first_mft_id + c->n_records){
+            wait_for_chunk(c,sp);
+            sp->mb.data = c->data;
+            sp->mb.first_mft_id = c->first_mft_id;
+            sp->mb.n_records = c->n_records;
+            break;
+        }
+
+        /* the record lies between chunks and cannot be read in bulk */
+        break;
+    }
+
+    /* keep the disk busy */
+    fill_chunk_queue(sp);
+}
+
+/**
+ * @brief Retrieves a single file record
+ * from the chunk of records read in bulk.
+ * @return Zero for success, negative value
+ * indicates that the record is not in the
+ * chunk or failed validation.
+ */
+static int get_buffered_file_record(ULONGLONG mft_id,
+        NTFS_FILE_RECORD_OUTPUT_BUFFER *nfrob,
+        mft_scan_parameters *sp)
+{
+    FILE_RECORD_HEADER *frh;
+
+    if(sp->mb.data == NULL)
+        return (-1);
+    if(mft_id < sp->mb.first_mft_id || \
+      mft_id >= sp->mb.first_mft_id + sp->mb.n_records)
+        return (-1);
+
+    memcpy(nfrob->FileRecordBuffer,sp->mb.data + \
+        (mft_id - sp->mb.first_mft_id) * sp->ml.file_record_size,
+        sp->ml.file_record_size);
+    frh = (FILE_RECORD_HEADER *)nfrob->FileRecordBuffer;
+    if(apply_fixups(frh,sp) < 0)
+        return (-1);
+
+    nfrob->FileReferenceNumber = mft_id | \
+        ((ULONGLONG)frh->SequenceNumber << 48);
+    nfrob->FileRecordLength = sp->ml.file_record_size;
+#ifdef TEST_NTFS_SCANNER
+    randomize_file_record_data((char *)(void *)nfrob,
+        sp->ml.file_record_buffer_size);
+#endif
+    sp->mb.bulk_records ++;
+    return 0;
+}
+
+/**
+ * @brief get_file_record analog taking
+ * file records from chunks read in bulk
+ * whenever possible.
+ * @note Only the owner of the queue of chunks
+ * loads them, decoding threads use the current
+ * chunk only.
+ */
+static NTSTATUS read_file_record(ULONGLONG mft_id,
+        NTFS_FILE_RECORD_OUTPUT_BUFFER *nfrob,
+        mft_scan_parameters *sp)
+{
+    if(sp->mb.chunks){
+        if(mft_id < sp->mb.first_mft_id || \
+          mft_id >= sp->mb.first_mft_id + sp->mb.n_records)
+            load_mft_chunk(mft_id,sp);
+    }
+    if(sp->mb.data){
+        if(get_buffered_file_record(mft_id,nfrob,sp) == 0)
+            return STATUS_SUCCESS;
+    }
+    if(sp->mb.chunks || sp->mb.data)
+        sp->mb.fallback_records ++;
+    return get_file_record(mft_id,nfrob,sp);
+}
+
+static void free_chunk_queue(mft_scan_parameters *sp);
+
+/**
+ * @brief Prepares sp->mb for bulk reading of file records.
+ * @note Bulk reading gets disabled silently
+ * when the map of $Mft is unavailable.
+ */
+static void init_mft_buffer(mft_scan_parameters *sp)
+{
+    wchar_t path[] = L"\\??\\A:";
+    UNICODE_STRING us;
+    OBJECT_ATTRIBUTES oa;
+    IO_STATUS_BLOCK iosb;
+    unsigned long unit;
+    NTSTATUS status;
+    int i;
+
+    memset(&sp->mb,0,sizeof(mft_buffer));
+    if(sp->mft_map == NULL){
+        itrace("map of $Mft is unavailable, bulk reading disabled");
+        return;
+    }
+
+    /* each chunk must hold an integral number of both clusters and records */
+    unit = max((unsigned long)sp->ml.cluster_size,sp->ml.file_record_size);
+    sp->mb.size = mft_buffer_size - mft_buffer_size % unit;
+    if(sp->mb.size == 0) sp->mb.size = unit;
+    sp->mb.queue_depth = mft_queue_depth;
+    itrace("mft will be read by %u byte chunks, %u chunks at once",
+        sp->mb.size,sp->mb.queue_depth);
+
+    /* open the volume for asynchronous reads */
+    path[4] = winx_toupper(sp->volume_letter);
+    RtlInitUnicodeString(&us,path);
+    InitializeObjectAttributes(&oa,&us,OBJ_CASE_INSENSITIVE,NULL,NULL);
+    status = NtCreateFile(&sp->mb.hVolume,FILE_READ_DATA | FILE_READ_ATTRIBUTES,
+        &oa,&iosb,NULL,FILE_ATTRIBUTE_NORMAL,FILE_SHARE_READ | FILE_SHARE_WRITE,
+        FILE_OPEN,0,NULL,0);
+    if(!NT_SUCCESS(status)){
+        strace(status,"cannot open %ws",path);
+        sp->mb.hVolume = NULL;
+        goto fail;
+    }
+
+    /* allocate the queue */
+    sp->mb.chunks = winx_tmalloc(sp->mb.queue_depth * sizeof(mft_chunk));
+    if(sp->mb.chunks == NULL){
+        etrace("cannot allocate %u bytes of memory",
+            sp->mb.queue_depth * sizeof(mft_chunk));
+        goto fail;
+    }
+    memset(sp->mb.chunks,0,sp->mb.queue_depth * sizeof(mft_chunk));
+    for(i = 0; i < sp->mb.queue_depth; i++){
+        sp->mb.chunks[i].data = winx_tmalloc(sp->mb.size);
+        if(sp->mb.chunks[i].data == NULL){
+            etrace("cannot allocate %u bytes of memory",sp->mb.size);
+            goto fail;
+        }
+        status = NtCreateEvent(&sp->mb.chunks[i].hEvent,
+            STANDARD_RIGHTS_ALL | 0x1ff,NULL,NotificationEvent,0);
+        if(!NT_SUCCESS(status)){
+            strace(status,"cannot create event");
+            sp->mb.chunks[i].hEvent = NULL;
+            goto fail;
+        }
+    }
+    sp->mb.next_mft_id = NO_MFT_ID;
+    return;
+
+fail:
+    itrace("bulk reading of file records disabled");
+    free_chunk_queue(sp);
+}
+
+static void free_chunk_queue(mft_scan_parameters *sp)
+{
+    int i;
+
+    if(sp->mb.chunks){
+        for(i = 0; i < sp->mb.queue_depth; i++){
+            /* never release buffers which are still in use by the system */
+            if(sp->mb.chunks[i].pending)
+                wait_for_chunk(&sp->mb.chunks[i],sp);
+            if(sp->mb.chunks[i].hEvent)
+                NtClose(sp->mb.chunks[i].hEvent);
+            winx_free(sp->mb.chunks[i].data);
+        }
+        winx_free(sp->mb.chunks);
+        sp->mb.chunks = NULL;
+    }
+    if(sp->mb.hVolume){
+        NtClose(sp->mb.hVolume);
+        sp->mb.hVolume = NULL;
+    }
+    sp->mb.data = NULL;
+    sp->mb.first_mft_id = sp->mb.n_records = 0;
+    sp->mb.n_chunks = 0;
+}
+
+static void free_mft_buffer(mft_scan_parameters *sp)
+{
+    free_chunk_queue(sp);
+    winx_blockmap_destroy(&sp->mft_map);
+    winx_free(sp->mft_bitmap);
+    sp->mft_bitmap = NULL;
+    sp->mft_bitmap_bits = 0;
+}
+
+/**
+ * @brief Adjusts bulk reading of the MFT.
+ * @param[in] buffer_size size of a single chunk
+ * of the MFT read at once, in bytes. Zero value
+ * selects the default size of 4 MB.
+ * @param[in] queue_depth number of chunks kept
+ * in memory at once; all of them except of the one
+ * being analyzed are read in background. Zero value
+ * selects the default depth of 3 chunks, so two reads
+ * are always in flight.
+ * @note Affects subsequent NTFS scans only.
+ */
+void winx_set_mft_read_parameters(unsigned long buffer_size,int queue_depth)
+{
+    if(buffer_size == 0) buffer_size = MFT_BUFFER_SIZE;
+    if(buffer_size > MAX_MFT_BUFFER_SIZE) buffer_size = MAX_MFT_BUFFER_SIZE;
+    if(queue_depth == 0) queue_depth = MFT_QUEUE_DEPTH;
+    if(queue_depth < 2) queue_depth = 2;
+    if(queue_depth > MAX_MFT_QUEUE_DEPTH) queue_depth = MAX_MFT_QUEUE_DEPTH;
+    mft_buffer_size = buffer_size;
+    mft_queue_depth = queue_depth;
+}
+
 /*
 **************************************************
 *           MFT layout retrieving code
 **************************************************
 */
 
+/**
+ * @brief Saves the map of $Mft to sp->mft_map.
+ * @note If some runs are stored in child records
+ * the map remains incomplete; records placed
+ * outside of it will be retrieved through
+ * FSCTL_GET_NTFS_FILE_RECORD.
+ */
+static void get_mft_map(PNONRESIDENT_ATTRIBUTE pnr_attr,mft_scan_parameters *sp)
+{
+    ULONGLONG lcn, vcn, length;
+    PUCHAR run;
+
+    winx_blockmap_destroy(&sp->mft_map);
+
+    lcn = 0; vcn = 0;
+    run = (PUCHAR)((char *)pnr_attr + pnr_attr->RunArrayOffset);
+    while(*run){
+        lcn += RunLCN(run);
+        length = RunCount(run);
+        if(RunLCN(run)){
+            if(!check_run(lcn,length,sp)){
+                etrace("invalid run found in $Mft map");
+                winx_blockmap_destroy(&sp->mft_map);
+                return;
+            }
+            if(!winx_blockmap_append(&sp->mft_map,vcn,lcn,length)){
+                winx_blockmap_destroy(&sp->mft_map);
+                return;
+            }
+        }
+        run += RunLength(run);
+        vcn += length;
+    }
+
+    if(vcn * sp->ml.cluster_size < pnr_attr->DataSize)
+        itrace("map of $Mft is incomplete, it covers %I64u clusters only",vcn);
+}
+
+/**
+ * @brief Saves the $Mft:$BITMAP attribute to sp->mft_bitmap.
+ * @details Each bit of the bitmap indicates whether
+ * the corresponding file record is in use or not.
+ * @note If the bitmap cannot be retrieved,
+ * all the records will be scanned as usual.
+ */
+static void get_mft_bitmap(PATTRIBUTE pattr,mft_scan_parameters *sp)
+{
+    PRESIDENT_ATTRIBUTE pr_attr;
+    PNONRESIDENT_ATTRIBUTE pnr_attr;
+    ULONGLONG size, buffer_size;
+    ULONGLONG lcn, vcn, length, n;
+    PUCHAR run;
+    NTSTATUS status;
+
+    winx_free(sp->mft_bitmap);
+    sp->mft_bitmap = NULL;
+    sp->mft_bitmap_bits = 0;
+
+    if(pattr->Nonresident){
+        pnr_attr = (PNONRESIDENT_ATTRIBUTE)pattr;
+        if(pnr_attr->LowVcn) return;
+        size = pnr_attr->InitializedSize;
+    } else {
+        pr_attr = (PRESIDENT_ATTRIBUTE)pattr;
+        size = pr_attr->ValueLength;
+    }
+    if(size == 0) return;
+
+    /* allocate an integral number of both clusters and 64-bit words */
+    buffer_size = (size + sp->ml.cluster_size - 1) / \
+        sp->ml.cluster_size * sp->ml.cluster_size;
+    buffer_size = (buffer_size + sizeof(ULONGLONG) - 1) / \
+        sizeof(ULONGLONG) * sizeof(ULONGLONG);
+    sp->mft_bitmap = winx_tmalloc((SIZE_T)buffer_size);
+    if(sp->mft_bitmap == NULL){
+        etrace("cannot allocate %I64u bytes of memory",buffer_size);
+        return;
+    }
+    memset(sp->mft_bitmap,0,(size_t)buffer_size);
+
+    if(pattr->Nonresident){
+        /* read the bitmap run by run */
+        lcn = 0; vcn = 0;
+        run = (PUCHAR)((char *)pnr_attr + pnr_attr->RunArrayOffset);
+        while(*run && vcn * sp->ml.cluster_size < size){
+            lcn += RunLCN(run);
+            length = RunCount(run);
+            if(RunLCN(run) == 0 || !check_run(lcn,length,sp)){
+                etrace("$Mft bitmap has invalid run");
+                goto fail;
+            }
+            /* the allocated size exceeds the initialized one often */
+            n = length;
+            if((vcn + n) * sp->ml.cluster_size > buffer_size)
+                n = buffer_size / sp->ml.cluster_size - vcn;
+            status = read_sectors(lcn * sp->ml.sectors_per_cluster,
+                (char *)sp->mft_bitmap + vcn * sp->ml.cluster_size,
+                (ULONG)(n * sp->ml.cluster_size),sp);
+            if(!NT_SUCCESS(status)){
+                strace(status,"cannot read $Mft bitmap");
+                goto fail;
+            }
+            run += RunLength(run);
+            vcn += length;
+        }
+        if(vcn * sp->ml.cluster_size < size){
+            etrace("$Mft bitmap is incomplete");
+            goto fail;
+        }
+    } else {
+        memcpy(sp->mft_bitmap,(char *)pr_attr + pr_attr->ValueOffset,
+            (size_t)size);
+    }
+
+    sp->mft_bitmap_bits = size * 8;
+    return;
+
+fail:
+    winx_free(sp->mft_bitmap);
+    sp->mft_bitmap = NULL;
+}
+
+/**
+ * @brief Searches for the nearest file record
+ * in use, starting from the specified one and
+ * moving towards the beginning of the MFT.
+ * @details Skips long runs of free records
+ * 64 records at once.
+ * @return Index of the record in use. Records
+ * not covered by the bitmap are always considered
+ * being in use. Free records are counted down
+ * to first_mft_id only.
+ */
+static ULONGLONG get_previous_used_record(ULONGLONG mft_id,
+        ULONGLONG first_mft_id,mft_scan_parameters *sp)
+{
+    ULONGLONG i, word, used_mft_id;
+    int bit;
+
+    if(sp->mft_bitmap == NULL || mft_id >= sp->mft_bitmap_bits)
+        return mft_id;
+
+    /* mask out records above the specified one */
+    i = mft_id / 64; bit = (int)(mft_id % 64);
+    word = sp->mft_bitmap[i];
+    if(bit < 63) word &= ((ULONGLONG)1 << (bit + 1)) - 1;
+
+    /* skip words consisting of free records only */
+    while(word == 0 && i * 64 > first_mft_id)
+        word = sp->mft_bitmap[--i];
+
+    if(word == 0){
+        /* $Mft is always in use, so the bitmap seems to be wrong */
+        used_mft_id = (i == 0) ? 0 : i * 64 - 1;
+    } else {
+        /* get the highest bit set */
+        bit = 0;
+        if(word >> 32){ word >>= 32; bit += 32; }
+        if(word >> 16){ word >>= 16; bit += 16; }
+        if(word >> 8){ word >>= 8; bit += 8; }
+        if(word >> 4){ word >>= 4; bit += 4; }
+        if(word >> 2){ word >>= 2; bit += 2; }
+        if(word >> 1){ bit += 1; }
+        used_mft_id = i * 64 + bit;
+    }
+
+    if(used_mft_id >= first_mft_id)
+        sp->skipped_records += mft_id - used_mft_id;
+    else
+        sp->skipped_records += mft_id - first_mft_id + 1;
+    return used_mft_id;
+}
+
 static void get_number_of_file_records_callback(PATTRIBUTE pattr,mft_scan_parameters *sp)
 {
     PNONRESIDENT_ATTRIBUTE pnr_attr;
@@ -380,7 +1051,11 @@ static void get_number_of_file_records_callback(PATTRIBUTE pattr,mft_scan_parame
         if(sp->ml.file_record_size)
             sp->ml.number_of_file_records = pnr_attr->DataSize / sp->ml.file_record_size;
         itrace("mft contains %I64u records",sp->ml.number_of_file_records);
+        if(pattr->NameLength == 0 && pnr_attr->LowVcn == 0)
+            get_mft_map(pnr_attr,sp);
     }
+    if(pattr->AttributeType == AttributeBitmap && pattr->NameLength == 0)
+        get_mft_bitmap(pattr,sp);
 }
 
 /**
@@ -640,8 +1315,11 @@ static void analyze_attribute_from_mft_record(ULONGLONG mft_id,ATTRIBUTE_TYPE at
         return;
     }
     
-    /* get the specified mft record */
-    status = get_file_record(mft_id,nfrob,sp);
+    /* get the specified mft record, it may be already in the buffer */
+    if(get_buffered_file_record(mft_id,nfrob,sp) == 0)
+        status = STATUS_SUCCESS;
+    else
+        status = get_file_record(mft_id,nfrob,sp);
     if(!NT_SUCCESS(status)){
         strace(status,"cannot read %I64u file record",mft_id);
         winx_free(nfrob);
@@ -1056,10 +1734,10 @@ static winx_file_info * find_filelist_entry(wchar_t *attr_name,mft_scan_paramete
         if(f->next == *sp->filelist) break;
     }
     
-    f = (winx_file_info *)winx_list_insert((list_entry **)(void *)sp->filelist,NULL,sizeof(winx_file_info));
+    f = winx_ftw_insert_file(sp->filelist,sp->arena);
 
     /* initialize structure */
-    f->name = winx_wcsdup(attr_name);
+    f->name = winx_arena_wcsdup(sp->arena,attr_name);
     if(f->name == NULL){
         etrace("cannot allocate %u bytes of memory",
             (wcslen(attr_name) + 1) * sizeof(wchar_t));
@@ -1074,6 +1752,7 @@ static winx_file_info * find_filelist_entry(wchar_t *attr_name,mft_scan_paramete
     memset(&f->disp,0,sizeof(winx_file_disposition));
     f->internal.BaseMftId = sp->mfi.BaseMftId;
     f->internal.ParentDirectoryMftId = FILE_root;
+    f->internal.ParentDirectory = NULL;
     f->creation_time = 0;
     f->last_modification_time = 0;
     f->last_access_time = 0;
@@ -1082,16 +1761,11 @@ static winx_file_info * find_filelist_entry(wchar_t *attr_name,mft_scan_paramete
 
 static void process_run(winx_file_info *f,ULONGLONG vcn,ULONGLONG lcn,ULONGLONG length,mft_scan_parameters *sp)
 {
-    winx_blockmap *block, *prev_block = NULL;
+    winx_blockmap *block;
     
     /* add information to f->disp */
-    if(f->disp.blockmap) prev_block = f->disp.blockmap->prev;
-    block = (winx_blockmap *)winx_list_insert((list_entry **)&f->disp.blockmap,
-        (list_entry *)prev_block,sizeof(winx_blockmap));
-    
-    block->vcn = vcn;
-    block->lcn = lcn;
-    block->length = length;
+    block = winx_blockmap_append(&f->disp.blockmap,vcn,lcn,length);
+    if(block == NULL) return;
 
     f->disp.clusters += block->length;
     
@@ -1252,7 +1926,8 @@ static int update_stream_name(winx_file_info *f,mft_scan_parameters *sp)
     int length;
     
     length = (int)wcslen(f->name) + (int)wcslen(sp->mfi.Name) + 1;
-    new_name = winx_malloc((length + 1) * sizeof(wchar_t));
+    new_name = winx_arena_alloc(sp->arena,(length + 1) * sizeof(wchar_t),
+        MALLOC_ABORT_ON_FAILURE);
     
     if(f->name[0]) /* the stream name is not empty */
         _snwprintf(new_name,length + 1,L"%ws:%ws",sp->mfi.Name,f->name);
@@ -1450,108 +2125,196 @@ static winx_file_info * find_directory_by_mft_id(ULONGLONG mft_id,
     }
 }
 
+/* an entry of the index of directories */
+typedef struct _dir_entry {
+    winx_file_info *f;              /* the directory */
+    winx_dir_node *node;            /* node shared by the directory contents */
+} dir_entry;
+
+/* an auxiliary structure for the build_file_path routine */
+typedef struct _path_builder {
+    dir_entry *dirs;                /* directories indexed by mft index */
+    ULONGLONG n_dirs;               /* number of entries in the dirs array */
+    file_entry *f_array;            /* sorted files, if dirs is unavailable */
+    unsigned long n_entries;        /* number of entries in f_array */
+    wchar_t root[8];                /* native path of the root directory */
+    winx_dir_node *root_node;       /* node of the root directory */
+    winx_file_info *stack[MAX_PATH]; /* directories waiting for their paths */
+    ULONGLONG n_nodes;              /* number of directory nodes created */
+    ULONGLONG nodes_size;           /* bytes occupied by directory nodes */
+} path_builder;
+
 /**
- * @brief Retrieves path of the specified directory
- * as well as mft index of its parent directory.
- * @param[in] mft_id the mft index of the directory to be inspected.
- * @param[out] path the output buffer receiving the directory path.
- * @param[out] parent_mft_id pointer to variable receiving the mft
- * index of the parent directory.
- * @return Nonzero value indicates that the output buffer contains
- * the full native path, otherwise it contains the directory name only.
+ * @brief Joins the parent path and the filename,
+ * truncating the result to MAX_PATH - 1 characters.
  */
-static int get_directory_information(ULONGLONG mft_id,wchar_t **path,ULONGLONG *parent_mft_id,
-    file_entry *f_array,unsigned long n_entries,mft_scan_parameters *sp)
+static wchar_t *join_path(wchar_t *parent_path,
+    int separator,wchar_t *name,winx_arena *arena)
 {
-    winx_file_info *f;
-    
-    *path = NULL;
-    *parent_mft_id = FILE_root;
-    
-    f = find_directory_by_mft_id(mft_id,f_array,n_entries,sp);
-    if(f == NULL){
-        etrace("%I64u directory not found",mft_id);
-        sp->errors ++;
-        return 0;
-    }
+    size_t parent_length, name_length, length;
+    wchar_t *path;
     
-    *parent_mft_id = f->internal.ParentDirectoryMftId;
+    parent_length = min(wcslen(parent_path),MAX_PATH - 1);
+    name_length = wcslen(name);
+    length = min(parent_length + separator + name_length,MAX_PATH - 1);
     
-    if(f->path){
-        *path = f->path;
-        return 1;
+    path = winx_arena_alloc(arena,(length + 1) * sizeof(wchar_t),0);
+    if(path == NULL){
+        etrace("cannot allocate %u bytes of memory",
+            (length + 1) * sizeof(wchar_t));
+        return NULL;
     }
     
-    if(f->name){
-        *path = f->name;
+    memcpy(path,parent_path,parent_length * sizeof(wchar_t));
+    if(separator && parent_length < length)
+        path[parent_length] = '\\';
+    if(parent_length + separator < length){
+        memcpy(path + parent_length + separator,name,
+            (length - parent_length - separator) * sizeof(wchar_t));
     }
-    return 0;
+    path[length] = 0;
+    return path;
 }
 
-/* an auxiliary structure for the build_file_path routine */
-typedef struct _path_parts {
-    wchar_t child[MAX_PATH];   /* already gathered part of the path */
-    wchar_t buffer[MAX_PATH];  /* an auxiliary buffer */
-} path_parts;
-
-static void build_file_path(winx_file_info *f,file_entry *f_array,
-    unsigned long n_entries,path_parts *p,mft_scan_parameters *sp)
+/**
+ * @brief Builds full path of the file.
+ * @details Used when the index of directories
+ * is unavailable. Paths of parent directories
+ * lacking them are built on the way as well,
+ * so each directory path gets built exactly once.
+ */
+static void build_file_path(winx_file_info *f,
+    path_builder *pb,mft_scan_parameters *sp)
 {
-    ULONGLONG mft_id,parent_mft_id;
-    int full_path_retrieved = 0;
-    wchar_t *parent_path,*src;
-    
-    /* initialize p->child by the filename */
-    wcsncpy(p->child,f->name,MAX_PATH - 1);
-    p->child[MAX_PATH - 1] = 0;
-    
-    /* loop through parent directories */
-    parent_mft_id = f->internal.ParentDirectoryMftId;
-    while(parent_mft_id != FILE_root && !full_path_retrieved){
-        if(ftw_ntfs_check_for_termination(sp)) return;
-        mft_id = parent_mft_id;
-        full_path_retrieved = get_directory_information(mft_id,
-            &parent_path,&parent_mft_id,f_array,n_entries,sp);
-        if(parent_path)
-            _snwprintf(p->buffer,MAX_PATH,L"%ws\\%ws",parent_path,p->child);
-        else
-            _snwprintf(p->buffer,MAX_PATH,L"\\%ws",p->child);
-        p->buffer[MAX_PATH - 1] = 0;
-        wcscpy(p->child,p->buffer);
-    }
-    
-    /* append root directory path, if not appended yet */
-    if(p->child[1] == '?'){
-        src = p->child;
-    } else {
-        _snwprintf(p->buffer,MAX_PATH,L"\\??\\%c:\\%ws",sp->volume_letter,p->child);
-        p->buffer[MAX_PATH - 1] = 0;
-        src = p->buffer;
+    winx_file_info *dir;
+    wchar_t *parent_path;
+    int separator = 0;
+    int depth = 0;
+
+    /* gather directories lacking paths */
+    parent_path = pb->root;
+    for(dir = f; dir->path == NULL; ){
+        if(depth == MAX_PATH){
+            etrace("%ws: path is too deep",f->name);
+            sp->errors ++;
+            separator = 1;
+            break;
+        }
+        pb->stack[depth++] = dir;
+        if(dir->internal.ParentDirectoryMftId == FILE_root)
+            break;
+        dir = find_directory_by_mft_id(dir->internal.ParentDirectoryMftId,
+            pb->f_array,pb->n_entries,sp);
+        if(dir == NULL){
+            etrace("%I64u directory not found",
+                pb->stack[depth - 1]->internal.ParentDirectoryMftId);
+            sp->errors ++;
+            separator = 1;
+            break;
+        }
+        if(dir->path){
+            parent_path = dir->path;
+            separator = 1;
+        }
     }
     
-    /* update f->path */
-    f->path = winx_wcsdup(src);
-    if(f->path == NULL){
-        etrace("cannot allocate %u bytes of memory",
-            (wcslen(src) + 1) * sizeof(wchar_t));
-        sp->errors ++;
-        return;
+    /* build their paths starting from the topmost one */
+    while(depth){
+        if(ftw_ntfs_check_for_termination(sp)) return;
+        dir = pb->stack[--depth];
+        /* cyclic references may put a directory on the stack twice */
+        if(dir->path == NULL){
+            dir->path = join_path(parent_path,separator,dir->name,sp->arena);
+            if(dir->path == NULL){
+                sp->errors ++;
+                return;
+            }
+        }
+        parent_path = dir->path;
+        separator = 1;
     }
 
     //trace(D"%ws",f->path);
 }
 
 /**
- * @todo This procedure eats lots of CPU tacts,
- * optimize it for speed or run with thread priority
- * below normal.
+ * @brief Retrieves node of the directory.
+ * @details Nodes of the directory and its
+ * parents lacking them get created on the way,
+ * so each directory gets its node exactly once.
+ * @return The node, NULL indicates failure.
+ */
+static winx_dir_node *get_dir_node(ULONGLONG mft_id,
+    path_builder *pb,mft_scan_parameters *sp)
+{
+    winx_dir_node *node;
+    winx_file_info *dir;
+    int depth = 0;
+
+    /* gather directories lacking nodes */
+    while(1){
+        if(mft_id == FILE_root){
+            node = pb->root_node;
+            break;
+        }
+        if(mft_id >= pb->n_dirs || pb->dirs[mft_id].f == NULL){
+            etrace("%I64u directory not found",mft_id);
+            sp->errors ++;
+            node = pb->root_node;
+            break;
+        }
+        if(pb->dirs[mft_id].node){
+            node = pb->dirs[mft_id].node;
+            break;
+        }
+        if(depth == MAX_PATH){
+            etrace("%ws: path is too deep",pb->stack[0]->name);
+            sp->errors ++;
+            node = pb->root_node;
+            break;
+        }
+        dir = pb->dirs[mft_id].f;
+        pb->stack[depth++] = dir;
+        mft_id = dir->internal.ParentDirectoryMftId;
+    }
+
+    /* create their nodes starting from the topmost one */
+    while(depth){
+        dir = pb->stack[--depth];
+        mft_id = dir->internal.BaseMftId;
+        /* cyclic references may put a directory on the stack twice */
+        if(pb->dirs[mft_id].node == NULL){
+            pb->dirs[mft_id].node = winx_create_dir_node(node,
+                dir->name,sp->arena);
+            if(pb->dirs[mft_id].node == NULL){
+                sp->errors ++;
+                return NULL;
+            }
+            pb->n_nodes ++;
+            pb->nodes_size += sizeof(winx_dir_node) + \
+                (wcslen(dir->name) + 1) * sizeof(wchar_t);
+        }
+        node = pb->dirs[mft_id].node;
+    }
+    return node;
+}
+
+/**
+ * @brief Builds full paths of all the files.
+ * @details Directories are indexed by their mft
+ * indices, so the entire procedure takes a single
+ * pass through the list of files. Each file refers
+ * to a node of its parent directory shared by all
+ * the directory contents instead of keeping its own
+ * copy of the full path.
  */
 static int build_full_paths(mft_scan_parameters *sp)
 {
-    path_parts *p;
-    file_entry *f_array = NULL;
-    unsigned long n_entries = 0;
+    path_builder *pb;
     winx_file_info *f;
+    winx_dir_node *node;
+    ULONGLONG mft_id, n_indexed = 0;
+    ULONGLONG paths_size = 0;
     ULONG i;
     ULONGLONG time;
     
@@ -1559,54 +2322,440 @@ static int build_full_paths(mft_scan_parameters *sp)
     time = winx_xtime();
     
     /* allocate memory */
-    p = winx_malloc(sizeof(path_parts));
-
-    /* prepare data for fast binary search */
-    for(f = *sp->filelist; f != NULL; f = f->next){
-        n_entries++;
-        if(f->next == *sp->filelist) break;
+    pb = winx_malloc(sizeof(path_builder));
+    memset(pb,0,sizeof(path_builder));
+    _snwprintf(pb->root,sizeof(pb->root) / sizeof(wchar_t),
+        L"\\??\\%c:\\",sp->volume_letter);
+    pb->root[sizeof(pb->root) / sizeof(wchar_t) - 1] = 0;
+
+    /* prepare the index of directories */
+    pb->n_dirs = sp->ml.number_of_file_records;
+    if(pb->n_dirs){
+        pb->dirs = winx_tmalloc(pb->n_dirs * sizeof(dir_entry));
+        if(pb->dirs == NULL){
+            etrace("cannot allocate %I64u bytes of memory",
+                pb->n_dirs * sizeof(dir_entry));
+        }
     }
-
-    if(n_entries){
-        f_array = winx_tmalloc(n_entries * sizeof(file_entry));
-        if(f_array == NULL){
-            etrace("cannot allocate %u bytes of memory",
-                n_entries * sizeof(file_entry));
+    if(pb->dirs){
+        pb->root_node = winx_create_dir_node(NULL,pb->root,sp->arena);
+        if(pb->root_node == NULL){
+            winx_free(pb->dirs);
+            pb->dirs = NULL;
         }
     }
+    if(pb->dirs){
+        memset(pb->dirs,0,pb->n_dirs * sizeof(dir_entry));
+        for(f = *sp->filelist; f != NULL; f = f->next){
+            mft_id = f->internal.BaseMftId;
+            if(mft_id < pb->n_dirs && pb->dirs[mft_id].f == NULL){
+                if(wcsstr(f->name,L":$") == NULL){
+                    pb->dirs[mft_id].f = f; n_indexed ++;
+                }
+            }
+            if(f->next == *sp->filelist) break;
+        }
+        itrace("%I64u files have been indexed by mft index",n_indexed);
 
-    if(f_array){
-        /* fill the array */
-        i = 0;
         for(f = *sp->filelist; f != NULL; f = f->next){
-            f_array[i].mft_id = f->internal.BaseMftId;
-            f_array[i].f = f;
-            if(i == (n_entries - 1)){ 
-                if(f->next != *sp->filelist)
-                    etrace("???");
-                break;
+            if(ftw_ntfs_check_for_termination(sp)) break;
+            if(f->path == NULL && f->internal.ParentDirectory == NULL){
+                node = get_dir_node(f->internal.ParentDirectoryMftId,pb,sp);
+                if(node){
+                    f->internal.ParentDirectory = node;
+                    node->refcount ++;
+                    paths_size += (winx_get_file_path_length(f) + 1) \
+                        * sizeof(wchar_t);
+                }
             }
-            i++;
             if(f->next == *sp->filelist) break;
         }
-        itrace("fast binary search will be used");
+
+        /* release references held by the index */
+        for(mft_id = 0; mft_id < pb->n_dirs; mft_id++)
+            winx_release_dir_node(pb->dirs[mft_id].node);
+        winx_release_dir_node(pb->root_node);
+        itrace("%I64u directory nodes occupy %I64u bytes, "
+            "while full paths would occupy %I64u bytes",
+            pb->n_nodes,pb->nodes_size,paths_size);
     } else {
-        itrace("slow linear search will be used");
-    }
-    
-    for(f = *sp->filelist; f != NULL; f = f->next){
-        if(ftw_ntfs_check_for_termination(sp)) break;
-        build_file_path(f,f_array,n_entries,p,sp);
-        if(f->next == *sp->filelist) break;
+        /* prepare data for binary search */
+        for(f = *sp->filelist; f != NULL; f = f->next){
+            pb->n_entries++;
+            if(f->next == *sp->filelist) break;
+        }
+        if(pb->n_entries){
+            pb->f_array = winx_tmalloc(pb->n_entries * sizeof(file_entry));
+            if(pb->f_array == NULL){
+                etrace("cannot allocate %u bytes of memory",
+                    pb->n_entries * sizeof(file_entry));
+            }
+        }
+        if(pb->f_array){
+            i = 0;
+            for(f = *sp->filelist; f != NULL; f = f->next){
+                pb->f_array[i].mft_id = f->internal.BaseMftId;
+                pb->f_array[i].f = f;
+                if(i == (pb->n_entries - 1)){
+                    if(f->next != *sp->filelist)
+                        etrace("???");
+                    break;
+                }
+                i++;
+                if(f->next == *sp->filelist) break;
+            }
+            itrace("binary search will be used");
+        } else {
+            itrace("slow linear search will be used");
+        }
+
+        for(f = *sp->filelist; f != NULL; f = f->next){
+            if(ftw_ntfs_check_for_termination(sp)) break;
+            if(f->path == NULL)
+                build_file_path(f,pb,sp);
+            if(f->next == *sp->filelist) break;
+        }
     }
     
     /* free allocated resources */
-    winx_free(f_array);
-    winx_free(p);
+    winx_free(pb->dirs);
+    winx_free(pb->f_array);
+    winx_free(pb);
     itrace("build_full_paths completed in %I64u ms",winx_xtime() - time);
     return 0;
 }
 
+/*
+**************************************************
+*          Analysis of file record ranges
+**************************************************
+*/
+
+/**
+ * @brief Analyzes file records of the specified
+ * range, moving from its end to its beginning.
+ * @return Zero for success, negative value
+ * indicates that the $Mft record is unavailable.
+ */
+static int scan_file_records(ULONGLONG first_mft_id,ULONGLONG last_mft_id,
+        NTFS_FILE_RECORD_OUTPUT_BUFFER *nfrob,mft_scan_parameters *sp)
+{
+    ULONGLONG mft_id, ret_mft_id;
+    NTSTATUS status;
+
+    mft_id = last_mft_id;
+    while(!ftw_ntfs_check_for_termination(sp)){
+        /* skip free records */
+        mft_id = get_previous_used_record(mft_id,first_mft_id,sp);
+        if(mft_id < first_mft_id)
+            break;
+
+        status = read_file_record(mft_id,nfrob,sp);
+        if(!NT_SUCCESS(status)){
+            if(mft_id == 0){
+                strace(status,"get_file_record for $Mft failed");
+                return (-1);
+            }
+            if(mft_id == first_mft_id)
+                break;
+            /* 0xc000000d (invalid parameter) means non existing record */
+            mft_id --; /* try to retrieve the previous record */
+            continue;
+        }
+
+        /* records of preceding ranges are analyzed by somebody else */
+        ret_mft_id = GetMftIdFromFRN(nfrob->FileReferenceNumber);
+        if(ret_mft_id < first_mft_id)
+            break;
+
+        /* analyze the file record */
+        //trace(D"NTFS record found, id = %I64u",ret_mft_id);
+        analyze_file_record(nfrob,sp);
+
+        /* go to the next record */
+        if(ret_mft_id == first_mft_id || mft_id == first_mft_id)
+            break;
+        if(ret_mft_id > mft_id){
+            /* avoid infinite loops */
+            etrace("returned file record index is above expected");
+            mft_id --;
+        } else {
+            mft_id = ret_mft_id - 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Appends the second list of files
+ * to the end of the first one.
+ */
+static void append_file_list(winx_file_info **plist,winx_file_info *list)
+{
+    winx_file_info *tail;
+
+    if(list == NULL)
+        return;
+    if(*plist == NULL){
+        *plist = list;
+        return;
+    }
+
+    tail = (*plist)->prev;
+    tail->next = list;
+    (*plist)->prev = list->prev;
+    list->prev->next = *plist;
+    list->prev = tail;
+}
+
+/*
+**************************************************
+*        Parallel analysis of file records
+**************************************************
+*/
+
+/*
+* Each chunk of the MFT read in bulk gets split
+* into equal ranges, one per decoding thread.
+* Threads collect files into their own lists,
+* which get merged in mft index order after that,
+* so the resulting list is the same as produced
+* by the serial scan. Records pointed by attribute
+* lists are retrieved through FSCTL when they're
+* outside of the current chunk, so they get resolved
+* regardless of the chunk boundaries.
+*/
+
+/*
+* Maximum number of threads
+* analyzing file records.
+*/
+#define MAX_DECODING_THREADS 16
+
+typedef struct _decoding_thread {
+    mft_scan_parameters sp;     /* scan parameters owned by the thread */
+    winx_file_info *filelist;   /* files found by the thread */
+    NTFS_FILE_RECORD_OUTPUT_BUFFER *nfrob; /* a single file record */
+    ULONGLONG first_mft_id;     /* the first record of the range */
+    ULONGLONG last_mft_id;      /* the last record of the range */
+    HANDLE hStartEvent;         /* signaled when the range is assigned */
+    HANDLE hDoneEvent;          /* signaled when the range is analyzed */
+    int result;                 /* result of the range analysis */
+    int stop;                   /* forces the thread to exit */
+} decoding_thread;
+
+static DWORD WINAPI decoding_thread_proc(LPVOID p)
+{
+    decoding_thread *dt = (decoding_thread *)p;
+
+    while(1){
+        (void)NtWaitForSingleObject(dt->hStartEvent,FALSE,NULL);
+        if(dt->stop) break;
+        dt->result = scan_file_records(dt->first_mft_id,
+            dt->last_mft_id,dt->nfrob,&dt->sp);
+        (void)NtSetEvent(dt->hDoneEvent,NULL);
+    }
+
+    (void)NtSetEvent(dt->hDoneEvent,NULL);
+    winx_exit_thread(0);
+    return 0;
+}
+
+/**
+ * @brief Returns the number of threads
+ * to be used for file records analysis.
+ */
+static int get_number_of_decoding_threads(mft_scan_parameters *sp)
+{
+    int n;
+
+#ifdef TEST_NTFS_SCANNER
+    /* the random number generator isn't thread safe */
+    return 1;
+#endif
+
+    /* threads take records from chunks read in bulk */
+    if(sp->mb.chunks == NULL)
+        return 1;
+
+    n = (int)NtCurrentTeb()->Peb->NumberOfProcessors;
+    if(n < 1) n = 1;
+    if(n > MAX_DECODING_THREADS) n = MAX_DECODING_THREADS;
+    return n;
+}
+
+static void destroy_decoding_thread(decoding_thread *dt)
+{
+    if(dt->hDoneEvent){
+        dt->stop = 1;
+        (void)NtSetEvent(dt->hStartEvent,NULL);
+        (void)NtWaitForSingleObject(dt->hDoneEvent,FALSE,NULL);
+    }
+    if(dt->hStartEvent) NtClose(dt->hStartEvent);
+    if(dt->hDoneEvent) NtClose(dt->hDoneEvent);
+    if(dt->sp.f_volume) winx_fclose(dt->sp.f_volume);
+    winx_free(dt->nfrob);
+    winx_ftw_release(dt->filelist);
+    memset(dt,0,sizeof(decoding_thread));
+}
+
+/**
+ * @brief Prepares a thread for file records analysis.
+ * @return Zero for success, negative value otherwise.
+ */
+static int create_decoding_thread(decoding_thread *dt,mft_scan_parameters *sp)
+{
+    NTSTATUS status;
+
+    memset(dt,0,sizeof(decoding_thread));
+    dt->sp = *sp;
+    dt->sp.filelist = &dt->filelist;
+    dt->sp.pcb = NULL; /* the progress callback isn't thread safe */
+    dt->sp.t = NULL; /* termination gets checked between chunks */
+    dt->sp.errors = 0;
+    dt->sp.processed_attr_list_entries = 0;
+    dt->sp.skipped_records = 0;
+    dt->sp.mb.bulk_records = 0;
+    dt->sp.mb.fallback_records = 0;
+    /* the queue of chunks is owned by the main thread */
+    dt->sp.mb.chunks = NULL;
+    dt->sp.mb.hVolume = NULL;
+
+    /* each thread uses its own volume handle, requests aren't serialized */
+    dt->sp.f_volume = winx_vopen(sp->volume_letter);
+    if(dt->sp.f_volume == NULL)
+        goto fail;
+
+    dt->nfrob = winx_tmalloc(sp->ml.file_record_buffer_size);
+    if(dt->nfrob == NULL){
+        etrace("cannot allocate %u bytes of memory",
+            sp->ml.file_record_buffer_size);
+        goto fail;
+    }
+
+    status = NtCreateEvent(&dt->hStartEvent,STANDARD_RIGHTS_ALL | 0x1ff,
+        NULL,SynchronizationEvent,0);
+    if(!NT_SUCCESS(status)){
+        strace(status,"cannot create event");
+        dt->hStartEvent = NULL;
+        goto fail;
+    }
+    status = NtCreateEvent(&dt->hDoneEvent,STANDARD_RIGHTS_ALL | 0x1ff,
+        NULL,SynchronizationEvent,0);
+    if(!NT_SUCCESS(status)){
+        strace(status,"cannot create event");
+        dt->hDoneEvent = NULL;
+        goto fail;
+    }
+
+    if(winx_create_thread(decoding_thread_proc,(LPVOID)dt) < 0){
+        NtClose(dt->hDoneEvent);
+        dt->hDoneEvent = NULL;
+        goto fail;
+    }
+    return 0;
+
+fail:
+    destroy_decoding_thread(dt);
+    return (-1);
+}
+
+/**
+ * @brief Analyzes the entire MFT by a number
+ * of threads, chunk by chunk from right to left.
+ * @return Zero for success, negative value otherwise.
+ */
+static int scan_mft_in_parallel(decoding_thread *dt,int n_threads,
+        NTFS_FILE_RECORD_OUTPUT_BUFFER *nfrob,mft_scan_parameters *sp)
+{
+    winx_file_info *chunk_list, *f;
+    ULONGLONG mft_id, first_mft_id, range;
+    ULONGLONG ret_mft_id;
+    NTSTATUS status;
+    int i, n, result = 0;
+
+    mft_id = sp->ml.number_of_file_records - 1;
+    while(!ftw_ntfs_check_for_termination(sp)){
+        /* read the next chunk */
+        mft_id = get_previous_used_record(mft_id,0,sp);
+        load_mft_chunk(mft_id,sp);
+        if(sp->mb.data == NULL){
+            /* the record cannot be read in bulk, analyze it here */
+            status = read_file_record(mft_id,nfrob,sp);
+            if(NT_SUCCESS(status)){
+                ret_mft_id = GetMftIdFromFRN(nfrob->FileReferenceNumber);
+                if(ret_mft_id <= mft_id){
+                    analyze_file_record(nfrob,sp);
+                    /* records between them are free */
+                    mft_id = ret_mft_id;
+                } else {
+                    /* avoid infinite loops */
+                    etrace("returned file record index is above expected");
+                }
+            } else if(mft_id == 0){
+                strace(status,"get_file_record for $Mft failed");
+                return (-1);
+            }
+            if(mft_id == 0)
+                break;
+            mft_id --;
+            continue;
+        }
+        first_mft_id = sp->mb.first_mft_id;
+
+        /* split it to equal ranges */
+        range = (mft_id - first_mft_id) / n_threads + 1;
+        for(i = 0; i < n_threads; i++){
+            dt[i].sp.mb.data = sp->mb.data;
+            dt[i].sp.mb.first_mft_id = sp->mb.first_mft_id;
+            dt[i].sp.mb.n_records = sp->mb.n_records;
+            dt[i].first_mft_id = first_mft_id + i * range;
+            if(dt[i].first_mft_id > mft_id)
+                break;
+            dt[i].last_mft_id = min(dt[i].first_mft_id + range - 1,mft_id);
+            (void)NtSetEvent(dt[i].hStartEvent,NULL);
+        }
+        n = i;
+
+        /* wait for all the ranges analysis */
+        for(i = 0; i < n; i++)
+            (void)NtWaitForSingleObject(dt[i].hDoneEvent,FALSE,NULL);
+
+        /* merge lists of files and counters */
+        chunk_list = NULL;
+        for(i = 0; i < n; i++){
+            if(dt[i].result < 0) result = -1;
+            append_file_list(&chunk_list,dt[i].filelist);
+            dt[i].filelist = NULL;
+            sp->errors += dt[i].sp.errors;
+            sp->processed_attr_list_entries += \
+                dt[i].sp.processed_attr_list_entries;
+            sp->skipped_records += dt[i].sp.skipped_records;
+            sp->mb.bulk_records += dt[i].sp.mb.bulk_records;
+            sp->mb.fallback_records += dt[i].sp.mb.fallback_records;
+            dt[i].sp.errors = 0;
+            dt[i].sp.processed_attr_list_entries = 0;
+            dt[i].sp.skipped_records = 0;
+            dt[i].sp.mb.bulk_records = 0;
+            dt[i].sp.mb.fallback_records = 0;
+        }
+        if(sp->pcb){
+            for(f = chunk_list; f; f = f->next){
+                sp->pcb(f,sp->user_defined_data);
+                if(f->next == chunk_list) break;
+            }
+        }
+        append_file_list(&chunk_list,*sp->filelist);
+        *sp->filelist = chunk_list;
+
+        /* go to the next chunk */
+        if(result < 0 || first_mft_id == 0)
+            break;
+        mft_id = first_mft_id - 1;
+    }
+    return result;
+}
+
 /*
 **************************************************
 *       NTFS scan entry point and helpers
@@ -1623,9 +2772,9 @@ static int build_full_paths(mft_scan_parameters *sp)
 static int scan_mft(mft_scan_parameters *sp)
 {
     NTFS_FILE_RECORD_OUTPUT_BUFFER *nfrob;
-    ULONGLONG start_time;
-    ULONGLONG mft_id, ret_mft_id;
-    NTSTATUS status;
+    decoding_thread *dt = NULL;
+    ULONGLONG start_time, time;
+    int i, n_threads;
     int result;
     
     itrace("mft scan started");
@@ -1639,6 +2788,7 @@ static int scan_mft(mft_scan_parameters *sp)
     /* get mft layout */
     if(get_mft_layout(sp) < 0){
 fail:
+        free_mft_buffer(sp);
         etrace("mft scan failed");
         return (-1);
     }
@@ -1648,46 +2798,75 @@ fail:
     if(nfrob == NULL){
         etrace("cannot allocate %u bytes of memory",
             sp->ml.file_record_buffer_size);
+        free_mft_buffer(sp);
         return (-1);
     }
+    init_mft_buffer(sp);
     
-    /* scan all file records sequentially */
-    mft_id = sp->ml.number_of_file_records - 1;
+    /* set it before the threads copy the scan parameters */
     sp->mft_scan_direction = MFT_SCAN_RTL;
-    while(!ftw_ntfs_check_for_termination(sp)){
-        status = get_file_record(mft_id,nfrob,sp);
-        if(!NT_SUCCESS(status)){
-            if(mft_id == 0){
-                strace(status,"get_file_record for $Mft failed");
-                winx_free(nfrob);
-                goto fail;
-            }
-            /* it returns 0xc000000d (invalid parameter) for non existing records */
-            mft_id --; /* try to retrieve the previous record */
-            continue;
-        }
-
-        /* analyze the file record */
-        ret_mft_id = GetMftIdFromFRN(nfrob->FileReferenceNumber);
-        //trace(D"NTFS record found, id = %I64u",ret_mft_id);
-        analyze_file_record(nfrob,sp);
 
-        /* go to the next record */
-        if(ret_mft_id == 0 || mft_id == 0)
-            break;
-        if(ret_mft_id > mft_id){
-            /* avoid infinite loops */
-            etrace("returned file record index is above expected");
-            mft_id --;
-        } else {
-            mft_id = ret_mft_id - 1;
+    /* prepare threads for parallel analysis */
+    n_threads = get_number_of_decoding_threads(sp);
+    if(n_threads > 1){
+        dt = winx_tmalloc(n_threads * sizeof(decoding_thread));
+        if(dt == NULL){
+            etrace("cannot allocate %u bytes of memory",
+                n_threads * sizeof(decoding_thread));
+            n_threads = 1;
+        }
+    }
+    if(n_threads > 1){
+        for(i = 0; i < n_threads; i++){
+            if(create_decoding_thread(&dt[i],sp) < 0) break;
+        }
+        n_threads = i;
+        if(n_threads < 2){
+            for(i = 0; i < n_threads; i++)
+                destroy_decoding_thread(&dt[i]);
+            n_threads = 1;
         }
     }
 
+    /* scan all file records sequentially */
+    if(sp->mft_bitmap == NULL)
+        itrace("$Mft bitmap is unavailable, all the records will be scanned");
+    if(n_threads > 1){
+        itrace("file records will be analyzed by %u threads",n_threads);
+        result = scan_mft_in_parallel(dt,n_threads,nfrob,sp);
+        for(i = 0; i < n_threads; i++)
+            destroy_decoding_thread(&dt[i]);
+    } else {
+        result = scan_file_records(0,
+            sp->ml.number_of_file_records - 1,nfrob,sp);
+    }
+    winx_free(dt);
+    if(result < 0){
+        winx_free(nfrob);
+        goto fail;
+    }
+
     itrace("%u attribute list entries have been processed totally",
         sp->processed_attr_list_entries);
-    itrace("file records scan completed in %I64u ms",
-        winx_xtime() - start_time);
+    time = winx_xtime() - start_time;
+    if(sp->mb.chunks){
+        itrace("%I64u file records have been read in bulk, %I64u through FSCTL",
+            sp->mb.bulk_records,sp->mb.fallback_records);
+        itrace("%I64u read requests issued, %I64u ms spent waiting for them",
+            sp->mb.requests,sp->mb.io_wait_time);
+        itrace("%I64u ms spent analyzing file records",
+            time - min(time,sp->mb.io_wait_time));
+    }
+    if(sp->mft_bitmap){
+        itrace("%I64u free file records have been skipped",
+            sp->skipped_records);
+    }
+    itrace("file records scan completed in %I64u ms",time);
+    if(time){
+        itrace("%I64u file records per second have been processed",
+            sp->ml.number_of_file_records * 1000 / time);
+    }
+    free_mft_buffer(sp);
     
     /* build full paths */
     result = build_full_paths(sp);
@@ -1713,7 +2892,8 @@ fail:
 static int ntfs_scan_disk_helper(char volume_letter,
     int flags, ftw_filter_callback fcb,
     ftw_progress_callback pcb, ftw_terminator t,
-    void *user_defined_data, winx_file_info **filelist)
+    void *user_defined_data, winx_file_info **filelist,
+    winx_arena *arena)
 {
 	wchar_t path[] = L"\\??\\A:";
     int result;
@@ -1721,6 +2901,7 @@ static int ntfs_scan_disk_helper(char volume_letter,
     winx_file_info *f;
     
     sp.filelist = filelist;
+    sp.arena = arena;
     sp.volume_letter = volume_letter;
     sp.processed_attr_list_entries = 0;
     sp.errors = 0;
@@ -1729,6 +2910,11 @@ static int ntfs_scan_disk_helper(char volume_letter,
     sp.pcb = pcb;
     sp.t = t;
     sp.user_defined_data = user_defined_data;
+    sp.mft_map = NULL;
+    memset(&sp.mb,0,sizeof(mft_buffer));
+    sp.mft_bitmap = NULL;
+    sp.mft_bitmap_bits = 0;
+    sp.skipped_records = 0;
     
     /* open the volume for read access */
     path[4] = winx_toupper(volume_letter);
@@ -1770,17 +2956,20 @@ static int ntfs_scan_disk_helper(char volume_letter,
  */
 winx_file_info *ntfs_scan_disk(char volume_letter,
     int flags, ftw_filter_callback fcb, ftw_progress_callback pcb, 
-    ftw_terminator t, void *user_defined_data)
+    ftw_terminator t, void *user_defined_data, winx_arena *arena)
 {
     winx_file_info *filelist = NULL;
     
-    if(ntfs_scan_disk_helper(volume_letter,flags,fcb,pcb,t,user_defined_data,&filelist) == (-1) && \
+    if(ntfs_scan_disk_helper(volume_letter,flags,fcb,pcb,t,
+      user_defined_data,&filelist,arena) == (-1) && \
       !(flags & WINX_FTW_ALLOW_PARTIAL_SCAN)){
-        /* destroy the list */
-        winx_ftw_release(filelist);
+        /* destroy the list along with the arena */
+        if(filelist) winx_ftw_release(filelist);
+        else winx_destroy_arena(arena);
         return NULL;
     }
-        
+
+    if(filelist == NULL) winx_destroy_arena(arena);
     return filelist;
 }
 
@@ -101,8 +101,369 @@ void winx_heap_free(void *addr)
     * Avoid winx_dbg_xxx calls here
     * to avoid recursion.
     */
-    if(hGlobalHeap && addr)
+    if(hGlobalHeap && addr){
+        /* blocks of arenas get released along with them */
+        if(winx_get_arena(addr)) return;
         (void)RtlFreeHeap(hGlobalHeap,0,addr);
+    }
+}
+
+/**
+ * @internal
+ * @brief Maximum number of arenas
+ * which may exist at the same time.
+ */
+#define MAX_ARENAS 16
+
+/**
+ * @internal
+ * @brief Size of the address range
+ * shared by all the arenas, in bytes.
+ * @details On 32-bit systems the range
+ * is kept small to leave enough of the
+ * address space to the heap; allocations
+ * exceeding it are passed to the heap.
+ */
+#if defined(_WIN64)
+#define ARENA_RESERVE_SIZE ((SIZE_T)16 * 1024 * 1024 * 1024)
+#else
+#define ARENA_RESERVE_SIZE ((SIZE_T)256 * 1024 * 1024)
+#endif
+
+/**
+ * @internal
+ * @brief The smallest range worth reserving.
+ */
+#define ARENA_MIN_RESERVE_SIZE ((SIZE_T)16 * 1024 * 1024)
+
+/**
+ * @internal
+ * @brief Arenas take the shared range
+ * by segments of this size, in bytes;
+ * larger blocks are passed to the heap.
+ */
+#define ARENA_SEGMENT_SIZE ((SIZE_T)1024 * 1024)
+
+/**
+ * @internal
+ * @brief Alignment of blocks allocated
+ * from arenas; matches the one guaranteed
+ * by the heap.
+ */
+#define ARENA_ALIGNMENT (2 * sizeof(void *))
+
+/*
+* The address range shared by all the arenas.
+*/
+typedef struct _arena_span {
+    char *base;                 /* the reserved address range */
+    SIZE_T size;                /* its size, in bytes */
+    ULONG n_segments;           /* number of segments in the range */
+    LONG volatile owners[1];    /* indices of owners plus one */
+} arena_span;
+
+winx_arena arenas[MAX_ARENAS] = {{0}};
+arena_span * volatile span = NULL;
+
+/**
+ * @internal
+ * @brief Reserves the address range
+ * shared by all the arenas, unless
+ * it has been reserved already.
+ * @return Zero for success, negative value otherwise.
+ */
+static int reserve_arena_span(void)
+{
+    arena_span *s;
+    PVOID base = NULL;
+    SIZE_T size, n, free_size = 0;
+    NTSTATUS status = STATUS_NO_MEMORY;
+
+    if(span) return 0;
+
+    /* reserve as much address space as possible */
+    for(size = ARENA_RESERVE_SIZE; size >= ARENA_MIN_RESERVE_SIZE; size >>= 1){
+        base = NULL;
+        status = NtAllocateVirtualMemory(NtCurrentProcess(),&base,0,
+            &size,MEM_RESERVE,PAGE_READWRITE);
+        if(NT_SUCCESS(status)) break;
+    }
+    if(!NT_SUCCESS(status)){
+        strace(status,"cannot reserve address space");
+        return (-1);
+    }
+
+    n = size / ARENA_SEGMENT_SIZE;
+    s = winx_heap_alloc(sizeof(arena_span) + n * sizeof(LONG),0);
+    if(s == NULL){
+        etrace("cannot allocate %u bytes of memory",
+            sizeof(arena_span) + n * sizeof(LONG));
+        (void)NtFreeVirtualMemory(NtCurrentProcess(),
+            &base,&free_size,MEM_RELEASE);
+        return (-1);
+    }
+    memset(s,0,sizeof(arena_span) + n * sizeof(LONG));
+    s->base = (char *)base;
+    s->size = size;
+    s->n_segments = (ULONG)n;
+
+    /* another thread may have reserved the range meanwhile */
+    if(InterlockedCompareExchangePointer((PVOID *)&span,s,NULL) != NULL){
+        (void)NtFreeVirtualMemory(NtCurrentProcess(),
+            &base,&free_size,MEM_RELEASE);
+        winx_heap_free(s);
+    }
+    return 0;
+}
+
+/**
+ * @internal
+ * @brief Returns the end of the
+ * segment containing an address.
+ */
+static char *get_segment_end(char *addr)
+{
+    SIZE_T i = (addr - span->base) / ARENA_SEGMENT_SIZE;
+
+    return span->base + (i + 1) * ARENA_SEGMENT_SIZE;
+}
+
+/**
+ * @internal
+ * @brief Takes a free segment
+ * of the shared range for an arena.
+ * @return Address of the committed
+ * segment, NULL indicates failure.
+ */
+static char *take_segment(winx_arena *arena)
+{
+    LONG owner = (LONG)(arena - arenas) + 1;
+    PVOID addr;
+    SIZE_T length;
+    NTSTATUS status;
+    ULONG i;
+
+    for(i = 0; i < span->n_segments; i++){
+        if(span->owners[i]) continue;
+        if(InterlockedCompareExchange(&span->owners[i],owner,0))
+            continue;
+        addr = span->base + i * ARENA_SEGMENT_SIZE;
+        length = ARENA_SEGMENT_SIZE;
+        status = NtAllocateVirtualMemory(NtCurrentProcess(),&addr,0,
+            &length,MEM_COMMIT,PAGE_READWRITE);
+        if(!NT_SUCCESS(status)){
+            (void)InterlockedExchange(&span->owners[i],0);
+            return NULL;
+        }
+        arena->size += ARENA_SEGMENT_SIZE;
+        return (char *)addr;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Creates an arena.
+ * @details Arenas allocate memory by advancing
+ * a pointer through segments of an address range
+ * shared by all of them, so allocations are cheap
+ * and all of them get released at once by
+ * winx_destroy_arena. Arenas take segments one by
+ * one, when they need them, so they reserve no more
+ * address space than they use. Blocks allocated from
+ * arenas may be passed to winx_free as usual, it
+ * ignores them. Arenas are thread safe.
+ * @return Pointer to the arena, NULL indicates failure.
+ * @note Intended to hold data sharing the same
+ * lifetime, like lists of files produced by
+ * a single disk scan.
+ */
+winx_arena *winx_create_arena(void)
+{
+    winx_arena *arena = NULL;
+    wchar_t name[32];
+    int i;
+
+    if(reserve_arena_span() < 0)
+        return NULL;
+
+    for(i = 0; i < MAX_ARENAS; i++){
+        if(InterlockedCompareExchange(&arenas[i].used,1,0) == 0){
+            arena = &arenas[i];
+            break;
+        }
+    }
+    if(arena == NULL){
+        etrace("too many arenas exist");
+        return NULL;
+    }
+
+    _snwprintf(name,sizeof(name) / sizeof(wchar_t),L"winx_arena_lock_%u",i);
+    name[sizeof(name) / sizeof(wchar_t) - 1] = 0;
+    if(winx_create_lock(name,&arena->hLock) < 0){
+        arena->used = 0;
+        return NULL;
+    }
+
+    arena->next = NULL;
+    arena->size = 0;
+    arena->overflow = 0;
+    return arena;
+}
+
+/**
+ * @brief Allocates a block of memory from an arena.
+ * @param[in] arena pointer to the arena. If this
+ * parameter is NULL, the heap is used instead.
+ * @param[in] size size of the block, in bytes.
+ * @param[in] flags a combination of MALLOC_XXX
+ * flags defined in zenwinx.h file.
+ * @return The address of the allocated block.
+ * NULL indicates failure.
+ * @note When the arena gets exhausted
+ * the block gets allocated from the heap.
+ */
+void *winx_arena_alloc(winx_arena *arena,size_t size,int flags)
+{
+    char *p, *segment;
+
+    /*
+    * Avoid winx_dbg_xxx calls here
+    * to avoid recursion.
+    */
+
+    if(arena == NULL || !arena->used)
+        return winx_heap_alloc(size,flags);
+
+    size = (size + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+    if(size == 0) size = ARENA_ALIGNMENT;
+    if(size >= ARENA_SEGMENT_SIZE)
+        goto use_heap;
+
+    for(;;){
+        /*
+        * The pointer never reaches the end of
+        * its segment, so the segment can be
+        * found by the pointer itself.
+        */
+        p = arena->next;
+        if(p && size < (SIZE_T)(get_segment_end(p) - p)){
+            if(InterlockedCompareExchangePointer((PVOID *)&arena->next,
+              p + size,p) == p) return p;
+            continue;
+        }
+
+        /* switch to a new segment */
+        if(winx_acquire_lock(arena->hLock,INFINITE) < 0)
+            goto use_heap;
+        if(arena->next != p){
+            /* another thread did it already */
+            (void)winx_release_lock(arena->hLock);
+            continue;
+        }
+        segment = take_segment(arena);
+        if(segment)
+            (void)InterlockedExchangePointer((PVOID *)&arena->next,
+                segment + size);
+        (void)winx_release_lock(arena->hLock);
+        if(segment == NULL)
+            goto use_heap;
+        return segment;
+    }
+
+use_heap:
+    (void)InterlockedIncrement(&arena->overflow);
+    return winx_heap_alloc(size,flags);
+}
+
+/**
+ * @brief Duplicates a string
+ * in memory allocated from an arena.
+ * @param[in] arena pointer to the arena.
+ * If this parameter is NULL, the heap is
+ * used instead.
+ * @param[in] s the string to be duplicated.
+ * @return The duplicated string, NULL
+ * indicates failure.
+ */
+wchar_t *winx_arena_wcsdup(winx_arena *arena,const wchar_t *s)
+{
+    wchar_t *copy;
+    size_t size;
+
+    if(s == NULL) return NULL;
+
+    size = (wcslen(s) + 1) * sizeof(wchar_t);
+    copy = winx_arena_alloc(arena,size,0);
+    if(copy) memcpy(copy,s,size);
+    return copy;
+}
+
+/**
+ * @brief Returns the arena
+ * containing a block of memory.
+ * @details Takes a constant time, so
+ * winx_free can call it for each block.
+ * @param[in] addr the address of the block.
+ * @return Pointer to the arena, NULL
+ * indicates that the block doesn't
+ * belong to any arena.
+ */
+winx_arena *winx_get_arena(void *addr)
+{
+    arena_span *s = span;
+    LONG owner;
+
+    /*
+    * Avoid winx_dbg_xxx calls here
+    * to avoid recursion.
+    */
+
+    if(addr == NULL || s == NULL) return NULL;
+    if((char *)addr < s->base || (char *)addr >= s->base + s->size)
+        return NULL;
+
+    owner = s->owners[((char *)addr - s->base) / ARENA_SEGMENT_SIZE];
+    return owner ? &arenas[owner - 1] : NULL;
+}
+
+/**
+ * @brief Destroys an arena releasing
+ * all the blocks allocated from it.
+ * @param[in] arena pointer to the arena.
+ * @note Blocks passed to the heap
+ * when the arena has been exhausted
+ * must be released by winx_free.
+ */
+void winx_destroy_arena(winx_arena *arena)
+{
+    LONG owner;
+    PVOID addr;
+    SIZE_T size;
+    ULONG i;
+
+    if(arena == NULL || !arena->used)
+        return;
+
+    itrace("arena took %I64u bytes, %u blocks passed to the heap",
+        (ULONGLONG)arena->size,(UINT)arena->overflow);
+
+    /* release the segments */
+    owner = (LONG)(arena - arenas) + 1;
+    for(i = 0; i < span->n_segments && arena->size; i++){
+        if(span->owners[i] != owner) continue;
+        addr = span->base + i * ARENA_SEGMENT_SIZE;
+        size = ARENA_SEGMENT_SIZE;
+        (void)NtFreeVirtualMemory(NtCurrentProcess(),
+            &addr,&size,MEM_DECOMMIT);
+        (void)InterlockedExchange(&span->owners[i],0);
+        arena->size -= ARENA_SEGMENT_SIZE;
+    }
+
+    winx_destroy_lock(arena->hLock);
+    arena->hLock = NULL;
+    arena->next = NULL;
+    arena->size = 0;
+    arena->used = 0;
 }
 
 /**
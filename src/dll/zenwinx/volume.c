@@ -27,6 +27,21 @@
 #include "prec.h"
 #include "zenwinx.h"
 
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#define LLINVALID ((ULONGLONG) -1)
+
+/*
+* The bitmap is requested in big portions
+* to keep the number of FSCTL calls low.
+* If there isn't enough memory for that,
+* smaller portions are used instead.
+*/
+#define BITMAPBYTES       (4 * 1024 * 1024)
+#define BITMAPBYTES_SMALL (64 * 1024)
+
 /**
  * @internal
  * @brief Opens the root directory of a volume.
@@ -456,6 +471,232 @@ int winx_vflush(char volume_letter)
     return result;
 }
 
+/************************************************************/
+/*              Search tree over the free regions           */
+/************************************************************/
+
+/*
+* Besides the sorted list, the regions are linked
+* into a treap keyed by lcn. Each node keeps the length
+* of the biggest region of its subtree, so the regions
+* can be located and searched by size in logarithmic time.
+* The root isn't stored anywhere, it's found by climbing
+* up from any region of the list.
+*/
+
+static winx_volume_region *rgn_root(winx_volume_region *r)
+{
+    if(r == NULL) return NULL;
+    while(r->parent) r = r->parent;
+    return r;
+}
+
+static void rgn_update(winx_volume_region *r)
+{
+    r->max_length = r->length;
+    if(r->left && r->left->max_length > r->max_length)
+        r->max_length = r->left->max_length;
+    if(r->right && r->right->max_length > r->max_length)
+        r->max_length = r->right->max_length;
+}
+
+static void rgn_update_path(winx_volume_region *r)
+{
+    for(; r; r = r->parent) rgn_update(r);
+}
+
+/* lifts the region over its parent */
+static void rgn_rotate_up(winx_volume_region *r)
+{
+    winx_volume_region *p = r->parent;
+    winx_volume_region *g = p->parent;
+
+    if(p->left == r){
+        p->left = r->right;
+        if(r->right) r->right->parent = p;
+        r->right = p;
+    } else {
+        p->right = r->left;
+        if(r->left) r->left->parent = p;
+        r->left = p;
+    }
+    p->parent = r;
+    r->parent = g;
+    if(g){
+        if(g->left == p) g->left = r;
+        else g->right = r;
+    }
+    rgn_update(p);
+    rgn_update(r);
+}
+
+static void rgn_tree_insert(winx_volume_region *root,winx_volume_region *r)
+{
+    winx_volume_region *p = NULL;
+    ULONG_PTR a = (ULONG_PTR)r;
+
+    r->left = r->right = NULL;
+    r->max_length = r->length;
+    /* addresses of heap blocks are random enough */
+    r->priority = (ULONG)(a >> 4) * 0x9E3779B1;
+    r->priority ^= r->priority >> 15;
+
+    while(root){
+        p = root;
+        root = (r->lcn < root->lcn) ? root->left : root->right;
+    }
+    r->parent = p;
+    if(p){
+        if(r->lcn < p->lcn) p->left = r;
+        else p->right = r;
+    }
+    rgn_update_path(p);
+
+    while(r->parent && r->parent->priority < r->priority)
+        rgn_rotate_up(r);
+}
+
+static void rgn_tree_remove(winx_volume_region *r)
+{
+    winx_volume_region *c, *p;
+
+    /* push the region down until it has a single child */
+    while(r->left && r->right){
+        c = (r->left->priority > r->right->priority) ? r->left : r->right;
+        rgn_rotate_up(c);
+    }
+    c = r->left ? r->left : r->right;
+    p = r->parent;
+    if(c) c->parent = p;
+    if(p){
+        if(p->left == r) p->left = c;
+        else p->right = c;
+    }
+    r->parent = r->left = r->right = NULL;
+    rgn_update_path(p);
+}
+
+/* returns the last region starting at or before the lcn */
+static winx_volume_region *rgn_find_prev(winx_volume_region *root,ULONGLONG lcn)
+{
+    winx_volume_region *prev = NULL;
+
+    while(root){
+        if(root->lcn > lcn){
+            root = root->left;
+        } else {
+            prev = root;
+            root = root->right;
+        }
+    }
+    return prev;
+}
+
+static winx_volume_region *rgn_insert(winx_volume_region **rlist,
+        winx_volume_region *prev,ULONGLONG lcn,ULONGLONG length)
+{
+    winx_volume_region *root, *r;
+
+    root = rgn_root(*rlist);
+    r = (winx_volume_region *)winx_list_insert((list_entry **)(void *)rlist,
+        (list_entry *)prev,sizeof(winx_volume_region));
+    r->lcn = lcn;
+    r->length = length;
+    rgn_tree_insert(root,r);
+    return r;
+}
+
+static void rgn_remove(winx_volume_region **rlist,winx_volume_region *r)
+{
+    rgn_tree_remove(r);
+    winx_list_remove((list_entry **)(void *)rlist,(list_entry *)r);
+}
+
+/**
+ * @internal
+ * @brief Returns index of the least
+ * significant set bit of a nonzero word.
+ */
+static int lowest_set_bit(ULONGLONG w)
+{
+#if defined(_MSC_VER) && defined(_WIN64)
+    unsigned long index;
+    _BitScanForward64(&index,w);
+    return (int)index;
+#elif defined(_MSC_VER)
+    unsigned long index;
+    if(_BitScanForward(&index,(unsigned long)w))
+        return (int)index;
+    _BitScanForward(&index,(unsigned long)(w >> 32));
+    return (int)index + 32;
+#elif defined(__GNUC__)
+    return __builtin_ctzll(w);
+#else
+    int index = 0;
+    while(!(w & 1)) w >>= 1, index ++;
+    return index;
+#endif
+}
+
+/**
+ * @internal
+ * @brief Adds free regions found
+ * in a portion of the volume bitmap.
+ * @param[in] map the bitmap, one bit per cluster,
+ * set bits stand for allocated clusters.
+ * @param[in] n number of clusters described by the bitmap.
+ * @param[in] start_lcn the first cluster described by the bitmap.
+ * @param[in,out] free_rgn_start the first cluster of the
+ * free region continued from the previous portion, LLINVALID
+ * if there's no such region. On return it gets the first cluster
+ * of the free region continued in the next portion.
+ * @param[in,out] rlist the list of free regions.
+ * @param[in,out] rgn the last region in the list.
+ * @return Nonzero value if the callback
+ * procedure requested the scan termination.
+ * @note The bitmap is processed by 64-bit words,
+ * so entirely free and entirely allocated words
+ * cost a single test each.
+ */
+static int scan_bitmap(const ULONGLONG *map,ULONGLONG n,ULONGLONG start_lcn,
+        ULONGLONG *free_rgn_start,winx_volume_region **rlist,
+        winx_volume_region **rgn,volume_region_callback cb,
+        void *user_defined_data)
+{
+    ULONGLONG i = 0, w, bits;
+
+    while(i < n){
+        w = map[i >> 6] >> (i & 63);
+        bits = 64 - (i & 63);
+        if(bits > n - i) bits = n - i;
+
+        if(*free_rgn_start == LLINVALID){
+            /* search for the next free cluster */
+            w = ~w;
+        }
+        if(bits < 64) w &= ((ULONGLONG)1 << bits) - 1;
+        if(w == 0){
+            i += bits;
+            continue;
+        }
+        i += lowest_set_bit(w);
+
+        if(*free_rgn_start == LLINVALID){
+            *free_rgn_start = start_lcn + i;
+        } else {
+            /* add free region to the list */
+            *rgn = rgn_insert(rlist,*rgn,*free_rgn_start,
+                start_lcn + i - *free_rgn_start);
+            *free_rgn_start = LLINVALID;
+            if(cb != NULL){
+                if(cb(*rgn,user_defined_data))
+                    return 1;
+            }
+        }
+    }
+    return 0;
+}
+
 /**
  * @brief Enumerates free regions on the specified volume.
  * @param[in] volume_letter the volume letter.
@@ -469,6 +710,9 @@ int winx_vflush(char volume_letter)
  * @return The list of free regions, NULL indicates that
  * either the disk is full (unlikely) or some error occured.
  * @note
+ * - The list must be modified through winx_add_volume_region
+ * and winx_sub_volume_region only, since they keep the search
+ * tree used by winx_find_xxx_volume_region routines up to date.
  * - It is possible to scan the disk partially by requesting
  * the scan termination through the callback procedure.
  * - The callback procedure should complete as quickly
@@ -479,13 +723,9 @@ winx_volume_region *winx_get_free_volume_regions(char volume_letter,
 {
     winx_volume_region *rlist = NULL, *rgn = NULL;
     BITMAP_DESCRIPTOR *bitmap;
-    #define LLINVALID   ((ULONGLONG) -1)
-    #define BITMAPBYTES 4096
-    #define BITMAPSIZE  (BITMAPBYTES + 2 * sizeof(ULONGLONG))
-    /* bit shifting array for efficient processing of the bitmap */
-    unsigned char bitshift[] = { 1, 2, 4, 8, 16, 32, 64, 128 };
+    ULONG bitmap_bytes = BITMAPBYTES;
     WINX_FILE *f;
-    ULONGLONG i, start, next, free_rgn_start;
+    ULONGLONG n, next, free_rgn_start;
     IO_STATUS_BLOCK iosb;
     NTSTATUS status;
     
@@ -493,7 +733,11 @@ winx_volume_region *winx_get_free_volume_regions(char volume_letter,
     volume_letter = winx_toupper(volume_letter);
     
     /* allocate memory */
-    bitmap = winx_malloc(BITMAPSIZE);
+    bitmap = winx_tmalloc(bitmap_bytes + 2 * sizeof(ULONGLONG));
+    if(bitmap == NULL){
+        bitmap_bytes = BITMAPBYTES_SMALL;
+        bitmap = winx_malloc(bitmap_bytes + 2 * sizeof(ULONGLONG));
+    }
     
     /* open the volume */
     f = winx_vopen(volume_letter);
@@ -506,10 +750,10 @@ winx_volume_region *winx_get_free_volume_regions(char volume_letter,
     next = 0, free_rgn_start = LLINVALID;
     do {
         /* get next portion of the bitmap */
-        memset(bitmap,0,BITMAPSIZE);
+        memset(bitmap,0,2 * sizeof(ULONGLONG));
         status = NtFsControlFile(winx_fileno(f),NULL,NULL,0,&iosb,
             FSCTL_GET_VOLUME_BITMAP,&next,sizeof(ULONGLONG),
-            bitmap,BITMAPSIZE);
+            bitmap,bitmap_bytes + 2 * sizeof(ULONGLONG));
         if(NT_SUCCESS(status)){
             NtWaitForSingleObject(winx_fileno(f),FALSE,NULL);
             status = iosb.Status;
@@ -527,39 +771,18 @@ winx_volume_region *winx_get_free_volume_regions(char volume_letter,
         }
         
         /* scan through the returned bitmap info */
-        start = bitmap->StartLcn;
-        for(i = 0; i < min(bitmap->ClustersToEndOfVol, 8 * BITMAPBYTES); i++){
-            if(!(bitmap->Map[ i/8 ] & bitshift[ i % 8 ])){
-                /* cluster is free */
-                if(free_rgn_start == LLINVALID)
-                    free_rgn_start = start + i;
-            } else {
-                /* cluster isn't free */
-                if(free_rgn_start != LLINVALID){
-                    /* add free region to the list */
-                    rgn = (winx_volume_region *)winx_list_insert((list_entry **)(void *)&rlist,
-                        (list_entry *)rgn,sizeof(winx_volume_region));
-                    rgn->lcn = free_rgn_start;
-                    rgn->length = start + i - free_rgn_start;
-                    if(cb != NULL){
-                        if(cb(rgn,user_defined_data))
-                            goto done;
-                    }
-                    free_rgn_start = LLINVALID;
-                }
-            }
-        }
+        n = min(bitmap->ClustersToEndOfVol, 8 * (ULONGLONG)bitmap_bytes);
+        if(scan_bitmap((ULONGLONG *)(void *)bitmap->Map,n,bitmap->StartLcn,
+          &free_rgn_start,&rlist,&rgn,cb,user_defined_data)) goto done;
         
         /* go to the next portion of data */
-        next = bitmap->StartLcn + i;
+        next = bitmap->StartLcn + n;
     } while(status != STATUS_SUCCESS);
 
     if(free_rgn_start != LLINVALID){
         /* add free region to the list */
-        rgn = (winx_volume_region *)winx_list_insert((list_entry **)(void *)&rlist,
-            (list_entry *)rgn,sizeof(winx_volume_region));
-        rgn->lcn = free_rgn_start;
-        rgn->length = start + i - free_rgn_start;
+        rgn = rgn_insert(&rlist,rgn,free_rgn_start,
+            next - free_rgn_start);
         if(cb != NULL){
             if(cb(rgn,user_defined_data))
                 goto done;
@@ -589,31 +812,23 @@ done:
 winx_volume_region *winx_add_volume_region(winx_volume_region *rlist,
         ULONGLONG lcn,ULONGLONG length)
 {
-    winx_volume_region *r, *rnext, *rprev = NULL;
+    winx_volume_region *rnext, *rprev;
     
     /* don't insert regions of zero length */
     if(length == 0) return rlist;
     
-    for(r = rlist; r; r = r->next){
-        if(r->lcn > lcn){
-            if(r != rlist) rprev = r->prev;
-            break;
-        }
-        if(r->next == rlist){
-            rprev = r;
-            break;
-        }
-    }
+    rprev = rgn_find_prev(rgn_root(rlist),lcn);
 
     /* hits the new region the previous one? */
     if(rprev){
         if(rprev->lcn + rprev->length == lcn){
             rprev->length += length;
-            if(rprev->lcn + rprev->length == rprev->next->lcn){
-                rprev->length += rprev->next->length;
-                winx_list_remove((list_entry **)(void *)&rlist,
-                    (list_entry *)rprev->next);
+            rnext = rprev->next;
+            if(rprev->lcn + rprev->length == rnext->lcn){
+                rprev->length += rnext->length;
+                rgn_remove(&rlist,rnext);
             }
+            rgn_update_path(rprev);
             return rlist;
         }
     }
@@ -625,14 +840,12 @@ winx_volume_region *winx_add_volume_region(winx_volume_region *rlist,
         if(lcn + length == rnext->lcn){
             rnext->lcn = lcn;
             rnext->length += length;
+            rgn_update_path(rnext);
             return rlist;
         }
     }
     
-    r = (winx_volume_region *)winx_list_insert((list_entry **)(void *)&rlist,
-        (list_entry *)rprev,sizeof(winx_volume_region));
-    r->lcn = lcn;
-    r->length = length;
+    (void)rgn_insert(&rlist,rprev,lcn,length);
     return rlist;
 }
 
@@ -653,8 +866,12 @@ winx_volume_region *winx_sub_volume_region(winx_volume_region *rlist,
     ULONGLONG remaining_clusters;
     ULONGLONG new_lcn, new_length;
 
+    /* start from the region which may cover the lcn */
+    r = rgn_find_prev(rgn_root(rlist),lcn);
+    if(r == NULL) r = rlist;
+
     remaining_clusters = length;
-    for(r = rlist; r && remaining_clusters; r = next){
+    for(; r && remaining_clusters; r = next){
         head = rlist;
         next = r->next;
         if(r->lcn >= lcn + length) break;
@@ -667,8 +884,7 @@ winx_volume_region *winx_sub_volume_region(winx_volume_region *rlist,
                 *        |-r-|
                 */
                 remaining_clusters -= r->length;
-                winx_list_remove((list_entry **)(void *)&rlist,
-                    (list_entry *)r);
+                rgn_remove(&rlist,r);
                 goto next_region;
             }
             if(r->lcn < lcn && (r->lcn + r->length) > lcn && \
@@ -679,6 +895,7 @@ winx_volume_region *winx_sub_volume_region(winx_volume_region *rlist,
                 * |----r----|
                 */
                 r->length = lcn - r->lcn;
+                rgn_update_path(r);
                 goto next_region;
             }
             if(r->lcn >= lcn && r->lcn < (lcn + length)){
@@ -689,8 +906,7 @@ winx_volume_region *winx_sub_volume_region(winx_volume_region *rlist,
                 */
                 new_lcn = lcn + length;
                 new_length = r->lcn + r->length - (lcn + length);
-                winx_list_remove((list_entry **)(void *)&rlist,
-                    (list_entry *)r);
+                rgn_remove(&rlist,r);
                 rlist = winx_add_volume_region(rlist,new_lcn,new_length);
                 goto next_region;
             }
@@ -703,6 +919,7 @@ winx_volume_region *winx_sub_volume_region(winx_volume_region *rlist,
                 new_lcn = lcn + length;
                 new_length = r->lcn + r->length - (lcn + length);
                 r->length = lcn - r->lcn;
+                rgn_update_path(r);
                 rlist = winx_add_volume_region(rlist,new_lcn,new_length);
                 goto next_region;
             }
@@ -723,4 +940,123 @@ void winx_release_free_volume_regions(winx_volume_region *rlist)
     winx_list_destroy((list_entry **)(void *)&rlist);
 }
 
+static winx_volume_region *rgn_find_first(winx_volume_region *r,
+        ULONGLONG min_lcn,ULONGLONG min_length)
+{
+    winx_volume_region *found;
+
+    if(r == NULL || r->max_length < min_length) return NULL;
+    if(r->lcn < min_lcn)
+        return rgn_find_first(r->right,min_lcn,min_length);
+    found = rgn_find_first(r->left,min_lcn,min_length);
+    if(found) return found;
+    if(r->length >= min_length) return r;
+    return rgn_find_first(r->right,min_lcn,min_length);
+}
+
+static winx_volume_region *rgn_find_last(winx_volume_region *r,
+        ULONGLONG min_lcn,ULONGLONG min_length)
+{
+    winx_volume_region *found;
+
+    if(r == NULL || r->max_length < min_length) return NULL;
+    if(r->lcn < min_lcn)
+        return rgn_find_last(r->right,min_lcn,min_length);
+    found = rgn_find_last(r->right,min_lcn,min_length);
+    if(found) return found;
+    if(r->length >= min_length) return r;
+    return rgn_find_last(r->left,min_lcn,min_length);
+}
+
+/* returns length of the biggest region starting at or after the lcn */
+static ULONGLONG rgn_max_length(winx_volume_region *r,ULONGLONG min_lcn)
+{
+    ULONGLONG max_length = 0;
+
+    while(r){
+        if(r->lcn >= min_lcn){
+            if(r->length > max_length)
+                max_length = r->length;
+            if(r->right && r->right->max_length > max_length)
+                max_length = r->right->max_length;
+            r = r->left;
+        } else {
+            r = r->right;
+        }
+    }
+    return max_length;
+}
+
+/**
+ * @brief Searches for the first region
+ * satisfying the specified conditions.
+ * @param[in] rlist the list of regions.
+ * @param[in] min_lcn minimum LCN of the region.
+ * @param[in] min_length minimum length of the region, in clusters.
+ * @param[out] max_length length of the biggest region
+ * among the regions starting at or after min_lcn
+ * and preceding the region found. Can be NULL.
+ * @return Pointer to the region, NULL if nothing found.
+ */
+winx_volume_region *winx_find_first_volume_region(winx_volume_region *rlist,
+        ULONGLONG min_lcn,ULONGLONG min_length,ULONGLONG *max_length)
+{
+    winx_volume_region *root, *rgn;
+
+    root = rgn_root(rlist);
+    rgn = rgn_find_first(root,min_lcn,min_length);
+    if(max_length){
+        if(rgn) *max_length = rgn->length;
+        else *max_length = rgn_max_length(root,min_lcn);
+    }
+    return rgn;
+}
+
+/**
+ * @brief Searches for the last region
+ * satisfying the specified conditions.
+ * @param[in] rlist the list of regions.
+ * @param[in] min_lcn minimum LCN of the region.
+ * @param[in] min_length minimum length of the region, in clusters.
+ * @param[out] max_length length of the biggest region
+ * among the regions following the region found. Can be NULL.
+ * @return Pointer to the region, NULL if nothing found.
+ */
+winx_volume_region *winx_find_last_volume_region(winx_volume_region *rlist,
+        ULONGLONG min_lcn,ULONGLONG min_length,ULONGLONG *max_length)
+{
+    winx_volume_region *root, *rgn;
+
+    root = rgn_root(rlist);
+    rgn = rgn_find_last(root,min_lcn,min_length);
+    if(max_length){
+        if(rgn) *max_length = rgn->length;
+        else *max_length = rgn_max_length(root,min_lcn);
+    }
+    return rgn;
+}
+
+/**
+ * @brief Searches for the largest region.
+ * @param[in] rlist the list of regions.
+ * @return Pointer to the region, NULL if the list is empty.
+ * @note If there are several regions of the same
+ * length, the first one is returned.
+ */
+winx_volume_region *winx_find_largest_volume_region(winx_volume_region *rlist)
+{
+    winx_volume_region *r = rgn_root(rlist);
+
+    while(r){
+        if(r->left && r->left->max_length == r->max_length){
+            r = r->left;
+        } else if(r->length == r->max_length){
+            return r->length ? r : NULL;
+        } else {
+            r = r->right;
+        }
+    }
+    return NULL;
+}
+
 /** @} */
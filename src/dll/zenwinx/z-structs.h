@@ -13,6 +13,15 @@ typedef struct _WINX_FILE {
 } WINX_FILE, *PWINX_FILE;
 
 
+/* mem.c */
+typedef struct _winx_arena {
+    char * volatile next;        /* the first free byte of a segment */
+    SIZE_T size;                 /* size of the segments taken, in bytes */
+    HANDLE hLock;                /* synchronizes switches of segments */
+    LONG volatile overflow;      /* number of blocks passed to the heap */
+    LONG volatile used;          /* nonzero for arenas in use */
+} winx_arena;
+
 typedef struct _winx_blockmap {
     struct _winx_blockmap *next; /* pointer to the next fragment */
     struct _winx_blockmap *prev; /* pointer to the previous fragment */
@@ -27,9 +36,24 @@ typedef struct _winx_file_disposition {
     winx_blockmap *blockmap;           /* map of the blocks */
 } winx_file_disposition;
 
+/*
+* Files found by winx_scan_disk on NTFS volumes
+* don't keep their full paths. Instead, they refer
+* to nodes of their parent directories shared by all
+* the directory contents. Full paths get built on demand
+* by winx_get_file_path and winx_file_path routines.
+*/
+typedef struct _winx_dir_node {
+    struct _winx_dir_node *parent; /* the parent, NULL for the root */
+    wchar_t *name;                 /* the name, native path for the root */
+    int length;                    /* length of the full path, in characters */
+    int refcount;                  /* number of references to the node */
+} winx_dir_node;
+
 typedef struct _winx_file_internal_info {
     ULONGLONG BaseMftId;
     ULONGLONG ParentDirectoryMftId;
+    winx_dir_node *ParentDirectory;
 } winx_file_internal_info;
 
 /*
@@ -114,4 +138,10 @@ typedef struct _winx_volume_region {
     struct _winx_volume_region *prev;  /* pointer to the previous region */
     ULONGLONG lcn;                     /* the logical cluster number */
     ULONGLONG length;                  /* size of the region, in clusters */
+    /* search tree over the same regions, keyed by lcn */
+    struct _winx_volume_region *parent;
+    struct _winx_volume_region *left;
+    struct _winx_volume_region *right;
+    ULONGLONG max_length;              /* the biggest length in the subtree */
+    ULONG priority;                    /* heap priority balancing the tree */
 } winx_volume_region;
\ No newline at end of file
@@ -139,7 +139,20 @@ winx_file_info *winx_scan_disk(char volume_letter, int flags,
 void winx_ftw_release(winx_file_info *filelist);
 #define winx_scan_disk_release(f) winx_ftw_release(f)
 
+int winx_get_file_path(winx_file_info *f,wchar_t *buffer,int length);
+int winx_get_file_path_length(winx_file_info *f);
+wchar_t *winx_file_path(winx_file_info *f);
+
+winx_blockmap *winx_blockmap_append(winx_blockmap **map,
+        ULONGLONG vcn,ULONGLONG lcn,ULONGLONG length);
+void winx_blockmap_destroy(winx_blockmap **map);
+
+void winx_set_mft_read_parameters(unsigned long buffer_size,int queue_depth);
+
 int winx_ftw_dump_file(winx_file_info *f,ftw_terminator t,void *user_defined_data);
+int winx_ftw_dump_file_range(winx_file_info *f,
+        ULONGLONG start_vcn,ULONGLONG end_vcn,winx_blockmap **map,
+        ftw_terminator t,void *user_defined_data);
 
 #ifdef _NTNDK_H_
 NTSTATUS winx_defrag_fopen(winx_file_info *f,int action,HANDLE *phandle);
@@ -168,6 +181,12 @@ void winx_destroy_lock(HANDLE h);
 void *winx_heap_alloc(size_t size,int flags);
 void winx_heap_free(void *addr);
 
+winx_arena *winx_create_arena(void);
+void *winx_arena_alloc(winx_arena *arena,size_t size,int flags);
+wchar_t *winx_arena_wcsdup(winx_arena *arena,const wchar_t *s);
+winx_arena *winx_get_arena(void *addr);
+void winx_destroy_arena(winx_arena *arena);
+
 
 /*
 * If small amount of memory is needed,
@@ -337,6 +356,11 @@ winx_volume_region *winx_add_volume_region(winx_volume_region *rlist,
 winx_volume_region *winx_sub_volume_region(winx_volume_region *rlist,
         ULONGLONG lcn,ULONGLONG length);
 void winx_release_free_volume_regions(winx_volume_region *rlist);
+winx_volume_region *winx_find_first_volume_region(winx_volume_region *rlist,
+        ULONGLONG min_lcn,ULONGLONG min_length,ULONGLONG *max_length);
+winx_volume_region *winx_find_last_volume_region(winx_volume_region *rlist,
+        ULONGLONG min_lcn,ULONGLONG min_length,ULONGLONG *max_length);
+winx_volume_region *winx_find_largest_volume_region(winx_volume_region *rlist);
 
 /* zenwinx.c */
 int winx_init_library(void);
@@ -231,6 +231,10 @@ void ProcessVolume(char letter)
         winx_printf("optimize mft on %c: ...\n",letter);
         message = "MFT optimization";
         break;
+    case ZONED_OPTIMIZATION_JOB:
+        winx_printf("zoned optimization of %c: ...\n",letter);
+        message = "Zoned optimization";
+        break;
     case SINGLE_FILE_MOVE_FRONT_JOB:
         winx_printf("SINGLE_FILE_MOVE_FRONT_JOB on %c: ...\n",letter);
         break;
@@ -289,6 +293,7 @@ int udefrag_handler(int argc,wchar_t **argv,wchar_t **envp)
     int a_flag = 0, o_flag = 0;
     int quick_optimization_flag = 0;
     int optimize_mft_flag = 0;
+    int zoned_optimization_flag = 0;
     int all_flag = 0, all_fixed_flag = 0;
     char letters[MAX_DOS_DRIVES];
     int i, n_letters = 0;
@@ -330,6 +335,9 @@ int udefrag_handler(int argc,wchar_t **argv,wchar_t **envp)
         } else if(!wcscmp(argv[i],L"--optimize-mft")){
             optimize_mft_flag = 1;
             continue;
+        } else if(!wcscmp(argv[i],L"--zoned-optimization")){
+            zoned_optimization_flag = 1;
+            continue;
         } else if(!wcscmp(argv[i],L"--all")){
             all_flag = 1;
             continue;
@@ -383,6 +391,7 @@ int udefrag_handler(int argc,wchar_t **argv,wchar_t **envp)
     else if(o_flag) current_job = FULL_OPTIMIZATION_JOB;
     else if(quick_optimization_flag) current_job = QUICK_OPTIMIZATION_JOB;
     else if(optimize_mft_flag) current_job = MFT_OPTIMIZATION_JOB;
+    else if(zoned_optimization_flag) current_job = ZONED_OPTIMIZATION_JOB;
     else current_job = DEFRAGMENTATION_JOB;
     
     current_job_flags = 0;
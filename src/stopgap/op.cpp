@@ -121,7 +121,7 @@ bool move_set(
       auto f = *i;
 
       if (op.opts.verbose) {
-        std::wcout << L"Found " << f->path << L"(" <<
+        std::wcout << L"Found " << winx_file_path(f) << L"(" <<
                    std::fixed << f->disp.blockmap->lcn <<
                    L", " << op.vol(f->disp.clusters) << L", frag: " <<
                    std::fixed << f->disp.fragments << L")" << std::endl;
@@ -178,17 +178,18 @@ void defrag(Operation &op)
 
     if (*i == op.last) {
       if (op.opts.verbose) {
-        std::wcout << L"Skipping " << (*i)->path << std::endl;
+        std::wcout << L"Skipping " << winx_file_path(*i) << std::endl;
       }
       op.fe->pop(*i);
     }
     if (op.opts.verbose) {
-      std::wcout << L"Handling file at: " << (*i)->path << L" (" <<
+      std::wcout << L"Handling file at: " << winx_file_path(*i) << L" (" <<
                  op.vol((*i)->disp.clusters) << L", frags: " <<
                  std::fixed << (*i)->disp.fragments << L")" << std::endl;
     }
     else {
-      std::wcout << L"\r" << util::light << (*i)->path + 4 << util::clear <<
+      std::wcout << L"\r" << util::light << winx_file_path(*i) + 4
+                 << util::clear <<
                  L" frags: " << util::red << (*i)->disp.fragments << util::clear <<
                  L"" << std::flush;
     }
@@ -203,7 +204,7 @@ void defrag(Operation &op)
       }
     }
     catch (const std::exception &ex) {
-      std::wcerr << std::endl << (*i)->path << L": " << util::red <<
+      std::wcerr << std::endl << winx_file_path(*i) << L": " << util::red <<
                  util::to_wstring(ex.what()) << util::clear << std::endl;
       op.ge->scan();
     }
@@ -248,7 +249,7 @@ bool widen_behind(Operation &op, const winx_volume_region *g, size_t maxMoves)
       moved++;
     }
     catch (const std::exception &ex) {
-      std::wcerr << std::endl << f->path << ": " << util::red <<
+      std::wcerr << std::endl << winx_file_path(f) << ": " << util::red <<
                  util::to_wstring(ex.what()) << util::clear << std::endl;
       return false;
     }
@@ -348,7 +349,7 @@ std::wstring stopgap_enumerate_gaps(char driveLetter)
     //Verbose File Listing:
     if (op.opts.verbose) {
         for (auto i = op.fe->unmovable().begin(), e = op.fe->unmovable().end(); i != e; ++i) {
-            verboseOutput << ((*i)->path + 4) << std::endl;
+            verboseOutput << (winx_file_path(*i) + 4) << std::endl;
         }
     }
     //Results:
@@ -378,13 +379,14 @@ std::wstring stopgap_findfiles_at_LCN(char driveLetter, ULONGLONG LCN, ULONGLONG
     ////Verbose File Listing:
     //if (op.opts.verbose) {
     //    for (auto i = op.fe->unmovable().begin(), e = op.fe->unmovable().end(); i != e; ++i) {
-    //        verboseOutput << ((*i)->path + 4) << std::endl;
+    //        verboseOutput << (winx_file_path(*i) + 4) << std::endl;
     //    }
     //}
     //Single File Result - Exact Match
     auto winx_file_result = op.fe->findAt(LCN);
     if (winx_file_result)
-        verboseOutput << "Found a match: " << winx_file_result->path << " at the exact LCN #" << LCN << ".\n" << std::endl;
+        verboseOutput << "Found a match: " << winx_file_path(winx_file_result)
+                      << " at the exact LCN #" << LCN << ".\n" << std::endl;
     //Multiple Files Results - Within range
     auto winx_filevectors = op.fe->findAll(LCN,length_range);
     if (winx_filevectors.size() < 1)
@@ -540,7 +542,7 @@ void Operation::init()
   if (opts.verbose) {
     std::wcout << util::yellow;
     for (auto i = fe->unmovable().begin(), e = fe->unmovable().end(); i != e; ++i) {
-      std::wcout << ((*i)->path + 4) << std::endl;
+      std::wcout << (winx_file_path(*i) + 4) << std::endl;
     }
     std::wcout << util::clear;
   }
@@ -116,7 +116,8 @@ namespace zen
                               &rv))
         {
             std::string ex("Failed to open file: ");
-            ex.append(zen::to_string(file->path));
+            ex.append(zen::to_string(
+                winx_file_path(const_cast<winx_file_info *>(file))));
             throw std::exception(ex.c_str());
         }
         return File(rv);
@@ -214,6 +215,9 @@ namespace zen
         sizes_t sizes_;
         const char volume_;
 
+        void forget(const winx_volume_region* r);
+        void remember(winx_volume_region* r);
+
         void free()
         {
             if (info_)
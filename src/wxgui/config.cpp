@@ -268,6 +268,9 @@ done:
     }
     ::udefrag_set_log_file_path();
 
+    // colors and sizes of the map cells may be changed
+    if(m_cMap) m_cMap->InvalidateMap();
+
     if(!error.IsEmpty()){
         wxMessageDialog dlg(this,error,wxT("UltraDefrag"),
             wxOK | wxICON_ERROR/* | wxSTAY_ON_TOP*/);
@@ -505,7 +505,9 @@ void MainFrame::FilesPopulateList(wxCommandEvent& event)
     while (file) {
         FilesListItem item;
         //Name/Path:
-        item.col0 << file->path + 4; /* skip the 4 chars: \??\  */
+        wchar_t path[MAX_PATH];
+        winx_get_file_path(file,path,MAX_PATH);
+        item.col0 << path + 4; /* skip the 4 chars: \??\  */
                                         //Fragments:
         item.col1 << file->disp.fragments;
         //Size:
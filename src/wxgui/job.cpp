@@ -57,6 +57,41 @@ void MainFrame::CacheJob(wxCommandEvent& event)
     JobsCacheEntry *cacheEntry = m_jobsCache[index];
     JobsCacheEntry *newEntry = (JobsCacheEntry *)event.GetClientData();
 
+    if(newEntry->clusterMap){
+        m_cMap->InvalidateMap();
+    } else {
+        // apply changes to the map of the previous entry
+        const int size = udefrag_get_map_level(newEntry->pi.cluster_map_size,
+            newEntry->pi.cluster_map_levels + 1,nullptr);
+        if(cacheEntry && cacheEntry->clusterMap \
+          && cacheEntry->pi.cluster_map_size == newEntry->pi.cluster_map_size \
+          && cacheEntry->pi.cluster_map_levels \
+          == newEntry->pi.cluster_map_levels){
+            newEntry->clusterMap = cacheEntry->clusterMap;
+            cacheEntry->clusterMap = nullptr;
+            // changes of the map itself go first, then changes of its levels
+            int count = 0;
+            while(count < newEntry->pi.map_changes_count \
+              && newEntry->mapChanges[count].first \
+              < newEntry->pi.cluster_map_size) count ++;
+            m_cMap->AddChanges(newEntry->mapChanges,count);
+        } else {
+            newEntry->clusterMap = new char[size];
+            memset(newEntry->clusterMap,DEFAULT_COLOR,size);
+            m_cMap->InvalidateMap();
+        }
+        const char *cells = newEntry->changedCells;
+        for(int i = 0; i < newEntry->pi.map_changes_count; i++){
+            memcpy(newEntry->clusterMap + newEntry->mapChanges[i].first,
+                cells,newEntry->mapChanges[i].count);
+            cells += newEntry->mapChanges[i].count;
+        }
+        delete [] newEntry->mapChanges;
+        delete [] newEntry->changedCells;
+        newEntry->mapChanges = nullptr;
+        newEntry->changedCells = nullptr;
+    }
+
     if(!cacheEntry){
         m_jobsCache[index] = newEntry;
     } else {
@@ -122,12 +157,61 @@ void JobThread::ProgressCallback(udefrag_progress_info *pi, void *p)
     JobsCacheEntry *cacheEntry = new JobsCacheEntry;
     cacheEntry->jobType = g_mainFrame->m_jobThread->m_jobType;
     memcpy(&cacheEntry->pi,pi,sizeof(udefrag_progress_info));
-    cacheEntry->clusterMap = new char[pi->cluster_map_size];
-    if(pi->cluster_map_size){
-        memcpy(cacheEntry->clusterMap,
-            pi->cluster_map,
-            pi->cluster_map_size
-        );
+    cacheEntry->pi.map_changes = nullptr;
+    cacheEntry->clusterMap = nullptr;
+    cacheEntry->mapChanges = nullptr;
+    cacheEntry->changedCells = nullptr;
+    if(pi->map_changes){
+        // pass changed cells only, the rest of the map is cached already
+        std::vector<udefrag_map_range> changes(pi->map_changes,
+            pi->map_changes + pi->map_changes_count);
+        for(int level = 1; level <= pi->cluster_map_levels; level++){
+            // cells of the level covering the changed cells
+            const int offset = udefrag_get_map_level(pi->cluster_map_size,
+                level,nullptr);
+            const size_t first_range = changes.size();
+            for(int i = 0; i < pi->map_changes_count; i++){
+                udefrag_map_range range;
+                range.first = pi->map_changes[i].first >> level;
+                range.count = ((pi->map_changes[i].first + \
+                    pi->map_changes[i].count - 1) >> level) - range.first + 1;
+                range.first += offset;
+                if(changes.size() > first_range \
+                  && changes.back().first + changes.back().count \
+                  >= range.first){
+                    changes.back().count = range.first + range.count \
+                        - changes.back().first;
+                } else {
+                    changes.push_back(range);
+                }
+            }
+        }
+        int cells = 0;
+        for(size_t i = 0; i < changes.size(); i++)
+            cells += changes[i].count;
+        cacheEntry->pi.map_changes_count = (int)changes.size();
+        cacheEntry->mapChanges = new udefrag_map_range[changes.size()];
+        cacheEntry->changedCells = new char[cells];
+        cells = 0;
+        for(size_t i = 0; i < changes.size(); i++){
+            cacheEntry->mapChanges[i] = changes[i];
+            memcpy(cacheEntry->changedCells + cells,
+                pi->cluster_map + changes[i].first,
+                changes[i].count
+            );
+            cells += changes[i].count;
+        }
+    } else {
+        // the map is followed by its coarser levels
+        const int size = udefrag_get_map_level(pi->cluster_map_size,
+            pi->cluster_map_levels + 1,nullptr);
+        cacheEntry->clusterMap = new char[size];
+        if(size){
+            memcpy(cacheEntry->clusterMap,
+                pi->cluster_map,
+                size
+            );
+        }
     }
     cacheEntry->stopped = g_mainFrame->m_stopped;
     event = new wxCommandEvent(wxEVT_COMMAND_MENU_SELECTED,ID_CacheJob);
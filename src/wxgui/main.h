@@ -577,11 +577,28 @@ public:
     void GetGridSizeforCMap(cmapreturn& gs) const;
     static void DrawSingleRectangleBorder(HDC m_cacheDC2, int xblock, int yblock, int line_width, int cell_size, HBRUSH brush,
         HBRUSH infill);
+    void AddChanges(const udefrag_map_range *changes, int count);
+    void InvalidateMap();
     ClusterMap *m_ClusterMap;
 private:
-    static char *ScaleMap(int scaled_size);
+    char *ScaleMap(int scaled_size);
+    char GetScaledCell(int i) const;
+    void RedrawCell(const cmapreturn& gs, int cell, int index,
+        HBRUSH freeBrush);
+    bool RedrawChanges(const cmapreturn& gs);
     int m_width;
     int m_height;
+    // cells changed since the last paint
+    std::vector<udefrag_map_range> m_changes;
+    std::vector<char> m_scaledMap;
+    // parameters of the last scaling
+    int m_scaleRatio;
+    int m_scaleLevel;
+    int m_usedCells;
+    bool m_fullRedraw;
+    void *m_paintedJob;
+    cmapreturn m_paintedGrid;
+    int m_paintedMapSize;
     HDC m_cacheDC;
     HBITMAP m_cacheBmp;
     HBRUSH m_brushes[SPACE_STATES];
@@ -594,6 +611,9 @@ typedef struct _JobsCacheEntry {
     udefrag_job_type jobType;
     udefrag_progress_info pi;
     char *clusterMap;
+    udefrag_map_range *mapChanges; // if clusterMap is NULL, cells changed
+                                   // since the previous entry
+    char *changedCells;            // new colors of the changed cells
     bool stopped;
 } JobsCacheEntry;
 
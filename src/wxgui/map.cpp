@@ -118,6 +118,11 @@ ClusterMap::ClusterMap(wxWindow* parent) : wxWindow(parent,wxID_ANY)
 
     m_width = m_height = 0;
     m_legendPopup = NULL;
+    m_fullRedraw = true;
+    m_paintedJob = nullptr;
+    memset(&m_paintedGrid,0,sizeof(m_paintedGrid));
+    m_paintedMapSize = 0;
+    m_scaleRatio = m_scaleLevel = m_usedCells = 0;
 }
 
 ClusterMap::~ClusterMap()
@@ -169,6 +174,10 @@ void ClusterMap::OnEraseBackground(wxEraseEvent& event)
  * @brief Scales cluster map
  * of the current job to fit
  * inside of the map control.
+ * @details To shrink the map the coarsest
+ * level of the map still having a cell per
+ * scaled cell gets used, so each scaled cell
+ * gets defined by a few cells at most.
  */
 char *ClusterMap::ScaleMap(int scaled_size)
 {
@@ -180,7 +189,9 @@ char *ClusterMap::ScaleMap(int scaled_size)
     if(scaled_size == map_size)
         return nullptr; // no need to scale
 
-    char *scaledMap = new char[scaled_size];
+    // the buffer is reused on each paint
+    m_scaledMap.resize(scaled_size);
+    char *scaledMap = &m_scaledMap[0];
 
     int ratio = scaled_size / map_size;
     int used_cells = 0;
@@ -192,40 +203,25 @@ char *ClusterMap::ScaleMap(int scaled_size)
                 used_cells ++;
             }
         }
+        m_scaleRatio = ratio;
+        m_scaleLevel = 0;
+        m_usedCells = used_cells;
     } else {
         // scale down
         ratio = map_size / scaled_size;
         if(ratio * scaled_size != map_size)
             ratio ++; /* round up */
 
-        used_cells = map_size / ratio;
-        for(int i = 0; i < used_cells; i++){
-            int states[SPACE_STATES];
-            memset(states,0,sizeof(states));
-            bool mft_detected = false;
-
-            int sequence_length = (i < used_cells - 1) ? \
-                ratio : map_size - i * ratio;
-
-            for(int j = 0; j < sequence_length; j++){
-                int index = (int)currentJob->clusterMap[i * ratio + j];
-                if(index >= 0 && index < SPACE_STATES) states[index] ++;
-                if(index == MFT_SPACE) mft_detected = true;
-            }
+        int level = 0;
+        while(level < currentJob->pi.cluster_map_levels \
+          && (2 << level) <= ratio) level ++;
+        m_scaleLevel = level;
+        m_scaleRatio = ratio;
 
-            if(mft_detected){
-                scaledMap[i] = MFT_SPACE;
-            } else {
-                // draw cell in dominating color
-                int maximum = states[0]; scaledMap[i] = 0;
-                for(int j = 1; j < SPACE_STATES; j++){
-                    if(states[j] >= maximum){
-                        maximum = states[j];
-                        scaledMap[i] = (char)j;
-                    }
-                }
-            }
-        }
+        used_cells = map_size / ratio;
+        m_usedCells = used_cells;
+        for(int i = 0; i < used_cells; i++)
+            scaledMap[i] = GetScaledCell(i);
     }
 
     // mark unused cells
@@ -235,11 +231,165 @@ char *ClusterMap::ScaleMap(int scaled_size)
     return scaledMap;
 }
 
+/**
+ * @brief Defines color of a cell
+ * of the shrunk map, as the color
+ * prevailing in the cells it covers.
+ * @note Parameters of the scaling are
+ * taken from the last ScaleMap call.
+ */
+char ClusterMap::GetScaledCell(int i) const
+{
+    JobsCacheEntry *currentJob = g_mainFrame->m_currentJob;
+    int map_size = currentJob->pi.cluster_map_size;
+    int ratio = m_scaleRatio, level = m_scaleLevel;
+    const char *cells = currentJob->clusterMap + \
+        udefrag_get_map_level(map_size,level,nullptr);
+
+    int states[SPACE_STATES];
+    memset(states,0,sizeof(states));
+    bool mft_detected = false;
+
+    int first = i * ratio;
+    int last = (i < m_usedCells - 1) ? first + ratio : map_size;
+
+    for(int j = first >> level; j <= (last - 1) >> level; j++){
+        // each cell of the level stands for 2^level cells of the map
+        int start = (j << level) > first ? (j << level) : first;
+        int end = ((j + 1) << level) < last ? ((j + 1) << level) : last;
+        int index = (int)cells[j];
+        if(index >= 0 && index < SPACE_STATES) states[index] += end - start;
+        if(index == MFT_SPACE) mft_detected = true;
+    }
+
+    if(mft_detected) return MFT_SPACE;
+
+    // draw cell in dominating color
+    int maximum = states[0]; char color = 0;
+    for(int j = 1; j < SPACE_STATES; j++){
+        if(states[j] >= maximum){
+            maximum = states[j];
+            color = (char)j;
+        }
+    }
+    return color;
+}
+
+/**
+ * @brief Remembers cells changed
+ * to redraw them on the next paint.
+ */
+void ClusterMap::AddChanges(const udefrag_map_range *changes, int count)
+{
+    if(m_fullRedraw) return;
+    m_changes.insert(m_changes.end(),changes,changes + count);
+
+    // the map may stay hidden for a long time
+    if(m_changes.size() > 65536) InvalidateMap();
+}
+
+/**
+ * @brief Forces the entire map
+ * to be redrawn on the next paint.
+ */
+void ClusterMap::InvalidateMap()
+{
+    m_fullRedraw = true;
+    m_changes.clear();
+}
+
+/**
+ * @brief Redraws a single cell
+ * of the cached picture.
+ */
+void ClusterMap::RedrawCell(const cmapreturn& gs, int cell, int index,
+    HBRUSH freeBrush)
+{
+    if(index < 0 || index >= SPACE_STATES) return;
+
+    RECT rc;
+    rc.top = gs.cell_size * (cell / gs.blocks_per_line) + gs.line_width;
+    rc.left = gs.cell_size * (cell % gs.blocks_per_line) + gs.line_width;
+    rc.right = rc.left + gs.block_size;
+    rc.bottom = rc.top + gs.block_size;
+    HBRUSH brush = (index == FREE_SPACE) ? freeBrush : m_brushes[index];
+    ::FillRect(m_cacheDC,&rc,brush);
+}
+
+/**
+ * @brief Redraws the changed cells only.
+ * @details When the map is scaled, only
+ * the scaled cells covering the changed
+ * cells get recalculated and redrawn.
+ * @return True for success, false if
+ * the entire map needs to be redrawn.
+ */
+bool ClusterMap::RedrawChanges(const cmapreturn& gs)
+{
+    JobsCacheEntry *currentJob = g_mainFrame->m_currentJob;
+
+    if(m_fullRedraw || !currentJob || currentJob != m_paintedJob) return false;
+    if(memcmp(&gs,&m_paintedGrid,sizeof(cmapreturn))) return false;
+
+    int map_size = currentJob->pi.cluster_map_size;
+    int scaled_size = gs.blocks_per_line * gs.lines;
+    if(!map_size || map_size != m_paintedMapSize) return false;
+    if(scaled_size != map_size && !m_usedCells) return false;
+
+    char free_r = (char)g_mainFrame->CheckOption(wxT("UD_FREE_COLOR_R"));
+    char free_g = (char)g_mainFrame->CheckOption(wxT("UD_FREE_COLOR_G"));
+    char free_b = (char)g_mainFrame->CheckOption(wxT("UD_FREE_COLOR_B"));
+    HBRUSH brush = ::CreateSolidBrush(RGB(free_r,free_g,free_b));
+
+    for(size_t k = 0; k < m_changes.size(); k++){
+        int first = m_changes[k].first;
+        int last = m_changes[k].first + m_changes[k].count;
+        if(last > map_size) last = map_size;
+        if(first < 0 || first >= last) continue;
+
+        if(scaled_size == map_size){
+            for(int cell = first; cell < last; cell++)
+                RedrawCell(gs,cell,currentJob->clusterMap[cell],brush);
+        } else if(scaled_size > map_size){
+            // each cell of the map stands for a few scaled cells
+            for(int cell = first; cell < last; cell++){
+                for(int j = 0; j < m_scaleRatio; j++){
+                    int i = cell * m_scaleRatio + j;
+                    m_scaledMap[i] = currentJob->clusterMap[cell];
+                    RedrawCell(gs,i,m_scaledMap[i],brush);
+                }
+            }
+        } else {
+            // each scaled cell stands for a few cells of the map
+            int i = first / m_scaleRatio;
+            int end = (last - 1) / m_scaleRatio;
+            if(i > m_usedCells - 1) i = m_usedCells - 1;
+            if(end > m_usedCells - 1) end = m_usedCells - 1;
+            for(; i <= end; i++){
+                m_scaledMap[i] = GetScaledCell(i);
+                RedrawCell(gs,i,m_scaledMap[i],brush);
+            }
+        }
+    }
+    ::DeleteObject(brush);
+    m_changes.clear();
+    return true;
+}
+
 void ClusterMap::OnPaint(wxPaintEvent& WXUNUSED(event))
 {
     cmapreturn gs;
     GetGridSizeforCMap(gs);
 
+    // the cached picture needs to be updated partially in most cases
+    if(RedrawChanges(gs)){
+        PAINTSTRUCT ps;
+        HDC hdc = ::BeginPaint((HWND)GetHandle(),&ps);
+        ::BitBlt(hdc,0,0, gs.width, gs.height,m_cacheDC,0,0,SRCCOPY);
+        ::EndPaint((HWND)GetHandle(),&ps);
+        return;
+    }
+
     // fill map by the free color
     char free_r = (char)g_mainFrame->CheckOption(wxT("UD_FREE_COLOR_R"));
     char free_g = (char)g_mainFrame->CheckOption(wxT("UD_FREE_COLOR_G"));
@@ -289,16 +439,21 @@ void ClusterMap::OnPaint(wxPaintEvent& WXUNUSED(event))
                     rc.right = rc.left + gs.block_size;
                     rc.bottom = rc.top + gs.block_size;
                     int index = (int)map[i * gs.blocks_per_line + j];
+                    if(index < 0 || index >= SPACE_STATES) continue;
                     if(index != FREE_SPACE){
                         ::FillRect(m_cacheDC,&rc,m_brushes[index]);
                     }
                 }
             }
-            //delete the pre-scaled array
-            delete [] scaledMap;
         }
     }
 
+    m_fullRedraw = false;
+    m_changes.clear();
+    m_paintedJob = currentJob;
+    m_paintedGrid = gs;
+    m_paintedMapSize = currentJob ? currentJob->pi.cluster_map_size : 0;
+
 draw:
     // draw map on the screen
     PAINTSTRUCT ps;
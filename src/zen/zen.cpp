@@ -94,6 +94,24 @@ namespace zen
         }
     }
 
+    void GapEnumeration::forget(const winx_volume_region *r)
+    {
+        regions_.erase(r->lcn);
+        auto range = sizes_.equal_range(r->length);
+        for (auto i = range.first; i != range.second; ++i) {
+            if (i->second == r) {
+                sizes_.erase(i);
+                break;
+            }
+        }
+    }
+
+    void GapEnumeration::remember(winx_volume_region *r)
+    {
+        regions_.insert(regions_t::value_type(r->lcn, r));
+        sizes_.insert(sizes_t::value_type(r->length, r));
+    }
+
     void GapEnumeration::pop(const uint64_t lcn, const uint64_t length)
     {
         // The idea here is that we always move files to the beginning of a gap.
@@ -102,28 +120,19 @@ namespace zen
             scan();
             return;
         }
-        auto range = sizes_.equal_range(g->second->length);
-        for (auto i = range.first; i != range.second; ++i) {
-            if (i->second != g->second) {
-                continue;
-            }
-            sizes_.erase(i);
-            break;
-        }
-        if (g->second->length > length) {
-            auto n = g->second;
-            regions_.erase(g);
-            n->lcn += length;
-            n->length -= length;
-            regions_.insert(sizes_t::value_type(n->lcn, n));
-            sizes_.insert(sizes_t::value_type(n->length, n));
-            return;
-        }
         if (g->second->length < length) {
             ::DebugBreak(); // Something went horribly wrong!
             return;
         }
-        regions_.erase(g);
+        forget(g->second);
+
+        // The list must be edited by zenwinx to keep its search tree valid,
+        // so regions may get reallocated: look the rest of the gap up again.
+        info_ = winx_sub_volume_region(info_, lcn, length);
+        auto n = winx_find_first_volume_region(info_, lcn + length, 1, nullptr);
+        if (n && n->lcn == lcn + length) {
+            remember(n);
+        }
     }
 
     void GapEnumeration::pop(const winx_file_info *f)
@@ -141,82 +150,28 @@ namespace zen
             if (!b->length) {
                 continue;
             }
-            auto prev = std::prev(regions_.lower_bound(b->lcn));
-            auto next = regions_.find(b->lcn + b->length);
-            bool mergePrev = prev != regions_.end() &&
-                prev->second->lcn + prev->second->length == b->lcn;
-            bool mergeNext = next != regions_.end();
-
-            // Try to merge with existing region(s).
-            if (mergePrev && mergeNext) {
-                auto range = sizes_.equal_range(prev->second->length);
-                for (auto i = range.first; i != range.second; ++i) {
-                    if (i->second != prev->second) {
-                        continue;
-                    }
-                    sizes_.erase(i);
-                    break;
-                }
-                range = sizes_.equal_range(next->second->length);
-                for (auto i = range.first; i != range.second; ++i) {
-                    if (i->second != next->second) {
-                        continue;
-                    }
-                    sizes_.erase(i);
-                    break;
-                }
-                prev->second->length += b->length + next->second->length;
-                regions_.erase(next);
-                sizes_.insert(sizes_t::value_type(prev->second->length, prev->second));
-                continue;
-            }
 
-            if (mergePrev) {
-                auto range = sizes_.equal_range(prev->second->length);
-                for (auto i = range.first; i != range.second; ++i) {
-                    if (i->second != prev->second) {
-                        continue;
-                    }
-                    sizes_.erase(i);
-                    break;
+            // Forget the regions the block gets merged with.
+            uint64_t lcn = b->lcn;
+            auto prev = regions_.lower_bound(b->lcn);
+            if (prev != regions_.begin()) {
+                --prev;
+                if (prev->second->lcn + prev->second->length == b->lcn) {
+                    lcn = prev->second->lcn;
+                    forget(prev->second);
                 }
-                prev->second->length += b->length;
-                sizes_.insert(sizes_t::value_type(prev->second->length, prev->second));
-                continue;
             }
-            if (mergeNext) {
-                auto range = sizes_.equal_range(next->second->length);
-                for (auto i = range.first; i != range.second; ++i) {
-                    if (i->second != next->second) {
-                        continue;
-                    }
-                    sizes_.erase(i);
-                    break;
-                }
-                auto n = next->second;
-                regions_.erase(next);
-                n->lcn = b->lcn;
-                n->length += b->length;
-                regions_.insert(regions_t::value_type(n->lcn, n));
-                sizes_.insert(sizes_t::value_type(n->length, n));
-                continue;
+            auto next = regions_.find(b->lcn + b->length);
+            if (next != regions_.end()) {
+                forget(next->second);
             }
 
-            if (!info_) {
-                DebugBreak();
-                scan();
-                return;
+            // Let zenwinx merge them, then remember the resulting region.
+            info_ = winx_add_volume_region(info_, b->lcn, b->length);
+            auto r = winx_find_first_volume_region(info_, lcn, 1, nullptr);
+            if (r) {
+                remember(r);
             }
-
-            // Insert a new region.
-            auto item = prev != regions_.end() ? prev->second : std::prev(
-                regions_.end())->second;
-            auto nr = (winx_volume_region *)winx_list_insert((list_entry **)(
-                void *)&info_, (list_entry *)item, sizeof(winx_volume_region));
-            nr->lcn = b->lcn;
-            nr->length = b->length;
-            regions_.insert(regions_t::value_type(nr->lcn, nr));
-            sizes_.insert(sizes_t::value_type(nr->length, nr));
         }
     }
 
@@ -258,7 +213,9 @@ namespace zen
                 unprocessable_++;
                 return;
             }
-            if (boost::regex_search(f.path, excluded)) {
+            wchar_t path[MAX_PATH];
+            winx_get_file_path(&f, path, MAX_PATH);
+            if (boost::regex_search(path, excluded)) {
                 unmovable_.push_back(&f);
                 unprocessable_++;
                 return;
@@ -109,7 +109,8 @@ inline File openFile(const winx_file_info *file)
   if (winx_defrag_fopen(const_cast<winx_file_info *>(file), WINX_OPEN_FOR_MOVE,
                         &rv)) {
     std::string ex("Failed to open file: ");
-    ex.append(zen::to_string(file->path));
+    ex.append(zen::to_string(
+      winx_file_path(const_cast<winx_file_info *>(file))));
     throw std::exception(ex.c_str());
   }
   return File(rv);
@@ -189,6 +190,9 @@ private:
   sizes_t sizes_;
   const char volume_;
 
+  void forget(const winx_volume_region *r);
+  void remember(winx_volume_region *r);
+
   void free() {
     if (info_) {
       winx_release_free_volume_regions(info_);